@@ -20,3 +20,5 @@ SOURCES     +=  main.cpp \
 
 HEADERS     +=  ../lib/serialib.h
 
+unix:LIBS   +=  -lpthread
+
@@ -0,0 +1,25 @@
+#-------------------------------------------------
+#
+# Check of the automatic reconnection on a pseudo-terminal
+#
+#-------------------------------------------------
+
+QT          -=  core
+QT          -=  network
+QT          -=  gui
+
+TARGET      = 	project
+CONFIG      += 	console
+CONFIG      -= 	app_bundle
+
+TEMPLATE    =   app
+
+
+SOURCES     +=  main.cpp \
+                ../lib/serialib.cpp
+
+HEADERS     +=  ../lib/serialib.h
+
+unix:LIBS   +=  -lpthread
+linux:LIBS  +=  -lutil -ldl
+
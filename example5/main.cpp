@@ -0,0 +1,224 @@
+/**
+ * @file /example5/main.cpp
+ * @date October 2026
+ * @brief Check of the automatic reconnection on a pseudo-terminal (Linux and macOS)
+ *
+ * The device is a symbolic link to the slave side of a pseudo-terminal, like the
+ * /dev/serial/by-id links of USB adapters. The master side is closed while the port
+ * is open (the adapter is unplugged), then a new pseudo-terminal takes the link
+ * (the adapter is plugged again). The program checks that:
+ *    - a write made during the hang-up waits for the device and completes,
+ *    - the reconnection is counted,
+ *    - DTR and RTS are restored on the new device.
+ *
+ * Pseudo-terminals have no modem lines: the requests on DTR and RTS are answered by
+ * the ioctl defined below, which keeps the lines of the device (a new device starts
+ * with both lines raised, as a real adapter when it is opened).
+ *
+ * The program returns the number of failed checks.
+ */
+
+
+// Serial library
+#include "../lib/serialib.h"
+#include <stdio.h>
+#include <string.h>
+
+
+#if defined (__linux__) || defined(__APPLE__)
+
+#include <dlfcn.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#if defined (__linux__)
+    #include <pty.h>
+#else
+    #include <util.h>
+#endif
+
+// Maximum time the device is missing
+#define DOWNTIME_MS     2000
+
+// Lines of the emulated device (TIOCM_DTR, TIOCM_RTS)
+static int deviceLines=TIOCM_DTR | TIOCM_RTS;
+
+
+/*!
+ * \brief ioctl  Emulate the modem lines of the device, the other requests go to the system
+  */
+extern "C" int ioctl(int fd, unsigned long request, ...)
+{
+    va_list args;
+    va_start(args, request);
+    void *argument=va_arg(args, void*);
+    va_end(args);
+
+    if (request==TIOCMBIS)  { deviceLines|=*(int*)argument; return 0; }
+    if (request==TIOCMBIC)  { deviceLines&=~*(int*)argument; return 0; }
+    if (request==TIOCMGET)  { *(int*)argument=deviceLines; return 0; }
+
+    typedef int (*ioctlFunction)(int, unsigned long, ...);
+    static ioctlFunction systemIoctl=(ioctlFunction)dlsym(RTLD_NEXT, "ioctl");
+    return systemIoctl(fd, request, argument);
+}
+
+
+/*!
+ * \brief plugDevice  Create a pseudo-terminal and point the link to its slave side
+ * \param link : path of the device
+ * \return The master side, -1 on error
+  */
+static int plugDevice(const char *link)
+{
+    int master, slave;
+    char name[256];
+    struct termios options;
+    if (openpty(&master, &slave, name, NULL, NULL)==-1) return -1;
+    tcgetattr(master, &options);
+    cfmakeraw(&options);
+    tcsetattr(master, TCSANOW, &options);
+    // The port opens the slave side by itself
+    close(slave);
+
+    // A new device starts with DTR and RTS raised
+    deviceLines=TIOCM_DTR | TIOCM_RTS;
+
+    // Replace the link atomically
+    char temporary[300];
+    snprintf(temporary, sizeof(temporary), "%s.new", link);
+    unlink(temporary);
+    if (symlink(name, temporary)==-1 || rename(temporary, link)==-1)
+    {
+        close(master);
+        return -1;
+    }
+    return master;
+}
+
+
+/*!
+ * \brief readMaster  Read bytes written by the port on the master side
+ * \return The number of bytes read before the timeout
+  */
+static int readMaster(int master, char *buffer, int size, int timeOut_ms)
+{
+    int count=0;
+    while (count<size)
+    {
+        struct pollfd pfd={master, POLLIN, 0};
+        if (poll(&pfd, 1, timeOut_ms)<=0) break;
+        int n=read(master, buffer+count, size-count);
+        if (n<=0) break;
+        count+=n;
+    }
+    return count;
+}
+
+
+// Device that comes back after a while
+struct replug {
+    const char *link;
+    int master;
+};
+
+static void* replugThread(void *arg)
+{
+    replug *device=(replug*)arg;
+    usleep(300000);
+    device->master=plugDevice(device->link);
+    return NULL;
+}
+
+
+// Display the result of a check, return 1 if it failed
+static int check(bool success, const char *message)
+{
+    printf("%s %s\n", success ? "[ OK ]" : "[FAIL]", message);
+    return success ? 0 : 1;
+}
+
+
+/*!
+ * \brief main  Unplug and plug the device while it is used
+  */
+int main( /*int argc, char *argv[]*/)
+{
+    // Private directory for the link to the device
+    char directory[]="/tmp/serialib-example5-XXXXXX";
+    if (mkdtemp(directory)==NULL) return -1;
+    char link[300];
+    snprintf(link, sizeof(link), "%s/ttyUSB", directory);
+
+    int master=plugDevice(link);
+    if (master<0) return -1;
+
+    // Open the device, wait for it up to DOWNTIME_MS when it disappears
+    serialib serial;
+    int failures=0;
+    failures+=check(serial.openDevice(link, 115200)==1, "open the device");
+    failures+=check(serial.setAutoReconnect(true, DOWNTIME_MS)==1, "enable the automatic reconnection");
+
+    // State of the lines that must survive the reconnection
+    serial.clearDTR();
+    serial.setRTS();
+    int lines=serial.getModemLines();
+    failures+=check(lines>=0 && !(lines & SERIAL_LINE_DTR) && (lines & SERIAL_LINE_RTS), "DTR cleared, RTS set");
+
+    // Data before the hang-up
+    char buffer[64];
+    serial.writeString("before\n");
+    failures+=check(readMaster(master, buffer, 7, 1000)==7 && memcmp(buffer, "before\n", 7)==0, "data received before the hang-up");
+
+    // Unplug the device, it comes back in another thread
+    close(master);
+    replug device={link, -1};
+    pthread_t thread;
+    pthread_create(&thread, NULL, replugThread, &device);
+
+    // The write waits for the device
+    int written=serial.writeString("after\n");
+    pthread_join(thread, NULL);
+    failures+=check(device.master>=0, "plug the device again");
+    failures+=check(written==1, "write resumed after the reconnection");
+    failures+=check(readMaster(device.master, buffer, 6, 1000)==6 && memcmp(buffer, "after\n", 6)==0, "data received after the reconnection");
+
+    SerialReconnectStats stats;
+    serial.getReconnectStats(&stats);
+    failures+=check(stats.count==1 && stats.connected, "one reconnection counted");
+    printf("       downtime %.1f ms\n", stats.lastDowntime_ns/1e6);
+
+    // The lines were restored on the new device
+    lines=serial.getModemLines();
+    failures+=check(lines>=0 && !(lines & SERIAL_LINE_DTR) && (lines & SERIAL_LINE_RTS), "DTR and RTS restored");
+
+    // Data in the other direction
+    if (device.master>=0) write(device.master, "echo\n", 5);
+    char received[8]={0};
+    failures+=check(serial.readBytes(received, 5, 1000)==5 && memcmp(received, "echo\n", 5)==0, "data read after the reconnection");
+
+    // Close the device
+    serial.closeDevice();
+    if (device.master>=0) close(device.master);
+    unlink(link);
+    rmdir(directory);
+
+    printf("%d check(s) failed\n", failures);
+    return failures;
+}
+
+#endif
+
+
+#if defined (_WIN32) || defined(_WIN64)
+
+/*!
+ * \brief main  Pseudo-terminals are not available on Windows
+  */
+int main( /*int argc, char *argv[]*/)
+{
+    printf("This check requires pseudo-terminals (Linux or macOS)\n");
+    return 0;
+}
+
+#endif
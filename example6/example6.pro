@@ -0,0 +1,27 @@
+#-------------------------------------------------
+#
+# Check of the socket bridge on a pseudo-terminal
+#
+#-------------------------------------------------
+
+QT          -=  core
+QT          -=  network
+QT          -=  gui
+
+TARGET      = 	project
+CONFIG      += 	console
+CONFIG      -= 	app_bundle
+
+TEMPLATE    =   app
+
+
+SOURCES     +=  main.cpp \
+                ../lib/serialib.cpp \
+                ../lib/serialib_bridge.cpp
+
+HEADERS     +=  ../lib/serialib.h \
+                ../lib/serialib_bridge.h
+
+unix:LIBS   +=  -lpthread
+linux:LIBS  +=  -lutil -ldl
+
@@ -0,0 +1,329 @@
+/**
+ * @file /example6/main.cpp
+ * @date October 2026
+ * @brief Check of the socket bridge on a pseudo-terminal (Linux and macOS)
+ *
+ * A pseudo-terminal stands for the device: its slave side is bridged on a Unix-domain
+ * socket, the program plays the device on the master side and the client on the socket.
+ * The program checks that:
+ *    - the bytes go through in both directions,
+ *    - the bytes sent by a client that closes its side right away reach the device,
+ *    - clients that disconnect while the device is sending don't stop the bridge
+ *      (the process must not be killed by SIGPIPE).
+ *
+ * On Linux, the checks run twice: with splice, then with the read/write fallback
+ * (the splice function defined below fails as with a driver that doesn't support it).
+ * macOS always uses the fallback.
+ *
+ * The program returns the number of failed checks.
+ */
+
+
+// Serial library
+#include "../lib/serialib.h"
+#include "../lib/serialib_bridge.h"
+#include <stdio.h>
+#include <string.h>
+
+
+#if defined (__linux__) || defined(__APPLE__)
+
+#include <dlfcn.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#if defined (__linux__)
+    #include <pty.h>
+#else
+    #include <util.h>
+#endif
+
+// Size of the blocks exchanged (larger than the buffers of the pseudo-terminal)
+#define BLOCK_SIZE      32768
+
+// Number of clients that disconnect while the device is sending
+#define DISCONNECTIONS  20
+
+
+#if defined (__linux__)
+
+// When true, splice fails as with a driver that doesn't support it
+static bool spliceDisabled=false;
+
+/*!
+ * \brief splice  Call the system, or fail with EINVAL when spliceDisabled is set
+  */
+extern "C" ssize_t splice(int fdIn, loff_t *offsetIn, int fdOut, loff_t *offsetOut, size_t length, unsigned int flags)
+{
+    if (spliceDisabled)
+    {
+        errno=EINVAL;
+        return -1;
+    }
+    typedef ssize_t (*spliceFunction)(int, loff_t*, int, loff_t*, size_t, unsigned int);
+    static spliceFunction systemSplice=(spliceFunction)dlsym(RTLD_NEXT, "splice");
+    return systemSplice(fdIn, offsetIn, fdOut, offsetOut, length, flags);
+}
+
+#endif
+
+
+// Bridge served by a thread
+struct bridgeThreadData {
+    serialBridge *bridge;
+    volatile bool stop;
+};
+
+static void* bridgeThread(void *arg)
+{
+    bridgeThreadData *data=(bridgeThreadData*)arg;
+    while (!data->stop) data->bridge->run(20);
+    return NULL;
+}
+
+
+// Device that keeps sending
+struct deviceThreadData {
+    int master;
+    volatile bool stop;
+};
+
+static void* deviceThread(void *arg)
+{
+    deviceThreadData *data=(deviceThreadData*)arg;
+    char block[1024];
+    memset(block, 'd', sizeof(block));
+    while (!data->stop)
+    {
+        struct pollfd pfd={data->master, POLLOUT, 0};
+        if (poll(&pfd, 1, 20)>0 && write(data->master, block, sizeof(block))<0) break;
+    }
+    return NULL;
+}
+
+
+/*!
+ * \brief connectClient  Connect a client to the bridge
+ * \return The socket of the client, -1 on error
+  */
+static int connectClient(const char *path)
+{
+    int client=socket(AF_UNIX, SOCK_STREAM, 0);
+    if (client==-1) return -1;
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family=AF_UNIX;
+    strncpy(address.sun_path, path, sizeof(address.sun_path)-1);
+    if (connect(client, (struct sockaddr*)&address, sizeof(address))==-1)
+    {
+        close(client);
+        return -1;
+    }
+    return client;
+}
+
+
+/*!
+ * \brief receive  Read bytes from a descriptor
+ * \return The number of bytes read before the timeout (or the end of file)
+  */
+static int receive(int fd, unsigned char *buffer, int size, int timeOut_ms)
+{
+    int count=0;
+    while (count<size)
+    {
+        struct pollfd pfd={fd, POLLIN, 0};
+        if (poll(&pfd, 1, timeOut_ms)<=0) break;
+        int n=read(fd, buffer+count, size-count);
+        if (n<=0) break;
+        count+=n;
+    }
+    return count;
+}
+
+
+/*!
+ * \brief transmit  Write bytes to a descriptor, while the other side reads them
+ * \return The number of bytes written before the timeout
+  */
+static int transmit(int fd, const unsigned char *buffer, int size, int timeOut_ms)
+{
+    int count=0;
+    while (count<size)
+    {
+        struct pollfd pfd={fd, POLLOUT, 0};
+        if (poll(&pfd, 1, timeOut_ms)<=0) break;
+        int n=write(fd, buffer+count, size-count);
+        if (n<=0) break;
+        count+=n;
+    }
+    return count;
+}
+
+
+// Writer of a block in a thread, while the main thread reads it
+struct transmitThreadData {
+    int fd;
+    const unsigned char *buffer;
+    int size;
+    int written;
+};
+
+static void* transmitThread(void *arg)
+{
+    transmitThreadData *data=(transmitThreadData*)arg;
+    data->written=transmit(data->fd, data->buffer, data->size, 2000);
+    return NULL;
+}
+
+
+// Display the result of a check, return 1 if it failed
+static int check(bool success, const char *mode, const char *message)
+{
+    printf("%s %s: %s\n", success ? "[ OK ]" : "[FAIL]", mode, message);
+    return success ? 0 : 1;
+}
+
+
+/*!
+ * \brief runChecks  Bridge a new pseudo-terminal and run the checks
+ * \param mode : name of the mode in the messages
+ * \param directory : private directory for the socket
+ * \return The number of failed checks
+  */
+static int runChecks(const char *mode, const char *directory)
+{
+    int failures=0;
+
+    // The device
+    int master, slave;
+    char name[256];
+    struct termios options;
+    if (openpty(&master, &slave, name, NULL, NULL)==-1) return check(false, mode, "create a pseudo-terminal");
+    tcgetattr(master, &options);
+    cfmakeraw(&options);
+    tcsetattr(master, TCSANOW, &options);
+    close(slave);
+    serialib serial;
+    failures+=check(serial.openDevice(name, 115200)==1, mode, "open the device");
+
+    // The bridge
+    char path[300];
+    snprintf(path, sizeof(path), "%s/bridge.sock", directory);
+    serialBridge bridge;
+    failures+=check(bridge.addUnixPort(&serial, path)>=0, mode, "serve the device on a socket");
+    bridgeThreadData bridgeData={&bridge, false};
+    pthread_t bridgeId;
+    pthread_create(&bridgeId, NULL, bridgeThread, &bridgeData);
+
+    // Blocks of data, different in each direction
+    static unsigned char toDevice[BLOCK_SIZE], toClient[BLOCK_SIZE], received[BLOCK_SIZE];
+    for (int i=0;i<BLOCK_SIZE;i++)
+    {
+        toDevice[i]=(unsigned char)(i*7+1);
+        toClient[i]=(unsigned char)(i*13+5);
+    }
+
+    // Round trip: client to device, then device to client
+    int client=connectClient(path);
+    failures+=check(client>=0, mode, "connect a client");
+    transmitThreadData writer={client, toDevice, BLOCK_SIZE, 0};
+    pthread_t writerId;
+    pthread_create(&writerId, NULL, transmitThread, &writer);
+    int count=receive(master, received, BLOCK_SIZE, 2000);
+    pthread_join(writerId, NULL);
+    failures+=check(count==BLOCK_SIZE && memcmp(received, toDevice, BLOCK_SIZE)==0, mode, "client to device");
+
+    writer.fd=master;
+    writer.buffer=toClient;
+    pthread_create(&writerId, NULL, transmitThread, &writer);
+    count=receive(client, received, BLOCK_SIZE, 2000);
+    pthread_join(writerId, NULL);
+    failures+=check(count==BLOCK_SIZE && memcmp(received, toClient, BLOCK_SIZE)==0, mode, "device to client");
+
+    // The client closes its side as soon as the block is written: the bridge still holds
+    // most of it, the device must get it all
+    transmit(client, toDevice, BLOCK_SIZE, 2000);
+    close(client);
+    count=receive(master, received, BLOCK_SIZE, 2000);
+    failures+=check(count==BLOCK_SIZE && memcmp(received, toDevice, BLOCK_SIZE)==0, mode, "bytes in flight delivered after the client closed");
+
+    // Clients that leave while the device is sending
+    deviceThreadData deviceData={master, false};
+    pthread_t deviceId;
+    pthread_create(&deviceId, NULL, deviceThread, &deviceData);
+    int served=0;
+    for (int i=0;i<DISCONNECTIONS;i++)
+    {
+        client=connectClient(path);
+        if (client<0) continue;
+        unsigned char some[256];
+        if (receive(client, some, sizeof(some), 1000)>0) served++;
+        close(client);
+        usleep(10000);
+    }
+    deviceData.stop=true;
+    pthread_join(deviceId, NULL);
+    failures+=check(served==DISCONNECTIONS, mode, "clients disconnecting while the device sends");
+
+    // The bridge still works
+    while (receive(master, received, BLOCK_SIZE, 100)>0) {}
+    client=connectClient(path);
+    failures+=check(client>=0 && write(client, "ping", 4)==4 && receive(master, received, 4, 2000)==4 &&
+                    memcmp(received, "ping", 4)==0, mode, "new client after the disconnections");
+    if (client>=0) close(client);
+
+    bridgeData.stop=true;
+    pthread_join(bridgeId, NULL);
+    SerialBridgeStats stats;
+    bridge.getStats(0, &stats);
+    printf("       %s: %lu connections, splice from the device %s, to the device %s\n", mode,
+           stats.connections, stats.spliceFromSerial ? "yes" : "no", stats.spliceToSerial ? "yes" : "no");
+#if defined (__linux__)
+    if (spliceDisabled)
+        failures+=check(!stats.spliceFromSerial && !stats.spliceToSerial, mode, "read/write fallback used");
+#endif
+
+    bridge.close();
+    serial.closeDevice();
+    close(master);
+    return failures;
+}
+
+
+/*!
+ * \brief main  Run the checks of the bridge
+  */
+int main( /*int argc, char *argv[]*/)
+{
+    // Private directory for the socket
+    char directory[]="/tmp/serialib-example6-XXXXXX";
+    if (mkdtemp(directory)==NULL) return -1;
+
+    int failures=0;
+#if defined (__linux__)
+    failures+=runChecks("splice", directory);
+    spliceDisabled=true;
+#endif
+    failures+=runChecks("read/write", directory);
+
+    rmdir(directory);
+    printf("%d check(s) failed\n", failures);
+    return failures;
+}
+
+#endif
+
+
+#if defined (_WIN32) || defined(_WIN64)
+
+/*!
+ * \brief main  The bridge is not available on Windows
+  */
+int main( /*int argc, char *argv[]*/)
+{
+    printf("This check requires pseudo-terminals and the bridge (Linux or macOS)\n");
+    return 0;
+}
+
+#endif
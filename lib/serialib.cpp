@@ -16,6 +16,172 @@ This is a licence-free software, it can be used by anyone who try to build a bet
  */
 
 #include "serialib.h"
+#include <new>
+
+
+
+//_____________
+// ::: Locks :::
+
+
+// Create a recursive lock
+static void initMutex(serialMutex &mutex)
+{
+#if defined (_WIN32) || defined(_WIN64)
+    InitializeCriticalSection(&mutex);
+#else
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&mutex, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+#endif
+}
+
+// Release a lock
+static void destroyMutex(serialMutex &mutex)
+{
+#if defined (_WIN32) || defined(_WIN64)
+    DeleteCriticalSection(&mutex);
+#else
+    pthread_mutex_destroy(&mutex);
+#endif
+}
+
+// Take a lock, or return false if another thread holds it
+static bool tryLockMutex(serialMutex &mutex)
+{
+#if defined (_WIN32) || defined(_WIN64)
+    return TryEnterCriticalSection(&mutex)!=0;
+#else
+    return pthread_mutex_trylock(&mutex)==0;
+#endif
+}
+
+// Release a lock taken with tryLockMutex
+static void unlockMutex(serialMutex &mutex)
+{
+#if defined (_WIN32) || defined(_WIN64)
+    LeaveCriticalSection(&mutex);
+#else
+    pthread_mutex_unlock(&mutex);
+#endif
+}
+
+#if defined (__linux__) || defined(__APPLE__)
+// Wait for a condition until a deadline of the monotonic clock
+static void waitConditionUntil(pthread_cond_t *cond, pthread_mutex_t *mutex, unsigned long long deadline_ns)
+{
+#if defined (__linux__)
+    // The condition uses the monotonic clock
+    unsigned long long time_ns=deadline_ns;
+#else
+    // The condition uses the real-time clock
+    unsigned long long now_ns=timeOut::monotonicTime_ns();
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    unsigned long long time_ns=now.tv_sec*1000000000ULL+now.tv_usec*1000ULL+(deadline_ns>now_ns ? deadline_ns-now_ns : 0);
+#endif
+    struct timespec deadline;
+    deadline.tv_sec=time_ns/1000000000ULL;
+    deadline.tv_nsec=time_ns%1000000000ULL;
+    pthread_cond_timedwait(cond, mutex, &deadline);
+}
+#endif
+
+// Read a value written by another thread (32-bit values only on Windows)
+template <typename T> static T atomicLoad(const T *value)
+{
+#if defined (_WIN32) || defined(_WIN64)
+    return (T)InterlockedCompareExchange((volatile LONG*)const_cast<T*>(value), 0, 0);
+#else
+    return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+#endif
+}
+
+// Write a value read by another thread (32-bit values only on Windows)
+template <typename T> static void atomicStore(T *value, T newValue)
+{
+#if defined (_WIN32) || defined(_WIN64)
+    InterlockedExchange((volatile LONG*)value, (LONG)newValue);
+#else
+    __atomic_store_n(value, newValue, __ATOMIC_RELEASE);
+#endif
+}
+
+// Hold a lock until the end of the scope
+class serialScopedLock
+{
+public:
+    serialScopedLock(serialMutex &mutex) : mutex(mutex)
+    {
+#if defined (_WIN32) || defined(_WIN64)
+        EnterCriticalSection(&mutex);
+#else
+        pthread_mutex_lock(&mutex);
+#endif
+    }
+    ~serialScopedLock() { unlockMutex(mutex); }
+private:
+    serialMutex &mutex;
+};
+
+
+
+//______________
+// ::: Memory :::
+
+
+// Allocate a block of whole pages, so it can be locked and unlocked without touching other objects
+static void* allocPages(size_t size)
+{
+#if defined (_WIN32) || defined(_WIN64)
+    return VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+    size_t page=(size_t)sysconf(_SC_PAGESIZE);
+    void *block=NULL;
+    if (posix_memalign(&block, page, (size+page-1)/page*page)!=0) return NULL;
+    return block;
+#endif
+}
+
+// Release a block allocated with allocPages
+static void freePages(void *block)
+{
+    if (block==NULL) return;
+#if defined (_WIN32) || defined(_WIN64)
+    VirtualFree(block, 0, MEM_RELEASE);
+#else
+    free(block);
+#endif
+}
+
+// Prefault a block allocated with allocPages and lock it in memory
+static bool lockPages(void *block, size_t size)
+{
+    volatile char *bytes=(volatile char*)block;
+    for (size_t i=0;i<size;i+=4096) bytes[i]=bytes[i];
+#if defined (_WIN32) || defined(_WIN64)
+    return VirtualLock(block, size)!=0;
+#else
+    return mlock(block, size)==0;
+#endif
+}
+
+// Unlock a block locked with lockPages
+static void unlockPages(void *block, size_t size)
+{
+#if defined (_WIN32) || defined(_WIN64)
+    VirtualUnlock(block, size);
+#else
+    munlock(block, size);
+#endif
+}
+
+#if defined (__linux__) || defined(__APPLE__)
+// Size of the block holding the reception times and the receive buffer
+#define SERIAL_RX_PAGES_SIZE    (2*SERIAL_RX_CHUNKS*sizeof(unsigned long long)+SERIAL_RX_BUFFER_SIZE)
+#endif
 
 
 
@@ -28,6 +194,35 @@ This is a licence-free software, it can be used by anyone who try to build a bet
 */
 serialib::serialib()
 {
+    // No flow control, standard XON/XOFF characters
+    flowControl=SERIAL_FLOWCONTROL_NONE;
+    xonChar=0x11;
+    xoffChar=0x13;
+    // No reference for getLineCountersDelta yet
+    lastCounters=SerialLineCounters();
+    // 8N1 at 9600 bauds until a device is opened
+    charTime_ns=1041667;
+    // Frames end after 3.5 characters of silence (as Modbus RTU)
+    setFrameGap(3.5f);
+    // Nothing received yet
+    rxTimeFirst_ns=rxTimeLast_ns=0;
+    // No write buffer
+    txBuf=NULL;
+    txBufSize=txBufUsed=txFlushThreshold=0;
+    txFlushDelay_ns=txBufTime_ns=0;
+    txFlushBeforeRead=true;
+    txBufError=false;
+    // Default scheduling, nothing locked
+    rtPriority=0;
+    rtCpuMask=0;
+    buffersLocked=false;
+    wakeupStats=SerialWakeupStats();
+    txWakeupStats=SerialWakeupStats();
+    // Separate locks for the reception and the transmission
+    initMutex(rxLock);
+    initMutex(txLock);
+    // Sleep while waiting for data
+    setWaitPolicy(SERIAL_WAIT_BLOCK);
 #if defined (_WIN32) || defined( _WIN64)
     // Set default value for RTS and DTR (Windows only)
     currentStateRTS=true;
@@ -36,6 +231,52 @@ serialib::serialib()
 #endif
 #if defined (__linux__) || defined(__APPLE__)
     fd = -1;
+    // Receive buffer and reception times in their own pages (see lockBuffers)
+    rxPages = allocPages(SERIAL_RX_PAGES_SIZE);
+    if (rxPages == NULL) throw std::bad_alloc();
+    rxChunkEnd = (unsigned long long*)rxPages;
+    rxChunkTime = rxChunkEnd + SERIAL_RX_CHUNKS;
+    rxBuffer = (unsigned char*)(rxChunkTime + SERIAL_RX_CHUNKS);
+    resetReceiveBuffer();
+    txPaused = rxPaused = false;
+    multidrop = false;
+    multidropAddress = multidropBroadcast = -1;
+    multidropState = 0;
+    multidropAccept = true;
+    // DTR and RTS are set by the driver when a device is opened
+    currentStateRTS = currentStateDTR = true;
+    // No device to reconnect
+    devicePath = NULL;
+    deviceBauds = 9600;
+    deviceDatabits = SERIAL_DATABITS_8;
+    deviceParity = SERIAL_PARITY_NONE;
+    deviceStopbits = SERIAL_STOPBITS_1;
+    autoReconnect = false;
+    reconnectMax_ns = 0;
+    lostTime_ns = 0;
+    reconnectStats = SerialReconnectStats();
+    initMutex(reconnectLock);
+    paceRate = paceBurst = 0;
+    paceTokens = 0;
+    paceTime_ns = 0;
+    txTimeout_ns = 0;
+    modemThreadRunning = false;
+    modemThreadStop = false;
+    modemThreadDone = false;
+    modemMonitorLines = 0;
+    modemCallback = NULL;
+    modemCallbackData = NULL;
+    modemCountsValid = false;
+    // No flush thread until setWriteBuffer sets a delay
+    txFlushThreadRunning = false;
+    txFlushStop = false;
+    pthread_condattr_t attributes;
+    pthread_condattr_init(&attributes);
+#if defined (__linux__)
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+#endif
+    pthread_cond_init(&txFlushCond, &attributes);
+    pthread_condattr_destroy(&attributes);
 #endif
 }
 
@@ -47,6 +288,26 @@ serialib::serialib()
 serialib::~serialib()
 {
     closeDevice();
+#if defined (__linux__) || defined(__APPLE__)
+    stopFlushThread();
+    pthread_cond_destroy(&txFlushCond);
+#endif
+    // Unlock the buffers before releasing them
+    if (buffersLocked)
+    {
+#if defined (__linux__) || defined(__APPLE__)
+        unlockPages(rxPages, SERIAL_RX_PAGES_SIZE);
+#endif
+        if (txBuf!=NULL) unlockPages(txBuf, txBufSize);
+    }
+    freePages(txBuf);
+    destroyMutex(rxLock);
+    destroyMutex(txLock);
+#if defined (__linux__) || defined(__APPLE__)
+    freePages(rxPages);
+    delete[] devicePath;
+    destroyMutex(reconnectLock);
+#endif
 }
 
 
@@ -121,14 +382,24 @@ serialib::~serialib()
                 - SERIAL_PARITY_NONE (N)
                 - SERIAL_PARITY_EVEN (E)
                 - SERIAL_PARITY_ODD (O)
-                - SERIAL_PARITY_MARK (MARK) (not supported on Unix)
-                - SERIAL_PARITY_SPACE (SPACE) (not supported on Unix)
+                - SERIAL_PARITY_MARK (MARK) (Linux only on Unix, with CMSPAR)
+                - SERIAL_PARITY_SPACE (SPACE) (Linux only on Unix, with CMSPAR)
     \param Stopbit: Number of stop bits
 
             \n Supported values:
                 - SERIAL_STOPBITS_1 (1)
                 - SERIAL_STOPBITS_1_5 (1.5) (not supported on Unix)
                 - SERIAL_STOPBITS_2 (2)
+    \param FlowControl: Flow control
+
+            \n Supported values:
+                - SERIAL_FLOWCONTROL_NONE
+                - SERIAL_FLOWCONTROL_HARDWARE (RTS/CTS)
+                - SERIAL_FLOWCONTROL_SOFTWARE (XON/XOFF, see setXonXoffChars)
+                - SERIAL_FLOWCONTROL_SOFTWARE_USER (XON/XOFF handled by serialib, same as SERIAL_FLOWCONTROL_SOFTWARE on Windows)
+                  Transmission is suspended when XOFF is received, and XOFF is sent
+                  when more than SERIAL_SOFT_FLOW_HIGH_WATER bytes are waiting to be read.
+                  XON/XOFF characters are removed from the received data.
 
      \return 1 success
      \return -1 device not found
@@ -140,11 +411,13 @@ serialib::~serialib()
      \return -7 Databits not recognized
      \return -8 Stopbits not recognized
      \return -9 Parity not recognized
+     \return -10 Flow control not recognized
   */
 char serialib::openDevice(const char *Device, const unsigned int Bauds,
                           SerialDataBits Databits,
                           SerialParity Parity,
-                          SerialStopBits Stopbits) {
+                          SerialStopBits Stopbits,
+                          SerialFlowControl FlowControl) {
 #if defined (_WIN32) || defined( _WIN64)
     // Open serial port
     hSerial = CreateFileA(Device,GENERIC_READ | GENERIC_WRITE,0,0,OPEN_EXISTING,/*FILE_ATTRIBUTE_NORMAL*/0,0);
@@ -217,6 +490,28 @@ char serialib::openDevice(const char *Device, const unsigned int Bauds,
     dcbSerialParams.StopBits = stopBits;
     // configure parity
     dcbSerialParams.Parity = parity;
+    // configure flow control
+    dcbSerialParams.fOutxCtsFlow = FALSE;
+    dcbSerialParams.fRtsControl = RTS_CONTROL_ENABLE;
+    dcbSerialParams.fOutX = FALSE;
+    dcbSerialParams.fInX = FALSE;
+    switch(FlowControl) {
+        case SERIAL_FLOWCONTROL_NONE: break;
+        case SERIAL_FLOWCONTROL_HARDWARE:
+            dcbSerialParams.fOutxCtsFlow = TRUE;
+            dcbSerialParams.fRtsControl = RTS_CONTROL_HANDSHAKE;
+            break;
+        case SERIAL_FLOWCONTROL_SOFTWARE:
+        case SERIAL_FLOWCONTROL_SOFTWARE_USER:
+            dcbSerialParams.fOutX = TRUE;
+            dcbSerialParams.fInX = TRUE;
+            dcbSerialParams.XonChar = xonChar;
+            dcbSerialParams.XoffChar = xoffChar;
+            break;
+        default: return -10;
+    }
+    flowControl = FlowControl;
+    setCharacterTime(Bauds, Databits, Parity, Stopbits);
 
     // Write the parameters
     if(!SetCommState(hSerial, &dcbSerialParams)) return -5;
@@ -238,10 +533,6 @@ char serialib::openDevice(const char *Device, const unsigned int Bauds,
     return 1;
 #endif
 #if defined (__linux__) || defined(__APPLE__)
-    // Structure with the device's options
-    struct termios options;
-
-
     // Open device
     fd = open(Device, O_RDWR | O_NOCTTY | O_NDELAY);
     // If the device is not open, return -2
@@ -249,9 +540,65 @@ char serialib::openDevice(const char *Device, const unsigned int Bauds,
     // Open the device in nonblocking mode
     fcntl(fd, F_SETFL, FNDELAY);
 
+    // Configure the device (multidrop is enabled afterwards with setMultidrop)
+    multidrop = false;
+    char Ret=setupDevice(fd, Bauds, Databits, Parity, Stopbits, FlowControl);
+    if (Ret<0) return Ret;
+
+    // Reset the receive buffer and the flow control state
+    flowControl = FlowControl;
+    setCharacterTime(Bauds, Databits, Parity, Stopbits);
+    resetReceiveBuffer();
+    txPaused = rxPaused = false;
+    // Reference for getLineCountersDelta, no previous event for waitModemChange
+    getLineCounters(&lastCounters);
+    modemCountsValid = false;
+    // Initial state of DTR and RTS (the driver may not report them)
+    int lines=getModemLines();
+    currentStateDTR = (lines<0) || (lines & SERIAL_LINE_DTR);
+    currentStateRTS = (lines<0) || (lines & SERIAL_LINE_RTS);
+
+    // Keep the settings to reopen the device after a hang-up
+    if (devicePath==NULL || strcmp(devicePath, Device)!=0)
+    {
+        delete[] devicePath;
+        devicePath=new char[strlen(Device)+1];
+        strcpy(devicePath, Device);
+    }
+    deviceBauds = Bauds;
+    deviceDatabits = Databits;
+    deviceParity = Parity;
+    deviceStopbits = Stopbits;
+    lostTime_ns = 0;
+    // Send the buffered bytes when their delay elapses (see setWriteBuffer)
+    if (txBufSize>0 && txFlushDelay_ns>0) startFlushThread();
+    // Success
+    return (1);
+#endif
+
+}
+
+
+#if defined (__linux__) || defined(__APPLE__)
+/*!
+     \brief Apply the settings of openDevice to an open device (termios options)
+     \param device : file descriptor of the device
+     \return 1 success
+     \return -4 Speed (Bauds) not recognized
+     \return -5 error while writing port parameters
+     \return -7 Databits not recognized
+     \return -8 Stopbits not recognized
+     \return -9 Parity not recognized
+     \return -10 Flow control not recognized
+  */
+char serialib::setupDevice(int device, const unsigned int Bauds, SerialDataBits Databits,
+                           SerialParity Parity, SerialStopBits Stopbits, SerialFlowControl FlowControl)
+{
+    // Structure with the device's options
+    struct termios options;
 
     // Get the current options of the port
-    tcgetattr(fd, &options);
+    tcgetattr(device, &options);
     // Clear all the options
     bzero(&options, sizeof(options));
 
@@ -332,27 +679,146 @@ char serialib::openDevice(const char *Device, const unsigned int Bauds,
         case SERIAL_PARITY_NONE: parity_flag = 0; break;
         case SERIAL_PARITY_EVEN: parity_flag = PARENB; break;
         case SERIAL_PARITY_ODD: parity_flag = (PARENB | PARODD); break;
-        //mark and space parity not supported
+#if defined (CMSPAR)
+        //stick parity: the parity bit is always 1 (mark) or 0 (space)
+        case SERIAL_PARITY_MARK: parity_flag = (PARENB | CMSPAR | PARODD); break;
+        case SERIAL_PARITY_SPACE: parity_flag = (PARENB | CMSPAR); break;
+#endif
         default: return -9;
     }
+    int flowcontrol_cflag = 0;
+    int flowcontrol_iflag = 0;
+    switch(FlowControl) {
+        case SERIAL_FLOWCONTROL_NONE: break;
+        case SERIAL_FLOWCONTROL_HARDWARE: flowcontrol_cflag = CRTSCTS; break;
+        case SERIAL_FLOWCONTROL_SOFTWARE: flowcontrol_iflag = (IXON | IXOFF); break;
+        //handled by serialib, the driver must not interpret XON/XOFF
+        case SERIAL_FLOWCONTROL_SOFTWARE_USER: break;
+        default: return -10;
+    }
 
     // Set the baud rate
     cfsetispeed(&options, Speed);
     cfsetospeed(&options, Speed);
     // Configure the device : data bits, stop bits, parity, no control flow
     // Ignore modem control lines (CLOCAL) and Enable receiver (CREAD)
-    options.c_cflag |= ( CLOCAL | CREAD | databits_flag | parity_flag | stopbits_flag);
-    options.c_iflag |= ( IGNPAR | IGNBRK );
+    options.c_cflag |= ( CLOCAL | CREAD | databits_flag | parity_flag | stopbits_flag | flowcontrol_cflag);
+    options.c_iflag |= ( IGNPAR | IGNBRK | flowcontrol_iflag);
+#if defined (CMSPAR)
+    if (multidrop)
+    {
+        // Space parity: the address bytes (parity bit set) are parity errors, marked 0xFF 0x00 by the driver
+        options.c_cflag = (options.c_cflag & ~PARODD) | PARENB | CMSPAR;
+        options.c_iflag = (options.c_iflag & ~(IGNPAR | ISTRIP)) | INPCK | PARMRK;
+    }
+#endif
+    // Software flow control characters
+    options.c_cc[VSTART]=xonChar;
+    options.c_cc[VSTOP]=xoffChar;
     // Timer unused
     options.c_cc[VTIME]=0;
     // At least on character before satisfy reading
     options.c_cc[VMIN]=0;
     // Activate the settings
-    tcsetattr(fd, TCSANOW, &options);
-    // Success
+    if (tcsetattr(device, TCSANOW, &options)==-1) return -5;
     return (1);
+}
+#endif
+
+
+/*!
+     \brief Compute the duration of one character on the line from the port settings
+     \param Bauds : baud rate
+     \param Databits : number of data bits
+     \param Parity : parity type
+     \param Stopbits : number of stop bits
+  */
+void serialib::setCharacterTime(unsigned int Bauds, SerialDataBits Databits, SerialParity Parity, SerialStopBits Stopbits)
+{
+    // Count half bits because of 1.5 stop bits, starting with the start bit
+    unsigned int halfBits=2;
+    switch(Databits) {
+        case SERIAL_DATABITS_5: halfBits+=10; break;
+        case SERIAL_DATABITS_6: halfBits+=12; break;
+        case SERIAL_DATABITS_7: halfBits+=14; break;
+        case SERIAL_DATABITS_16: halfBits+=32; break;
+        default: halfBits+=16; break;
+    }
+    if (Parity!=SERIAL_PARITY_NONE) halfBits+=2;
+    switch(Stopbits) {
+        case SERIAL_STOPBITS_1_5: halfBits+=3; break;
+        case SERIAL_STOPBITS_2: halfBits+=4; break;
+        default: halfBits+=2; break;
+    }
+    charTime_ns=(unsigned long)(halfBits*500000000ULL/Bauds);
+    // Follow the new baud rate if the frame gap is set in characters
+    if (frameGapChars>0) frameGap_ns=(unsigned long long)(frameGapChars*charTime_ns);
+}
+
+
+/*!
+     \brief Return the duration of one character on the line for the current settings
+            (start bit, data bits, parity bit and stop bits at the current baud rate).
+            Useful to express delays in character times.
+     \return The duration of one character in nanoseconds
+  */
+unsigned long serialib::characterTime_ns()
+{
+    return charTime_ns;
+}
+
+
+/*!
+     \brief Return the file descriptor of the device, to wait for it with poll/select among
+            other descriptors, or to move data with splice (see serialib_bridge.h).
+            Bytes already in the receive buffer of serialib are not seen through the descriptor.
+     \return The file descriptor, -1 if the device is not open or on Windows
+  */
+int serialib::fileDescriptor()
+{
+#if defined (__linux__) || defined(__APPLE__)
+    return fd;
+#else
+    return -1;
 #endif
+}
+
+
+/*!
+     \brief Set the silence on the line that ends a frame (see readFrame), in character times.
+            The gap follows the baud rate of the device opened afterwards. Default is 3.5
+            characters, as Modbus RTU.
+     \param nbCharacters : duration of the gap, in character times
+  */
+void serialib::setFrameGap(float nbCharacters)
+{
+    frameGapChars=nbCharacters;
+    frameGap_ns=(unsigned long long)(nbCharacters*charTime_ns);
+}
 
+
+/*!
+     \brief Set the silence on the line that ends a frame (see readFrame), in microseconds.
+            Useful when the gap of the device doesn't depend on the baud rate.
+     \param gap_us : duration of the gap, in microseconds
+  */
+void serialib::setFrameGap_us(unsigned int gap_us)
+{
+    frameGapChars=0;
+    frameGap_ns=gap_us*1000ULL;
+}
+
+
+/*!
+     \brief Set the characters used for software flow control.
+            Must be called before openDevice, the default characters are XON=0x11 (DC1) and XOFF=0x13 (DC3)
+     \param Xon : character that resumes the transmission
+     \param Xoff : character that suspends the transmission
+  */
+void serialib::setXonXoffChars(char Xon, char Xoff)
+{
+    xonChar=Xon;
+    xoffChar=Xoff;
 }
 
 bool serialib::isDeviceOpen()
@@ -370,6 +836,17 @@ bool serialib::isDeviceOpen()
 */
 void serialib::closeDevice()
 {
+#if defined (__linux__) || defined(__APPLE__)
+    // The flush thread writes on the device (restarted by openDevice), and the monitor
+    // thread uses it. Both are stopped without txLock: the monitor callback may write
+    stopFlushThread();
+    stopModemMonitor();
+#endif
+    // Send the buffered bytes (if the device is still open), the writers are done
+    serialScopedLock lock(txLock);
+    if (txBufUsed>0 && isDeviceOpen()) flushWriteBuffer();
+    txBufUsed=0;
+    txBufError=false;
 #if defined (_WIN32) || defined( _WIN64)
     CloseHandle(hSerial);
     hSerial = INVALID_HANDLE_VALUE;
@@ -382,6 +859,86 @@ void serialib::closeDevice()
 
 
 
+/*!
+     \brief Enable the auto-reconnect mode: when the device disappears (USB adapter unplugged
+            or reset), the call that detects the hang-up waits for the device node to come back,
+            reopens it with the settings of openDevice, restores DTR and RTS, then carries on:
+                - a read waits within its own timeout, and returns -2 once the device has been
+                  absent for more than maxDowntime_ms,
+                - a write waits up to maxDowntime_ms, then sends the bytes not written yet
+                  (including the write buffer). Bytes queued in the driver when the device
+                  disappeared are lost. With maxDowntime_ms=0, a write blocks until the device
+                  comes back, and the other writers (and the write buffer flush) wait for it:
+                  set a maximum downtime if the writers must not block forever,
+                - the modem monitor waits for the device, then resumes.
+            The bytes already in the receive buffer are kept. On Linux, the directory of the
+            device is watched with inotify, so the device is reopened as soon as its node is
+            created; on macOS it is checked every SERIAL_RECONNECT_RETRY_MS.
+            Unix only
+     \param enable : true to reconnect automatically
+     \param maxDowntime_ms : delay after which a missing device is reported as an error (0 = wait
+            forever, writes included)
+     \return 1 success
+     \return -1 not supported on this platform
+  */
+int serialib::setAutoReconnect(bool enable, unsigned int maxDowntime_ms)
+{
+#if defined (__linux__) || defined(__APPLE__)
+    serialScopedLock lock(reconnectLock);
+    autoReconnect=enable;
+    reconnectMax_ns=maxDowntime_ms*1000000ULL;
+    return 1;
+#else
+    UNUSED(enable);
+    UNUSED(maxDowntime_ms);
+    return -1;
+#endif
+}
+
+
+
+/*!
+     \brief Get the number of reconnections and the downtime of the device (see setAutoReconnect)
+     \param stats : reconnection statistics
+  */
+void serialib::getReconnectStats(SerialReconnectStats *stats)
+{
+#if defined (__linux__) || defined(__APPLE__)
+    serialScopedLock lock(reconnectLock);
+    *stats=reconnectStats;
+    stats->connected=isDeviceOpen() && lostTime_ns==0;
+#else
+    *stats=SerialReconnectStats();
+    stats->connected=isDeviceOpen();
+#endif
+}
+
+
+
+/*!
+     \brief Check the device, and try once (without waiting) to reopen it if it disappeared and
+            auto-reconnect is enabled. For code that uses the file descriptor directly (see
+            fileDescriptor), and so never goes through the reconnection of the reads and writes.
+            Unix only
+     \return 1 the device is usable (present, or reopened)
+     \return 0 the device is still absent, try again later
+     \return -1 the device is lost (not open, auto-reconnect disabled or maximum downtime reached)
+  */
+int serialib::checkDevice()
+{
+#if defined (__linux__) || defined(__APPLE__)
+    if (fd<0) return -1;
+    unsigned long generation=reconnectStats.count;
+    struct pollfd pfd={fd,POLLOUT,0};
+    if (poll(&pfd,1,0)>=0 && !(pfd.revents & (POLLHUP | POLLERR | POLLNVAL))) return 1;
+    return reconnectDevice(0, generation);
+#else
+    return isDeviceOpen() ? 1 : -1;
+#endif
+}
+
+
+
 
 //___________________________________________
 // ::: Read/Write operation on characters :::
@@ -396,22 +953,13 @@ void serialib::closeDevice()
   */
 int serialib::writeChar(const char Byte)
 {
-#if defined (_WIN32) || defined( _WIN64)
-    // Number of bytes written
-    DWORD dwBytesWritten;
-    // Write the char to the serial device
-    // Return -1 if an error occured
-    if(!WriteFile(hSerial,&Byte,1,&dwBytesWritten,NULL)) return -1;
-    // Write operation successfull
-    return 1;
-#endif
-#if defined (__linux__) || defined(__APPLE__)
+    // Serialize the writers (the readers are not blocked)
+    serialScopedLock lock(txLock);
     // Write the char
-    if (write(fd,&Byte,1)!=1) return -1;
+    if (writeBuffered(&Byte,1)!=1) return -1;
 
     // Write operation successfull
     return 1;
-#endif
 }
 
 
@@ -428,24 +976,14 @@ int serialib::writeChar(const char Byte)
   */
 int serialib::writeString(const char *receivedString)
 {
-#if defined (_WIN32) || defined( _WIN64)
-    // Number of bytes written
-    DWORD dwBytesWritten;
-    // Write the string
-    if(!WriteFile(hSerial,receivedString,strlen(receivedString),&dwBytesWritten,NULL))
-        // Error while writing, return -1
-        return -1;
-    // Write operation successfull
-    return 1;
-#endif
-#if defined (__linux__) || defined(__APPLE__)
+    // Serialize the writers (the readers are not blocked)
+    serialScopedLock lock(txLock);
     // Lenght of the string
     int Lenght=strlen(receivedString);
     // Write the string
-    if (write(fd,receivedString,Lenght)!=Lenght) return -1;
+    if (writeBuffered(receivedString,Lenght)!=Lenght) return -1;
     // Write operation successfull
     return 1;
-#endif
 }
 
 // _____________________________________
@@ -462,45 +1000,369 @@ int serialib::writeString(const char *receivedString)
   */
 int serialib::writeBytes(const void *Buffer, const unsigned int NbBytes, unsigned int *NbBytesWritten)
 {
-#if defined (_WIN32) || defined( _WIN64)
+    // Serialize the writers (the readers are not blocked)
+    serialScopedLock lock(txLock);
     // Write data
-    if(!WriteFile(hSerial, Buffer, NbBytes, NbBytesWritten, NULL))
-        // Error while writing, return -1
-        return -1;
+    int Ret = writeBuffered (Buffer,NbBytes);
+    *NbBytesWritten = (Ret<0) ? 0 : Ret;
+    if (Ret !=(int)NbBytes) return -1;
     // Write operation successfull
     return 1;
+}
+
+
+
+/*!
+     \brief Write bytes on the device, without buffering
+     \param buffer : array of bytes to send
+     \param nbBytes : number of bytes to send
+     \return >=0 the number of bytes written
+     \return -1 error while writing
+  */
+int serialib::writeDevice(const void *buffer, unsigned int nbBytes)
+{
+#if defined (_WIN32) || defined( _WIN64)
+    // Number of bytes written
+    DWORD dwBytesWritten;
+    // Write data
+    if(!WriteFile(hSerial, buffer, nbBytes, &dwBytesWritten, NULL)) return -1;
+    return dwBytesWritten;
 #endif
 #if defined (__linux__) || defined(__APPLE__)
-    // Write data
-    *NbBytesWritten = write (fd,Buffer,NbBytes);
-    if (*NbBytesWritten !=(ssize_t)NbBytes) return -1;
-    // Write operation successfull
-    return 1;
+    return writeData(buffer,nbBytes);
 #endif
 }
 
-int serialib::writeBytes(const void *Buffer, const unsigned int NbBytes)
-{
-    unsigned int NbBytesWritten;
-    return writeBytes(Buffer, NbBytes, &NbBytesWritten);
-}
+
 
 /*!
-     \brief Wait for a byte from the serial device and return the data read
-     \param pByte : data read on the serial device
-     \param timeOut_ms : delay of timeout before giving up the reading
-            If set to zero, timeout is disable (Optional)
+     \brief Enable the write buffer: writeChar, writeString and writeBytes accumulate the bytes,
+            which are sent in one system call when
+                - the buffer holds flushThreshold bytes (or is full),
+                - the first buffered byte is older than flushDelay_us (a background thread sends
+                  the bytes when the delay elapses, on Windows the delay is checked at each write or read),
+                - a read is done (if flushBeforeRead is true, so a request is sent before waiting
+                  for its answer),
+                - flushWriteBuffer or closeDevice is called.
+            Code that writes a message byte by byte then does one system call per message.
+            The pending bytes are sent before the buffer is resized or disabled.
+     \param size : size of the buffer (0 disables the buffering)
+     \param flushThreshold : number of bytes that triggers the transmission (0 = size)
+     \param flushDelay_us : maximum age of the buffered bytes (0 = no limit)
+     \param flushBeforeRead : send the buffered bytes before reading
      \return 1 success
-     \return 0 Timeout reached
-     \return -1 error while setting the Timeout
-     \return -2 error while reading the byte
+     \return -1 error while sending the pending bytes
+     \return -2 the buffer can't be allocated
+     \return -3 the flush thread can't be created (the delay is checked at each write or read)
   */
-int serialib::readChar(char *pByte,unsigned int timeOut_ms)
+int serialib::setWriteBuffer(unsigned int size, unsigned int flushThreshold, unsigned int flushDelay_us, bool flushBeforeRead)
 {
-#if defined (_WIN32) || defined(_WIN64)
-    // Number of bytes read
-    DWORD dwBytesRead = 0;
-
+#if defined (__linux__) || defined(__APPLE__)
+    // The flush thread waits on txLock: stop it before taking the lock
+    stopFlushThread();
+#endif
+    {
+        // Serialize the writers (the readers are not blocked)
+        serialScopedLock lock(txLock);
+        // Send the pending bytes with the previous settings (kept on failure)
+        if (flushWriteBuffer()<0)
+        {
+#if defined (__linux__) || defined(__APPLE__)
+            if (txBufSize>0 && txFlushDelay_ns>0 && fd>=0) startFlushThread();
+#endif
+            return -1;
+        }
+
+        if (size!=txBufSize)
+        {
+            // The write buffer stays locked after lockBuffers
+            if (buffersLocked && txBuf!=NULL) unlockPages(txBuf, txBufSize);
+            freePages(txBuf);
+            txBuf=NULL;
+            txBufSize=0;
+            if (size>0)
+            {
+                txBuf=(char*)allocPages(size);
+                if (txBuf==NULL) return -2;
+                txBufSize=size;
+                if (buffersLocked) lockPages(txBuf, txBufSize);
+            }
+        }
+        txFlushThreshold=(flushThreshold==0 || flushThreshold>size) ? size : flushThreshold;
+        txFlushDelay_ns=flushDelay_us*1000ULL;
+        txFlushBeforeRead=flushBeforeRead;
+    }
+#if defined (__linux__) || defined(__APPLE__)
+    // Send the bytes when their delay elapses, even if the application neither writes nor reads
+    // (started by openDevice if the device is closed)
+    if (txBufSize>0 && txFlushDelay_ns>0 && fd>=0 && startFlushThread()<0) return -3;
+#endif
+    return 1;
+}
+
+
+
+/*!
+     \brief Send the bytes accumulated in the write buffer (see setWriteBuffer)
+     \return >=0 the number of bytes sent
+     \return -1 error while writing (now, or during a flush before a read)
+  */
+int serialib::flushWriteBuffer()
+{
+    // Serialize the writers (the readers are not blocked)
+    serialScopedLock lock(txLock);
+    // Report the failure of an automatic flush
+    if (txBufError)
+    {
+        txBufError=false;
+        return -1;
+    }
+    if (txBufUsed==0) return 0;
+
+    unsigned int nbBytes=txBufUsed;
+    txBufUsed=0;
+    if (writeDevice(txBuf,nbBytes)!=(int)nbBytes) return -1;
+    return nbBytes;
+}
+
+
+
+/*!
+     \brief Write bytes through the write buffer, or directly when the buffer is disabled
+     \param buffer : array of bytes to send
+     \param nbBytes : number of bytes to send
+     \return nbBytes success (the bytes are sent or buffered)
+     \return -1 error while writing
+  */
+int serialib::writeBuffered(const void *buffer, unsigned int nbBytes)
+{
+    if (txBufSize==0) return writeDevice(buffer,nbBytes);
+
+    // Make room for the new bytes, large blocks bypass the buffer
+    if (txBufUsed+nbBytes>txBufSize && flushWriteBuffer()<0) return -1;
+    if (nbBytes>=txBufSize)
+        return (writeDevice(buffer,nbBytes)==(int)nbBytes) ? (int)nbBytes : -1;
+    // An earlier automatic flush failed
+    if (txBufError)
+    {
+        txBufError=false;
+        return -1;
+    }
+
+    // Accumulate, a new batch arms the flush thread
+    if (txBufUsed==0)
+    {
+        txBufTime_ns=timeOut::monotonicTime_ns();
+#if defined (__linux__) || defined(__APPLE__)
+        if (txFlushThreadRunning) pthread_cond_signal(&txFlushCond);
+#endif
+    }
+    memcpy(txBuf+txBufUsed,buffer,nbBytes);
+    txBufUsed+=nbBytes;
+
+    // Send when the threshold or the delay is reached
+    if (txBufUsed>=txFlushThreshold ||
+        (txFlushDelay_ns>0 && timeOut::monotonicTime_ns()-txBufTime_ns>=txFlushDelay_ns))
+        if (flushWriteBuffer()<0) return -1;
+    return nbBytes;
+}
+
+
+
+/*!
+     \brief Send the buffered bytes before a read (when enabled) or when their delay has elapsed.
+            A failure is reported by the next write or flushWriteBuffer. Nothing is done
+            while another thread is writing.
+     \param beforeRead : true when called before reading
+  */
+void serialib::checkWriteBuffer(bool beforeRead)
+{
+    // A writer is busy: it will send the buffered bytes itself
+    if (!tryLockMutex(txLock)) return;
+    if (txBufUsed>0 &&
+        ((beforeRead && txFlushBeforeRead) ||
+         (txFlushDelay_ns>0 && timeOut::monotonicTime_ns()-txBufTime_ns>=txFlushDelay_ns)))
+        if (flushWriteBuffer()<0) txBufError=true;
+    unlockMutex(txLock);
+}
+
+#if defined (__linux__) || defined(__APPLE__)
+/*!
+     \brief Start the thread that sends the buffered bytes when their delay elapses
+     \return 1 success
+     \return -1 error while creating the thread
+  */
+int serialib::startFlushThread()
+{
+    if (txFlushThreadRunning) return 1;
+    txFlushStop=false;
+    if (pthread_create(&txFlushThread, NULL, flushThread, this)!=0) return -1;
+    txFlushThreadRunning=true;
+    return 1;
+}
+
+
+/*!
+     \brief Stop the flush thread and wait for its termination. Must be called without txLock
+  */
+void serialib::stopFlushThread()
+{
+    if (!txFlushThreadRunning) return;
+    pthread_mutex_lock(&txLock);
+    txFlushStop=true;
+    pthread_cond_signal(&txFlushCond);
+    pthread_mutex_unlock(&txLock);
+    pthread_join(txFlushThread, NULL);
+    txFlushThreadRunning=false;
+}
+
+
+/*!
+     \brief Body of the flush thread: sleeps until a batch of bytes is buffered, then until
+            the delay of the batch elapses, and sends it (unless it was sent in the meantime).
+            A failure is reported by the next write or flushWriteBuffer.
+     \param arg : the serialib object
+     \return NULL
+  */
+void* serialib::flushThread(void *arg)
+{
+    serialib *serial=(serialib*)arg;
+    // Real-time settings requested with setRealtimeThreads
+    if (serial->rtPriority!=0 || serial->rtCpuMask!=0)
+        applyRealtime(pthread_self(), serial->rtPriority, serial->rtCpuMask);
+    // txLock is only released while waiting
+    pthread_mutex_lock(&serial->txLock);
+    while (!serial->txFlushStop)
+    {
+        // Nothing buffered: wait for the next batch
+        if (serial->txBufUsed==0)
+        {
+            pthread_cond_wait(&serial->txFlushCond, &serial->txLock);
+            continue;
+        }
+        // Wait for the delay of the current batch (a new batch may start in the meantime)
+        unsigned long long deadline=serial->txBufTime_ns+serial->txFlushDelay_ns;
+        if (timeOut::monotonicTime_ns()<deadline)
+        {
+            waitConditionUntil(&serial->txFlushCond, &serial->txLock, deadline);
+            continue;
+        }
+        if (serial->flushWriteBuffer()<0) serial->txBufError=true;
+    }
+    pthread_mutex_unlock(&serial->txLock);
+    return NULL;
+}
+#endif
+
+
+int serialib::writeBytes(const void *Buffer, const unsigned int NbBytes)
+{
+    unsigned int NbBytesWritten;
+    return writeBytes(Buffer, NbBytes, &NbBytesWritten);
+}
+
+
+
+/*!
+     \brief Enable the 9-bit multidrop mode (RS-485 buses where the 9th bit marks the address
+            bytes): the port uses space parity, the driver marks the bytes received with the
+            parity bit set (PARMRK), and serialib drops the frames addressed to other nodes
+            before they reach the buffers of the application. A frame starts with its address
+            byte, which is kept in the received data. Frames are sent with writeAddressed.
+            Must be called after openDevice (openDevice disables the mode).
+            Linux only
+     \param enable : true to enable the multidrop mode
+     \param address : address of this node, -1 to receive all the frames
+     \param broadcastAddress : address of the frames for all the nodes, -1 if none
+     \return 1 success
+     \return -1 not supported on this platform
+     \return -2 error while writing port parameters
+  */
+int serialib::setMultidrop(bool enable, int address, int broadcastAddress)
+{
+#if defined (__linux__) && defined (CMSPAR)
+    serialScopedLock lockRx(rxLock);
+    serialScopedLock lockTx(txLock);
+    multidrop=enable;
+    multidropAddress=address;
+    multidropBroadcast=broadcastAddress;
+    // Nothing is kept until the first address byte when filtering
+    multidropState=0;
+    multidropAccept=(address<0);
+    if (setupDevice(fd, deviceBauds, deviceDatabits, deviceParity, deviceStopbits, flowControl)<0) return -2;
+    // The parity bit is always on the line in multidrop mode
+    setCharacterTime(deviceBauds, deviceDatabits, enable ? SERIAL_PARITY_SPACE : deviceParity, deviceStopbits);
+    return 1;
+#else
+    UNUSED(enable);
+    UNUSED(address);
+    UNUSED(broadcastAddress);
+    return -1;
+#endif
+}
+
+
+
+/*!
+     \brief Write a frame in multidrop mode (see setMultidrop): the address byte is sent with
+            the parity bit set, then the data bytes with the parity bit cleared. The parity is
+            switched with TCSADRAIN, so the driver sends the previous bytes first.
+     \param address : address of the destination node
+     \param data : bytes of the frame, after the address
+     \param nbBytes : number of bytes of data
+     \return 1 success
+     \return -1 error while writing
+     \return -2 the multidrop mode is not enabled
+  */
+int serialib::writeAddressed(unsigned char address, const void *data, unsigned int nbBytes)
+{
+#if defined (__linux__) && defined (CMSPAR)
+    // Serialize the writers (the readers are not blocked)
+    serialScopedLock lock(txLock);
+    if (!multidrop) return -2;
+    // The buffered bytes belong to the previous frame
+    if (flushWriteBuffer()<0) return -1;
+
+    // Parity bit set for the address byte
+    struct termios options;
+    if (tcgetattr(fd, &options)==-1) return -1;
+    options.c_cflag |= PARODD;
+    if (tcsetattr(fd, TCSADRAIN, &options)==-1) return -1;
+    int Ret=writeDevice(&address,1);
+
+    // Parity bit cleared for the data bytes
+    options.c_cflag &= ~PARODD;
+    if (tcsetattr(fd, TCSADRAIN, &options)==-1 || Ret!=1) return -1;
+    if (nbBytes>0 && writeDevice(data,nbBytes)!=(int)nbBytes) return -1;
+    return 1;
+#else
+    UNUSED(address);
+    UNUSED(data);
+    UNUSED(nbBytes);
+    return -2;
+#endif
+}
+
+/*!
+     \brief Wait for a byte from the serial device and return the data read
+     \param pByte : data read on the serial device
+     \param timeOut_ms : delay of timeout before giving up the reading
+            If set to zero, timeout is disable (Optional)
+     \return 1 success
+     \return 0 Timeout reached
+     \return -1 error while setting the Timeout
+     \return -2 error while reading the byte
+  */
+int serialib::readChar(char *pByte,unsigned int timeOut_ms)
+{
+    // Serialize the readers (the writers are not blocked)
+    serialScopedLock lock(rxLock);
+    // Send the pending request before waiting for the answer
+    checkWriteBuffer(true);
+#if defined (_WIN32) || defined(_WIN64)
+    // Number of bytes read
+    DWORD dwBytesRead = 0;
+
     // Set the TimeOut
     timeouts.ReadTotalTimeoutConstant=timeOut_ms;
 
@@ -514,23 +1376,30 @@ int serialib::readChar(char *pByte,unsigned int timeOut_ms)
     if (dwBytesRead==0) return 0;
 
     // The byte is read
+    rxTimeFirst_ns=rxTimeLast_ns=timeOut::monotonicTime_ns();
     return 1;
 #endif
 #if defined (__linux__) || defined(__APPLE__)
-    // Timer used for timeout
-    timeOut         timer;
-    // Initialise the timer
-    timer.initTimer();
-    // While Timeout is not reached
-    while (timer.elapsedTime_ms()<timeOut_ms || timeOut_ms==0)
+    unsigned long long deadline=timeOut::monotonicTime_ns()+timeOut_ms*1000000ULL;
+    while (true)
     {
-        // Try to read a byte on the device
-        switch (read(fd,pByte,1)) {
+        // Read the pending bytes at once, then serve them from the receive buffer
+        if (rxHead==rxTail && fillReceiveBuffer()<0) return -2;
+        switch (readData(pByte,1)) {
         case 1  : return 1; // Read successfull
         case -1 : return -2; // Error while reading
         }
+
+        // Wait for the next bytes, according to the wait policy
+        long long remaining=-1;
+        if (timeOut_ms>0)
+        {
+            unsigned long long now=timeOut::monotonicTime_ns();
+            if (now>=deadline) return 0;
+            remaining=deadline-now;
+        }
+        if (waitReadable(remaining)<0) return -2;
     }
-    return 0;
 #endif
 }
 
@@ -552,6 +1421,8 @@ int serialib::readStringNoTimeOut(char *receivedString,char finalChar,unsigned i
     unsigned int    NbBytes=0;
     // Returned value from Read
     char            charRead;
+    // Reception time of the first character
+    unsigned long long firstTime=0;
 
     // While the buffer is not full
     while (NbBytes<maxNbBytes)
@@ -562,11 +1433,14 @@ int serialib::readStringNoTimeOut(char *receivedString,char finalChar,unsigned i
         // Check a character has been read
         if (charRead==1)
         {
+            // Keep the reception time of the first character
+            if (NbBytes==0) firstTime=rxTimeFirst_ns;
             // Check if this is the final char
             if (receivedString[NbBytes]==finalChar)
             {
                 // This is the final char, add zero (end of string)
                 receivedString  [++NbBytes]=0;
+                rxTimeFirst_ns=firstTime;
                 // Return the number of bytes read
                 return NbBytes;
             }
@@ -579,6 +1453,7 @@ int serialib::readStringNoTimeOut(char *receivedString,char finalChar,unsigned i
         if (charRead<0) return charRead;
     }
     // Buffer is full : return -3
+    rxTimeFirst_ns=firstTime;
     return -3;
 }
 
@@ -597,6 +1472,8 @@ int serialib::readStringNoTimeOut(char *receivedString,char finalChar,unsigned i
   */
 int serialib::readString(char *receivedString,char finalChar,unsigned int maxNbBytes,unsigned int timeOut_ms)
 {
+    // Serialize the readers (the writers are not blocked)
+    serialScopedLock lock(rxLock);
     // Check if timeout is requested
     if (timeOut_ms==0) return readStringNoTimeOut(receivedString,finalChar,maxNbBytes);
 
@@ -607,6 +1484,8 @@ int serialib::readString(char *receivedString,char finalChar,unsigned int maxNbB
     // Timer used for timeout
     timeOut         timer;
     long int        timeOutParam;
+    // Reception time of the first character
+    unsigned long long firstTime=0;
 
     // Initialize the timer (for timeout)
     timer.initTimer();
@@ -626,11 +1505,14 @@ int serialib::readString(char *receivedString,char finalChar,unsigned int maxNbB
             // If a byte has been received
             if (charRead==1)
             {
+                // Keep the reception time of the first character
+                if (nbBytes==0) firstTime=rxTimeFirst_ns;
                 // Check if the character received is the final one
                 if (receivedString[nbBytes]==finalChar)
                 {
                     // Final character: add the end character 0
                     receivedString  [++nbBytes]=0;
+                    rxTimeFirst_ns=firstTime;
                     // Return the number of bytes read
                     return nbBytes;
                 }
@@ -647,11 +1529,13 @@ int serialib::readString(char *receivedString,char finalChar,unsigned int maxNbB
             // Add the end caracter
             receivedString[nbBytes]=0;
             // Return 0 (timeout reached)
+            if (nbBytes>0) rxTimeFirst_ns=firstTime;
             return 0;
         }
     }
 
     // Buffer is full : return -3
+    rxTimeFirst_ns=firstTime;
     return -3;
 }
 
@@ -661,9 +1545,9 @@ int serialib::readString(char *receivedString,char finalChar,unsigned int maxNbB
      \param buffer : array of bytes read from the serial device
      \param maxNbBytes : maximum allowed number of bytes read
      \param timeOut_ms : delay of timeout before giving up the reading
-     \param sleepDuration_us : delay of CPU relaxing in microseconds (Linux only)
-            In the reading loop, a sleep can be performed after each reading
-            This allows CPU to perform other tasks
+     \param sleepDuration_us : deprecated, the function waits for the data according to the
+            wait policy (see setWaitPolicy). Only used as a polling period if the device
+            can't be polled (Linux only)
      \return >=0 return the number of bytes read before timeout or
                 requested data is completed
      \return -1 error while setting the Timeout
@@ -671,6 +1555,10 @@ int serialib::readString(char *receivedString,char finalChar,unsigned int maxNbB
   */
 int serialib::readBytes (void *buffer,unsigned int maxNbBytes,unsigned int timeOut_ms, unsigned int sleepDuration_us)
 {
+    // Serialize the readers (the writers are not blocked)
+    serialScopedLock lock(rxLock);
+    // Send the pending request before waiting for the answer
+    checkWriteBuffer(true);
 #if defined (_WIN32) || defined(_WIN64)
     // Avoid warning while compiling
     UNUSED(sleepDuration_us);
@@ -688,38 +1576,58 @@ int serialib::readBytes (void *buffer,unsigned int maxNbBytes,unsigned int timeO
     // Read the bytes from the serial device, return -2 if an error occured
     if(!ReadFile(hSerial,buffer,(DWORD)maxNbBytes,&dwBytesRead, NULL))  return -2;
 
+    // Only the end of the reading can be timestamped on Windows
+    if (dwBytesRead>0) rxTimeFirst_ns=rxTimeLast_ns=timeOut::monotonicTime_ns();
     // Return the byte read
     return dwBytesRead;
 #endif
 #if defined (__linux__) || defined(__APPLE__)
-    // Timer used for timeout
-    timeOut          timer;
-    // Initialise the timer
-    timer.initTimer();
+    unsigned long long deadline=timeOut::monotonicTime_ns()+timeOut_ms*1000000ULL;
     unsigned int     NbByteRead=0;
-    // While Timeout is not reached
-    while (timer.elapsedTime_ms()<timeOut_ms || timeOut_ms==0)
+    // Reception time of the first byte
+    unsigned long long firstTime=0;
+    while (true)
     {
         // Compute the position of the current byte
         unsigned char* Ptr=(unsigned char*)buffer+NbByteRead;
         // Try to read a byte on the device
-        int Ret=read(fd,(void*)Ptr,maxNbBytes-NbByteRead);
+        int Ret=readData((void*)Ptr,maxNbBytes-NbByteRead);
         // Error while reading
         if (Ret==-1) return -2;
 
         // One or several byte(s) has been read on the device
         if (Ret>0)
         {
+            // Keep the reception time of the first byte
+            if (NbByteRead==0) firstTime=rxTimeFirst_ns;
             // Increase the number of read bytes
             NbByteRead+=Ret;
             // Success : bytes has been read
             if (NbByteRead>=maxNbBytes)
+            {
+                rxTimeFirst_ns=firstTime;
                 return NbByteRead;
+            }
+            continue;
+        }
+
+        // Wait for the next bytes, according to the wait policy
+        long long remaining=-1;
+        if (timeOut_ms>0)
+        {
+            unsigned long long now=timeOut::monotonicTime_ns();
+            if (now>=deadline) break;
+            remaining=deadline-now;
+        }
+        if (waitReadable(remaining)<0)
+        {
+            // The device can't be polled: fall back to periodic reads
+            if (sleepDuration_us==0) return -2;
+            usleep(sleepDuration_us);
         }
-        // Suspend the loop to avoid charging the CPU
-        usleep (sleepDuration_us);
     }
     // Timeout reached, return the number of bytes read
+    if (NbByteRead>0) rxTimeFirst_ns=firstTime;
     return NbByteRead;
 #endif
 }
@@ -727,332 +1635,2535 @@ int serialib::readBytes (void *buffer,unsigned int maxNbBytes,unsigned int timeO
 
 
 
-// _________________________
-// ::: Special operation :::
-
-
-
 /*!
-    \brief Empty receiver buffer
-    Note that when using serial over USB on Unix systems, a delay of 20ms may be necessary before calling the flushReceiver function
-    \return If the function succeeds, the return value is nonzero.
-            If the function fails, the return value is zero.
-*/
-char serialib::flushReceiver()
+     \brief Read the bytes already received. If no byte is available, wait for the first one:
+            the function returns as soon as data is received, unlike readBytes that waits
+            for maxNbBytes bytes or for the timeout.
+     \param buffer : array of bytes read from the serial device
+     \param maxNbBytes : maximum allowed number of bytes read
+     \param timeOut_ms : delay of timeout before giving up the reading (0 = no timeout)
+     \return >0 success, return the number of bytes read
+     \return 0 timeout reached
+     \return -1 error while setting the Timeout
+     \return -2 error while reading the bytes
+  */
+int serialib::readAvailable(void *buffer, unsigned int maxNbBytes, const unsigned int timeOut_ms)
 {
+    // Serialize the readers (the writers are not blocked)
+    serialScopedLock lock(rxLock);
+    // Send the pending request before waiting for the answer
+    checkWriteBuffer(true);
 #if defined (_WIN32) || defined(_WIN64)
-    // Purge receiver
-    return PurgeComm (hSerial, PURGE_RXCLEAR);
+    // Number of bytes read
+    DWORD dwBytesRead = 0;
+    // Return immediately with the bytes received, or with the first byte received before the timeout
+    COMMTIMEOUTS    available=timeouts;
+    available.ReadIntervalTimeout=MAXDWORD;
+    available.ReadTotalTimeoutMultiplier=MAXDWORD;
+    available.ReadTotalTimeoutConstant=(timeOut_ms==0) ? MAXDWORD-1 : (DWORD)timeOut_ms;
+    if(!SetCommTimeouts(hSerial, &available)) return -1;
+
+    // Read the bytes, then restore the usual timeouts
+    BOOL success=ReadFile(hSerial,buffer,(DWORD)maxNbBytes,&dwBytesRead, NULL);
+    if(!SetCommTimeouts(hSerial, &timeouts)) return -1;
+    if(!success) return -2;
+    if (dwBytesRead>0) rxTimeFirst_ns=rxTimeLast_ns=timeOut::monotonicTime_ns();
+    return dwBytesRead;
 #endif
 #if defined (__linux__) || defined(__APPLE__)
-    // Purge receiver
-    tcflush(fd,TCIFLUSH);
-    return true;
+    unsigned long long deadline=timeOut::monotonicTime_ns()+timeOut_ms*1000000ULL;
+    while (true)
+    {
+        // Read the bytes already received
+        int Ret=readData(buffer,maxNbBytes);
+        if (Ret!=0) return (Ret<0) ? -2 : Ret;
+
+        // Sleep until new bytes are received
+        long long remaining=-1;
+        if (timeOut_ms>0)
+        {
+            unsigned long long now=timeOut::monotonicTime_ns();
+            if (now>=deadline) return 0;
+            remaining=deadline-now;
+        }
+        if (waitReadable(remaining)<0) return -2;
+    }
 #endif
 }
 
 
 
 /*!
-    \brief  Return the number of bytes in the received buffer (UNIX only)
-    \return The number of bytes received by the serial provider but not yet read.
-*/
-int serialib::available()
-{    
+     \brief Read a frame delimited by silence on the line: the bytes received until the line
+            stays idle for the frame gap (see setFrameGap). The gap is measured from the
+            reception time of the last chunk with a precise poll deadline, so the frame is
+            returned as soon as the gap has elapsed.
+            On Windows, the gap is applied with ReadIntervalTimeout (millisecond resolution).
+     \param buffer : array of bytes that receives the frame
+     \param maxNbBytes : size of buffer
+     \param timeOut_ms : delay of timeout before the first byte (0 = no timeout)
+     \return >0 success, return the size of the frame
+     \return 0 timeout reached
+     \return -1 error while setting the timeouts (Windows)
+     \return -2 error while reading the bytes
+     \return -3 the frame is larger than buffer, the rest of the frame is discarded
+  */
+int serialib::readFrame(void *buffer, unsigned int maxNbBytes, const unsigned int timeOut_ms)
+{
+    // Serialize the readers (the writers are not blocked)
+    serialScopedLock lock(rxLock);
+    // Send the pending request before waiting for the answer
+    checkWriteBuffer(true);
 #if defined (_WIN32) || defined(_WIN64)
-    // Device errors
-    DWORD commErrors;
-    // Device status
-    COMSTAT commStatus;
-    // Read status
-    ClearCommError(hSerial, &commErrors, &commStatus);
-    // Return the number of pending bytes
-    return commStatus.cbInQue;
+    DWORD dwBytesRead = 0;
+    // Wait for the first byte, then stop when the interval between two bytes exceeds the gap
+    COMMTIMEOUTS    frame=timeouts;
+    frame.ReadIntervalTimeout=(DWORD)((frameGap_ns+999999)/1000000);
+    if (frame.ReadIntervalTimeout==0) frame.ReadIntervalTimeout=1;
+    frame.ReadTotalTimeoutMultiplier=0;
+    frame.ReadTotalTimeoutConstant=(DWORD)timeOut_ms;
+    if(!SetCommTimeouts(hSerial, &frame)) return -1;
+
+    // Read the frame, then restore the usual timeouts
+    BOOL success=ReadFile(hSerial,buffer,(DWORD)maxNbBytes,&dwBytesRead, NULL);
+    if(!SetCommTimeouts(hSerial, &timeouts)) return -1;
+    if(!success) return -2;
+    if (dwBytesRead>0) rxTimeFirst_ns=rxTimeLast_ns=timeOut::monotonicTime_ns();
+    return dwBytesRead;
 #endif
 #if defined (__linux__) || defined(__APPLE__)
-    int nBytes=0;
-    // Return number of pending bytes in the receiver
-    ioctl(fd, FIONREAD, &nBytes);
-    return nBytes;
-#endif
+    unsigned char *data=(unsigned char*)buffer;
+    unsigned int nbBytes=0;
+    bool overflow=false;
+    unsigned long long firstTime=0;
+    unsigned long long deadline=timeOut::monotonicTime_ns()+timeOut_ms*1000000ULL;
+    while (true)
+    {
+        // Read what has been received, bytes beyond the end of buffer are discarded
+        unsigned char discard[64];
+        int Ret=(nbBytes<maxNbBytes) ? readData(data+nbBytes,maxNbBytes-nbBytes) : readData(discard,sizeof(discard));
+        if (Ret<0) return -2;
+        if (Ret>0)
+        {
+            if (nbBytes==0) firstTime=rxTimeFirst_ns;
+            if (nbBytes<maxNbBytes) nbBytes+=Ret;
+            else overflow=true;
+            continue;
+        }
 
-}
+        if (nbBytes==0 && !overflow)
+        {
+            // Wait for the first byte
+            long long remaining=-1;
+            if (timeOut_ms>0)
+            {
+                unsigned long long now=timeOut::monotonicTime_ns();
+                if (now>=deadline) return 0;
+                remaining=deadline-now;
+            }
+            if (waitReadable(remaining)<0) return -2;
+            continue;
+        }
 
+        // Wait until the gap after the last chunk has elapsed
+        unsigned long long idle=rxTimeLast_ns+frameGap_ns;
+        unsigned long long now=timeOut::monotonicTime_ns();
+        int Wait=waitReadable(now<idle ? (long long)(idle-now) : 0);
+        if (Wait<0) return -2;
+        // No byte during the gap (and not interrupted by a signal): end of the frame
+        if (Wait==0 && timeOut::monotonicTime_ns()>=idle) break;
+    }
+    rxTimeFirst_ns=firstTime;
+    return overflow ? -3 : (int)nbBytes;
+#endif
+}
 
 
-// __________________
-// ::: I/O Access :::
 
 /*!
-    \brief      Set or unset the bit DTR (pin 4)
-                DTR stands for Data Terminal Ready
-                Convenience method :This method calls setDTR and clearDTR
-    \param      status = true set DTR
-                status = false unset DTR
-    \return     If the function fails, the return value is false
-                If the function succeeds, the return value is true.
-*/
-bool serialib::DTR(bool status)
+     \brief Read exactly nbBytes bytes from the serial device (with timeout).
+            The bytes are gathered in the receive buffer with as few system calls as possible
+            (one read per chunk received), the call sleeps while no data is available.
+            If the timeout is reached, nothing is consumed: the bytes already received
+            are kept for the next read.
+            Unix only
+     \param buffer : array of bytes read from the serial device
+     \param nbBytes : number of bytes to read (no more than SERIAL_RX_BUFFER_SIZE)
+     \param timeOut_ms : delay of timeout before giving up the reading (0 = no timeout)
+     \return nbBytes success
+     \return 0 timeout reached
+     \return -1 not supported on this platform
+     \return -2 error while reading the bytes
+     \return -3 nbBytes is larger than the receive buffer
+  */
+int serialib::readExact(void *buffer, unsigned int nbBytes, const unsigned int timeOut_ms)
 {
-    if (status)
-        // Set DTR
-        return this->setDTR();
-    else
-        // Unset DTR
-        return this->clearDTR();
+    // Serialize the readers (the writers are not blocked)
+    serialScopedLock lock(rxLock);
+    // Send the pending request before waiting for the answer
+    checkWriteBuffer(true);
+#if defined (__linux__) || defined(__APPLE__)
+    if (nbBytes>SERIAL_RX_BUFFER_SIZE) return -3;
+    // Gather the bytes in the receive buffer
+    int Ret=fillReceiveBufferUntil(nbBytes, timeOut::monotonicTime_ns()+timeOut_ms*1000000ULL, timeOut_ms==0);
+    if (Ret<=0) return Ret;
+    // Copy and consume the bytes
+    memcpy(buffer,rxBuffer+rxHead,nbBytes);
+    consumeTimestamps(nbBytes);
+    rxHead+=nbBytes;
+    return nbBytes;
+#else
+    UNUSED(buffer);
+    UNUSED(nbBytes);
+    UNUSED(timeOut_ms);
+    return -1;
+#endif
 }
 
 
+
 /*!
-    \brief      Set the bit DTR (pin 4)
-                DTR stands for Data Terminal Ready
-    \return     If the function fails, the return value is false
-                If the function succeeds, the return value is true.
-*/
-bool serialib::setDTR()
+     \brief Read a length-prefixed packet from the serial device (with timeout).
+            The header is read first, the length field is decoded according to format,
+            then the rest of the packet is read. The whole packet (header included) is
+            copied in buffer. If the timeout is reached, nothing is consumed: the bytes
+            already received are kept for the next call.
+            Unix only
+     \param buffer : array of bytes that receives the packet
+     \param maxNbBytes : size of buffer
+     \param format : position, size and byte order of the length field
+     \param timeOut_ms : delay of timeout before giving up the reading (0 = no timeout)
+     \return >0 success, return the size of the packet
+     \return 0 timeout reached
+     \return -1 not supported on this platform
+     \return -2 error while reading the bytes
+     \return -3 the packet is too large (for buffer, format.maxPacketSize or the receive buffer),
+                its header is discarded so the next call can resynchronize
+     \return -4 invalid format
+  */
+int serialib::readPacket(void *buffer, unsigned int maxNbBytes, const SerialPacketFormat &format, const unsigned int timeOut_ms)
 {
-#if defined (_WIN32) || defined(_WIN64)
-    // Set DTR
-    currentStateDTR=true;
-    return EscapeCommFunction(hSerial,SETDTR);
-#endif
+    // Serialize the readers (the writers are not blocked)
+    serialScopedLock lock(rxLock);
+    // Send the pending request before waiting for the answer
+    checkWriteBuffer(true);
 #if defined (__linux__) || defined(__APPLE__)
-    // Set DTR
-    int status_DTR=0;
-    ioctl(fd, TIOCMGET, &status_DTR);
-    status_DTR |= TIOCM_DTR;
-    ioctl(fd, TIOCMSET, &status_DTR);
-    return true;
+    // Check the format
+    if (format.lengthSize<1 || format.lengthSize>4) return -4;
+    if (format.lengthOffset+format.lengthSize>format.headerSize) return -4;
+    if (format.headerSize>SERIAL_RX_BUFFER_SIZE) return -4;
+
+    unsigned long long deadline=timeOut::monotonicTime_ns()+timeOut_ms*1000000ULL;
+
+    // Wait for the header
+    int Ret=fillReceiveBufferUntil(format.headerSize, deadline, timeOut_ms==0);
+    if (Ret<=0) return Ret;
+
+    // Decode the length field
+    const unsigned char *field=rxBuffer+rxHead+format.lengthOffset;
+    unsigned long length=0;
+    for (unsigned int i=0;i<format.lengthSize;i++)
+    {
+        if (format.bigEndian)   length=(length<<8) | field[i];
+        else                    length|=(unsigned long)field[i]<<(8*i);
+    }
+    long long packetSize=(long long)format.headerSize+length+format.lengthAdjust;
+
+    // Reject the packets that can't be received
+    if (packetSize<(long long)format.headerSize ||
+        packetSize>(long long)maxNbBytes ||
+        packetSize>SERIAL_RX_BUFFER_SIZE ||
+        (format.maxPacketSize>0 && packetSize>(long long)format.maxPacketSize))
+    {
+        consumeTimestamps(format.headerSize);
+        rxHead+=format.headerSize;
+        return -3;
+    }
+
+    // Wait for the rest of the packet
+    Ret=fillReceiveBufferUntil((unsigned int)packetSize, deadline, timeOut_ms==0);
+    if (Ret<=0) return Ret;
+
+    // Copy and consume the packet
+    memcpy(buffer,rxBuffer+rxHead,(size_t)packetSize);
+    consumeTimestamps((unsigned int)packetSize);
+    rxHead+=(unsigned int)packetSize;
+    return (int)packetSize;
+#else
+    UNUSED(buffer);
+    UNUSED(maxNbBytes);
+    UNUSED(format);
+    UNUSED(timeOut_ms);
+    return -1;
 #endif
 }
 
+
+
 /*!
-    \brief      Clear the bit DTR (pin 4)
-                DTR stands for Data Terminal Ready
+     \brief Wait until nbBytes bytes are received and return a pointer to them in the receive
+            buffer, without copy and without consuming them. Combined with serialib_layout.h,
+            the fields of a message can be decoded in place:
+            \code
+            const unsigned char *bytes = serial.peekBytes(Message::size, 100);
+            if (bytes) value = serialView<Message>(bytes).get<Message::Field>();
+            serial.consumeBytes(Message::size);
+            \endcode
+            The pointer is valid until the next read operation or consumeBytes.
+            Unix only
+     \param nbBytes : number of bytes to access (no more than SERIAL_RX_BUFFER_SIZE)
+     \param timeOut_ms : delay of timeout before giving up the reading (0 = no timeout)
+     \return pointer to the first byte received
+     \return NULL on timeout, error or if nbBytes is too large
+  */
+const unsigned char* serialib::peekBytes(unsigned int nbBytes, const unsigned int timeOut_ms)
+{
+    // Serialize the readers (the writers are not blocked)
+    serialScopedLock lock(rxLock);
+    // Send the pending request before waiting for the answer
+    checkWriteBuffer(true);
+#if defined (__linux__) || defined(__APPLE__)
+    if (nbBytes>SERIAL_RX_BUFFER_SIZE) return NULL;
+    if (fillReceiveBufferUntil(nbBytes, timeOut::monotonicTime_ns()+timeOut_ms*1000000ULL, timeOut_ms==0)<=0) return NULL;
+    return rxBuffer+rxHead;
+#else
+    UNUSED(nbBytes);
+    UNUSED(timeOut_ms);
+    return NULL;
+#endif
+}
+
+
+
+/*!
+     \brief Remove bytes from the receive buffer, typically after peekBytes
+     \param nbBytes : number of bytes to remove
+     \return the number of bytes removed (less than nbBytes if the buffer holds fewer bytes)
+     \return -1 not supported on this platform
+  */
+int serialib::consumeBytes(unsigned int nbBytes)
+{
+    // Serialize the readers (the writers are not blocked)
+    serialScopedLock lock(rxLock);
+#if defined (__linux__) || defined(__APPLE__)
+    if (nbBytes>rxTail-rxHead) nbBytes=rxTail-rxHead;
+    consumeTimestamps(nbBytes);
+    rxHead+=nbBytes;
+    return nbBytes;
+#else
+    UNUSED(nbBytes);
+    return -1;
+#endif
+}
+
+
+
+/*!
+     \brief Read a length-prefixed packet in a frame (typically from a serialFramePool),
+            without allocation. See readPacket above for the details.
+     \param frame : frame that receives the packet, frame->size is set to the size of the packet
+     \param format : position, size and byte order of the length field
+     \param timeOut_ms : delay of timeout before giving up the reading (0 = no timeout)
+     \return >0 success, return the size of the packet
+     \return 0 timeout reached
+     \return -1 not supported on this platform
+     \return -2 error while reading the bytes
+     \return -3 the packet is too large for the frame
+     \return -4 invalid format
+  */
+int serialib::readPacket(serialFrame *frame, const SerialPacketFormat &format, const unsigned int timeOut_ms)
+{
+    int Ret=readPacket(frame->data, frame->capacity, format, timeOut_ms);
+    frame->size=(Ret>0) ? Ret : 0;
+    return Ret;
+}
+
+
+
+#if defined (__linux__) || defined(__APPLE__)
+/*!
+     \brief Read bytes from the receive buffer or, when the buffer is empty, from the device.
+            When XON/XOFF is handled by serialib, the flow control characters are removed
+            from the data and XOFF is sent when too many bytes are pending in the driver.
+     \param buffer : array of bytes read
+     \param maxNbBytes : maximum allowed number of bytes read
+     \return >=0 number of bytes read (0 if no data is available)
+     \return -1 error while reading
+  */
+int serialib::readData(void *buffer, unsigned int maxNbBytes)
+{
+    // Serve the receive buffer first
+    if (rxHead<rxTail)
+    {
+        unsigned int nbBytes=rxTail-rxHead;
+        if (nbBytes>maxNbBytes) nbBytes=maxNbBytes;
+        memcpy(buffer,rxBuffer+rxHead,nbBytes);
+        consumeTimestamps(nbBytes);
+        rxHead+=nbBytes;
+        // The room freed may let the peer send again
+        throttlePeer();
+        return nbBytes;
+    }
+
+    // Read directly from the device
+    unsigned long generation=reconnectStats.count;
+    ssize_t Ret=read(fd,buffer,maxNbBytes);
+    if (Ret==-1 && (errno==EAGAIN || errno==EWOULDBLOCK || errno==EINTR))
+    {
+        // Nothing pending: the peer may be waiting for XON
+        throttlePeer();
+        return 0;
+    }
+    // Hang-up: reopen the device if it is already back, otherwise let the caller wait for it
+    if (Ret==-1) return (reconnectDevice(0,generation)>=0) ? 0 : -1;
+    // Time stamp as close as possible to the reading
+    if (Ret>0) rxTimeFirst_ns=rxTimeLast_ns=timeOut::monotonicTime_ns();
+    // Keep the frames addressed to us
+    if (multidrop) Ret=filterMultidrop((unsigned char*)buffer,Ret);
+    if (flowControl!=SERIAL_FLOWCONTROL_SOFTWARE_USER) return Ret;
+
+    // Remove XON/XOFF and throttle the peer if we are late
+    Ret=filterFlowControl((unsigned char*)buffer,Ret);
+    throttlePeer();
+    return Ret;
+}
+
+
+
+/*!
+     \brief When XON/XOFF is handled by serialib, send XOFF when too many bytes are pending
+            (in the driver and in the receive buffer), and XON when they have been read.
+            Called by every path that reads from the device or consumes the receive buffer
+  */
+void serialib::throttlePeer()
+{
+    if (flowControl!=SERIAL_FLOWCONTROL_SOFTWARE_USER) return;
+    int pending=0;
+    ioctl(fd, FIONREAD, &pending);
+    pending+=rxTail-rxHead;
+    if (!rxPaused && pending>SERIAL_SOFT_FLOW_HIGH_WATER)
+    {
+        if (write(fd,&xoffChar,1)==1) rxPaused=true;
+    }
+    else if (rxPaused && pending<SERIAL_SOFT_FLOW_LOW_WATER)
+    {
+        if (write(fd,&xonChar,1)==1) rxPaused=false;
+    }
+}
+
+
+
+/*!
+     \brief Move the bytes pending in the driver to the end of the receive buffer
+     \return >=0 number of bytes added to the receive buffer
+     \return -1 error while reading
+  */
+int serialib::fillReceiveBuffer()
+{
+    // Move the pending bytes to the beginning of the buffer
+    if (rxHead>0)
+    {
+        memmove(rxBuffer,rxBuffer+rxHead,rxTail-rxHead);
+        rxTail-=rxHead;
+        rxHead=0;
+    }
+    // Buffer full
+    if (rxTail>=SERIAL_RX_BUFFER_SIZE)
+    {
+        throttlePeer();
+        return 0;
+    }
+
+    // Read as many bytes as possible
+    unsigned long generation=reconnectStats.count;
+    ssize_t Ret=read(fd,rxBuffer+rxTail,SERIAL_RX_BUFFER_SIZE-rxTail);
+    if (Ret==-1 && (errno==EAGAIN || errno==EWOULDBLOCK || errno==EINTR))
+    {
+        // Nothing pending: the peer may be waiting for XON
+        throttlePeer();
+        return 0;
+    }
+    // Hang-up: reopen the device if it is already back, otherwise let the caller wait for it
+    if (Ret==-1) return (reconnectDevice(0,generation)>=0) ? 0 : -1;
+    // Time stamp as close as possible to the reading
+    unsigned long long now=timeOut::monotonicTime_ns();
+    // Keep the frames addressed to us
+    if (multidrop)
+        Ret=filterMultidrop(rxBuffer+rxTail,Ret);
+    if (flowControl==SERIAL_FLOWCONTROL_SOFTWARE_USER)
+        Ret=filterFlowControl(rxBuffer+rxTail,Ret);
+    if (Ret>0) rxTail+=Ret;
+    // Throttle the peer, or let it send again, from the bytes left
+    throttlePeer();
+    if (Ret<=0) return 0;
+
+    // Keep the reception time of the chunk (merged with the last one if there is no room left)
+    rxTotalIn+=Ret;
+    if (rxChunkCount<SERIAL_RX_CHUNKS)
+    {
+        unsigned int last=(rxChunkFirst+rxChunkCount)%SERIAL_RX_CHUNKS;
+        rxChunkEnd[last]=rxTotalIn;
+        rxChunkTime[last]=now;
+        rxChunkCount++;
+    }
+    else
+        rxChunkEnd[(rxChunkFirst+rxChunkCount-1)%SERIAL_RX_CHUNKS]=rxTotalIn;
+    return Ret;
+}
+
+
+
+/*!
+     \brief Set the reception times of the last read (see getReceiveTimestamps) for the next
+            nbBytes bytes of the receive buffer, which are about to be consumed
+     \param nbBytes : number of bytes consumed
+  */
+void serialib::consumeTimestamps(unsigned int nbBytes)
+{
+    if (nbBytes==0) return;
+    // Chunk of the first byte
+    while (rxChunkCount>0 && rxChunkEnd[rxChunkFirst]<=rxTotalOut)
+    {
+        rxChunkFirst=(rxChunkFirst+1)%SERIAL_RX_CHUNKS;
+        rxChunkCount--;
+    }
+    if (rxChunkCount>0) rxTimeFirst_ns=rxChunkTime[rxChunkFirst];
+
+    // Chunk of the last byte
+    rxTotalOut+=nbBytes;
+    while (rxChunkCount>0 && rxChunkEnd[rxChunkFirst]<rxTotalOut)
+    {
+        rxChunkFirst=(rxChunkFirst+1)%SERIAL_RX_CHUNKS;
+        rxChunkCount--;
+    }
+    if (rxChunkCount>0) rxTimeLast_ns=rxChunkTime[rxChunkFirst];
+}
+
+
+
+/*!
+     \brief Empty the receive buffer and forget the reception times of its chunks
+  */
+void serialib::resetReceiveBuffer()
+{
+    rxHead = rxTail = 0;
+    rxChunkFirst = rxChunkCount = 0;
+    rxTotalIn = rxTotalOut = 0;
+}
+
+
+
+/*!
+     \brief Wait until the receive buffer holds at least nbBytes bytes
+     \param nbBytes : number of bytes expected (no more than SERIAL_RX_BUFFER_SIZE)
+     \param deadline_ns : monotonic time when waiting is given up
+     \param noTimeOut : if true, the deadline is ignored
+     \return 1 the bytes are in the receive buffer
+     \return 0 timeout reached
+     \return -2 error while reading
+  */
+int serialib::fillReceiveBufferUntil(unsigned int nbBytes, unsigned long long deadline_ns, bool noTimeOut)
+{
+    while (rxTail-rxHead<nbBytes)
+    {
+        // Move the pending bytes into the buffer
+        int Ret=fillReceiveBuffer();
+        if (Ret<0) return -2;
+        if (rxTail-rxHead>=nbBytes) break;
+
+        // Sleep until more bytes are received
+        long long remaining=-1;
+        if (!noTimeOut)
+        {
+            unsigned long long now=timeOut::monotonicTime_ns();
+            if (now>=deadline_ns) return 0;
+            remaining=deadline_ns-now;
+        }
+        if (waitReadable(remaining)<0) return -2;
+    }
+    return 1;
+}
+
+
+
+/*!
+     \brief Wait until the device has data to read: busy-poll for the spin budget of the
+            wait policy (see setWaitPolicy), then sleep
+     \param timeout_ns : maximum waiting time in nanoseconds, negative for no timeout
+     \return 1 data can be read
+     \return 0 timeout reached (or interrupted by a signal)
+     \return -1 error while waiting
+  */
+int serialib::waitReadable(long long timeout_ns)
+{
+    struct pollfd pfd={fd,POLLIN,0};
+    unsigned long generation=reconnectStats.count;
+    unsigned long long start=timeOut::monotonicTime_ns();
+    // Deadline used to measure the wake-up latency
+    unsigned long long deadline=(timeout_ns>0) ? start+timeout_ns : 0;
+    int Ret=0;
+
+    // Busy-poll for the spin budget: no sleep, no wake-up latency
+    unsigned long long budget=(waitPolicy==SERIAL_WAIT_BLOCK) ? 0 : spinBudget_ns;
+    if (timeout_ns>=0 && budget>(unsigned long long)timeout_ns) budget=timeout_ns;
+    if (budget>0)
+    {
+        unsigned long long now=start;
+        while ((Ret=poll(&pfd,1,0))==0 && (now=timeOut::monotonicTime_ns())-start<budget) {}
+        if (Ret==0 && timeout_ns>=0)
+        {
+            // Nothing during the spin, sleep for the rest of the timeout
+            timeout_ns-=now-start;
+            if (timeout_ns<=0)
+            {
+                recordArrival(now-start);
+                return 0;
+            }
+        }
+    }
+
+    if (Ret==0)
+    {
+#if defined (__linux__)
+        // Nanosecond resolution
+        struct timespec timeout, *pTimeout=NULL;
+        if (timeout_ns>=0)
+        {
+            timeout.tv_sec=timeout_ns/1000000000LL;
+            timeout.tv_nsec=timeout_ns%1000000000LL;
+            pTimeout=&timeout;
+        }
+        Ret=ppoll(&pfd,1,pTimeout,NULL);
+#else
+        // Millisecond resolution, rounded up
+        Ret=poll(&pfd,1,(timeout_ns<0) ? -1 : (int)((timeout_ns+999999)/1000000));
+#endif
+    }
+    if (Ret==-1) return (errno==EINTR) ? 0 : -1;
+    if (Ret==0)
+    {
+        if (deadline>0) recordWakeup(wakeupStats, deadline);
+        recordArrival(timeOut::monotonicTime_ns()-start);
+        return 0;
+    }
+    // Error, or hang up with nothing left to read
+    if ((pfd.revents & (POLLNVAL | POLLERR)) || ((pfd.revents & POLLHUP) && !(pfd.revents & POLLIN)))
+    {
+        // Wait for the device for the rest of the timeout (auto-reconnect), then let the caller read again
+        long long remaining=-1;
+        if (timeout_ns>=0)
+        {
+            unsigned long long now=timeOut::monotonicTime_ns();
+            remaining=(deadline>now) ? (long long)(deadline-now) : 0;
+        }
+        return (reconnectDevice(remaining,generation)>=0) ? 0 : -1;
+    }
+    recordArrival(timeOut::monotonicTime_ns()-start);
+    return 1;
+}
+
+
+
+/*!
+     \brief Tune the spin budget of the adaptive wait policy: spin for about twice the usual
+            delay before data arrives when it is within the maximum budget, otherwise
+            don't spin at all (spinning would only burn the CPU before sleeping anyway)
+     \param wait_ns : time spent waiting for data (or until the timeout)
+  */
+void serialib::recordArrival(unsigned long long wait_ns)
+{
+    if (waitPolicy!=SERIAL_WAIT_ADAPTIVE) return;
+    // Moving average over about 8 waits
+    arrivalAverage_ns=arrivalAverage_ns-arrivalAverage_ns/8+wait_ns/8;
+    spinBudget_ns=(2*arrivalAverage_ns<=spinMax_ns) ? 2*arrivalAverage_ns : 0;
+}
+
+
+
+/*!
+     \brief Remove the XON and XOFF characters from received data.
+            The last character received sets the transmission state.
+     \param data : received bytes, filtered in place
+     \param nbBytes : number of received bytes
+     \return The number of bytes left in data
+  */
+unsigned int serialib::filterFlowControl(unsigned char *data, unsigned int nbBytes)
+{
+    unsigned int nbKept=0;
+    for (unsigned int i=0;i<nbBytes;i++)
+    {
+        // Read by the writers without rxLock
+        if (data[i]==(unsigned char)xoffChar)       atomicStore(&txPaused, true);
+        else if (data[i]==(unsigned char)xonChar)   atomicStore(&txPaused, false);
+        else data[nbKept++]=data[i];
+    }
+    return nbKept;
+}
+
+
+
+/*!
+     \brief Decode the parity marks of the multidrop mode (PARMRK): 0xFF 0x00 b is an address
+            byte b (parity bit set), 0xFF 0xFF is a data byte 0xFF. The address byte starts a
+            frame, which is kept (address byte included) if it is addressed to us or broadcast.
+            Runs of data bytes are kept or dropped at once, the marks are found with memchr.
+            The state is kept between calls, a mark can be split over two reads.
+     \param data : received bytes, filtered in place
+     \param nbBytes : number of received bytes
+     \return The number of bytes left in data
+  */
+unsigned int serialib::filterMultidrop(unsigned char *data, unsigned int nbBytes)
+{
+    unsigned int nbKept=0;
+    unsigned int i=0;
+    while (i<nbBytes)
+    {
+        if (multidropState==0)
+        {
+            // Data bytes until the next mark
+            unsigned char *mark=(unsigned char*)memchr(data+i,0xFF,nbBytes-i);
+            unsigned int end=(mark==NULL) ? nbBytes : (unsigned int)(mark-data);
+            if (multidropAccept)
+            {
+                if (nbKept!=i) memmove(data+nbKept,data+i,end-i);
+                nbKept+=end-i;
+            }
+            i=end;
+            if (mark!=NULL)
+            {
+                multidropState=1;
+                i++;
+            }
+            continue;
+        }
+
+        unsigned char byte=data[i++];
+        if (multidropState==1)
+        {
+            // 0xFF 0x00 announces an address byte, 0xFF 0xFF is an escaped data byte
+            if (byte==0x00) multidropState=2;
+            else
+            {
+                if (multidropAccept) data[nbKept++]=byte;
+                multidropState=0;
+            }
+            continue;
+        }
+
+        // Address byte: start of a frame
+        multidropAccept=(multidropAddress<0 || byte==multidropAddress || byte==multidropBroadcast);
+        if (multidropAccept) data[nbKept++]=byte;
+        multidropState=0;
+    }
+    return nbKept;
+}
+
+
+
+/*!
+     \brief Wait until the peer allows transmission (after XOFF, wait for XON).
+            Received data is stored in the receive buffer while waiting.
+     \param deadline_ns : monotonic time at which the wait is abandoned (0 = no limit)
+     \return 1 transmission is allowed
+     \return -1 error while reading, or receive buffer full while waiting for XON
+     \return -2 timeout reached, XON not received
+  */
+int serialib::waitTransmitAllowed(unsigned long long deadline_ns)
+{
+    // Look for XON/XOFF in the pending bytes
+    if (fillReceiveBufferShared()<0) return -1;
+    while (atomicLoad(&txPaused))
+    {
+        // XON lost, or the peer stopped reading
+        if (deadline_ns>0 && timeOut::monotonicTime_ns()>=deadline_ns) return -2;
+        // A reader thread receives XON for us
+        if (!tryLockMutex(rxLock))
+        {
+            timeOut::sleepUntil_ns(timeOut::monotonicTime_ns()+1000000);
+            continue;
+        }
+        // XON can't be received if there is no room left
+        int Ret=(rxHead==0 && rxTail>=SERIAL_RX_BUFFER_SIZE) ? -1 : 1;
+        // Sleep until new bytes are received
+        struct pollfd pfd={fd,POLLIN,0};
+        if (Ret==1 && poll(&pfd,1,1)==-1 && errno!=EINTR) Ret=-1;
+        if (Ret==1 && fillReceiveBuffer()<0) Ret=-1;
+        unlockMutex(rxLock);
+        if (Ret<0) return -1;
+    }
+    return 1;
+}
+
+
+
+/*!
+     \brief Read the pending bytes (and XON/XOFF) from the transmission path. When a reader
+            thread holds the reception path, it handles XON/XOFF itself and nothing is done.
+     \return >=0 number of bytes added to the receive buffer
+     \return -1 error while reading
+  */
+int serialib::fillReceiveBufferShared()
+{
+    if (!tryLockMutex(rxLock)) return 0;
+    int Ret=fillReceiveBuffer();
+    unlockMutex(rxLock);
+    return Ret;
+}
+
+
+
+/*!
+     \brief Reopen the device after a hang-up (see setAutoReconnect). The device is reopened
+            with the settings of openDevice and duplicated onto the current file descriptor,
+            so the descriptor doesn't change and the other threads simply retry their calls.
+            The lock is only held while reopening: each thread waits for the device node with
+            its own timeout.
+     \param timeout_ns : maximum waiting time in nanoseconds (0 = one attempt, negative = until
+            the maximum downtime)
+     \param generation : number of reconnections when the failing call was made
+     \return 1 the device can be used again (reopened now or by another thread)
+     \return 0 timeout reached, the device is still missing
+     \return -1 auto-reconnect disabled, error not caused by a hang-up, or device missing for
+            more than the maximum downtime
+  */
+int serialib::reconnectDevice(long long timeout_ns, unsigned long generation)
+{
+    unsigned long long start=timeOut::monotonicTime_ns();
+    int notify=-1;
+    int watch=-1;
+    int Ret=0;
+    while (true)
+    {
+        {
+            serialScopedLock lock(reconnectLock);
+            if (!autoReconnect || fd<0) return -1;
+            // Still healthy: either reopened by another thread, or not a hang-up at all
+            struct pollfd pfd={fd,POLLOUT,0};
+            if (poll(&pfd,1,0)>=0 && !(pfd.revents & (POLLHUP | POLLERR | POLLNVAL)))
+            {
+                Ret=(reconnectStats.count!=generation) ? 1 : -1;
+                break;
+            }
+            unsigned long long now=timeOut::monotonicTime_ns();
+            if (lostTime_ns==0) lostTime_ns=now;
+
+            // Try to reopen the device with its settings
+            int device=open(devicePath, O_RDWR | O_NOCTTY | O_NDELAY);
+            if (device!=-1)
+            {
+                fcntl(device, F_SETFL, FNDELAY);
+                if (setupDevice(device, deviceBauds, deviceDatabits, deviceParity, deviceStopbits, flowControl)<0 ||
+                    dup2(device, fd)==-1)
+                {
+                    close(device);
+                    Ret=-1;
+                    break;
+                }
+                close(device);
+
+                // Restore the state of the lines and of the flow control
+                setModemLines((currentStateDTR ? SERIAL_LINE_DTR : 0) | (currentStateRTS ? SERIAL_LINE_RTS : 0),
+                              (currentStateDTR ? 0 : SERIAL_LINE_DTR) | (currentStateRTS ? 0 : SERIAL_LINE_RTS));
+                atomicStore(&txPaused, false);
+                rxPaused = false;
+                getLineCounters(&lastCounters);
+                // The monitor thread waits for the reconnection and resumes by itself (it
+                // can't be restarted from here: its callback may be waiting for txLock)
+                if (!modemThreadRunning) modemCountsValid = false;
+
+                // Downtime
+                now=timeOut::monotonicTime_ns();
+                reconnectStats.count++;
+                reconnectStats.lastDowntime_ns=now-lostTime_ns;
+                reconnectStats.totalDowntime_ns+=now-lostTime_ns;
+                if (now-lostTime_ns>reconnectStats.maxDowntime_ns) reconnectStats.maxDowntime_ns=now-lostTime_ns;
+                lostTime_ns=0;
+                Ret=1;
+                break;
+            }
+
+            // Give up after the maximum downtime
+            if (reconnectMax_ns>0 && now-lostTime_ns>=reconnectMax_ns)
+            {
+                Ret=-1;
+                break;
+            }
+        }
+
+        // Time left for this call (limited by the maximum downtime)
+        unsigned long long now=timeOut::monotonicTime_ns();
+        long long remaining=-1;
+        if (timeout_ns>=0) remaining=(start+timeout_ns>now) ? (long long)(start+timeout_ns-now) : 0;
+        if (reconnectMax_ns>0)
+        {
+            long long downtime=(lostTime_ns+reconnectMax_ns>now) ? (long long)(lostTime_ns+reconnectMax_ns-now) : 0;
+            if (remaining<0 || downtime<remaining) remaining=downtime;
+        }
+        if (remaining==0)
+        {
+            Ret=0;
+            break;
+        }
+
+#if defined (__linux__)
+        // Watch the directory of the device before the next attempt, so its creation is not missed
+        if (notify==-1) notify=inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (notify!=-1 && watch==-1)
+        {
+            char directory[PATH_MAX];
+            strncpy(directory, devicePath, sizeof(directory)-1);
+            directory[sizeof(directory)-1]=0;
+            char *slash=strrchr(directory, '/');
+            if (slash==NULL) strcpy(directory, ".");
+            else if (slash==directory) slash[1]=0;
+            else *slash=0;
+            watch=inotify_add_watch(notify, directory, IN_CREATE | IN_MOVED_TO | IN_ATTRIB);
+            // Try again now that the directory is watched
+            if (watch!=-1) continue;
+        }
+        if (watch!=-1)
+        {
+            // Sleep until a file is created (or its permissions are set) in the directory
+            struct pollfd pfd={notify,POLLIN,0};
+            if (poll(&pfd,1,(remaining<0) ? -1 : (int)((remaining+999999)/1000000))>0)
+            {
+                char events[4096];
+                while (read(notify, events, sizeof(events))>0) {}
+            }
+            continue;
+        }
+#endif
+        // The directory can't be watched: try again periodically
+        long long retry=SERIAL_RECONNECT_RETRY_MS*1000000LL;
+        if (remaining>=0 && remaining<retry) retry=remaining;
+        timeOut::sleepUntil_ns(timeOut::monotonicTime_ns()+retry);
+    }
+#if defined (__linux__)
+    if (notify!=-1) close(notify);
+#endif
+    return Ret;
+}
+
+
+
+/*!
+     \brief Write bytes on the device. Partial writes are completed, waiting for the driver
+            when its output buffer is full (or when the flow control suspends the transmission).
+            When XON/XOFF is handled by serialib, at most SERIAL_SOFT_FLOW_CHUNK bytes
+            are queued in the driver so XOFF stops the transmission quickly.
+            The waiting is limited by the write timeout (see setWriteTimeout).
+     \param buffer : array of bytes to send
+     \param nbBytes : number of bytes to send
+     \return >=0 the number of bytes written (nbBytes on success, less on timeout)
+     \return -1 error while writing
+  */
+int serialib::writeData(const void *buffer, unsigned int nbBytes)
+{
+    const unsigned char *data=(const unsigned char*)buffer;
+    unsigned int written=0;
+    unsigned long long deadline=(txTimeout_ns>0) ? timeOut::monotonicTime_ns()+txTimeout_ns : 0;
+    while (written<nbBytes)
+    {
+        unsigned int chunk=nbBytes-written;
+        if (flowControl==SERIAL_FLOWCONTROL_SOFTWARE_USER)
+        {
+            // Keep the driver queue short, and check for XOFF while it drains
+            int queued=0;
+            while (ioctl(fd, TIOCOUTQ, &queued)!=-1 && queued>SERIAL_SOFT_FLOW_CHUNK && !atomicLoad(&txPaused))
+            {
+                if (deadline>0 && timeOut::monotonicTime_ns()>=deadline) return written;
+                struct pollfd pfd={fd,POLLIN,0};
+                if (poll(&pfd,1,1)>0 && fillReceiveBufferShared()<0) return -1;
+            }
+            int allowed=waitTransmitAllowed(deadline);
+            if (allowed==-2) return written;
+            if (allowed<0) return -1;
+            if (chunk>SERIAL_SOFT_FLOW_CHUNK) chunk=SERIAL_SOFT_FLOW_CHUNK;
+        }
+        if (paceRate>0)
+        {
+            // Never send more than one burst at once, and wait for the tokens
+            if (chunk>paceBurst) chunk=paceBurst;
+            paceTransmit(chunk);
+        }
+
+        unsigned long generation=reconnectStats.count;
+        ssize_t Ret=write(fd,data+written,chunk);
+        // Give back the tokens of the bytes not accepted by the driver
+        if (paceRate>0) paceTokens+=chunk-(Ret>0 ? Ret : 0);
+        if (Ret>0)
+        {
+            written+=Ret;
+            continue;
+        }
+        if (Ret==-1 && errno!=EAGAIN && errno!=EWOULDBLOCK && errno!=EINTR)
+        {
+            // Hang-up: wait for the device (auto-reconnect), then send the rest
+            if (reconnectDevice(-1,generation)>0) continue;
+            return -1;
+        }
+
+        // Output buffer full, wait until the driver accepts more bytes
+        int wait=-1;
+        if (deadline>0)
+        {
+            unsigned long long now=timeOut::monotonicTime_ns();
+            if (now>=deadline) return written;
+            wait=(int)((deadline-now+999999)/1000000);
+        }
+        struct pollfd pfd={fd,POLLOUT,0};
+        if (poll(&pfd,1,wait)==-1 && errno!=EINTR) return -1;
+    }
+    return written;
+}
+
+
+
+/*!
+     \brief Wait until nbBytes tokens are available in the transmit bucket, then consume them.
+            The bucket is refilled at paceRate tokens per second and holds at most paceBurst tokens.
+     \param nbBytes : number of bytes about to be sent (no more than paceBurst)
+  */
+void serialib::paceTransmit(unsigned int nbBytes)
+{
+    unsigned long long now=timeOut::monotonicTime_ns();
+    // Refill the bucket with the tokens earned since the last call
+    paceTokens+=(double)(now-paceTime_ns)*paceRate/1e9;
+    if (paceTokens>paceBurst) paceTokens=paceBurst;
+    paceTime_ns=now;
+
+    if (paceTokens<nbBytes)
+    {
+        // Sleep until the missing tokens are earned
+        unsigned long long wakeUp=now+(unsigned long long)((nbBytes-paceTokens)*1e9/paceRate);
+        timeOut::sleepUntil_ns(wakeUp);
+        now=timeOut::monotonicTime_ns();
+        paceTokens+=(double)(now-paceTime_ns)*paceRate/1e9;
+        paceTime_ns=now;
+    }
+    paceTokens-=nbBytes;
+}
+#endif
+
+
+
+/*!
+     \brief Return the reception times of the first and last bytes returned by the last read
+            (readChar, readString, readBytes, readAvailable, readExact, readPacket or consumeBytes).
+            The times are taken with the monotonic clock (see timeOut::monotonicTime_ns) right after
+            the read system call that pulled the bytes from the driver, so they don't include the
+            scheduling delays of the application. For a line or a packet received in several chunks,
+            the first and last times are the times of the first and last chunks.
+            On Windows, both times are the end of the reading.
+     \param firstByte_ns : reception time of the first byte (can be NULL)
+     \param lastByte_ns : reception time of the last byte (can be NULL)
+  */
+void serialib::getReceiveTimestamps(unsigned long long *firstByte_ns, unsigned long long *lastByte_ns)
+{
+    // Serialize the readers (the writers are not blocked)
+    serialScopedLock lock(rxLock);
+    if (firstByte_ns!=NULL) *firstByte_ns=rxTimeFirst_ns;
+    if (lastByte_ns!=NULL)  *lastByte_ns=rxTimeLast_ns;
+}
+
+
+
+/*!
+     \brief Limit the transmission rate for devices with small receive buffers and no flow control.
+            The bytes written by writeChar, writeString and writeBytes are sent in bursts of at most
+            burstBytes bytes, at an average rate of bytesPerSecond (token bucket).
+            For example, setTransmitPacing(6400,64) sends 64 bytes every 10 ms.
+            Unix only, ignored on Windows.
+     \param bytesPerSecond : maximum average rate in bytes per second, 0 disables the pacing
+     \param burstBytes : maximum number of bytes sent at once (bucket size)
+  */
+void serialib::setTransmitPacing(unsigned int bytesPerSecond, unsigned int burstBytes)
+{
+    // Serialize the writers (the readers are not blocked)
+    serialScopedLock lock(txLock);
+#if defined (__linux__) || defined(__APPLE__)
+    paceRate=bytesPerSecond;
+    paceBurst=(burstBytes>0) ? burstBytes : 1;
+    // Start with a full bucket
+    paceTokens=paceBurst;
+    paceTime_ns=timeOut::monotonicTime_ns();
+#else
+    UNUSED(bytesPerSecond);
+    UNUSED(burstBytes);
+#endif
+}
+
+
+
+/*!
+     \brief Limit the time a write waits for the transmission: for XON after the peer sent
+            XOFF (SERIAL_FLOWCONTROL_SOFTWARE_USER), and for room in the driver (hardware flow
+            control, or device that stopped sending). On timeout, writeBytes returns -1 and
+            the bytes written so far are reported. Unix only, ignored on Windows.
+     \param timeOut_ms : maximum waiting time of each write in milliseconds, 0 waits forever (default)
+  */
+void serialib::setWriteTimeout(unsigned int timeOut_ms)
+{
+    // Serialize the writers (the readers are not blocked)
+    serialScopedLock lock(txLock);
+#if defined (__linux__) || defined(__APPLE__)
+    txTimeout_ns=timeOut_ms*1000000ULL;
+#else
+    UNUSED(timeOut_ms);
+#endif
+}
+
+
+
+// _________________________
+// ::: Special operation :::
+
+
+
+/*!
+    \brief Empty receiver buffer
+    Note that when using serial over USB on Unix systems, a delay of 20ms may be necessary before calling the flushReceiver function
+    \return If the function succeeds, the return value is nonzero.
+            If the function fails, the return value is zero.
+*/
+char serialib::flushReceiver()
+{
+    // Serialize the readers (the writers are not blocked)
+    serialScopedLock lock(rxLock);
+#if defined (_WIN32) || defined(_WIN64)
+    // Purge receiver
+    return PurgeComm (hSerial, PURGE_RXCLEAR);
+#endif
+#if defined (__linux__) || defined(__APPLE__)
+    // Purge receiver
+    tcflush(fd,TCIFLUSH);
+    resetReceiveBuffer();
+    return true;
+#endif
+}
+
+
+
+/*!
+    \brief  Return the number of bytes in the received buffer (UNIX only)
+    \return The number of bytes received by the serial provider but not yet read.
+*/
+int serialib::available()
+{    
+    // Serialize the readers (the writers are not blocked)
+    serialScopedLock lock(rxLock);
+#if defined (_WIN32) || defined(_WIN64)
+    // Device errors
+    DWORD commErrors;
+    // Device status
+    COMSTAT commStatus;
+    // Read status
+    ClearCommError(hSerial, &commErrors, &commStatus);
+    // Return the number of pending bytes
+    return commStatus.cbInQue;
+#endif
+#if defined (__linux__) || defined(__APPLE__)
+    int nBytes=0;
+    // Return number of pending bytes in the receiver and in the receive buffer
+    ioctl(fd, FIONREAD, &nBytes);
+    return nBytes+(rxTail-rxHead);
+#endif
+
+}
+
+
+
+/*!
+    \brief  Return the number of bytes written on the device but not transmitted yet
+            (still queued in the driver). Bytes in the UART FIFO may not be included,
+            depending on the driver.
+    \return The number of bytes waiting for transmission
+    \return -1 if the number of bytes can't be read
+*/
+int serialib::pendingOutput()
+{
+    // Serialize the writers (the readers are not blocked)
+    serialScopedLock lock(txLock);
+#if defined (_WIN32) || defined(_WIN64)
+    // Device errors
+    DWORD commErrors;
+    // Device status
+    COMSTAT commStatus;
+    // Read status
+    if (!ClearCommError(hSerial, &commErrors, &commStatus)) return -1;
+    // Return the number of bytes in the output queue and in the write buffer
+    return commStatus.cbOutQue+txBufUsed;
+#endif
+#if defined (__linux__) || defined(__APPLE__)
+    int nBytes=0;
+    // Return number of bytes in the output queue of the driver and in the write buffer
+    if (ioctl(fd, TIOCOUTQ, &nBytes)==-1) return -1;
+    return nBytes+txBufUsed;
+#endif
+}
+
+
+
+/*!
+    \brief  Wait until all the bytes written are transmitted on the line.
+            Unlike tcdrain, the wait is bounded by a timeout. The output queue is polled
+            at the rate the line drains it: the sleep duration is estimated from the
+            number of pending bytes and the character time, so the end of the transmission
+            is detected within about one character time.
+            On Linux, when the driver reports the state of the UART (TIOCSERGETLSR), the function
+            also waits for the transmitter to be empty, otherwise one more character time is waited
+            for the last byte in the shift register.
+            Typical use: switch the direction of a half-duplex bus, or start a response timer.
+    \param  timeOut_ms : delay of timeout before giving up (0 = no timeout)
+    \param  lastByteTime_ns : if not NULL, monotonic time when the end of the transmission
+            was detected (see timeOut::monotonicTime_ns)
+    \return 1 all the bytes are transmitted
+    \return 0 timeout reached
+    \return -1 error while reading the output queue
+*/
+int serialib::waitTransmitted(const unsigned int timeOut_ms, unsigned long long *lastByteTime_ns)
+{
+    // Serialize the writers (the readers are not blocked)
+    serialScopedLock lock(txLock);
+    // The buffered bytes must be transmitted too
+    if (flushWriteBuffer()<0) return -1;
+    unsigned long long deadline=timeOut::monotonicTime_ns()+timeOut_ms*1000000ULL;
+    while (true)
+    {
+        int queued=pendingOutput();
+        if (queued<0) return -1;
+
+        unsigned long long now=timeOut::monotonicTime_ns();
+        if (queued==0)
+        {
+#if defined (__linux__) && defined (TIOCSERGETLSR)
+            // Wait for the shift register when the driver knows it
+            unsigned int lsr=0;
+            if (ioctl(fd, TIOCSERGETLSR, &lsr)!=-1)
+            {
+                if (lsr & TIOCSER_TEMT)
+                {
+                    if (lastByteTime_ns!=NULL) *lastByteTime_ns=now;
+                    return 1;
+                }
+                queued=1;
+            }
+            else
+#endif
+            {
+                // Unknown state of the UART, the last byte may still be on the line
+                timeOut::sleepUntil_ns(now+charTime_ns);
+                if (lastByteTime_ns!=NULL) *lastByteTime_ns=timeOut::monotonicTime_ns();
+                return 1;
+            }
+        }
+
+        // Timeout reached
+        if (timeOut_ms>0 && now>=deadline) return 0;
+
+        // Sleep while the pending bytes are sent (at least 50us, never beyond the deadline)
+        unsigned long long wakeUp=now+(unsigned long long)queued*charTime_ns;
+        if (wakeUp<now+50000) wakeUp=now+50000;
+        if (timeOut_ms>0 && wakeUp>deadline) wakeUp=deadline;
+        timeOut::sleepUntil_ns(wakeUp);
+        recordWakeup(txWakeupStats, wakeUp);
+    }
+}
+
+
+
+// __________________
+// ::: I/O Access :::
+
+/*!
+    \brief      Set or unset the bit DTR (pin 4)
+                DTR stands for Data Terminal Ready
+                Convenience method :This method calls setDTR and clearDTR
+    \param      status = true set DTR
+                status = false unset DTR
+    \return     If the function fails, the return value is false
+                If the function succeeds, the return value is true.
+*/
+bool serialib::DTR(bool status)
+{
+    if (status)
+        // Set DTR
+        return this->setDTR();
+    else
+        // Unset DTR
+        return this->clearDTR();
+}
+
+
+/*!
+    \brief      Set the bit DTR (pin 4)
+                DTR stands for Data Terminal Ready
+    \return     If the function fails, the return value is false
+                If the function succeeds, the return value is true.
+*/
+bool serialib::setDTR()
+{
+#if defined (_WIN32) || defined(_WIN64)
+    // Set DTR
+    currentStateDTR=true;
+    return EscapeCommFunction(hSerial,SETDTR);
+#endif
+#if defined (__linux__) || defined(__APPLE__)
+    // Set DTR (single system call, other lines are not affected)
+    int status_DTR=TIOCM_DTR;
+    if (ioctl(fd, TIOCMBIS, &status_DTR)==-1) return false;
+    // Restored after a reconnection
+    currentStateDTR=true;
+    return true;
+#endif
+}
+
+/*!
+    \brief      Clear the bit DTR (pin 4)
+                DTR stands for Data Terminal Ready
+    \return     If the function fails, the return value is false
+                If the function succeeds, the return value is true.
+*/
+bool serialib::clearDTR()
+{
+#if defined (_WIN32) || defined(_WIN64)
+    // Clear DTR
+    currentStateDTR=false;
+    return EscapeCommFunction(hSerial,CLRDTR);
+#endif
+#if defined (__linux__) || defined(__APPLE__)
+    // Clear DTR (single system call, other lines are not affected)
+    int status_DTR=TIOCM_DTR;
+    if (ioctl(fd, TIOCMBIC, &status_DTR)==-1) return false;
+    // Restored after a reconnection
+    currentStateDTR=false;
+    return true;
+#endif
+}
+
+
+
+/*!
+    \brief      Set or unset the bit RTS (pin 7)
+                RTS stands for Data Termina Ready
+                Convenience method :This method calls setDTR and clearDTR
+    \param      status = true set DTR
+                status = false unset DTR
+    \return     false if the function fails
+    \return     true if the function succeeds
+*/
+bool serialib::RTS(bool status)
+{
+    if (status)
+        // Set RTS
+        return this->setRTS();
+    else
+        // Unset RTS
+        return this->clearRTS();
+}
+
+
+/*!
+    \brief      Set the bit RTS (pin 7)
+                RTS stands for Data Terminal Ready
+    \return     If the function fails, the return value is false
+                If the function succeeds, the return value is true.
+*/
+bool serialib::setRTS()
+{
+#if defined (_WIN32) || defined(_WIN64)
+    // Set RTS
+    currentStateRTS=true;
+    return EscapeCommFunction(hSerial,SETRTS);
+#endif
+#if defined (__linux__) || defined(__APPLE__)
+    // Set RTS (single system call, other lines are not affected)
+    int status_RTS=TIOCM_RTS;
+    if (ioctl(fd, TIOCMBIS, &status_RTS)==-1) return false;
+    // Restored after a reconnection
+    currentStateRTS=true;
+    return true;
+#endif
+}
+
+
+
+/*!
+    \brief      Clear the bit RTS (pin 7)
+                RTS stands for Data Terminal Ready
+    \return     If the function fails, the return value is false
+                If the function succeeds, the return value is true.
+*/
+bool serialib::clearRTS()
+{
+#if defined (_WIN32) || defined(_WIN64)
+    // Clear RTS
+    currentStateRTS=false;
+    return EscapeCommFunction(hSerial,CLRRTS);
+#endif
+#if defined (__linux__) || defined(__APPLE__)
+    // Clear RTS (single system call, other lines are not affected)
+    int status_RTS=TIOCM_RTS;
+    if (ioctl(fd, TIOCMBIC, &status_RTS)==-1) return false;
+    // Restored after a reconnection
+    currentStateRTS=false;
+    return true;
+#endif
+}
+
+
+
+
+/*!
+    \brief      Get the CTS's status (pin 8)
+                CTS stands for Clear To Send
+    \return     Return true if CTS is set otherwise false
+  */
+bool serialib::isCTS()
+{
+#if defined (_WIN32) || defined(_WIN64)
+    DWORD modemStat;
+    GetCommModemStatus(hSerial, &modemStat);
+    return modemStat & MS_CTS_ON;
+#endif
+#if defined (__linux__) || defined(__APPLE__)
+    int status=0;
+    //Get the current status of the CTS bit
+    ioctl(fd, TIOCMGET, &status);
+    return status & TIOCM_CTS;
+#endif
+}
+
+
+
+/*!
+    \brief      Get the DSR's status (pin 6)
+                DSR stands for Data Set Ready
+    \return     Return true if DTR is set otherwise false
+  */
+bool serialib::isDSR()
+{
+#if defined (_WIN32) || defined(_WIN64)
+    DWORD modemStat;
+    GetCommModemStatus(hSerial, &modemStat);
+    return modemStat & MS_DSR_ON;
+#endif
+#if defined (__linux__) || defined(__APPLE__)
+    int status=0;
+    //Get the current status of the DSR bit
+    ioctl(fd, TIOCMGET, &status);
+    return status & TIOCM_DSR;
+#endif
+}
+
+
+
+
+
+
+/*!
+    \brief      Get the DCD's status (pin 1)
+                CDC stands for Data Carrier Detect
+    \return     true if DCD is set
+    \return     false otherwise
+  */
+bool serialib::isDCD()
+{
+#if defined (_WIN32) || defined(_WIN64)
+    DWORD modemStat;
+    GetCommModemStatus(hSerial, &modemStat);
+    return modemStat & MS_RLSD_ON;
+#endif
+#if defined (__linux__) || defined(__APPLE__)
+    int status=0;
+    //Get the current status of the DCD bit
+    ioctl(fd, TIOCMGET, &status);
+    return status & TIOCM_CAR;
+#endif
+}
+
+
+/*!
+    \brief      Get the RING's status (pin 9)
+                Ring Indicator
+    \return     Return true if RING is set otherwise false
+  */
+bool serialib::isRI()
+{
+#if defined (_WIN32) || defined(_WIN64)
+    DWORD modemStat;
+    GetCommModemStatus(hSerial, &modemStat);
+    return modemStat & MS_RING_ON;
+#endif
+#if defined (__linux__) || defined(__APPLE__)
+    int status=0;
+    //Get the current status of the RING bit
+    ioctl(fd, TIOCMGET, &status);
+    return status & TIOCM_RNG;
+#endif
+}
+
+
+/*!
+    \brief      Get the DTR's status (pin 4)
+                DTR stands for Data Terminal Ready
+                May behave abnormally on Windows
+    \return     Return true if CTS is set otherwise false
+  */
+bool serialib::isDTR()
+{
+#if defined (_WIN32) || defined( _WIN64)
+    return currentStateDTR;
+#endif
+#if defined (__linux__) || defined(__APPLE__)
+    int status=0;
+    //Get the current status of the DTR bit
+    ioctl(fd, TIOCMGET, &status);
+    return status & TIOCM_DTR  ;
+#endif
+}
+
+
+
+/*!
+    \brief      Get the RTS's status (pin 7)
+                RTS stands for Request To Send
+                May behave abnormally on Windows
+    \return     Return true if RTS is set otherwise false
+  */
+bool serialib::isRTS()
+{
+#if defined (_WIN32) || defined(_WIN64)
+    return currentStateRTS;
+#endif
+#if defined (__linux__) || defined(__APPLE__)
+    int status=0;
+    //Get the current status of the CTS bit
+    ioctl(fd, TIOCMGET, &status);
+    return status & TIOCM_RTS;
+#endif
+}
+
+
+
+/*!
+    \brief      Set and clear several output lines (DTR, RTS) in a single call.
+                On Linux, each mask is applied with one ioctl (TIOCMBIS / TIOCMBIC)
+                so the lines that are not listed are never read back and rewritten.
+                A line present in both masks is set.
+    \param      setLines : lines to set (combination of SERIAL_LINE_DTR and SERIAL_LINE_RTS)
+    \param      clearLines : lines to clear (combination of SERIAL_LINE_DTR and SERIAL_LINE_RTS)
     \return     If the function fails, the return value is false
                 If the function succeeds, the return value is true.
-*/
-bool serialib::clearDTR()
+  */
+bool serialib::setModemLines(int setLines, int clearLines)
 {
+    // A line both set and cleared is set
+    clearLines &= ~setLines;
 #if defined (_WIN32) || defined(_WIN64)
-    // Clear DTR
-    currentStateDTR=false;
-    return EscapeCommFunction(hSerial,CLRDTR);
+    bool success=true;
+    // Windows can only change one line per call
+    if ((setLines & SERIAL_LINE_DTR) && !setDTR())      success=false;
+    if ((setLines & SERIAL_LINE_RTS) && !setRTS())      success=false;
+    if ((clearLines & SERIAL_LINE_DTR) && !clearDTR())  success=false;
+    if ((clearLines & SERIAL_LINE_RTS) && !clearRTS())  success=false;
+    return success;
 #endif
 #if defined (__linux__) || defined(__APPLE__)
-    // Clear DTR
-    int status_DTR=0;
-    ioctl(fd, TIOCMGET, &status_DTR);
-    status_DTR &= ~TIOCM_DTR;
-    ioctl(fd, TIOCMSET, &status_DTR);
+    // Convert the masks into the termios bits
+    int setBits=0, clearBits=0;
+    if (setLines & SERIAL_LINE_DTR)     setBits|=TIOCM_DTR;
+    if (setLines & SERIAL_LINE_RTS)     setBits|=TIOCM_RTS;
+    if (clearLines & SERIAL_LINE_DTR)   clearBits|=TIOCM_DTR;
+    if (clearLines & SERIAL_LINE_RTS)   clearBits|=TIOCM_RTS;
+
+    // Set lines, then clear lines (no system call for an empty mask)
+    if (setBits && ioctl(fd, TIOCMBIS, &setBits)==-1) return false;
+    if (clearBits && ioctl(fd, TIOCMBIC, &clearBits)==-1) return false;
+    // Restored after a reconnection
+    if (setLines & SERIAL_LINE_DTR)     currentStateDTR=true;
+    if (setLines & SERIAL_LINE_RTS)     currentStateRTS=true;
+    if (clearLines & SERIAL_LINE_DTR)   currentStateDTR=false;
+    if (clearLines & SERIAL_LINE_RTS)   currentStateRTS=false;
     return true;
 #endif
 }
 
 
-
+
+/*!
+    \brief      Get the status of all the modem lines with a single request
+                Useful to avoid one system call per line when several lines are checked
+    \return     A combination of SerialModemLine flags (SERIAL_LINE_CTS | SERIAL_LINE_DCD ...)
+    \return     -1 if the status can't be read
+  */
+int serialib::getModemLines()
+{
+    int lines=0;
+#if defined (_WIN32) || defined(_WIN64)
+    DWORD modemStat;
+    if (!GetCommModemStatus(hSerial, &modemStat)) return -1;
+    if (modemStat & MS_CTS_ON)  lines|=SERIAL_LINE_CTS;
+    if (modemStat & MS_DSR_ON)  lines|=SERIAL_LINE_DSR;
+    if (modemStat & MS_RLSD_ON) lines|=SERIAL_LINE_DCD;
+    if (modemStat & MS_RING_ON) lines|=SERIAL_LINE_RI;
+    // Output lines can't be read on Windows, return the last state written
+    if (currentStateDTR)        lines|=SERIAL_LINE_DTR;
+    if (currentStateRTS)        lines|=SERIAL_LINE_RTS;
+#endif
+#if defined (__linux__) || defined(__APPLE__)
+    int status=0;
+    // Get the status of every line at once
+    if (ioctl(fd, TIOCMGET, &status)==-1) return -1;
+    if (status & TIOCM_DTR)     lines|=SERIAL_LINE_DTR;
+    if (status & TIOCM_RTS)     lines|=SERIAL_LINE_RTS;
+    if (status & TIOCM_CTS)     lines|=SERIAL_LINE_CTS;
+    if (status & TIOCM_DSR)     lines|=SERIAL_LINE_DSR;
+    if (status & TIOCM_CAR)     lines|=SERIAL_LINE_DCD;
+    if (status & TIOCM_RNG)     lines|=SERIAL_LINE_RI;
+#endif
+    return lines;
+}
+
+
+
+#if defined (__linux__) && defined (TIOCMIWAIT)
+// Input lines whose transition counter differs between two snapshots
+static int changedLines(const SerialLineCounters &before, const SerialLineCounters &after)
+{
+    int changed=0;
+    if (after.cts!=before.cts)  changed|=SERIAL_LINE_CTS;
+    if (after.dsr!=before.dsr)  changed|=SERIAL_LINE_DSR;
+    if (after.dcd!=before.dcd)  changed|=SERIAL_LINE_DCD;
+    if (after.ri!=before.ri)    changed|=SERIAL_LINE_RI;
+    return changed;
+}
+
+// Empty handler: the wake-up signal only interrupts the wait of the modem monitor
+static void modemWakeHandler(int)
+{
+}
+#endif
+
+
+/*!
+    \brief      Wait until one of the input lines (CTS, DSR, DCD, RI) changes.
+                The call blocks (without consuming CPU) in the TIOCMIWAIT ioctl until the driver
+                reports a transition, then timestamps it with a monotonic clock.
+                Transitions are detected from the driver counters (TIOCGICOUNT), so a short pulse
+                that is back to its initial state when the call returns is still reported in changed.
+                The counters are compared with those of the previous event before blocking: a transition
+                that occured between two calls (while the previous event was handled) is reported at once.
+                Linux only, the driver must support TIOCMIWAIT (most UART and USB adapters do, pseudo-terminals don't)
+    \param      lines : input lines to wait for (combination of SERIAL_LINE_CTS, SERIAL_LINE_DSR, SERIAL_LINE_DCD and SERIAL_LINE_RI)
+    \param      event : transition details (optional, can be NULL)
+    \return     1 success, a transition occured
+    \return     -1 waiting is not supported by the driver or the platform (or the device was removed)
+    \return     -2 error while reading the line status
+    \return     -3 the wait was interrupted by a signal, nothing changed
+  */
+int serialib::waitModemChange(int lines, SerialModemEvent *event)
+{
+#if defined (__linux__) || defined(__APPLE__)
+    return waitModemEvent(lines, event, NULL);
+#else
+    UNUSED(lines);
+    UNUSED(event);
+    return -1;
+#endif
+}
+
+
+
+#if defined (__linux__) || defined(__APPLE__)
+/*!
+    \brief      Body of waitModemChange. The monitor thread flags the time it spends in the
+                driver, so stopModemMonitor only signals it there (never during the callback)
+    \param      lines : input lines to wait for
+    \param      event : transition details (optional, can be NULL)
+    \param      inDriver : set while waiting in TIOCMIWAIT (NULL if not needed)
+    \return     see waitModemChange
+  */
+int serialib::waitModemEvent(int lines, SerialModemEvent *event, bool *inDriver)
+{
+#if defined (__linux__) && defined (TIOCMIWAIT)
+    // Convert the mask into the termios bits
+    int waitBits=0;
+    if (lines & SERIAL_LINE_CTS)    waitBits|=TIOCM_CTS;
+    if (lines & SERIAL_LINE_DSR)    waitBits|=TIOCM_DSR;
+    if (lines & SERIAL_LINE_DCD)    waitBits|=TIOCM_CD;
+    if (lines & SERIAL_LINE_RI)     waitBits|=TIOCM_RNG;
+
+    // Counters now, compared with the counters of the previous event (the first call starts from now)
+    SerialLineCounters counts;
+    bool counters = (getLineCounters(&counts)==1);
+    if (counters && !modemCountsValid)
+    {
+        modemCounts=counts;
+        modemCountsValid=true;
+    }
+
+    // Lines that changed since the previous event
+    int changed = counters ? (changedLines(modemCounts, counts) & lines) : 0;
+
+    // Sleep until the driver reports a transition, unless one is already pending
+    if (changed==0)
+    {
+        if (inDriver!=NULL) __atomic_store_n(inDriver, true, __ATOMIC_SEQ_CST);
+        // The monitor is stopping: don't enter the driver (the signal may have been sent already)
+        int Ret=(inDriver!=NULL && __atomic_load_n(&modemThreadStop, __ATOMIC_SEQ_CST)) ?
+                -1 : ioctl(fd, TIOCMIWAIT, waitBits);
+        int error=(Ret==-1 && inDriver!=NULL && __atomic_load_n(&modemThreadStop, __ATOMIC_SEQ_CST)) ? EINTR : errno;
+        if (inDriver!=NULL) __atomic_store_n(inDriver, false, __ATOMIC_SEQ_CST);
+        if (Ret==-1) return (error==EINTR) ? -3 : -1;
+        counters = counters && (getLineCounters(&counts)==1);
+    }
+
+    // Time stamp as soon as possible after the wake up
+    unsigned long long timestamp=timeOut::monotonicTime_ns();
+
+    // Lines that changed, and reference for the next call
+    changed = counters ? changedLines(modemCounts, counts) : 0;
+    if (counters) modemCounts=counts;
+    if (event==NULL) return 1;
+
+    // Fill the event
+    event->timestamp_ns=timestamp;
+    event->lines=getModemLines();
+    if (event->lines<0) return -2;
+    // Only report the requested lines
+    event->changed=changed & lines;
+    event->ctsCount=counts.cts;
+    event->dsrCount=counts.dsr;
+    event->dcdCount=counts.dcd;
+    event->riCount=counts.ri;
+    return 1;
+#else
+    UNUSED(lines);
+    UNUSED(event);
+    UNUSED(inDriver);
+    return -1;
+#endif
+}
+#endif
+
+
+
+/*!
+    \brief      Start a background thread that waits for transitions on the input lines
+                and calls callback for each of them (see waitModemChange).
+                The callback is executed by the monitor thread: it must return quickly
+                and must not call stopModemMonitor or closeDevice (it may write).
+                With auto-reconnect (see setAutoReconnect), the thread waits for a removed
+                device to come back, then resumes.
+                stopModemMonitor interrupts the wait in the driver (and only that wait, never the
+                callback) with SERIAL_MODEM_WAKE_SIGNAL: if the application has no handler for this
+                signal (SIGURG by default, see serialib.h), an empty process-wide handler is installed
+                and left in place. A handler of the application must not use SA_RESTART.
+                Linux only
+    \param      lines : input lines to monitor (combination of SERIAL_LINE_CTS, SERIAL_LINE_DSR, SERIAL_LINE_DCD and SERIAL_LINE_RI)
+    \param      callback : function called for each transition
+    \param      userData : pointer passed back to the callback
+    \return     1 success, the thread is running
+    \return     -1 monitoring is not supported on this platform
+    \return     -2 error while creating the thread
+    \return     -3 the monitor is already running
+  */
+int serialib::startModemMonitor(int lines, SerialModemCallback callback, void *userData)
+{
+#if defined (__linux__) && defined (TIOCMIWAIT)
+    if (modemThreadRunning) return -3;
+
+    // Parameters of the thread
+    modemMonitorLines=lines;
+    modemCallback=callback;
+    modemCallbackData=userData;
+    modemThreadStop=false;
+    modemThreadDone=false;
+    modemThreadInDriver=false;
+
+    // The wake-up signal must interrupt the ioctl: install a handler without SA_RESTART if there is none
+    struct sigaction action;
+    if (sigaction(SERIAL_MODEM_WAKE_SIGNAL, NULL, &action)==0 && !(action.sa_flags & SA_SIGINFO) &&
+        (action.sa_handler==SIG_DFL || action.sa_handler==SIG_IGN))
+    {
+        memset(&action, 0, sizeof(action));
+        action.sa_handler=modemWakeHandler;
+        sigemptyset(&action.sa_mask);
+        sigaction(SERIAL_MODEM_WAKE_SIGNAL, &action, NULL);
+    }
+
+    // Start the thread
+    if (pthread_create(&modemThread, NULL, modemMonitorThread, this)!=0) return -2;
+    modemThreadRunning=true;
+    return 1;
+#else
+    UNUSED(lines);
+    UNUSED(callback);
+    UNUSED(userData);
+    return -1;
+#endif
+}
+
+
+
+/*!
+    \brief      Stop the modem monitor thread and wait for its termination.
+                Does nothing if the monitor is not running
+  */
+void serialib::stopModemMonitor()
+{
+#if defined (__linux__) || defined(__APPLE__)
+    if (!modemThreadRunning) return;
+    // Ask the thread to stop, and interrupt its wait in the driver until it exits (a signal
+    // received just before the thread enters the ioctl doesn't interrupt it). The thread is
+    // only signaled while it is flagged in the driver, so the callback is never interrupted
+    __atomic_store_n(&modemThreadStop, true, __ATOMIC_SEQ_CST);
+    while (!__atomic_load_n(&modemThreadDone, __ATOMIC_ACQUIRE))
+    {
+        if (__atomic_load_n(&modemThreadInDriver, __ATOMIC_SEQ_CST))
+            pthread_kill(modemThread, SERIAL_MODEM_WAKE_SIGNAL);
+        usleep(1000);
+    }
+    pthread_join(modemThread, NULL);
+    modemThreadRunning=false;
+#endif
+}
+
+
+
+// ____________________________
+// ::: Line error counters :::
+
+
+/*!
+    \brief      Get the counters maintained by the serial driver (TIOCGICOUNT).
+                The counters start when the driver is loaded or the device is plugged, not when it is opened.
+                Linux only, not supported by pseudo-terminals
+    \param      counters : received bytes, transmitted bytes, line errors, overruns and line transitions
+    \return     1 success
+    \return     -1 counters are not supported by the driver or the platform
+  */
+int serialib::getLineCounters(SerialLineCounters *counters)
+{
+#if defined (__linux__) && defined (TIOCGICOUNT)
+    struct serial_icounter_struct icount;
+    // Clear the counters, in case of error
+    memset(counters,0,sizeof(SerialLineCounters));
+    // Read the counters from the driver
+    if (ioctl(fd, TIOCGICOUNT, &icount)==-1) return -1;
+    counters->rx=(unsigned int)icount.rx;
+    counters->tx=(unsigned int)icount.tx;
+    counters->frame=(unsigned int)icount.frame;
+    counters->parity=(unsigned int)icount.parity;
+    counters->overrun=(unsigned int)icount.overrun;
+    counters->bufOverrun=(unsigned int)icount.buf_overrun;
+    counters->brk=(unsigned int)icount.brk;
+    counters->cts=(unsigned int)icount.cts;
+    counters->dsr=(unsigned int)icount.dsr;
+    counters->dcd=(unsigned int)icount.dcd;
+    counters->ri=(unsigned int)icount.rng;
+    return 1;
+#else
+    memset(counters,0,sizeof(SerialLineCounters));
+    return -1;
+#endif
+}
+
+
+
+/*!
+    \brief      Get the increase of the driver counters since the previous call of this function
+                (or since openDevice for the first call). Useful to correlate lost data with
+                the load, without keeping track of the absolute values.
+                Linux only, not supported by pseudo-terminals
+    \param      delta : increase of each counter
+    \return     1 success
+    \return     -1 counters are not supported by the driver or the platform
+  */
+int serialib::getLineCountersDelta(SerialLineCounters *delta)
+{
+    SerialLineCounters current;
+    if (getLineCounters(&current)!=1)
+    {
+        memset(delta,0,sizeof(SerialLineCounters));
+        return -1;
+    }
+    // The driver counters are 32 bits and may wrap around
+    delta->rx=(unsigned int)(current.rx-lastCounters.rx);
+    delta->tx=(unsigned int)(current.tx-lastCounters.tx);
+    delta->frame=(unsigned int)(current.frame-lastCounters.frame);
+    delta->parity=(unsigned int)(current.parity-lastCounters.parity);
+    delta->overrun=(unsigned int)(current.overrun-lastCounters.overrun);
+    delta->bufOverrun=(unsigned int)(current.bufOverrun-lastCounters.bufOverrun);
+    delta->brk=(unsigned int)(current.brk-lastCounters.brk);
+    delta->cts=(unsigned int)(current.cts-lastCounters.cts);
+    delta->dsr=(unsigned int)(current.dsr-lastCounters.dsr);
+    delta->dcd=(unsigned int)(current.dcd-lastCounters.dcd);
+    delta->ri=(unsigned int)(current.ri-lastCounters.ri);
+    // Reference for the next call
+    lastCounters=current;
+    return 1;
+}
+
+
+
+
+// __________________________
+// ::: Real-time tuning :::
+
+
+/*!
+     \brief Prepare the calling thread for real-time reading: pin it to a set of CPUs, switch it to
+            SCHED_FIFO with the given priority and prefault its stack, so the thread is not preempted
+            by normal threads and does not page-fault in the read loop.
+            Raising the priority usually requires root or CAP_SYS_NICE (RLIMIT_RTPRIO).
+            On Windows, the priority is mapped to THREAD_PRIORITY_TIME_CRITICAL, the affinity to
+            SetThreadAffinityMask. CPU affinity is not supported on macOS.
+     \param priority : SCHED_FIFO priority (1 to 99, 0 = keep the current scheduling)
+     \param cpuMask : allowed CPUs, bit n for CPU n (0 = keep the current affinity)
+     \return 1 success
+     \return -1 the affinity can't be set
+     \return -2 the priority can't be set
+  */
+int serialib::setThreadRealtime(int priority, unsigned long long cpuMask)
+{
+    // Touch the stack now rather than in the read loop
+    volatile char stack[65536];
+    for (unsigned int i=0;i<sizeof(stack);i+=4096) stack[i]=0;
+
+#if defined (_WIN32) || defined(_WIN64)
+    if (cpuMask!=0 && SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)cpuMask)==0) return -1;
+    if (priority!=0 && !SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL)) return -2;
+    return 1;
+#endif
+#if defined (__linux__) || defined(__APPLE__)
+    return applyRealtime(pthread_self(), priority, cpuMask);
+#endif
+}
+
+
+
+/*!
+     \brief Set the affinity and the priority of the threads created by serialib for this port
+            (modem monitor, write buffer flush, and writeBroadcast writer). The settings are
+            applied to the running threads and to the threads started later.
+            See setThreadRealtime for the parameters.
+     \return 1 success
+     \return -1 the affinity can't be set
+     \return -2 the priority can't be set
+  */
+int serialib::setRealtimeThreads(int priority, unsigned long long cpuMask)
+{
+    rtPriority=priority;
+    rtCpuMask=cpuMask;
+    int Ret=1;
+#if defined (__linux__) || defined(__APPLE__)
+    if (modemThreadRunning) Ret=applyRealtime(modemThread, priority, cpuMask);
+    if (txFlushThreadRunning)
+    {
+        int flushRet=applyRealtime(txFlushThread, priority, cpuMask);
+        if (Ret==1) Ret=flushRet;
+    }
+#endif
+    return Ret;
+}
+
+
+
+/*!
+     \brief Prefault and lock in memory the buffers of the port (receive buffer and write
+            buffer), so reading never waits for a page fault. The buffers are allocated in
+            their own pages, so only they are locked: the serialib object itself is not (lock
+            it with its stack or its allocation if needed). A write buffer set later by
+            setWriteBuffer is locked too.
+            For the whole process (code, heap, stacks), use mlockall(MCL_CURRENT | MCL_FUTURE).
+     \return 1 success
+     \return -1 the memory can't be locked (see RLIMIT_MEMLOCK)
+  */
+int serialib::lockBuffers()
+{
+    serialScopedLock lock(txLock);
+    if (buffersLocked) return 1;
+    // Each buffer is prefaulted, even if locking fails
+#if defined (__linux__) || defined(__APPLE__)
+    if (!lockPages(rxPages, SERIAL_RX_PAGES_SIZE)) return -1;
+#endif
+    if (txBuf!=NULL && !lockPages(txBuf, txBufSize))
+    {
+#if defined (__linux__) || defined(__APPLE__)
+        unlockPages(rxPages, SERIAL_RX_PAGES_SIZE);
+#endif
+        return -1;
+    }
+    buffersLocked=true;
+    return 1;
+}
+
+
+
+/*!
+     \brief Get the scheduling latency observed when the reading thread wakes up on a deadline:
+            the delay between the deadline (timeout, frame gap, transmission sleep) and the time
+            the thread actually runs again. The worst value bounds the extra latency of the reads.
+     \param stats : statistics since the opening (or since the last reset)
+     \param reset : clear the statistics after reading them
+  */
+void serialib::getWakeupLatency(SerialWakeupStats *stats, bool reset)
+{
+    serialScopedLock rx(rxLock);
+    serialScopedLock tx(txLock);
+    // Merge the reception and the transmission paths
+    if (stats!=NULL)
+    {
+        *stats=wakeupStats;
+        stats->count+=txWakeupStats.count;
+        stats->total_ns+=txWakeupStats.total_ns;
+        if (txWakeupStats.max_ns>stats->max_ns) stats->max_ns=txWakeupStats.max_ns;
+        if (wakeupStats.count==0) stats->last_ns=txWakeupStats.last_ns;
+    }
+    if (reset) wakeupStats=txWakeupStats=SerialWakeupStats();
+}
+
+
+
+/*!
+     \brief Select how the reads wait for data. Sleeping in poll costs the wake-up latency of
+            the scheduler (tens of microseconds), spinning costs a CPU core. With SERIAL_WAIT_SPIN,
+            the reads busy-poll the device for spinBudget_us, then sleep. With SERIAL_WAIT_ADAPTIVE,
+            the budget is tuned from the observed delays before data arrives (up to spinBudget_us):
+            ports that receive a steady stream get near-spin latency, idle ports sleep.
+            The policy applies to readChar, readString, readAvailable, readFrame, readExact,
+            readPacket and peekBytes. Unix only.
+     \param policy : wait policy of this port
+     \param spinBudget_us : maximum busy-poll duration, in microseconds
+  */
+void serialib::setWaitPolicy(SerialWaitPolicy policy, unsigned int spinBudget_us)
+{
+    // Serialize the readers (the writers are not blocked)
+    serialScopedLock lock(rxLock);
+    waitPolicy=policy;
+    spinMax_ns=spinBudget_us*1000ULL;
+    // The adaptive policy starts without spinning until it has observed some arrivals
+    spinBudget_ns=(policy==SERIAL_WAIT_ADAPTIVE) ? 0 : spinMax_ns;
+    arrivalAverage_ns=spinMax_ns;
+}
+
+
+
+/*!
+     \brief Return the current spin budget: the configured one with SERIAL_WAIT_SPIN,
+            the tuned one with SERIAL_WAIT_ADAPTIVE, 0 with SERIAL_WAIT_BLOCK
+     \return The spin budget in microseconds
+  */
+unsigned int serialib::getSpinBudget_us()
+{
+    return (waitPolicy==SERIAL_WAIT_BLOCK) ? 0 : (unsigned int)(spinBudget_ns/1000);
+}
+
+
+
+/*!
+     \brief Record the latency of a wake-up planned at deadline_ns
+     \param stats : statistics of the reception or the transmission path
+     \param deadline_ns : planned wake-up time (monotonic clock)
+  */
+void serialib::recordWakeup(SerialWakeupStats &stats, unsigned long long deadline_ns)
+{
+    unsigned long long now=timeOut::monotonicTime_ns();
+    unsigned long long latency=(now>deadline_ns) ? now-deadline_ns : 0;
+    stats.count++;
+    stats.last_ns=latency;
+    stats.total_ns+=latency;
+    if (latency>stats.max_ns) stats.max_ns=latency;
+}
+
+
+
+
+
+// _______________
+// ::: Threads :::
+
+
+/*!
+     \brief Keep several writes together: the other writers wait until unlockTransmitter.
+            Useful when a frame is written by several calls (header, payload, checksum).
+            The readers are not blocked. Calls can be nested.
+  */
+void serialib::lockTransmitter()
+{
+#if defined (_WIN32) || defined(_WIN64)
+    EnterCriticalSection(&txLock);
+#else
+    pthread_mutex_lock(&txLock);
+#endif
+}
+
+
 /*!
-    \brief      Set or unset the bit RTS (pin 7)
-                RTS stands for Data Termina Ready
-                Convenience method :This method calls setDTR and clearDTR
-    \param      status = true set DTR
-                status = false unset DTR
-    \return     false if the function fails
-    \return     true if the function succeeds
-*/
-bool serialib::RTS(bool status)
+     \brief Let the other writers continue (see lockTransmitter)
+  */
+void serialib::unlockTransmitter()
 {
-    if (status)
-        // Set RTS
-        return this->setRTS();
-    else
-        // Unset RTS
-        return this->clearRTS();
+    unlockMutex(txLock);
 }
 
 
-/*!
-    \brief      Set the bit RTS (pin 7)
-                RTS stands for Data Terminal Ready
-    \return     If the function fails, the return value is false
-                If the function succeeds, the return value is true.
-*/
-bool serialib::setRTS()
-{
+
+// __________________________
+// ::: Multi-port write :::
+
+
+// Signal of the end of the threads of writeBroadcast
+struct serialBroadcastWake {
 #if defined (_WIN32) || defined(_WIN64)
-    // Set RTS
-    currentStateRTS=true;
-    return EscapeCommFunction(hSerial,SETRTS);
+    HANDLE                  event;
 #endif
 #if defined (__linux__) || defined(__APPLE__)
-    // Set RTS
-    int status_RTS=0;
-    ioctl(fd, TIOCMGET, &status_RTS);
-    status_RTS |= TIOCM_RTS;
-    ioctl(fd, TIOCMSET, &status_RTS);
-    return true;
+    pthread_mutex_t         mutex;
+    pthread_cond_t          cond;
 #endif
+};
+
+// Parameters and progress of a thread of writeBroadcast
+struct serialBroadcastTask {
+    SerialBroadcastPort*    target;
+    unsigned int            chunkSize;
+    serialBroadcastWake*    wake;
+    // Progress, written by the thread and read with atomicLoad
+    unsigned int            written;
+    int                     status;
+};
+
+// Copy the progress of the threads to the ports, return true when all the threads are done
+static bool broadcastProgress(serialBroadcastTask *tasks, unsigned int nbPorts)
+{
+    bool done=true;
+    for (unsigned int i=0;i<nbPorts;i++)
+    {
+        tasks[i].target->status=atomicLoad(&tasks[i].status);
+        tasks[i].target->written=atomicLoad(&tasks[i].written);
+        if (tasks[i].target->status==0) done=false;
+    }
+    return done;
 }
 
-
-
 /*!
-    \brief      Clear the bit RTS (pin 7)
-                RTS stands for Data Terminal Ready
-    \return     If the function fails, the return value is false
-                If the function succeeds, the return value is true.
-*/
-bool serialib::clearRTS()
+     \brief Write on many ports at the same time, typically to flash a fleet of boards: each port
+            is written by its own thread, so the total time is the time of the slowest port
+            rather than the sum of the times. The ports can share the same payload or have their own.
+            Each port is written by chunks of chunkSize bytes. ports[i].written and ports[i].status
+            are updated by the calling thread before each call to progress and at the end, so
+            progress can read them safely. A failing port doesn't stop the others.
+            The function returns when all the ports are done (the bytes are queued in the drivers,
+            call waitTransmitted on each port to wait for the end of the transmission).
+            The ports must not be used by other threads during the call.
+     \param ports : ports, payloads and progress
+     \param nbPorts : number of ports
+     \param chunkSize : number of bytes written between two progress updates
+     \param progress : function called from the calling thread every progressPeriod_ms
+            while writing, and once at the end (can be NULL)
+     \param userData : parameter of the progress function
+     \param progressPeriod_ms : period of the progress reports
+     \return 0 all the ports are written
+     \return >0 the number of ports that failed (see their status)
+  */
+int serialib::writeBroadcast(SerialBroadcastPort *ports, unsigned int nbPorts, unsigned int chunkSize,
+                             SerialBroadcastCallback progress, void *userData, unsigned int progressPeriod_ms)
 {
+    if (chunkSize==0) chunkSize=1024;
+    if (progressPeriod_ms==0) progressPeriod_ms=100;
 #if defined (_WIN32) || defined(_WIN64)
-    // Clear RTS
-    currentStateRTS=false;
-    return EscapeCommFunction(hSerial,CLRRTS);
+    HANDLE *threads=new HANDLE[nbPorts];
 #endif
 #if defined (__linux__) || defined(__APPLE__)
-    // Clear RTS
-    int status_RTS=0;
-    ioctl(fd, TIOCMGET, &status_RTS);
-    status_RTS &= ~TIOCM_RTS;
-    ioctl(fd, TIOCMSET, &status_RTS);
-    return true;
+    pthread_t *threads=new pthread_t[nbPorts];
 #endif
-}
+    serialBroadcastTask *tasks=new serialBroadcastTask[nbPorts];
 
+    // The threads signal their end, so the progress loop stops as soon as the last one is done
+    serialBroadcastWake wake;
+#if defined (_WIN32) || defined(_WIN64)
+    wake.event=CreateEvent(NULL, FALSE, FALSE, NULL);
+#endif
+#if defined (__linux__) || defined(__APPLE__)
+    pthread_mutex_init(&wake.mutex, NULL);
+    pthread_condattr_t attributes;
+    pthread_condattr_init(&attributes);
+#if defined (__linux__)
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+#endif
+    pthread_cond_init(&wake.cond, &attributes);
+    pthread_condattr_destroy(&attributes);
+#endif
 
+    // Start one thread per port
+    for (unsigned int i=0;i<nbPorts;i++)
+    {
+        ports[i].written=0;
+        ports[i].status=0;
+        tasks[i].target=&ports[i];
+        tasks[i].chunkSize=chunkSize;
+        tasks[i].wake=&wake;
+        tasks[i].written=0;
+        tasks[i].status=0;
+#if defined (_WIN32) || defined(_WIN64)
+        threads[i]=CreateThread(NULL, 0, broadcastThread, &tasks[i], 0, NULL);
+        if (threads[i]==NULL)
+#endif
+#if defined (__linux__) || defined(__APPLE__)
+        if (pthread_create(&threads[i], NULL, broadcastThread, &tasks[i])!=0)
+#endif
+        {
+            tasks[i].status=-2;
+        }
+    }
 
+    // Report the progress every progressPeriod_ms until all the ports are done
+    // (without a progress function, just wait for the threads below)
+    if (progress!=NULL)
+    {
+        while (!broadcastProgress(tasks, nbPorts))
+        {
+            progress(ports, nbPorts, userData);
+            unsigned long long deadline=timeOut::monotonicTime_ns()+progressPeriod_ms*1000000ULL;
+#if defined (_WIN32) || defined(_WIN64)
+            // The event is set when a thread ends
+            unsigned long long now;
+            while ((now=timeOut::monotonicTime_ns())<deadline && !broadcastProgress(tasks, nbPorts))
+                WaitForSingleObject(wake.event, (DWORD)((deadline-now+999999)/1000000));
+#endif
+#if defined (__linux__) || defined(__APPLE__)
+            // The condition is signaled when a thread ends (its status is set with the mutex held)
+            pthread_mutex_lock(&wake.mutex);
+            while (timeOut::monotonicTime_ns()<deadline && !broadcastProgress(tasks, nbPorts))
+                waitConditionUntil(&wake.cond, &wake.mutex, deadline);
+            pthread_mutex_unlock(&wake.mutex);
+#endif
+        }
+    }
 
-/*!
-    \brief      Get the CTS's status (pin 8)
-                CTS stands for Clear To Send
-    \return     Return true if CTS is set otherwise false
-  */
-bool serialib::isCTS()
-{
+    // Release the threads
+    int failed=0;
+    for (unsigned int i=0;i<nbPorts;i++)
+    {
+        if (tasks[i].status!=-2)
+        {
 #if defined (_WIN32) || defined(_WIN64)
-    DWORD modemStat;
-    GetCommModemStatus(hSerial, &modemStat);
-    return modemStat & MS_CTS_ON;
+            WaitForSingleObject(threads[i], INFINITE);
+            CloseHandle(threads[i]);
 #endif
 #if defined (__linux__) || defined(__APPLE__)
-    int status=0;
-    //Get the current status of the CTS bit
-    ioctl(fd, TIOCMGET, &status);
-    return status & TIOCM_CTS;
+            pthread_join(threads[i], NULL);
+#endif
+        }
+    }
+    broadcastProgress(tasks, nbPorts);
+    for (unsigned int i=0;i<nbPorts;i++)
+        if (ports[i].status<0) failed++;
+#if defined (_WIN32) || defined(_WIN64)
+    CloseHandle(wake.event);
+#endif
+#if defined (__linux__) || defined(__APPLE__)
+    pthread_cond_destroy(&wake.cond);
+    pthread_mutex_destroy(&wake.mutex);
 #endif
+    delete[] threads;
+    delete[] tasks;
+    if (progress!=NULL) progress(ports, nbPorts, userData);
+    return failed;
 }
 
 
 
 /*!
-    \brief      Get the DSR's status (pin 6)
-                DSR stands for Data Set Ready
-    \return     Return true if DTR is set otherwise false
+     \brief Body of the threads of writeBroadcast: write the payload of one port by chunks
+     \param arg : the serialBroadcastTask of the port
   */
-bool serialib::isDSR()
+#if defined (_WIN32) || defined(_WIN64)
+DWORD WINAPI serialib::broadcastThread(LPVOID arg)
+#endif
+#if defined (__linux__) || defined(__APPLE__)
+void* serialib::broadcastThread(void *arg)
+#endif
 {
+    serialBroadcastTask *task=(serialBroadcastTask*)arg;
+    SerialBroadcastPort *target=task->target;
+    const unsigned char *data=(const unsigned char*)target->data;
+    unsigned int chunkSize=task->chunkSize;
+    unsigned int written=0;
+    int status=1;
+#if defined (__linux__) || defined(__APPLE__)
+    // Real-time settings requested with setRealtimeThreads on the port
+    if (target->port->rtPriority!=0 || target->port->rtCpuMask!=0)
+        applyRealtime(pthread_self(), target->port->rtPriority, target->port->rtCpuMask);
+#endif
+
+    while (written<target->size)
+    {
+        unsigned int chunk=target->size-written;
+        if (chunk>chunkSize) chunk=chunkSize;
+        if (target->port->writeBytes(data+written, chunk)!=1)
+        {
+            status=-1;
+            break;
+        }
+        written+=chunk;
+        atomicStore(&task->written, written);
+    }
+    // Send what may be left in the write buffer
+    if (status==1 && target->port->flushWriteBuffer()<0) status=-1;
+    // Publish the result and wake the calling thread up
 #if defined (_WIN32) || defined(_WIN64)
-    DWORD modemStat;
-    GetCommModemStatus(hSerial, &modemStat);
-    return modemStat & MS_DSR_ON;
+    atomicStore(&task->status, status);
+    SetEvent(task->wake->event);
+    return 0;
 #endif
 #if defined (__linux__) || defined(__APPLE__)
-    int status=0;
-    //Get the current status of the DSR bit
-    ioctl(fd, TIOCMGET, &status);
-    return status & TIOCM_DSR;
+    pthread_mutex_lock(&task->wake->mutex);
+    atomicStore(&task->status, status);
+    pthread_cond_signal(&task->wake->cond);
+    pthread_mutex_unlock(&task->wake->mutex);
+    return NULL;
 #endif
 }
 
 
 
+#if defined (__linux__) || defined(__APPLE__)
+/*!
+     \brief Pin a thread to a set of CPUs and switch it to SCHED_FIFO
+     \param thread : thread to configure
+     \param priority : SCHED_FIFO priority (0 = keep the current scheduling)
+     \param cpuMask : allowed CPUs, bit n for CPU n (0 = keep the current affinity)
+     \return 1 success
+     \return -1 the affinity can't be set (or is not supported)
+     \return -2 the priority can't be set
+  */
+int serialib::applyRealtime(pthread_t thread, int priority, unsigned long long cpuMask)
+{
+    if (cpuMask!=0)
+    {
+#if defined (__linux__)
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        for (unsigned int cpu=0;cpu<64;cpu++)
+            if (cpuMask & (1ULL<<cpu)) CPU_SET(cpu, &cpus);
+        if (pthread_setaffinity_np(thread, sizeof(cpus), &cpus)!=0) return -1;
+#else
+        // No CPU affinity on macOS
+        return -1;
+#endif
+    }
+    if (priority!=0)
+    {
+        struct sched_param param;
+        param.sched_priority=priority;
+        if (pthread_setschedparam(thread, SCHED_FIFO, &param)!=0) return -2;
+    }
+    return 1;
+}
 
 
 
 /*!
-    \brief      Get the DCD's status (pin 1)
-                CDC stands for Data Carrier Detect
-    \return     true if DCD is set
-    \return     false otherwise
+    \brief      Body of the modem monitor thread, until stopModemMonitor sets the stop flag.
+                The wait in TIOCMIWAIT is interrupted by SERIAL_MODEM_WAKE_SIGNAL, the callback
+                is never interrupted.
+    \param      arg : the serialib object
+    \return     NULL
   */
-bool serialib::isDCD()
+void* serialib::modemMonitorThread(void *arg)
+{
+    serialib *serial=(serialib*)arg;
+    SerialModemEvent event;
+    int ret;
+
+    // Real-time settings requested with setRealtimeThreads
+    if (serial->rtPriority!=0 || serial->rtCpuMask!=0)
+        applyRealtime(pthread_self(), serial->rtPriority, serial->rtCpuMask);
+
+    while (!__atomic_load_n(&serial->modemThreadStop, __ATOMIC_ACQUIRE))
+    {
+        unsigned long generation=serial->reconnectStats.count;
+        ret=serial->waitModemEvent(serial->modemMonitorLines, &event, &serial->modemThreadInDriver);
+
+        // Interrupted by a signal: check the stop flag and wait again
+        if (ret==-3) continue;
+        if (ret<0)
+        {
+            // Device removed: wait for it (reopened by this thread, or by a read or a write)
+            // by steps, so the stop flag is checked, then resume with new counters
+            int back=0;
+            while (back==0 && !__atomic_load_n(&serial->modemThreadStop, __ATOMIC_ACQUIRE))
+                back=serial->reconnectDevice(SERIAL_RECONNECT_RETRY_MS*1000000LL, generation);
+            // Stop on error (auto-reconnect disabled, device lost or wait not supported)
+            if (back<=0) break;
+            serial->modemCountsValid=false;
+            continue;
+        }
+        if (serial->modemCallback!=NULL && !__atomic_load_n(&serial->modemThreadStop, __ATOMIC_ACQUIRE))
+            serial->modemCallback(&event, serial->modemCallbackData);
+    }
+    // stopModemMonitor stops sending the wake-up signal
+    __atomic_store_n(&serial->modemThreadDone, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+#endif
+
+
+
+
+
+
+// ******************************************
+//  Class serialFramePool
+// ******************************************
+
+
+/*!
+    \brief      Constructor of the class serialFramePool. All the memory is allocated here,
+                acquire and release never allocate.
+    \param      frameCapacity : size of each frame in bytes
+    \param      frameCount : number of frames
+*/
+serialFramePool::serialFramePool(unsigned int frameCapacity, unsigned int frameCount)
 {
+    capacity=frameCapacity;
+    storage=new unsigned char[(size_t)frameCapacity*frameCount];
+    frames=new serialFrame[frameCount];
+
+    // All the frames are free
+    freeList=NULL;
+    for (unsigned int i=frameCount;i>0;i--)
+    {
+        frames[i-1].data=storage+(size_t)(i-1)*frameCapacity;
+        frames[i-1].size=0;
+        frames[i-1].capacity=frameCapacity;
+        frames[i-1].next=freeList;
+        freeList=&frames[i-1];
+    }
+    nbFree=frameCount;
+
 #if defined (_WIN32) || defined(_WIN64)
-    DWORD modemStat;
-    GetCommModemStatus(hSerial, &modemStat);
-    return modemStat & MS_RLSD_ON;
+    InitializeCriticalSection(&lock);
 #endif
 #if defined (__linux__) || defined(__APPLE__)
-    int status=0;
-    //Get the current status of the DCD bit
-    ioctl(fd, TIOCMGET, &status);
-    return status & TIOCM_CAR;
+    pthread_mutex_init(&lock, NULL);
 #endif
 }
 
 
 /*!
-    \brief      Get the RING's status (pin 9)
-                Ring Indicator
-    \return     Return true if RING is set otherwise false
-  */
-bool serialib::isRI()
+    \brief      Destructor of the class serialFramePool. The frames must not be used anymore.
+*/
+serialFramePool::~serialFramePool()
 {
 #if defined (_WIN32) || defined(_WIN64)
-    DWORD modemStat;
-    GetCommModemStatus(hSerial, &modemStat);
-    return modemStat & MS_RING_ON;
+    DeleteCriticalSection(&lock);
 #endif
 #if defined (__linux__) || defined(__APPLE__)
-    int status=0;
-    //Get the current status of the RING bit
-    ioctl(fd, TIOCMGET, &status);
-    return status & TIOCM_RNG;
+    pthread_mutex_destroy(&lock);
 #endif
+    delete[] frames;
+    delete[] storage;
 }
 
 
 /*!
-    \brief      Get the DTR's status (pin 4)
-                DTR stands for Data Terminal Ready
-                May behave abnormally on Windows
-    \return     Return true if CTS is set otherwise false
-  */
-bool serialib::isDTR()
+    \brief      Get a free frame. Its size is reset to 0.
+    \return     A frame of frameCapacity() bytes
+    \return     NULL if all the frames are in use
+*/
+serialFrame* serialFramePool::acquire()
 {
-#if defined (_WIN32) || defined( _WIN64)
-    return currentStateDTR;
+#if defined (_WIN32) || defined(_WIN64)
+    EnterCriticalSection(&lock);
 #endif
 #if defined (__linux__) || defined(__APPLE__)
-    int status=0;
-    //Get the current status of the DTR bit
-    ioctl(fd, TIOCMGET, &status);
-    return status & TIOCM_DTR  ;
+    pthread_mutex_lock(&lock);
+#endif
+    // Pop the first free frame
+    serialFrame *frame=freeList;
+    if (frame!=NULL)
+    {
+        freeList=frame->next;
+        nbFree--;
+    }
+#if defined (_WIN32) || defined(_WIN64)
+    LeaveCriticalSection(&lock);
+#endif
+#if defined (__linux__) || defined(__APPLE__)
+    pthread_mutex_unlock(&lock);
 #endif
+    if (frame!=NULL)
+    {
+        frame->size=0;
+        frame->next=NULL;
+    }
+    return frame;
 }
 
 
+/*!
+    \brief      Give a frame back to the pool. Can be called from any thread.
+    \param      frame : frame obtained with acquire (NULL is ignored)
+*/
+void serialFramePool::release(serialFrame *frame)
+{
+    if (frame==NULL) return;
+#if defined (_WIN32) || defined(_WIN64)
+    EnterCriticalSection(&lock);
+#endif
+#if defined (__linux__) || defined(__APPLE__)
+    pthread_mutex_lock(&lock);
+#endif
+    // Push the frame on the free list (the most recently used frame is reused first, it is hot in cache)
+    frame->next=freeList;
+    freeList=frame;
+    nbFree++;
+#if defined (_WIN32) || defined(_WIN64)
+    LeaveCriticalSection(&lock);
+#endif
+#if defined (__linux__) || defined(__APPLE__)
+    pthread_mutex_unlock(&lock);
+#endif
+}
+
 
 /*!
-    \brief      Get the RTS's status (pin 7)
-                RTS stands for Request To Send
-                May behave abnormally on Windows
-    \return     Return true if RTS is set otherwise false
-  */
-bool serialib::isRTS()
+    \brief      Return the number of free frames
+    \return     The number of frames that can be acquired
+*/
+unsigned int serialFramePool::available()
 {
 #if defined (_WIN32) || defined(_WIN64)
-    return currentStateRTS;
+    EnterCriticalSection(&lock);
 #endif
 #if defined (__linux__) || defined(__APPLE__)
-    int status=0;
-    //Get the current status of the CTS bit
-    ioctl(fd, TIOCMGET, &status);
-    return status & TIOCM_RTS;
+    pthread_mutex_lock(&lock);
+#endif
+    // Read under the lock: acquire and release may run in other threads
+    unsigned int count=nbFree;
+#if defined (_WIN32) || defined(_WIN64)
+    LeaveCriticalSection(&lock);
 #endif
+#if defined (__linux__) || defined(__APPLE__)
+    pthread_mutex_unlock(&lock);
+#endif
+    return count;
 }
 
 
+/*!
+    \brief      Return the capacity of the frames
+    \return     The size of each frame in bytes
+*/
+unsigned int serialFramePool::frameCapacity()
+{
+    return capacity;
+}
 
 
 
@@ -1135,3 +4246,52 @@ unsigned long int timeOut::elapsedTime_ms()
     return sec*1000+usec/1000;
 #endif
 }
+
+
+/*!
+    \brief      Returns the current time of a monotonic clock (not affected by system time changes).
+                Only differences between two values are meaningful.
+    \return     The current time in nanoseconds
+  */
+unsigned long long timeOut::monotonicTime_ns()
+{
+#if defined (_WIN32) || defined(_WIN64)
+    LARGE_INTEGER counter, frequency;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    // Split the conversion to avoid overflows
+    return (unsigned long long)(counter.QuadPart/frequency.QuadPart)*1000000000ULL
+         + (unsigned long long)(counter.QuadPart%frequency.QuadPart)*1000000000ULL/frequency.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec*1000000000ULL+now.tv_nsec;
+#endif
+}
+
+
+/*!
+    \brief      Sleep until the monotonic clock (see monotonicTime_ns) reaches the requested time.
+                Returns immediately if the time is already reached.
+    \param      time_ns : wake up time in nanoseconds
+  */
+void timeOut::sleepUntil_ns(unsigned long long time_ns)
+{
+#if defined (_WIN32) || defined(_WIN64)
+    unsigned long long now=monotonicTime_ns();
+    if (time_ns>now) Sleep((DWORD)((time_ns-now+999999)/1000000));
+#elif defined (__linux__)
+    // Absolute deadline: no drift when the sleep is interrupted
+    struct timespec deadline;
+    deadline.tv_sec=time_ns/1000000000ULL;
+    deadline.tv_nsec=time_ns%1000000000ULL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL)==EINTR);
+#else
+    unsigned long long now=monotonicTime_ns();
+    if (time_ns<=now) return;
+    struct timespec duration;
+    duration.tv_sec=(time_ns-now)/1000000000ULL;
+    duration.tv_nsec=(time_ns-now)%1000000000ULL;
+    nanosleep(&duration, NULL);
+#endif
+}
@@ -50,11 +50,52 @@ This is a licence-free software, it can be used by anyone who try to build a bet
     #include <fcntl.h>
     #include <unistd.h>
     #include <sys/ioctl.h>
+    #include <errno.h>
+    #include <poll.h>
+    // Threads (modem monitor), and the signal that interrupts its wait
+    #include <pthread.h>
+    #include <signal.h>
+    #include <time.h>
+    // Real-time tuning (scheduling, memory locking)
+    #include <sched.h>
+    #include <sys/mman.h>
+#endif
+#if defined (__linux__)
+    // Serial driver counters (TIOCGICOUNT)
+    #include <linux/serial.h>
+    // Wait for the device node to come back (auto-reconnect)
+    #include <sys/inotify.h>
+    #include <limits.h>
 #endif
 
 /*! To avoid unused parameters */
 #define UNUSED(x) (void)(x)
 
+/*! Size of the internal receive buffer (Unix only) */
+#define SERIAL_RX_BUFFER_SIZE       4096
+
+/*! Number of reception times kept for the chunks of the receive buffer */
+#define SERIAL_RX_CHUNKS            64
+
+/*! Maximum number of bytes queued in the driver when XON/XOFF is handled by serialib */
+#define SERIAL_SOFT_FLOW_CHUNK      16
+
+/*! Pending input (bytes) above which serialib sends XOFF when XON/XOFF is handled by serialib */
+#define SERIAL_SOFT_FLOW_HIGH_WATER 2048
+
+/*! Pending input (bytes) below which serialib sends XON again */
+#define SERIAL_SOFT_FLOW_LOW_WATER  256
+
+/*! Delay between two attempts to reopen a lost device when its directory can't be watched */
+#define SERIAL_RECONNECT_RETRY_MS   100
+
+/*! Signal sent to the modem monitor thread to interrupt its wait in the driver (Unix only).
+    startModemMonitor installs an empty handler for it if the application has none, so an
+    application that uses SIGURG builds serialib with -DSERIAL_MODEM_WAKE_SIGNAL=<another signal> */
+#ifndef SERIAL_MODEM_WAKE_SIGNAL
+#define SERIAL_MODEM_WAKE_SIGNAL    SIGURG
+#endif
+
 /**
  * number of serial data bits
  */
@@ -86,8 +127,151 @@ enum SerialParity {
     SERIAL_PARITY_SPACE /**< space bit */
 };
 
+/**
+ * type of flow control
+ */
+enum SerialFlowControl {
+    SERIAL_FLOWCONTROL_NONE, /**< no flow control */
+    SERIAL_FLOWCONTROL_HARDWARE, /**< RTS/CTS handled by the driver */
+    SERIAL_FLOWCONTROL_SOFTWARE, /**< XON/XOFF handled by the driver */
+    SERIAL_FLOWCONTROL_SOFTWARE_USER /**< XON/XOFF handled by serialib, for drivers without XON/XOFF support (Unix only) */
+};
+
+/**
+ * modem control and status lines (can be combined as a bit mask)
+ */
+enum SerialModemLine {
+    SERIAL_LINE_DTR = 0x01, /**< Data Terminal Ready (output) */
+    SERIAL_LINE_RTS = 0x02, /**< Request To Send (output) */
+    SERIAL_LINE_CTS = 0x04, /**< Clear To Send (input) */
+    SERIAL_LINE_DSR = 0x08, /**< Data Set Ready (input) */
+    SERIAL_LINE_DCD = 0x10, /**< Data Carrier Detect (input) */
+    SERIAL_LINE_RI  = 0x20  /**< Ring Indicator (input) */
+};
+
+/**
+ * modem line transition reported by serialib::waitModemChange
+ */
+struct SerialModemEvent {
+    int                 lines;          /**< state of the lines after the transition (SerialModemLine flags) */
+    int                 changed;        /**< input lines that changed during the wait (SerialModemLine flags) */
+    unsigned long long  timestamp_ns;   /**< monotonic time when the transition was reported (see timeOut::monotonicTime_ns) */
+    unsigned long       ctsCount;       /**< number of CTS transitions counted by the driver since it was opened */
+    unsigned long       dsrCount;       /**< number of DSR transitions counted by the driver since it was opened */
+    unsigned long       dcdCount;       /**< number of DCD transitions counted by the driver since it was opened */
+    unsigned long       riCount;        /**< number of RI transitions counted by the driver since it was opened */
+};
+
+/**
+ * line counters maintained by the serial driver (TIOCGICOUNT)
+ */
+struct SerialLineCounters {
+    unsigned long       rx;             /**< bytes received */
+    unsigned long       tx;             /**< bytes transmitted */
+    unsigned long       frame;          /**< framing errors */
+    unsigned long       parity;         /**< parity errors (counted even if the bytes are ignored) */
+    unsigned long       overrun;        /**< hardware (UART FIFO) overruns */
+    unsigned long       bufOverrun;     /**< software (tty buffer) overruns */
+    unsigned long       brk;            /**< breaks received */
+    unsigned long       cts;            /**< CTS transitions */
+    unsigned long       dsr;            /**< DSR transitions */
+    unsigned long       dcd;            /**< DCD transitions */
+    unsigned long       ri;             /**< RI transitions */
+};
+
+/**
+ * how the reads wait for data (Unix only)
+ */
+enum SerialWaitPolicy {
+    SERIAL_WAIT_BLOCK, /**< sleep in poll until data arrives (lowest CPU usage) */
+    SERIAL_WAIT_SPIN, /**< busy-poll for the spin budget, then sleep */
+    SERIAL_WAIT_ADAPTIVE /**< busy-poll for a budget tuned from the observed arrival delays, then sleep */
+};
+
+/**
+ * scheduling latency observed when the reading thread wakes up at a deadline
+ * (timeout of a poll, gap of readFrame, sleep of waitTransmitted)
+ */
+struct SerialWakeupStats {
+    unsigned long       count;          /**< number of wake-ups measured */
+    unsigned long long  last_ns;        /**< latency of the last wake-up */
+    unsigned long long  max_ns;         /**< worst latency */
+    unsigned long long  total_ns;       /**< sum of the latencies (total_ns/count is the average) */
+};
+
+/**
+ * reconnections of a device that disappeared (see serialib::setAutoReconnect)
+ */
+struct SerialReconnectStats {
+    unsigned long       count;          /**< number of reconnections */
+    bool                connected;      /**< the device is present (false while waiting for it) */
+    unsigned long long  lastDowntime_ns;  /**< time between the detection of the last hang-up and the reopening */
+    unsigned long long  maxDowntime_ns;   /**< longest downtime */
+    unsigned long long  totalDowntime_ns; /**< sum of the downtimes */
+};
+
+/**
+ * format of length-prefixed packets read by serialib::readPacket
+ * The packet starts with a header of headerSize bytes that contains the length field,
+ * the total size of the packet is headerSize + length + lengthAdjust.
+ */
+struct SerialPacketFormat {
+    unsigned int        headerSize;     /**< number of bytes before the payload, including the length field */
+    unsigned int        lengthOffset;   /**< position of the length field in the header */
+    unsigned int        lengthSize;     /**< size of the length field: 1, 2, 3 or 4 bytes */
+    bool                bigEndian;      /**< byte order of the length field */
+    int                 lengthAdjust;   /**< added to the length field (ex: -2 if the length includes a 2 bytes header) */
+    unsigned int        maxPacketSize;  /**< packets larger than this size are rejected (0 = no limit) */
+};
+
+/**
+ * frame of a serialFramePool
+ */
+struct serialFrame {
+    unsigned char*      data;           /**< bytes of the frame */
+    unsigned int        size;           /**< number of bytes used in data */
+    unsigned int        capacity;       /**< number of bytes allocated for data */
+    serialFrame*        next;           /**< used by the pool, don't modify */
+};
+
+/*! Function called by the modem monitor thread on each transition */
+typedef void (*SerialModemCallback)(const SerialModemEvent *event, void *userData);
+
+class serialib;
+
+/**
+ * one port of a serialib::writeBroadcast, with its payload and its progress
+ */
+struct SerialBroadcastPort {
+    serialib*           port;           /**< open port to write on */
+    const void*         data;           /**< bytes to write (the same buffer can be shared by all the ports) */
+    unsigned int        size;           /**< number of bytes to write */
+    unsigned int        written;        /**< bytes written so far (updated before each progress report) */
+    int                 status;         /**< 0 in progress, 1 done, -1 write error, -2 thread not started */
+};
+
+/*! Function called periodically by serialib::writeBroadcast to report the progress */
+typedef void (*SerialBroadcastCallback)(const SerialBroadcastPort *ports, unsigned int nbPorts, void *userData);
+
+/*! Lock of the reception or the transmission path of a serialib (recursive) */
+#if defined (_WIN32) || defined(_WIN64)
+typedef CRITICAL_SECTION serialMutex;
+#else
+typedef pthread_mutex_t serialMutex;
+#endif
+
 /*!  \class     serialib
      \brief     This class is used for communication over a serial device.
+
+                Threads: the reception and the transmission have separate states and separate
+                locks. One thread can read while other threads write, without waiting for each
+                other. Each write call (writeChar, writeString, writeBytes) is atomic with respect
+                to the other writers; a frame made of several calls can be kept together with
+                lockTransmitter / unlockTransmitter. Concurrent readers are serialized, and the
+                pointer returned by peekBytes is only valid for the thread that called it.
+                openDevice, closeDevice and the configuration functions must not be called
+                while other threads use the port.
+                On Windows, the driver still serializes ReadFile and WriteFile on the same handle.
 */
 class serialib
 {
@@ -114,7 +298,11 @@ public:
     char openDevice(const char *Device, const unsigned int Bauds,
                     SerialDataBits Databits = SERIAL_DATABITS_8,
                     SerialParity Parity = SERIAL_PARITY_NONE,
-                    SerialStopBits Stopbits = SERIAL_STOPBITS_1);
+                    SerialStopBits Stopbits = SERIAL_STOPBITS_1,
+                    SerialFlowControl FlowControl = SERIAL_FLOWCONTROL_NONE);
+
+    // Characters used for software flow control (must be called before openDevice)
+    void    setXonXoffChars(char Xon, char Xoff);
 
     // Check device opening state
     bool isDeviceOpen();
@@ -122,6 +310,15 @@ public:
     // Close the current device
     void    closeDevice();
 
+    // Reopen the device transparently when it disappears and comes back (Unix only)
+    int     setAutoReconnect(bool enable, unsigned int maxDowntime_ms=0);
+
+    // Number of reconnections and downtime
+    void    getReconnectStats(SerialReconnectStats *stats);
+
+    // Check the device, and try once to reopen it if it disappeared (auto-reconnect, Unix only)
+    int     checkDevice();
+
 
 
 
@@ -161,9 +358,54 @@ public:
     int     writeBytes(const void *Buffer, const unsigned int NbBytes, unsigned int *NbBytesWritten);
     int     writeBytes  (const void *Buffer, const unsigned int NbBytes);
 
+    // 9-bit multidrop: the parity bit marks the address bytes, frames for other nodes are dropped (Linux only)
+    int     setMultidrop(bool enable, int address=-1, int broadcastAddress=-1);
+
+    // Write a frame in multidrop mode: address byte (parity bit set), then data bytes
+    int     writeAddressed(unsigned char address, const void *data, unsigned int nbBytes);
+
     // Read an array of byte (with timeout)
     int     readBytes   (void *buffer,unsigned int maxNbBytes,const unsigned int timeOut_ms=0, unsigned int sleepDuration_us=100);
 
+    // Read the bytes already received, or wait for the first one (with timeout)
+    int     readAvailable(void *buffer, unsigned int maxNbBytes, const unsigned int timeOut_ms=0);
+
+    // Read a frame delimited by silence on the line (with timeout for the first byte)
+    int     readFrame   (void *buffer, unsigned int maxNbBytes, const unsigned int timeOut_ms=0);
+
+    // Set the silence that ends a frame, in character times or in microseconds
+    void    setFrameGap(float nbCharacters);
+    void    setFrameGap_us(unsigned int gap_us);
+
+    // Read exactly nbBytes bytes (with timeout, Unix only)
+    int     readExact   (void *buffer, unsigned int nbBytes, const unsigned int timeOut_ms=0);
+
+    // Read a length-prefixed packet (with timeout, Unix only)
+    int     readPacket  (void *buffer, unsigned int maxNbBytes, const SerialPacketFormat &format, const unsigned int timeOut_ms=0);
+    int     readPacket  (serialFrame *frame, const SerialPacketFormat &format, const unsigned int timeOut_ms=0);
+
+    // Access the next bytes of the receive buffer without copy (with timeout, Unix only)
+    const unsigned char* peekBytes(unsigned int nbBytes, const unsigned int timeOut_ms=0);
+
+    // Remove bytes from the receive buffer (after peekBytes)
+    int     consumeBytes(unsigned int nbBytes);
+
+    // Reception times of the first and last bytes returned by the last read
+    void    getReceiveTimestamps(unsigned long long *firstByte_ns, unsigned long long *lastByte_ns);
+
+    // Limit the transmission rate (token bucket, Unix only)
+    void    setTransmitPacing(unsigned int bytesPerSecond, unsigned int burstBytes=1);
+
+    // Maximum time a write waits for the peer (XOFF) or for the driver (Unix only)
+    void    setWriteTimeout(unsigned int timeOut_ms);
+
+    // Accumulate the written bytes in a buffer, sent on threshold, delay, read or flushWriteBuffer
+    int     setWriteBuffer(unsigned int size, unsigned int flushThreshold=0,
+                           unsigned int flushDelay_us=0, bool flushBeforeRead=true);
+
+    // Send the bytes accumulated in the write buffer
+    int     flushWriteBuffer();
+
 
 
 
@@ -177,6 +419,18 @@ public:
     // Return the number of bytes in the received buffer
     int     available();
 
+    // Return the number of bytes written but not transmitted yet
+    int     pendingOutput();
+
+    // Wait until all the bytes written are transmitted (with timeout)
+    int     waitTransmitted(const unsigned int timeOut_ms=0, unsigned long long *lastByteTime_ns=NULL);
+
+    // Return the duration of one character on the line (start, data, parity and stop bits)
+    unsigned long characterTime_ns();
+
+    // Return the file descriptor of the device (Unix only, for poll or splice)
+    int     fileDescriptor();
+
 
 
 
@@ -212,15 +466,168 @@ public:
     // Get CTR status (Data Terminal Ready, pin 4)
     bool    isDTR();
 
+    // Set and clear several output lines in one call (SERIAL_LINE_DTR | SERIAL_LINE_RTS)
+    bool    setModemLines(int setLines, int clearLines=0);
+
+    // Get a snapshot of all the modem lines (combination of SerialModemLine)
+    int     getModemLines();
+
+    // Block until one of the input lines changes (Linux only)
+    int     waitModemChange(int lines, SerialModemEvent *event);
+
+    // Report the input line transitions to a callback from a background thread (Linux only)
+    // Takes over SERIAL_MODEM_WAKE_SIGNAL (SIGURG) if the application has no handler for it
+    int     startModemMonitor(int lines, SerialModemCallback callback, void *userData=NULL);
+
+    // Stop the background thread started by startModemMonitor
+    void    stopModemMonitor();
+
+
+
+
+    // ____________________________
+    // ::: Line error counters :::
+
+
+    // Get the counters of the driver (bytes, line errors and overruns, Linux only)
+    int     getLineCounters(SerialLineCounters *counters);
+
+    // Get the increase of the counters since the previous call (or since openDevice)
+    int     getLineCountersDelta(SerialLineCounters *delta);
+
+
+
+
+    // __________________________
+    // ::: Real-time tuning :::
+
+
+    // Pin the calling thread to CPUs and raise its priority (SCHED_FIFO)
+    static int setThreadRealtime(int priority, unsigned long long cpuMask=0);
+
+    // Same settings for the threads created by serialib (modem monitor, flush, writeBroadcast)
+    int     setRealtimeThreads(int priority, unsigned long long cpuMask=0);
+
+    // Prefault and lock in memory the buffers of the port
+    int     lockBuffers();
+
+    // Scheduling latency measured at each wake-up on a deadline
+    void    getWakeupLatency(SerialWakeupStats *stats, bool reset=false);
+
+    // Busy-poll before sleeping when waiting for data (Unix only)
+    void    setWaitPolicy(SerialWaitPolicy policy, unsigned int spinBudget_us=50);
+
+    // Current spin budget (tuned by SERIAL_WAIT_ADAPTIVE)
+    unsigned int getSpinBudget_us();
+
+
+
+
+    // _______________
+    // ::: Threads :::
+
+
+    // Keep several writes together (frame written by several calls)
+    void    lockTransmitter();
+    void    unlockTransmitter();
+
+
+
+
+    // __________________________
+    // ::: Multi-port write :::
+
+
+    // Write on many ports at the same time, one thread per port
+    static int writeBroadcast(SerialBroadcastPort *ports, unsigned int nbPorts, unsigned int chunkSize=1024,
+                              SerialBroadcastCallback progress=NULL, void *userData=NULL, unsigned int progressPeriod_ms=100);
+
 
 private:
     // Read a string (no timeout)
     int             readStringNoTimeOut  (char *String,char FinalChar,unsigned int MaxNbBytes);
 
-    // Current DTR and RTS state (can't be read on WIndows)
+    // Current DTR and RTS state (can't be read on WIndows, restored after a reconnection on Unix)
     bool            currentStateRTS;
     bool            currentStateDTR;
 
+    // Flow control settings
+    SerialFlowControl flowControl;
+    char            xonChar;
+    char            xoffChar;
+
+    // Counters at the previous call of getLineCountersDelta
+    SerialLineCounters lastCounters;
+
+    // Reception times of the first and last bytes returned by the last read
+    unsigned long long  rxTimeFirst_ns;
+    unsigned long long  rxTimeLast_ns;
+
+    // Compute the duration of one character from the port settings
+    void            setCharacterTime(unsigned int Bauds, SerialDataBits Databits, SerialParity Parity, SerialStopBits Stopbits);
+
+    // Duration of one character on the line
+    unsigned long   charTime_ns;
+
+    // Silence that ends a frame (readFrame), in character times (0 when set in microseconds)
+    float               frameGapChars;
+    unsigned long long  frameGap_ns;
+
+    // Write through the write buffer when it is enabled
+    int             writeBuffered(const void *buffer, unsigned int nbBytes);
+
+    // Flush the write buffer before a read, or when its delay has elapsed
+    void            checkWriteBuffer(bool beforeRead);
+
+    // Write bytes on the device (no buffering)
+    int             writeDevice(const void *buffer, unsigned int nbBytes);
+
+    // Settings applied to the threads created by serialib (0 = unchanged)
+    int                 rtPriority;
+    unsigned long long  rtCpuMask;
+
+    // Buffers locked in memory by lockBuffers
+    bool                buffersLocked;
+
+    // Wake-up latencies of the reception path (waitReadable) and of the transmission path (waitTransmitted)
+    SerialWakeupStats   wakeupStats;
+    SerialWakeupStats   txWakeupStats;
+
+    // Locks of the reception and the transmission paths
+    serialMutex         rxLock;
+    serialMutex         txLock;
+
+    // Read XON/XOFF from the transmission path, unless a reader is already doing it
+    int             fillReceiveBufferShared();
+
+    // Wait policy: maximum spin duration, and average delay before data arrives (adaptive policy)
+    SerialWaitPolicy    waitPolicy;
+    unsigned long long  spinMax_ns;
+    unsigned long long  spinBudget_ns;
+    unsigned long long  arrivalAverage_ns;
+
+    // Record the latency of a wake-up planned at deadline_ns
+    void            recordWakeup(SerialWakeupStats &stats, unsigned long long deadline_ns);
+
+    // Body of the threads of writeBroadcast
+#if defined (_WIN32) || defined(_WIN64)
+    static DWORD WINAPI broadcastThread(LPVOID arg);
+#endif
+#if defined (__linux__) || defined(__APPLE__)
+    static void*    broadcastThread(void *arg);
+#endif
+
+    // Write buffer: txBufUsed bytes pending since txBufTime_ns
+    char*               txBuf;
+    unsigned int        txBufSize;
+    unsigned int        txBufUsed;
+    unsigned int        txFlushThreshold;
+    unsigned long long  txFlushDelay_ns;
+    bool                txFlushBeforeRead;
+    unsigned long long  txBufTime_ns;
+    // A flush before a read failed, reported by the next write
+    bool                txBufError;
+
 
 
 
@@ -233,6 +640,138 @@ private:
 #endif
 #if defined (__linux__) || defined(__APPLE__)
     int             fd;
+
+    // Read from the receive buffer, or from the device when the buffer is empty
+    int             readData(void *buffer, unsigned int maxNbBytes);
+
+    // Write all the bytes to the device, honoring the flow control
+    int             writeData(const void *buffer, unsigned int nbBytes);
+
+    // Move the pending bytes of the device into the receive buffer
+    int             fillReceiveBuffer();
+
+    // Remove XON/XOFF characters from received data and update the flow control state
+    unsigned int    filterFlowControl(unsigned char *data, unsigned int nbBytes);
+
+    // Send XOFF or XON from the number of pending input bytes (XON/XOFF handled by serialib)
+    void            throttlePeer();
+
+    // Decode the parity marks of the multidrop mode and remove the frames of the other nodes
+    unsigned int    filterMultidrop(unsigned char *data, unsigned int nbBytes);
+
+    // Multidrop mode: own and broadcast addresses (-1 = none), decoding state of the parity marks
+    // (0 data, 1 after 0xFF, 2 after 0xFF 0x00) and whether the current frame is kept
+    bool            multidrop;
+    int             multidropAddress;
+    int             multidropBroadcast;
+    unsigned char   multidropState;
+    bool            multidropAccept;
+
+    // Wait until the peer allows transmission (XON/XOFF handled by serialib), until a deadline
+    int             waitTransmitAllowed(unsigned long long deadline_ns);
+
+    // Wait until the device has data to read (negative timeout = no timeout)
+    int             waitReadable(long long timeout_ns);
+
+    // Tune the spin budget from the time spent waiting for data
+    void            recordArrival(unsigned long long wait_ns);
+
+    // Wait until the receive buffer holds nbBytes bytes
+    int             fillReceiveBufferUntil(unsigned int nbBytes, unsigned long long deadline_ns, bool noTimeOut);
+
+    // Page-aligned block holding the reception times and the receive buffer (see lockBuffers)
+    void*           rxPages;
+
+    // Receive buffer (SERIAL_RX_BUFFER_SIZE bytes): bytes from rxHead to rxTail are pending
+    unsigned char*  rxBuffer;
+    unsigned int    rxHead;
+    unsigned int    rxTail;
+
+    // Set the reception times for the next nbBytes bytes of the receive buffer
+    void            consumeTimestamps(unsigned int nbBytes);
+
+    // Empty the receive buffer and forget the reception times
+    void            resetReceiveBuffer();
+
+    // Reception time of the chunks in the receive buffer: ring of SERIAL_RX_CHUNKS (end position, time)
+    unsigned long long* rxChunkEnd;
+    unsigned long long* rxChunkTime;
+    unsigned int        rxChunkFirst;
+    unsigned int        rxChunkCount;
+    // Number of bytes added to and removed from the receive buffer since the opening
+    unsigned long long  rxTotalIn;
+    unsigned long long  rxTotalOut;
+
+    // Software flow control state: peer sent XOFF (accessed with atomic operations), we sent XOFF
+    bool            txPaused;
+    bool            rxPaused;
+
+    // Wait until nbBytes can be sent according to the transmit pacing
+    void            paceTransmit(unsigned int nbBytes);
+
+    // Transmit pacing: rate (0 if disabled), bucket size, available tokens and time of the last refill
+    unsigned int        paceRate;
+    unsigned int        paceBurst;
+    double              paceTokens;
+    unsigned long long  paceTime_ns;
+
+    // Maximum waiting time of a write (0 = no limit)
+    unsigned long long  txTimeout_ns;
+
+    // Apply the settings of openDevice to an open device
+    char            setupDevice(int device, const unsigned int Bauds, SerialDataBits Databits,
+                                SerialParity Parity, SerialStopBits Stopbits, SerialFlowControl FlowControl);
+
+    // Reopen the device after a hang-up (auto-reconnect), waiting for it at most timeout_ns
+    int             reconnectDevice(long long timeout_ns, unsigned long generation);
+
+    // Settings of the device, kept to reopen it after a hang-up
+    char*               devicePath;
+    unsigned int        deviceBauds;
+    SerialDataBits      deviceDatabits;
+    SerialParity        deviceParity;
+    SerialStopBits      deviceStopbits;
+
+    // Auto-reconnect: enabled, maximum downtime (0 = no limit), time of the hang-up (0 = device present)
+    bool                autoReconnect;
+    unsigned long long  reconnectMax_ns;
+    unsigned long long  lostTime_ns;
+    SerialReconnectStats reconnectStats;
+    // Serializes the reopening (the waiting is done without the lock)
+    serialMutex         reconnectLock;
+
+    // Body of the modem monitor thread
+    static void*    modemMonitorThread(void *arg);
+
+    // waitModemChange, flagging the time spent in the driver (the only wait stopModemMonitor interrupts)
+    int             waitModemEvent(int lines, SerialModemEvent *event, bool *inDriver);
+
+    // Apply affinity and priority to a thread
+    static int      applyRealtime(pthread_t thread, int priority, unsigned long long cpuMask);
+
+    // Modem monitor thread and its parameters (stop, done and inDriver are accessed with atomic operations)
+    pthread_t           modemThread;
+    bool                modemThreadRunning;
+    bool                modemThreadStop;
+    bool                modemThreadDone;
+    bool                modemThreadInDriver;
+    int                 modemMonitorLines;
+    SerialModemCallback modemCallback;
+    void*               modemCallbackData;
+    // Transition counters at the previous event of waitModemChange
+    SerialLineCounters  modemCounts;
+    bool                modemCountsValid;
+
+    // Thread that sends the buffered bytes when their delay elapses (waits on txLock)
+    static void*    flushThread(void *arg);
+    int             startFlushThread();
+    void            stopFlushThread();
+
+    // Flush thread, and the condition that signals a new batch of buffered bytes (with txLock)
+    pthread_t           txFlushThread;
+    pthread_cond_t      txFlushCond;
+    bool                txFlushThreadRunning;
+    bool                txFlushStop;
 #endif
 
 };
@@ -256,6 +795,12 @@ public:
     // Return the elapsed time since initialization
     unsigned long int   elapsedTime_ms();
 
+    // Return the current time of a monotonic clock in nanoseconds
+    static unsigned long long monotonicTime_ns();
+
+    // Sleep until the monotonic clock reaches time_ns
+    static void         sleepUntil_ns(unsigned long long time_ns);
+
 private:
 #if defined (NO_POSIX_TIME)
     // Used to store the previous time (for computing timeout)
@@ -267,4 +812,56 @@ private:
 #endif
 };
 
+
+
+
+/*!  \class     serialFramePool
+     \brief     Fixed number of fixed-size frames allocated once, recycled without heap allocation.
+                Frames can be acquired and released from any thread, a pool can be shared by several ports.
+   */
+class serialFramePool
+{
+public:
+
+    // Constructor: allocate frameCount frames of frameCapacity bytes
+    serialFramePool(unsigned int frameCapacity, unsigned int frameCount);
+
+    // Destructor: free the frames (they must all be released)
+    ~serialFramePool();
+
+    // Get a free frame (NULL if the pool is exhausted)
+    serialFrame*        acquire();
+
+    // Give a frame back to the pool
+    void                release(serialFrame *frame);
+
+    // Number of free frames
+    unsigned int        available();
+
+    // Capacity of each frame in bytes
+    unsigned int        frameCapacity();
+
+private:
+    // Not copyable
+    serialFramePool(const serialFramePool&);
+    serialFramePool& operator=(const serialFramePool&);
+
+    // Bytes of all the frames, and frame descriptors
+    unsigned char*      storage;
+    serialFrame*        frames;
+    unsigned int        capacity;
+
+    // Free frames
+    serialFrame*        freeList;
+    unsigned int        nbFree;
+
+    // Protects the free list
+#if defined (_WIN32) || defined(_WIN64)
+    CRITICAL_SECTION    lock;
+#endif
+#if defined (__linux__) || defined(__APPLE__)
+    pthread_mutex_t     lock;
+#endif
+};
+
 #endif // serialib_H
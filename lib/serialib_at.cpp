@@ -0,0 +1,486 @@
+/*!
+ \file    serialib_at.cpp
+ \brief   Source file of the class serialAt.
+          AT command engine: queued and pipelined commands, incremental response parsing and
+          routing of the unsolicited result codes (URC) to callbacks.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY CLAIM,
+DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+
+This is a licence-free software, it can be used by anyone who try to build a better world.
+ */
+
+#include "serialib_at.h"
+#include <string.h>
+
+
+
+/*!
+    \brief      A queued command: text sent on the port, prefix of its response lines,
+                deadline and callback
+*/
+struct serialAtCommand
+{
+    int                 id;
+    // Command followed by a carriage return
+    char                text[SERIAL_AT_COMMAND_SIZE];
+    unsigned int        length;
+    // Prefix of the information lines ("+CSQ:" for AT+CSQ), empty if the command has none
+    char                prefix[SERIAL_AT_PREFIX_SIZE];
+    unsigned int        prefixLength;
+    // Timeout, and deadline once sent (0 = no deadline)
+    unsigned int        timeOut_ms;
+    unsigned long long  deadline_ns;
+    SerialAtCallback    callback;
+    void*               userData;
+    // Intermediate lines of the response
+    char*               response;
+    unsigned int        responseLength;
+};
+
+
+/*!
+    \brief      Final result codes, matched at the beginning of a line
+*/
+static const struct {
+    const char*         text;
+    SerialAtResult      result;
+} finalCodes[] = {
+    { "OK",             SERIAL_AT_OK },
+    { "ERROR",          SERIAL_AT_ERROR },
+    { "+CME ERROR:",    SERIAL_AT_CME_ERROR },
+    { "+CMS ERROR:",    SERIAL_AT_CMS_ERROR },
+    { "NO CARRIER",     SERIAL_AT_NO_CARRIER },
+    { "BUSY",           SERIAL_AT_BUSY },
+    { "NO ANSWER",      SERIAL_AT_NO_ANSWER },
+    { "NO DIALTONE",    SERIAL_AT_NO_DIALTONE },
+    { "CONNECT",        SERIAL_AT_CONNECT }
+};
+
+
+// Final result code of a line, SERIAL_AT_PENDING if the line is not a final result code
+static SerialAtResult finalResult(const char *line, unsigned int length)
+{
+    for (unsigned int i=0;i<sizeof(finalCodes)/sizeof(finalCodes[0]);i++)
+    {
+        unsigned int codeLength=strlen(finalCodes[i].text);
+        if (length<codeLength || memcmp(line, finalCodes[i].text, codeLength)!=0) continue;
+        // "OK" and "ERROR" are the whole line, the others can be followed by details
+        if (length>codeLength && (finalCodes[i].result==SERIAL_AT_OK || finalCodes[i].result==SERIAL_AT_ERROR)) continue;
+        return finalCodes[i].result;
+    }
+    return SERIAL_AT_PENDING;
+}
+
+
+/*!
+    \brief      State of a blocking command (see serialAt::command)
+*/
+struct serialAtWait
+{
+    bool                done;
+    SerialAtResult      result;
+    char*               response;
+    unsigned int        responseSize;
+};
+
+
+// Completion of a blocking command: keep the result and copy the response
+static void commandDone(int id, SerialAtResult result, const char *response, void *userData)
+{
+    UNUSED(id);
+    serialAtWait *wait=(serialAtWait*)userData;
+    wait->done=true;
+    wait->result=result;
+    if (wait->response!=NULL && wait->responseSize>0)
+    {
+        strncpy(wait->response, response, wait->responseSize-1);
+        wait->response[wait->responseSize-1]=0;
+    }
+}
+
+
+
+// ******************************************
+//  Class serialAt
+// ******************************************
+
+
+/*!
+    \brief      Constructor of the class serialAt. All the memory is allocated here.
+    \param      port : open serial port connected to the modem
+    \param      maxCommands : maximum number of commands queued
+    \param      responseSize : maximum size of the response of a command (longer responses are truncated)
+*/
+serialAt::serialAt(serialib *port, unsigned int maxCommands, unsigned int responseSize)
+{
+    this->port=port;
+    this->maxCommands=maxCommands;
+    this->responseSize=responseSize;
+    commands=new serialAtCommand[maxCommands];
+    responses=new char[(size_t)maxCommands*responseSize];
+    for (unsigned int i=0;i<maxCommands;i++)
+        commands[i].response=responses+(size_t)i*responseSize;
+    first=count=inFlight=0;
+    // One command at a time, as most modems expect
+    depth=1;
+    nextId=0;
+    completed=0;
+    nbUrc=0;
+    lineLength=0;
+}
+
+
+/*!
+    \brief      Destructor of the class serialAt. The pending commands are dropped without callback
+*/
+serialAt::~serialAt()
+{
+    delete[] commands;
+    delete[] responses;
+}
+
+
+/*!
+    \brief      Set the number of commands sent without waiting for the final result code of the
+                previous ones. The responses are matched in order. Most modems discard the
+                characters received while they execute a command: keep 1 (default) unless the
+                modem is known to buffer its input.
+    \param      depth : number of commands in flight (at least 1)
+*/
+void serialAt::setPipelineDepth(unsigned int depth)
+{
+    this->depth=(depth==0) ? 1 : depth;
+}
+
+
+/*!
+    \brief      Route the unsolicited lines that start with prefix to a callback. A line that
+                starts with the prefix of the command being executed belongs to its response
+                (+CREG: is a response of AT+CREG?, and a URC otherwise). An empty prefix receives
+                the lines that match no prefix while no command is executed.
+    \param      prefix : beginning of the line ("+CREG:", "RING", "+CMTI:"...)
+    \param      callback : function called with the line
+    \param      userData : pointer passed back to the callback
+    \return     1 success
+    \return     -1 too many prefixes, or prefix too long
+*/
+int serialAt::addUrc(const char *prefix, SerialAtUrcCallback callback, void *userData)
+{
+    if (nbUrc>=SERIAL_AT_MAX_URC || strlen(prefix)>=SERIAL_AT_PREFIX_SIZE) return -1;
+    strcpy(urcPrefix[nbUrc], prefix);
+    urcCallback[nbUrc]=callback;
+    urcData[nbUrc]=userData;
+    nbUrc++;
+    return 1;
+}
+
+
+/*!
+    \brief      Queue a command. It is sent immediately if the pipeline has room, otherwise when
+                the previous commands complete (during run or command). The deadline starts when
+                the command is sent.
+    \param      command : command without carriage return ("AT+CSQ")
+    \param      timeOut_ms : maximum time to wait for the final result code (0 = no timeout)
+    \param      callback : function called with the result (NULL if the result is not needed)
+    \param      userData : pointer passed back to the callback
+    \return     >=0 identifier of the command, passed to the callback
+    \return     -1 the queue is full
+    \return     -2 the command is too long
+*/
+int serialAt::send(const char *command, unsigned int timeOut_ms, SerialAtCallback callback, void *userData)
+{
+    if (count>=maxCommands) return -1;
+    unsigned int length=strlen(command);
+    if (length+2>SERIAL_AT_COMMAND_SIZE) return -2;
+
+    serialAtCommand *slot=&commands[(first+count)%maxCommands];
+    slot->id=nextId;
+    nextId=(nextId+1) & 0x7FFFFFFF;
+    memcpy(slot->text, command, length);
+    slot->text[length]='\r';
+    slot->text[length+1]=0;
+    slot->length=length+1;
+    slot->timeOut_ms=timeOut_ms;
+    slot->deadline_ns=0;
+    slot->callback=callback;
+    slot->userData=userData;
+    slot->responseLength=0;
+    slot->response[0]=0;
+
+    // Prefix of the information lines: "AT+CREG?" answers "+CREG: ..."
+    slot->prefixLength=0;
+    const char *name=command;
+    if ((name[0]=='A' || name[0]=='a') && (name[1]=='T' || name[1]=='t')) name+=2;
+    if (name[0]=='+' || name[0]=='^' || name[0]=='$' || name[0]=='#' || name[0]=='%')
+    {
+        unsigned int nameLength=strcspn(name, "=?;");
+        if (nameLength+2<=SERIAL_AT_PREFIX_SIZE)
+        {
+            memcpy(slot->prefix, name, nameLength);
+            slot->prefix[nameLength]=':';
+            slot->prefix[nameLength+1]=0;
+            slot->prefixLength=nameLength+1;
+        }
+    }
+    count++;
+
+    int id=slot->id;
+    sendQueued();
+    return id;
+}
+
+
+/*!
+    \brief      Send the queued commands while the number of commands in flight is below the
+                pipeline depth. A write error completes all the commands with SERIAL_AT_IO_ERROR.
+*/
+void serialAt::sendQueued()
+{
+    while (inFlight<count && inFlight<depth)
+    {
+        serialAtCommand *slot=&commands[(first+inFlight)%maxCommands];
+        if (port->writeBytes(slot->text, slot->length)!=1)
+        {
+            finishAll(SERIAL_AT_IO_ERROR);
+            return;
+        }
+        slot->deadline_ns=(slot->timeOut_ms==0) ? 0 :
+                          timeOut::monotonicTime_ns()+slot->timeOut_ms*1000000ULL;
+        inFlight++;
+    }
+}
+
+
+/*!
+    \brief      Complete the oldest command: call its callback, then free its slot
+    \param      result : result of the command
+*/
+void serialAt::finish(SerialAtResult result)
+{
+    if (count==0) return;
+    serialAtCommand *slot=&commands[first];
+    // The slot stays in use during the callback, so its response is not overwritten by send
+    if (slot->callback!=NULL) slot->callback(slot->id, result, slot->response, slot->userData);
+    first=(first+1)%maxCommands;
+    count--;
+    if (inFlight>0) inFlight--;
+    completed++;
+}
+
+
+/*!
+    \brief      Complete all the commands, sent or not
+    \param      result : result given to all the commands
+*/
+void serialAt::finishAll(SerialAtResult result)
+{
+    // The callbacks can queue new commands: only complete the ones present now
+    unsigned int nbCommands=count;
+    inFlight=0;
+    // Nothing is sent while the queue is emptied
+    unsigned int savedDepth=depth;
+    depth=0;
+    for (unsigned int i=0;i<nbCommands;i++) finish(result);
+    depth=savedDepth;
+}
+
+
+/*!
+    \brief      Complete the oldest commands whose deadline has passed with SERIAL_AT_TIMEOUT.
+                A response received afterwards can be taken for the response of the next command.
+*/
+void serialAt::expire()
+{
+    unsigned long long now=timeOut::monotonicTime_ns();
+    while (inFlight>0 && commands[first].deadline_ns!=0 && now>=commands[first].deadline_ns)
+        finish(SERIAL_AT_TIMEOUT);
+}
+
+
+/*!
+    \brief      Complete all the queued commands with SERIAL_AT_CANCELLED. The commands already
+                sent are still executed by the modem, their responses will be ignored or taken
+                as URCs.
+*/
+void serialAt::cancelAll()
+{
+    finishAll(SERIAL_AT_CANCELLED);
+}
+
+
+/*!
+    \brief      Number of commands queued or waiting for their final result code
+    \return     The number of pending commands
+*/
+unsigned int serialAt::pending()
+{
+    return count;
+}
+
+
+/*!
+    \brief      Append a line to the response of the oldest command (truncated when full)
+    \param      text : the line
+    \param      length : length of the line
+*/
+void serialAt::appendResponse(const char *text, unsigned int length)
+{
+    serialAtCommand *slot=&commands[first];
+    if (responseSize==0) return;
+    unsigned int room=responseSize-1-slot->responseLength;
+    // Lines are separated by '\n'
+    if (slot->responseLength>0 && room>0)
+    {
+        slot->response[slot->responseLength++]='\n';
+        room--;
+    }
+    if (length>room) length=room;
+    memcpy(slot->response+slot->responseLength, text, length);
+    slot->responseLength+=length;
+    slot->response[slot->responseLength]=0;
+}
+
+
+/*!
+    \brief      Handle a complete line: echo of the command, final result code, information line
+                of the command being executed, or URC
+    \param      text : the line, without end of line
+    \param      length : length of the line
+*/
+void serialAt::processLine(const char *text, unsigned int length)
+{
+    serialAtCommand *current=(inFlight>0) ? &commands[first] : NULL;
+    if (current!=NULL)
+    {
+        // Echo of the command (ATE1)
+        if (length==current->length-1 && memcmp(text, current->text, length)==0) return;
+
+        // Final result code: the error details and the CONNECT speed are kept in the response
+        SerialAtResult result=finalResult(text, length);
+        if (result!=SERIAL_AT_PENDING)
+        {
+            if (result!=SERIAL_AT_OK && result!=SERIAL_AT_ERROR) appendResponse(text, length);
+            finish(result);
+            return;
+        }
+
+        // Information line of the command
+        if (current->prefixLength>0 && length>=current->prefixLength &&
+            memcmp(text, current->prefix, current->prefixLength)==0)
+        {
+            appendResponse(text, length);
+            return;
+        }
+    }
+
+    // Unsolicited result code
+    for (unsigned int i=0;i<nbUrc;i++)
+    {
+        unsigned int prefixLength=strlen(urcPrefix[i]);
+        if (prefixLength>0 && length>=prefixLength && memcmp(text, urcPrefix[i], prefixLength)==0)
+        {
+            urcCallback[i](text, urcData[i]);
+            return;
+        }
+    }
+
+    // Any other line belongs to the command being executed, or to the default URC callback
+    if (current!=NULL)
+    {
+        appendResponse(text, length);
+        return;
+    }
+    for (unsigned int i=0;i<nbUrc;i++)
+        if (urcPrefix[i][0]==0)
+        {
+            urcCallback[i](text, urcData[i]);
+            return;
+        }
+}
+
+
+/*!
+    \brief      Wait for data (at most until the timeout or the deadline of the command being
+                executed), parse the received lines, dispatch the results and the URCs, then
+                send the queued commands
+    \param      timeOut_ms : maximum waiting time (0 = until data is received or a deadline passes)
+    \return     >=0 number of commands completed
+    \return     -1 error while reading (the commands are completed with SERIAL_AT_IO_ERROR)
+*/
+int serialAt::run(unsigned int timeOut_ms)
+{
+    completed=0;
+    sendQueued();
+    expire();
+    sendQueued();
+
+    // Wake up for the deadline of the oldest command
+    unsigned int wait_ms=timeOut_ms;
+    if (inFlight>0 && commands[first].deadline_ns!=0)
+    {
+        unsigned long long now=timeOut::monotonicTime_ns();
+        unsigned long long left=(commands[first].deadline_ns>now) ? commands[first].deadline_ns-now : 0;
+        unsigned int left_ms=(unsigned int)((left+999999)/1000000);
+        if (left_ms==0) left_ms=1;
+        if (wait_ms==0 || left_ms<wait_ms) wait_ms=left_ms;
+    }
+
+    char buffer[1024];
+    int Ret=port->readAvailable(buffer, sizeof(buffer), wait_ms);
+    if (Ret<0)
+    {
+        finishAll(SERIAL_AT_IO_ERROR);
+        return -1;
+    }
+
+    // Split the lines, an incomplete line is kept for the next call
+    for (int i=0;i<Ret;i++)
+    {
+        char c=buffer[i];
+        if (c=='\r' || c=='\n')
+        {
+            if (lineLength>0)
+            {
+                line[lineLength]=0;
+                processLine(line, lineLength);
+            }
+            lineLength=0;
+        }
+        else if (lineLength<SERIAL_AT_LINE_SIZE-1) line[lineLength++]=c;
+    }
+
+    expire();
+    sendQueued();
+    return completed;
+}
+
+
+/*!
+    \brief      Send a command and wait for its final result code. The commands queued before
+                are executed first, and the URCs received meanwhile are dispatched.
+                Must not be called from a callback.
+    \param      command : command without carriage return ("AT+CGSN")
+    \param      response : receives the intermediate lines separated by '\n' (can be NULL)
+    \param      responseSize : size of response
+    \param      timeOut_ms : maximum time to wait for the final result code (0 = no timeout)
+    \return     The result of the command (SERIAL_AT_REJECTED if it can't be queued)
+*/
+SerialAtResult serialAt::command(const char *command, char *response, unsigned int responseSize, unsigned int timeOut_ms)
+{
+    serialAtWait wait;
+    wait.done=false;
+    wait.result=SERIAL_AT_PENDING;
+    wait.response=response;
+    wait.responseSize=responseSize;
+    if (response!=NULL && responseSize>0) response[0]=0;
+
+    if (send(command, timeOut_ms, commandDone, &wait)<0) return SERIAL_AT_REJECTED;
+    while (!wait.done)
+        if (run()<0) break;
+    return wait.result;
+}
@@ -0,0 +1,165 @@
+/*!
+\file    serialib_at.h
+\brief   AT command engine: queued and pipelined commands, incremental response parsing and
+         routing of the unsolicited result codes (URC) to callbacks.
+
+The responses are parsed line by line as they arrive, so a URC received in the middle of a
+response (+CREG, RING...) goes to its callback instead of being mixed with the response. The
+next queued command is sent as soon as the final result code of the previous one is received.
+
+    serialAt at(&serial);
+    at.addUrc("+CREG:", onRegistration);
+    at.addUrc("RING", onRing);
+    at.send("AT+CSQ", 1000, onSignalQuality);       // queued, result reported to the callback
+    at.send("AT+COPS?", 5000, onOperator);
+    while (running) at.run(100);                    // read, parse, dispatch, send the next commands
+
+    char imei[64];
+    if (at.command("AT+CGSN", imei, sizeof(imei))==SERIAL_AT_OK) ...   // blocking convenience
+
+A line of the response belongs to the command being executed when it starts with the prefix of
+the command ("+CSQ:" for AT+CSQ) or matches no URC prefix. The callbacks are called from send,
+run and command; they can queue new commands with send, but must not call run or command.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY CLAIM,
+DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+This is a licence-free software, it can be used by anyone who try to build a better world.
+*/
+
+
+#ifndef SERIALIB_AT_H
+#define SERIALIB_AT_H
+
+#include "serialib.h"
+
+/*! Maximum length of a command, including the final carriage return */
+#define SERIAL_AT_COMMAND_SIZE      256
+
+/*! Maximum length of a received line (longer lines are truncated) */
+#define SERIAL_AT_LINE_SIZE         512
+
+/*! Maximum number of URC prefixes */
+#define SERIAL_AT_MAX_URC           16
+
+/*! Maximum length of a URC prefix or of a command prefix */
+#define SERIAL_AT_PREFIX_SIZE       32
+
+/**
+ * result of an AT command
+ */
+enum SerialAtResult {
+    SERIAL_AT_PENDING, /**< queued or waiting for the final result code */
+    SERIAL_AT_OK, /**< OK */
+    SERIAL_AT_ERROR, /**< ERROR */
+    SERIAL_AT_CME_ERROR, /**< +CME ERROR: (the line is in the response) */
+    SERIAL_AT_CMS_ERROR, /**< +CMS ERROR: (the line is in the response) */
+    SERIAL_AT_NO_CARRIER, /**< NO CARRIER */
+    SERIAL_AT_BUSY, /**< BUSY */
+    SERIAL_AT_NO_ANSWER, /**< NO ANSWER */
+    SERIAL_AT_NO_DIALTONE, /**< NO DIALTONE */
+    SERIAL_AT_CONNECT, /**< CONNECT, the modem switched to data mode (the line is in the response) */
+    SERIAL_AT_TIMEOUT, /**< no final result code before the deadline */
+    SERIAL_AT_IO_ERROR, /**< error while writing the command or reading the response */
+    SERIAL_AT_CANCELLED, /**< removed by cancelAll */
+    SERIAL_AT_REJECTED /**< not queued: queue full or command too long */
+};
+
+/*! Function called when a command completes, response holds the intermediate lines separated
+    by '\n' (valid during the call only) */
+typedef void (*SerialAtCallback)(int id, SerialAtResult result, const char *response, void *userData);
+
+/*! Function called for each unsolicited result code */
+typedef void (*SerialAtUrcCallback)(const char *line, void *userData);
+
+/*! A queued command */
+struct serialAtCommand;
+
+
+
+/*!  \class     serialAt
+     \brief     Sends AT commands on an open serialib port and parses the responses.
+   */
+class serialAt
+{
+public:
+
+    // Constructor of the class
+    serialAt(serialib *port, unsigned int maxCommands=16, unsigned int responseSize=1024);
+
+    // Destructor
+    ~serialAt();
+
+    // Number of commands sent without waiting for the previous final result code
+    void                setPipelineDepth(unsigned int depth);
+
+    // Route the lines starting with prefix to a callback (empty prefix = other unsolicited lines)
+    int                 addUrc(const char *prefix, SerialAtUrcCallback callback, void *userData=NULL);
+
+    // Queue a command (sent as soon as the pipeline has room)
+    int                 send(const char *command, unsigned int timeOut_ms=1000,
+                             SerialAtCallback callback=NULL, void *userData=NULL);
+
+    // Read and parse the responses, send the queued commands, expire the deadlines (with timeout)
+    int                 run(unsigned int timeOut_ms=0);
+
+    // Send a command and wait for its result (the URCs are still dispatched)
+    SerialAtResult      command(const char *command, char *response=NULL, unsigned int responseSize=0,
+                                unsigned int timeOut_ms=1000);
+
+    // Number of commands queued or waiting for their result
+    unsigned int        pending();
+
+    // Complete all the queued commands with SERIAL_AT_CANCELLED
+    void                cancelAll();
+
+private:
+    // Not copyable
+    serialAt(const serialAt&);
+    serialAt& operator=(const serialAt&);
+
+    // Send the queued commands while the pipeline has room
+    void                sendQueued();
+
+    // Complete the oldest command, or all of them
+    void                finish(SerialAtResult result);
+    void                finishAll(SerialAtResult result);
+
+    // Complete the oldest command if its deadline has passed
+    void                expire();
+
+    // Handle a complete line
+    void                processLine(const char *line, unsigned int length);
+
+    // Append a line to the response of the oldest command
+    void                appendResponse(const char *line, unsigned int length);
+
+    // Queue of commands: ring of maxCommands slots, the first inFlight ones are sent
+    serialib*           port;
+    serialAtCommand*    commands;
+    char*               responses;
+    unsigned int        maxCommands;
+    unsigned int        responseSize;
+    unsigned int        first;
+    unsigned int        count;
+    unsigned int        inFlight;
+    unsigned int        depth;
+    int                 nextId;
+    // Commands completed during the current call of run
+    int                 completed;
+
+    // URC prefixes and their callbacks
+    char                urcPrefix[SERIAL_AT_MAX_URC][SERIAL_AT_PREFIX_SIZE];
+    SerialAtUrcCallback urcCallback[SERIAL_AT_MAX_URC];
+    void*               urcData[SERIAL_AT_MAX_URC];
+    unsigned int        nbUrc;
+
+    // Line being received
+    char                line[SERIAL_AT_LINE_SIZE];
+    unsigned int        lineLength;
+};
+
+#endif // SERIALIB_AT_H
@@ -0,0 +1,547 @@
+/*!
+ \file    serialib_bridge.cpp
+ \brief   Source file of the class serialBridge.
+          Expose serial ports on TCP or Unix-domain sockets, moving the data with splice (Unix only).
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY CLAIM,
+DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+
+This is a licence-free software, it can be used by anyone who try to build a better world.
+ */
+
+#include "serialib_bridge.h"
+
+#if defined (__linux__) || defined(__APPLE__)
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/*! Maximum number of bytes moved by one splice or read */
+#define SERIAL_BRIDGE_CHUNK         65536
+
+// macOS has no MSG_NOSIGNAL, its client sockets are set to SO_NOSIGPIPE instead
+#if !defined (MSG_NOSIGNAL)
+#define MSG_NOSIGNAL                0
+#endif
+
+
+
+/*!
+    \brief      One direction of a bridged port: the bytes wait in a pipe between the source
+                and the destination. The copy buffer is only used when splice is not available.
+*/
+struct serialBridgeFlow
+{
+    // Pipe between the source and the destination, and number of bytes in it
+    int                 pipe[2];
+    unsigned int        fill;
+    // splice is used on the source side and on the destination side
+    bool                spliceIn;
+    bool                spliceOut;
+    // Bytes taken from the pipe and not written yet (read/write fallback)
+    unsigned char       copy[SERIAL_BRIDGE_COPY_SIZE];
+    unsigned int        copyStart;
+    unsigned int        copyEnd;
+};
+
+
+/*!
+    \brief      A bridged port: the device, its listening socket, its client and the two flows
+*/
+struct serialBridgePort
+{
+    serialib*           port;
+    int                 serialFd;
+    int                 listenFd;
+    int                 clientFd;
+    // The client closed its side: deliver its bytes to the device, then close it
+    bool                clientEof;
+    // The device failed: not polled until the next check (0 = device up)
+    unsigned long long  retry_ns;
+    // Path of the Unix-domain socket (removed when the bridge is closed)
+    char                unixPath[108];
+    // Device to client, and client to device
+    serialBridgeFlow    toClient;
+    serialBridgeFlow    toSerial;
+    SerialBridgeStats   stats;
+};
+
+
+// Number of bytes waiting in a flow
+static inline unsigned int pending(const serialBridgeFlow *flow)
+{
+    return flow->fill+(flow->copyEnd-flow->copyStart);
+}
+
+
+// Create the pipe of a flow
+static int openFlow(serialBridgeFlow *flow)
+{
+    flow->fill=0;
+    flow->copyStart=flow->copyEnd=0;
+    if (pipe(flow->pipe)==-1) return -1;
+    fcntl(flow->pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(flow->pipe[1], F_SETFL, O_NONBLOCK);
+    return 1;
+}
+
+
+// Close the pipe of a flow
+static void closeFlow(serialBridgeFlow *flow)
+{
+    if (flow->pipe[0]!=-1) ::close(flow->pipe[0]);
+    if (flow->pipe[1]!=-1) ::close(flow->pipe[1]);
+    flow->pipe[0]=flow->pipe[1]=-1;
+    flow->fill=0;
+    flow->copyStart=flow->copyEnd=0;
+}
+
+
+
+// ******************************************
+//  Class serialBridge
+// ******************************************
+
+
+/*!
+    \brief      Constructor of the class serialBridge.
+    \param      maxPorts : maximum number of ports served
+*/
+serialBridge::serialBridge(unsigned int maxPorts)
+{
+    this->maxPorts=maxPorts;
+    nbPorts=0;
+    ports=new serialBridgePort[maxPorts];
+    // Three descriptors per port: listening socket, device and client
+    pollFds=new struct pollfd[3*maxPorts];
+}
+
+
+/*!
+    \brief      Destructor of the class serialBridge. It closes the sockets (the ports stay open)
+*/
+serialBridge::~serialBridge()
+{
+    close();
+    delete[] ports;
+    delete[] pollFds;
+}
+
+
+/*!
+    \brief      Serve a port on a TCP socket
+    \param      port : open serial port
+    \param      tcpPort : TCP port to listen on
+    \param      address : IPv4 address to listen on ("0.0.0.0" for all the interfaces)
+    \return     >=0 index of the port in the bridge (see getStats)
+    \return     -1 too many ports
+    \return     -2 the socket can't be created or bound
+    \return     -3 the pipes can't be created
+    \return     -4 the port is not open
+*/
+int serialBridge::addTcpPort(serialib *port, unsigned short tcpPort, const char *address)
+{
+    struct sockaddr_in socketAddress;
+    memset(&socketAddress, 0, sizeof(socketAddress));
+    socketAddress.sin_family=AF_INET;
+    socketAddress.sin_port=htons(tcpPort);
+    if (inet_pton(AF_INET, address, &socketAddress.sin_addr)!=1) return -2;
+
+    int listenFd=socket(AF_INET, SOCK_STREAM, 0);
+    if (listenFd==-1) return -2;
+    int reuse=1;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (bind(listenFd, (struct sockaddr*)&socketAddress, sizeof(socketAddress))==-1)
+    {
+        ::close(listenFd);
+        return -2;
+    }
+    return addPort(port, listenFd, NULL);
+}
+
+
+/*!
+    \brief      Serve a port on a Unix-domain socket. An existing socket file at path is replaced.
+    \param      port : open serial port
+    \param      path : path of the socket
+    \return     see addTcpPort
+*/
+int serialBridge::addUnixPort(serialib *port, const char *path)
+{
+    struct sockaddr_un socketAddress;
+    memset(&socketAddress, 0, sizeof(socketAddress));
+    socketAddress.sun_family=AF_UNIX;
+    if (strlen(path)>=sizeof(socketAddress.sun_path)) return -2;
+    strcpy(socketAddress.sun_path, path);
+
+    int listenFd=socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd==-1) return -2;
+    unlink(path);
+    if (bind(listenFd, (struct sockaddr*)&socketAddress, sizeof(socketAddress))==-1)
+    {
+        ::close(listenFd);
+        return -2;
+    }
+    return addPort(port, listenFd, path);
+}
+
+
+/*!
+    \brief      Register a port with its bound socket
+    \param      port : open serial port
+    \param      listenFd : bound socket, closed on error
+    \param      unixPath : path of the Unix-domain socket, NULL for TCP
+    \return     see addTcpPort
+*/
+int serialBridge::addPort(serialib *port, int listenFd, const char *unixPath)
+{
+    int Ret=-1;
+    if (nbPorts>=maxPorts) Ret=-1;
+    else if (port->fileDescriptor()<0) Ret=-4;
+    else if (listen(listenFd, 4)==-1) Ret=-2;
+    else Ret=1;
+    if (Ret<0)
+    {
+        ::close(listenFd);
+        return Ret;
+    }
+    fcntl(listenFd, F_SETFL, O_NONBLOCK);
+
+    serialBridgePort *bridged=&ports[nbPorts];
+    memset(bridged, 0, sizeof(serialBridgePort));
+    bridged->port=port;
+    bridged->serialFd=port->fileDescriptor();
+    bridged->listenFd=listenFd;
+    bridged->clientFd=-1;
+    if (unixPath!=NULL) strcpy(bridged->unixPath, unixPath);
+    bridged->toClient.pipe[0]=bridged->toClient.pipe[1]=-1;
+    bridged->toSerial.pipe[0]=bridged->toSerial.pipe[1]=-1;
+    if (openFlow(&bridged->toClient)<0 || openFlow(&bridged->toSerial)<0)
+    {
+        closeFlow(&bridged->toClient);
+        closeFlow(&bridged->toSerial);
+        ::close(listenFd);
+        return -3;
+    }
+#if defined (__linux__)
+    // Try splice first, fall back to read/write if the driver doesn't support it
+    bridged->toClient.spliceIn=bridged->toClient.spliceOut=true;
+    bridged->toSerial.spliceIn=bridged->toSerial.spliceOut=true;
+#endif
+    return nbPorts++;
+}
+
+
+/*!
+    \brief      Close the listening sockets, the clients and the pipes. The serial ports stay open.
+*/
+void serialBridge::close()
+{
+    for (unsigned int i=0;i<nbPorts;i++)
+    {
+        closeClient(&ports[i]);
+        ::close(ports[i].listenFd);
+        if (ports[i].unixPath[0]!=0) unlink(ports[i].unixPath);
+        closeFlow(&ports[i].toClient);
+        closeFlow(&ports[i].toSerial);
+    }
+    nbPorts=0;
+}
+
+
+/*!
+    \brief      Get the traffic of a port
+    \param      index : index returned by addTcpPort or addUnixPort
+    \param      stats : traffic of the port
+    \return     1 success
+    \return     -1 invalid index
+*/
+int serialBridge::getStats(int index, SerialBridgeStats *stats)
+{
+    if (index<0 || index>=(int)nbPorts) return -1;
+    *stats=ports[index].stats;
+    stats->connected=(ports[index].clientFd!=-1);
+    stats->deviceUp=(ports[index].retry_ns==0);
+    stats->spliceFromSerial=ports[index].toClient.spliceIn;
+    stats->spliceToSerial=ports[index].toSerial.spliceOut;
+    return 1;
+}
+
+
+/*!
+    \brief      Accept a client, or refuse it if another client is connected
+    \param      bridged : port whose listening socket is readable
+*/
+void serialBridge::acceptClient(serialBridgePort *bridged)
+{
+    int clientFd=accept(bridged->listenFd, NULL, NULL);
+    if (clientFd==-1) return;
+    if (bridged->clientFd!=-1)
+    {
+        ::close(clientFd);
+        bridged->stats.refused++;
+        return;
+    }
+    fcntl(clientFd, F_SETFL, O_NONBLOCK);
+    // Small writes of the device must not wait for more data (fails on Unix-domain sockets)
+    int noDelay=1;
+    setsockopt(clientFd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+#if defined (SO_NOSIGPIPE)
+    // Writing to a client that closed its side fails with EPIPE instead of raising SIGPIPE
+    int noSigPipe=1;
+    setsockopt(clientFd, SOL_SOCKET, SO_NOSIGPIPE, &noSigPipe, sizeof(noSigPipe));
+#endif
+    bridged->clientFd=clientFd;
+    bridged->clientEof=false;
+    bridged->stats.connections++;
+}
+
+
+/*!
+    \brief      Close the client of a port. The data in flight is dropped (the pipes are recreated).
+    \param      bridged : port
+*/
+void serialBridge::closeClient(serialBridgePort *bridged)
+{
+    if (bridged->clientFd==-1) return;
+    ::close(bridged->clientFd);
+    bridged->clientFd=-1;
+    bridged->clientEof=false;
+    closeFlow(&bridged->toClient);
+    closeFlow(&bridged->toSerial);
+    openFlow(&bridged->toClient);
+    openFlow(&bridged->toSerial);
+}
+
+
+/*!
+    \brief      Stop polling a device that failed (a hung-up device is always readable), and
+                schedule its next check. The client stays connected, the bytes the device was
+                sending are dropped.
+    \param      bridged : port
+*/
+void serialBridge::deviceFailed(serialBridgePort *bridged)
+{
+    bridged->retry_ns=timeOut::monotonicTime_ns()+SERIAL_BRIDGE_RETRY_MS*1000000ULL;
+    closeFlow(&bridged->toClient);
+    openFlow(&bridged->toClient);
+}
+
+
+/*!
+    \brief      Move the bytes available on a descriptor to the pipe of a flow
+    \param      flow : flow to fill (its pipe is empty)
+    \param      source : readable descriptor
+    \return     >0 number of bytes moved
+    \return     0 nothing to read
+    \return     -1 end of file or error
+*/
+int serialBridge::fillFlow(serialBridgeFlow *flow, int source)
+{
+    ssize_t Ret;
+#if defined (__linux__)
+    if (flow->spliceIn)
+    {
+        Ret=splice(source, NULL, flow->pipe[1], NULL, SERIAL_BRIDGE_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (Ret>0)
+        {
+            flow->fill+=Ret;
+            return Ret;
+        }
+        if (Ret==0) return -1;
+        if (errno==EAGAIN || errno==EINTR) return 0;
+        if (errno!=EINVAL) return -1;
+        // Not supported by this descriptor, copy from now on
+        flow->spliceIn=false;
+    }
+#endif
+    // The pipe is empty, a chunk of the copy buffer always fits in it
+    unsigned char buffer[SERIAL_BRIDGE_COPY_SIZE];
+    Ret=read(source, buffer, sizeof(buffer));
+    if (Ret==0) return -1;
+    if (Ret==-1) return (errno==EAGAIN || errno==EINTR) ? 0 : -1;
+    if (write(flow->pipe[1], buffer, Ret)!=Ret) return -1;
+    flow->fill+=Ret;
+    return Ret;
+}
+
+
+/*!
+    \brief      Move the bytes of a flow to a descriptor. Writing to a socket whose peer is gone
+                fails with EPIPE and never raises SIGPIPE (which would kill the process).
+    \param      flow : flow to drain
+    \param      destination : writable descriptor
+    \param      socket : the destination is a client socket
+    \return     >=0 number of bytes moved
+    \return     -1 error (EPIPE: the client is gone)
+*/
+int serialBridge::drainFlow(serialBridgeFlow *flow, int destination, bool socket)
+{
+    ssize_t Ret;
+#if defined (__linux__)
+    if (flow->spliceOut && flow->fill>0)
+    {
+        // splice has no MSG_NOSIGNAL: block SIGPIPE in this thread while it runs, and
+        // consume the signal it raised (unless one was already pending)
+        sigset_t sigPipe, previousMask, pendingSignals;
+        bool wasPending=false;
+        if (socket)
+        {
+            sigemptyset(&sigPipe);
+            sigaddset(&sigPipe, SIGPIPE);
+            sigpending(&pendingSignals);
+            wasPending=(sigismember(&pendingSignals, SIGPIPE)==1);
+            pthread_sigmask(SIG_BLOCK, &sigPipe, &previousMask);
+        }
+        Ret=splice(flow->pipe[0], NULL, destination, NULL, flow->fill, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (socket)
+        {
+            int error=errno;
+            if (Ret==-1 && error==EPIPE && !wasPending)
+            {
+                struct timespec noWait={0, 0};
+                while (sigtimedwait(&sigPipe, NULL, &noWait)==-1 && errno==EINTR) {}
+            }
+            pthread_sigmask(SIG_SETMASK, &previousMask, NULL);
+            errno=error;
+        }
+        if (Ret>0)
+        {
+            flow->fill-=Ret;
+            return Ret;
+        }
+        if (Ret==-1 && (errno==EAGAIN || errno==EINTR)) return 0;
+        if (Ret==0 || errno!=EINVAL) return -1;
+        // Not supported by this descriptor, copy from now on
+        flow->spliceOut=false;
+    }
+#endif
+    // Take the next chunk from the pipe
+    if (flow->copyStart==flow->copyEnd && flow->fill>0)
+    {
+        Ret=read(flow->pipe[0], flow->copy, flow->fill<sizeof(flow->copy) ? flow->fill : sizeof(flow->copy));
+        if (Ret<=0) return -1;
+        flow->fill-=Ret;
+        flow->copyStart=0;
+        flow->copyEnd=Ret;
+    }
+    if (flow->copyStart==flow->copyEnd) return 0;
+    if (socket) Ret=send(destination, flow->copy+flow->copyStart, flow->copyEnd-flow->copyStart, MSG_NOSIGNAL);
+    else Ret=write(destination, flow->copy+flow->copyStart, flow->copyEnd-flow->copyStart);
+    if (Ret==-1) return (errno==EAGAIN || errno==EINTR) ? 0 : -1;
+    flow->copyStart+=Ret;
+    return Ret;
+}
+
+
+/*!
+    \brief      Wait for events on the ports, the clients and the listening sockets, then move
+                the data. A direction only reads its source when its pipe is empty, so a slow
+                client slows down the reading of the device (and conversely) without buffering.
+                A device that failed is checked every SERIAL_BRIDGE_RETRY_MS.
+    \param      timeOut_ms : maximum waiting time (0 = no timeout)
+    \return     >=0 number of descriptors that had events
+    \return     -1 error while waiting
+*/
+int serialBridge::run(const unsigned int timeOut_ms)
+{
+    // Wake up for the next check of a failed device
+    unsigned long long now=timeOut::monotonicTime_ns();
+    int timeout=(timeOut_ms==0) ? -1 : (int)timeOut_ms;
+    for (unsigned int i=0;i<nbPorts;i++)
+    {
+        serialBridgePort *bridged=&ports[i];
+        if (bridged->retry_ns==0) continue;
+        if (bridged->retry_ns<=now)
+        {
+            // Back (reopened by auto-reconnect, or by the application)
+            if (bridged->port->checkDevice()==1 && bridged->port->fileDescriptor()>=0)
+            {
+                bridged->serialFd=bridged->port->fileDescriptor();
+                bridged->retry_ns=0;
+                continue;
+            }
+            bridged->retry_ns=now+SERIAL_BRIDGE_RETRY_MS*1000000ULL;
+        }
+        int wait=(int)((bridged->retry_ns-now+999999)/1000000);
+        if (timeout<0 || wait<timeout) timeout=wait;
+    }
+
+    // Events wanted by each port
+    for (unsigned int i=0;i<nbPorts;i++)
+    {
+        serialBridgePort *bridged=&ports[i];
+        struct pollfd *fds=&pollFds[3*i];
+        bool connected=(bridged->clientFd!=-1);
+        bool deviceUp=(bridged->retry_ns==0);
+        fds[0].fd=bridged->listenFd;
+        fds[0].events=POLLIN;
+        // A failed device is left out (negative descriptors are ignored by poll)
+        fds[1].fd=deviceUp ? bridged->serialFd : -1;
+        fds[1].events=(short)(((connected && !bridged->clientEof && pending(&bridged->toClient)==0) ? POLLIN : 0) |
+                              (pending(&bridged->toSerial)>0 ? POLLOUT : 0));
+        // A client that closed its side is no longer polled (it would always be readable)
+        fds[2].fd=bridged->clientEof ? -1 : bridged->clientFd;
+        fds[2].events=(short)(((connected && pending(&bridged->toSerial)==0) ? POLLIN : 0) |
+                              (pending(&bridged->toClient)>0 ? POLLOUT : 0));
+        fds[0].revents=fds[1].revents=fds[2].revents=0;
+    }
+
+    int Ret=poll(pollFds, 3*nbPorts, timeout);
+    if (Ret==-1) return (errno==EINTR) ? 0 : -1;
+
+    for (unsigned int i=0;i<nbPorts;i++)
+    {
+        serialBridgePort *bridged=&ports[i];
+        struct pollfd *fds=&pollFds[3*i];
+        bool clientFailed=false;
+        bool serialFailed=false;
+
+        // Device to client
+        if ((fds[1].revents & POLLIN) && bridged->clientFd!=-1 && !bridged->clientEof)
+            if (fillFlow(&bridged->toClient, bridged->serialFd)<0) serialFailed=true;
+        if (pending(&bridged->toClient)>0 && bridged->clientFd!=-1 && !bridged->clientEof)
+        {
+            // A client that is gone (EPIPE, ECONNRESET) is closed below
+            int moved=drainFlow(&bridged->toClient, bridged->clientFd, true);
+            if (moved<0) clientFailed=true;
+            else bridged->stats.toClient+=moved;
+        }
+
+        // Client to device: at the end of file, the bytes in flight are still delivered
+        if (fds[2].revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            int moved=fillFlow(&bridged->toSerial, bridged->clientFd);
+            if (moved<0 && (fds[2].revents & POLLERR)) clientFailed=true;
+            else if (moved<0) bridged->clientEof=true;
+        }
+        if (pending(&bridged->toSerial)>0 && bridged->retry_ns==0)
+        {
+            int moved=drainFlow(&bridged->toSerial, bridged->serialFd, false);
+            if (moved<0) serialFailed=true;
+            else bridged->stats.toSerial+=moved;
+        }
+
+        // Device hung up or removed
+        if (fds[1].revents & (POLLHUP | POLLERR | POLLNVAL)) serialFailed=true;
+        if (serialFailed && bridged->retry_ns==0) deviceFailed(bridged);
+
+        // Client gone, or done once its bytes are delivered (dropped if the device is absent)
+        if (clientFailed ||
+            (bridged->clientEof && (pending(&bridged->toSerial)==0 || bridged->retry_ns!=0)))
+            closeClient(bridged);
+
+        // New client
+        if (fds[0].revents & POLLIN) acceptClient(bridged);
+    }
+    return Ret;
+}
+
+#endif
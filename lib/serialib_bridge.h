@@ -0,0 +1,133 @@
+/*!
+\file    serialib_bridge.h
+\brief   Expose serial ports on TCP or Unix-domain sockets, moving the data with splice (Unix only).
+
+Each port listens on its own socket and accepts one client at a time (other connections are
+refused while a client is connected). All the ports and their clients are served by one thread:
+
+    serialib serial;
+    serial.openDevice("/dev/ttyUSB0", 115200);
+    serialBridge bridge;
+    bridge.addTcpPort(&serial, 5000);               // or bridge.addUnixPort(&serial, "/tmp/ttyUSB0.sock");
+    while (running) bridge.run(100);
+
+On Linux, the data moves between the device and the socket through a pipe with splice(): the
+bytes are never copied to user space. When splice is not supported by the driver (or on macOS),
+the bridge falls back to read/write for that direction.
+
+While bridged, the port must not be read or written through serialib: the bytes go straight to
+the driver, so serialib's software flow control, pacing and write buffer are not applied.
+
+When the device disappears, it is removed from the poll set and checked every
+SERIAL_BRIDGE_RETRY_MS (it is reopened if auto-reconnect is enabled on the port, see
+serialib::setAutoReconnect); the client stays connected. When a client closes its side, the
+bytes it sent are delivered to the device before its connection is closed.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY CLAIM,
+DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+This is a licence-free software, it can be used by anyone who try to build a better world.
+*/
+
+
+#ifndef SERIALIB_BRIDGE_H
+#define SERIALIB_BRIDGE_H
+
+#include "serialib.h"
+
+#if defined (__linux__) || defined(__APPLE__)
+
+/*! Default maximum number of ports of a bridge */
+#define SERIAL_BRIDGE_MAX_PORTS     64
+
+/*! Size of the copy buffers used when splice is not available */
+#define SERIAL_BRIDGE_COPY_SIZE     4096
+
+/*! Delay between two checks of a device that disappeared */
+#define SERIAL_BRIDGE_RETRY_MS      100
+
+/**
+ * traffic of a bridged port
+ */
+struct SerialBridgeStats {
+    unsigned long long  toClient;           /**< bytes moved from the device to the clients */
+    unsigned long long  toSerial;           /**< bytes moved from the clients to the device */
+    unsigned long       connections;        /**< clients accepted */
+    unsigned long       refused;            /**< connections refused because a client was connected */
+    bool                connected;          /**< a client is connected */
+    bool                deviceUp;           /**< the device is usable (false while it is absent) */
+    bool                spliceFromSerial;   /**< the device is read with splice (false: read/write) */
+    bool                spliceToSerial;     /**< the device is written with splice (false: read/write) */
+};
+
+/*! One direction of a bridged port */
+struct serialBridgeFlow;
+
+/*! A bridged port */
+struct serialBridgePort;
+
+
+
+/*!  \class     serialBridge
+     \brief     Serves serial ports on TCP or Unix-domain sockets from a single thread.
+   */
+class serialBridge
+{
+public:
+
+    // Constructor of the class
+    serialBridge(unsigned int maxPorts=SERIAL_BRIDGE_MAX_PORTS);
+
+    // Destructor, close the sockets
+    ~serialBridge();
+
+    // Serve a port on a TCP socket
+    int                 addTcpPort(serialib *port, unsigned short tcpPort, const char *address="127.0.0.1");
+
+    // Serve a port on a Unix-domain socket
+    int                 addUnixPort(serialib *port, const char *path);
+
+    // Move the data between the ports and their clients (with timeout)
+    int                 run(const unsigned int timeOut_ms=0);
+
+    // Traffic of a port
+    int                 getStats(int index, SerialBridgeStats *stats);
+
+    // Close the sockets and the clients
+    void                close();
+
+private:
+    // Not copyable
+    serialBridge(const serialBridge&);
+    serialBridge& operator=(const serialBridge&);
+
+    // Register a port with its listening socket
+    int                 addPort(serialib *port, int listenFd, const char *unixPath);
+
+    // Accept or refuse a client
+    void                acceptClient(serialBridgePort *bridged);
+
+    // Close the client of a port and drop the data in flight
+    void                closeClient(serialBridgePort *bridged);
+
+    // Stop polling a device that failed, check it again later
+    void                deviceFailed(serialBridgePort *bridged);
+
+    // Move data from a descriptor to the pipe of a flow, then from the pipe to a descriptor
+    // (a socket destination never raises SIGPIPE)
+    int                 fillFlow(serialBridgeFlow *flow, int source);
+    int                 drainFlow(serialBridgeFlow *flow, int destination, bool socket);
+
+    // Ports and poll descriptors
+    serialBridgePort*   ports;
+    unsigned int        maxPorts;
+    unsigned int        nbPorts;
+    struct pollfd*      pollFds;
+};
+
+#endif
+
+#endif // SERIALIB_BRIDGE_H
@@ -0,0 +1,700 @@
+/*!
+ \file    serialib_broker.cpp
+ \brief   Source file of the classes serialBroker and serialBrokerClient.
+          Share one serial port between several processes through System V shared memory (Unix only).
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY CLAIM,
+DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+
+This is a licence-free software, it can be used by anyone who try to build a better world.
+ */
+
+#include "serialib_broker.h"
+
+#if defined (__linux__) || defined(__APPLE__)
+
+#include <limits.h>
+#include <stdio.h>
+#include <signal.h>
+#include <sys/stat.h>
+#if defined (__linux__)
+    // Futex: sleep until the broker publishes new bytes
+    #include <linux/futex.h>
+    #include <sys/syscall.h>
+#endif
+
+/*! Identifies an initialized segment */
+#define SERIAL_BROKER_MAGIC     0x5342524BU
+
+/*! Maximum length of the path of the wake-up FIFO */
+#define SERIAL_BROKER_PATH      64
+
+/*! Offset of the rings in the segment (cache line aligned) */
+#define SERIAL_BROKER_HEADER    ((sizeof(serialBrokerShared)+63)&~(size_t)63)
+
+
+
+/*!
+    \brief      Header of the shared memory segment.
+                The positions are absolute (number of bytes since the creation), the position
+                in a ring is position & (size-1). Positions are only read and written with
+                atomic operations, the bytes of the rings are published by the positions.
+*/
+struct serialBrokerShared
+{
+    // SERIAL_BROKER_MAGIC once initialized
+    uint32_t            magic;
+    // 0 when the broker is closed
+    uint32_t            alive;
+    // Size of the rings (powers of two)
+    uint32_t            rxSize;
+    uint32_t            txSize;
+
+    // Bytes received: published, and reserved (being written in the ring by the broker)
+    uint64_t            rxWritten;
+    uint64_t            rxReserved;
+    // Incremented at each publication, the clients sleep on it
+    uint32_t            rxSequence;
+    // Number of clients sleeping on rxSequence
+    uint32_t            rxWaiters;
+
+    // Serializes the clients that queue bytes to write
+    pthread_mutex_t     txLock;
+    // Bytes queued by the clients, and bytes written on the port by the broker
+    uint64_t            txWritten;
+    uint64_t            txRead;
+
+    // FIFO the clients write one byte into after queuing bytes, to wake the broker up
+    // (in a directory created by the broker with mkdtemp)
+    char                wakePath[SERIAL_BROKER_PATH];
+};
+
+
+
+//_________________________
+// ::: Shared positions :::
+
+
+// Read a position written by another process
+static inline uint64_t loadPosition(uint64_t *position)
+{
+    return __atomic_load_n(position, __ATOMIC_ACQUIRE);
+}
+
+// Publish a position to the other processes
+static inline void storePosition(uint64_t *position, uint64_t value)
+{
+    __atomic_store_n(position, value, __ATOMIC_RELEASE);
+}
+
+// Receive ring of a segment
+static inline unsigned char* rxRing(serialBrokerShared *shared)
+{
+    return (unsigned char*)shared+SERIAL_BROKER_HEADER;
+}
+
+// Transmit ring of a segment
+static inline unsigned char* txRing(serialBrokerShared *shared)
+{
+    return (unsigned char*)shared+SERIAL_BROKER_HEADER+shared->rxSize;
+}
+
+// Smallest power of two greater or equal to size
+static unsigned int roundPowerOfTwo(unsigned int size)
+{
+    unsigned int power=64;
+    while (power<size) power<<=1;
+    return power;
+}
+
+
+
+// ******************************************
+//  Class serialBroker
+// ******************************************
+
+
+/*!
+    \brief      Constructor of the class serialBroker.
+*/
+serialBroker::serialBroker()
+{
+    port=NULL;
+    shmId=-1;
+    shared=NULL;
+    wakeFd=-1;
+}
+
+
+/*!
+    \brief      Destructor of the class serialBroker. It removes the shared memory segment
+*/
+serialBroker::~serialBroker()
+{
+    close();
+}
+
+
+/*!
+    \brief      Build a System V IPC key from the path of the device, so the broker and
+                the clients agree on the key without configuration.
+    \param      device : path of the device (must exist)
+    \return     The key, or -1 if the device doesn't exist
+*/
+key_t serialBroker::keyFromDevice(const char *device)
+{
+    return ftok(device, 'S');
+}
+
+
+/*!
+    \brief      Create the shared memory segment of a port. A previous segment with the same key is
+                replaced only if it is stale: no process attached, or its creator (a broker that crashed)
+                is dead. The clients still attached to a stale segment are notified (their reads return -2).
+    \param      port : open serial port, owned by this process
+    \param      key : key of the segment (see keyFromDevice)
+    \param      rxSize : size of the receive ring (rounded up to a power of two). A client that is late
+                by more than 3/4 of the ring is overrun.
+    \param      txSize : size of the transmit ring (rounded up to a power of two), the largest message a client can queue
+    \param      mode : permissions of the segment (0600 by default: only the processes of the same user can attach,
+                use 0660 to share the port with a group). Any process that can attach can write on the port.
+    \return     1 success
+    \return     -1 the broker is already created
+    \return     -2 error while creating the shared memory segment
+    \return     -3 error while initializing the segment or the wake-up FIFO
+    \return     -4 a segment with the same key is in use (another broker runs, or the segment can't be inspected)
+*/
+int serialBroker::create(serialib *port, key_t key, unsigned int rxSize, unsigned int txSize, mode_t mode)
+{
+    if (shared!=NULL) return -1;
+    rxSize=roundPowerOfTwo(rxSize);
+    txSize=roundPowerOfTwo(txSize);
+    size_t segmentSize=SERIAL_BROKER_HEADER+rxSize+txSize;
+
+    // Remove a stale segment, never one still used
+    int oldId=shmget(key, 0, 0);
+    if (oldId!=-1)
+    {
+        struct shmid_ds status;
+        if (shmctl(oldId, IPC_STAT, &status)==-1) return -4;
+        if (status.shm_nattch>0)
+        {
+            // Attached: stale only if the broker that created it is dead
+            if (kill(status.shm_cpid, 0)==0 || errno!=ESRCH) return -4;
+            // Notify the clients left attached
+            void *address=shmat(oldId, NULL, 0);
+            if (address!=(void*)-1)
+            {
+                serialBrokerShared *old=(serialBrokerShared*)address;
+                if (__atomic_load_n(&old->magic, __ATOMIC_ACQUIRE)==SERIAL_BROKER_MAGIC)
+                {
+                    __atomic_store_n(&old->alive, 0, __ATOMIC_RELEASE);
+                    __atomic_add_fetch(&old->rxSequence, 1, __ATOMIC_RELEASE);
+#if defined (__linux__)
+                    syscall(SYS_futex, &old->rxSequence, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+                }
+                shmdt(address);
+            }
+        }
+        if (shmctl(oldId, IPC_RMID, NULL)==-1) return -4;
+    }
+
+    // Create and map the segment
+    shmId=shmget(key, segmentSize, IPC_CREAT | IPC_EXCL | (mode & 0666));
+    if (shmId==-1) return -2;
+    void *address=shmat(shmId, NULL, 0);
+    if (address==(void*)-1)
+    {
+        shmctl(shmId, IPC_RMID, NULL);
+        shmId=-1;
+        return -2;
+    }
+    shared=(serialBrokerShared*)address;
+
+    // Initialize the header
+    memset(shared, 0, SERIAL_BROKER_HEADER);
+    shared->rxSize=rxSize;
+    shared->txSize=txSize;
+    shared->alive=1;
+
+    // The lock is shared between processes, and recovered if a client dies while holding it
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+#if defined (__linux__)
+    pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+#endif
+    int Ret=pthread_mutex_init(&shared->txLock, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+    if (Ret!=0)
+    {
+        close();
+        return -3;
+    }
+
+    // Wake-up FIFO in a new directory with a random name, so no other user can create it
+    // in advance. The directory can be searched by the users allowed to attach
+    char directory[]="/tmp/serialib-broker-XXXXXX";
+    if (mkdtemp(directory)==NULL)
+    {
+        close();
+        return -3;
+    }
+    chmod(directory, 0700 | ((mode & 0060) ? 0010 : 0) | ((mode & 0006) ? 0001 : 0));
+    snprintf(shared->wakePath, SERIAL_BROKER_PATH, "%s/wake", directory);
+    if (mkfifo(shared->wakePath, mode & 0666)==-1)
+    {
+        rmdir(directory);
+        shared->wakePath[0]=0;
+        close();
+        return -3;
+    }
+    // Opened for reading and writing, so it never reports end of file when no client is attached
+    wakeFd=open(shared->wakePath, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (wakeFd==-1 || fchmod(wakeFd, mode & 0666)==-1)
+    {
+        close();
+        return -3;
+    }
+
+    // The segment can be used by the clients
+    this->port=port;
+    __atomic_store_n(&shared->magic, SERIAL_BROKER_MAGIC, __ATOMIC_RELEASE);
+    return 1;
+}
+
+
+/*!
+    \brief      Wait for received bytes (with timeout) and publish them to the clients, while writing
+                on the port the bytes queued by the clients as soon as they are queued. Must be called in a loop.
+                The bytes are read from the port directly into the shared ring (no copy).
+    \param      timeOut_ms : maximum waiting time for received bytes (0 = no timeout)
+    \return     >=0 number of bytes published
+    \return     -1 the broker is not created
+    \return     -2 error while writing on the port
+    \return     -3 error while reading the port
+*/
+int serialBroker::pump(const unsigned int timeOut_ms)
+{
+    if (shared==NULL) return -1;
+    unsigned long long deadline=timeOut::monotonicTime_ns()+timeOut_ms*1000000ULL;
+    int Ret;
+    while (true)
+    {
+        // Transmit the bytes queued by the clients
+        if (transmit()<0) return -2;
+
+        // Bytes already received (possibly in the buffer of serialib, not seen by poll)
+        if (port->available()>0) break;
+
+        // Wait for the port, or for a client that queues bytes
+        int timeout=-1;
+        if (timeOut_ms>0)
+        {
+            unsigned long long now=timeOut::monotonicTime_ns();
+            if (now>=deadline) return 0;
+            timeout=(int)((deadline-now+999999)/1000000);
+        }
+        struct pollfd fds[2];
+        fds[0].fd=port->fileDescriptor();
+        fds[0].events=POLLIN;
+        fds[1].fd=wakeFd;
+        fds[1].events=POLLIN;
+        Ret=poll(fds, 2, timeout);
+        if (Ret<0 && errno!=EINTR) return -3;
+        if (Ret<=0) continue;
+
+        // Empty the FIFO, the queued bytes are sent at the next iteration
+        if (fds[1].revents & POLLIN)
+        {
+            char wake[64];
+            while (read(wakeFd, wake, sizeof(wake))>0) {}
+        }
+        if (fds[0].revents) break;
+    }
+
+    // Reserve a contiguous part of the ring (a quarter at most, so late clients can be detected)
+    uint64_t written=shared->rxWritten;
+    unsigned int offset=(unsigned int)(written & (shared->rxSize-1));
+    unsigned int space=shared->rxSize-offset;
+    if (space>shared->rxSize/4) space=shared->rxSize/4;
+    storePosition(&shared->rxReserved, written+space);
+    // The reservation must be visible before the bytes are overwritten
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    // Receive directly in the ring (the bytes are available, the timeout only covers
+    // received bytes that are all flow control characters)
+    Ret=port->readAvailable(rxRing(shared)+offset, space, 1);
+    if (Ret<0) return -3;
+    if (Ret==0) return 0;
+
+    // Publish the bytes and wake up the clients
+    storePosition(&shared->rxWritten, written+Ret);
+    __atomic_add_fetch(&shared->rxSequence, 1, __ATOMIC_RELEASE);
+#if defined (__linux__)
+    if (__atomic_load_n(&shared->rxWaiters, __ATOMIC_ACQUIRE)>0)
+        syscall(SYS_futex, &shared->rxSequence, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+    return Ret;
+}
+
+
+/*!
+    \brief      Write on the port the bytes queued by the clients
+    \return     1 success
+    \return     -1 error while writing on the port
+*/
+int serialBroker::transmit()
+{
+    uint64_t txWritten=loadPosition(&shared->txWritten);
+    uint64_t txRead=shared->txRead;
+    while (txRead<txWritten)
+    {
+        unsigned int offset=(unsigned int)(txRead & (shared->txSize-1));
+        unsigned int nbBytes=shared->txSize-offset;
+        if (nbBytes>txWritten-txRead) nbBytes=(unsigned int)(txWritten-txRead);
+        if (port->writeBytes(txRing(shared)+offset, nbBytes)!=1) return -1;
+        txRead+=nbBytes;
+        storePosition(&shared->txRead, txRead);
+    }
+    return 1;
+}
+
+
+/*!
+    \brief      Remove the shared memory segment. The clients are notified (their reads return -2),
+                the memory is released when the last client detaches.
+*/
+void serialBroker::close()
+{
+    if (shared!=NULL)
+    {
+        // Notify the clients
+        __atomic_store_n(&shared->alive, 0, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&shared->rxSequence, 1, __ATOMIC_RELEASE);
+#if defined (__linux__)
+        syscall(SYS_futex, &shared->rxSequence, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+        // The clients attached keep their descriptor of the FIFO
+        if (shared->wakePath[0]!=0)
+        {
+            unlink(shared->wakePath);
+            *strrchr(shared->wakePath, '/')=0;
+            rmdir(shared->wakePath);
+        }
+        shmdt(shared);
+        shared=NULL;
+    }
+    if (wakeFd!=-1)
+    {
+        ::close(wakeFd);
+        wakeFd=-1;
+    }
+    if (shmId!=-1)
+    {
+        shmctl(shmId, IPC_RMID, NULL);
+        shmId=-1;
+    }
+    port=NULL;
+}
+
+
+
+
+// ******************************************
+//  Class serialBrokerClient
+// ******************************************
+
+
+/*!
+    \brief      Constructor of the class serialBrokerClient.
+*/
+serialBrokerClient::serialBrokerClient()
+{
+    shared=NULL;
+    wakeFd=-1;
+    cursor=0;
+}
+
+
+/*!
+    \brief      Destructor of the class serialBrokerClient. It detaches from the shared memory
+*/
+serialBrokerClient::~serialBrokerClient()
+{
+    detach();
+}
+
+
+/*!
+    \brief      Attach to the shared memory segment of a broker.
+                The client receives the bytes published after this call.
+    \param      key : key of the segment (see serialBroker::keyFromDevice)
+    \return     1 success
+    \return     -1 the client is already attached
+    \return     -2 no broker for this key
+    \return     -3 the segment is not a broker segment, or the broker is closed
+    \return     -4 error while opening the wake-up FIFO of the broker, or it is not a FIFO
+                of the user who created the segment
+*/
+int serialBrokerClient::attach(key_t key)
+{
+    if (shared!=NULL) return -1;
+
+    // Map the segment
+    int shmId=shmget(key, 0, 0);
+    if (shmId==-1) return -2;
+    void *address=shmat(shmId, NULL, 0);
+    if (address==(void*)-1) return -2;
+    shared=(serialBrokerShared*)address;
+
+    // Check the segment
+    if (__atomic_load_n(&shared->magic, __ATOMIC_ACQUIRE)!=SERIAL_BROKER_MAGIC ||
+        __atomic_load_n(&shared->alive, __ATOMIC_ACQUIRE)==0)
+    {
+        detach();
+        return -3;
+    }
+
+    // Open the wake-up FIFO for reading and writing: a write never raises SIGPIPE, even
+    // if the broker crashed (this client never reads it)
+    char wakePath[SERIAL_BROKER_PATH];
+    memcpy(wakePath, shared->wakePath, SERIAL_BROKER_PATH);
+    wakePath[SERIAL_BROKER_PATH-1]=0;
+    wakeFd=open(wakePath, O_RDWR | O_NONBLOCK | O_CLOEXEC | O_NOFOLLOW);
+    // Only write into a FIFO created by the user who created the segment
+    struct stat fifoStatus;
+    struct shmid_ds segmentStatus;
+    if (wakeFd==-1 || fstat(wakeFd, &fifoStatus)==-1 || !S_ISFIFO(fifoStatus.st_mode) ||
+        shmctl(shmId, IPC_STAT, &segmentStatus)==-1 || fifoStatus.st_uid!=segmentStatus.shm_perm.cuid)
+    {
+        detach();
+        return -4;
+    }
+
+    // Start with the next bytes received
+    cursor=loadPosition(&shared->rxWritten);
+    return 1;
+}
+
+
+/*!
+    \brief      Detach from the shared memory segment
+*/
+void serialBrokerClient::detach()
+{
+    if (wakeFd!=-1)
+    {
+        close(wakeFd);
+        wakeFd=-1;
+    }
+    if (shared==NULL) return;
+    shmdt(shared);
+    shared=NULL;
+}
+
+
+/*!
+    \brief      Return the number of bytes received by the broker and not read yet by this client
+    \return     The number of bytes available (may exceed the ring size if the client is overrun)
+*/
+unsigned int serialBrokerClient::available()
+{
+    if (shared==NULL) return 0;
+    return (unsigned int)(loadPosition(&shared->rxWritten)-cursor);
+}
+
+
+/*!
+    \brief      Wait until bytes are available after the cursor
+    \param      timeOut_ms : maximum waiting time (0 = no timeout)
+    \return     1 bytes are available
+    \return     0 timeout reached
+    \return     -1 the client is not attached
+    \return     -2 the broker is closed
+*/
+int serialBrokerClient::waitData(const unsigned int timeOut_ms)
+{
+    if (shared==NULL) return -1;
+    unsigned long long deadline=timeOut::monotonicTime_ns()+timeOut_ms*1000000ULL;
+    while (true)
+    {
+        // Sequence before checking, so a publication between the check and the sleep wakes us up
+        uint32_t sequence=__atomic_load_n(&shared->rxSequence, __ATOMIC_ACQUIRE);
+        if (loadPosition(&shared->rxWritten)!=cursor) return 1;
+        if (__atomic_load_n(&shared->alive, __ATOMIC_ACQUIRE)==0) return -2;
+
+        // Remaining time
+        unsigned long long now=timeOut::monotonicTime_ns();
+        if (timeOut_ms>0 && now>=deadline) return 0;
+#if defined (__linux__)
+        // Sleep until the next publication
+        struct timespec timeout, *pTimeout=NULL;
+        if (timeOut_ms>0)
+        {
+            timeout.tv_sec=(deadline-now)/1000000000ULL;
+            timeout.tv_nsec=(deadline-now)%1000000000ULL;
+            pTimeout=&timeout;
+        }
+        __atomic_add_fetch(&shared->rxWaiters, 1, __ATOMIC_ACQ_REL);
+        syscall(SYS_futex, &shared->rxSequence, FUTEX_WAIT, sequence, pTimeout, NULL, 0);
+        __atomic_sub_fetch(&shared->rxWaiters, 1, __ATOMIC_ACQ_REL);
+#else
+        // No futex, suspend the loop to avoid charging the CPU
+        UNUSED(sequence);
+        usleep(100);
+#endif
+    }
+}
+
+
+/*!
+    \brief      Copy the next received bytes (with timeout)
+    \param      buffer : array of bytes read
+    \param      maxNbBytes : maximum allowed number of bytes read
+    \param      timeOut_ms : maximum waiting time for the first byte (0 = no timeout)
+    \return     >0 number of bytes read
+    \return     0 timeout reached
+    \return     -1 the client is not attached
+    \return     -2 the broker is closed
+    \return     -3 the client is overrun: bytes were lost, the next read starts with the oldest bytes available
+*/
+int serialBrokerClient::read(void *buffer, unsigned int maxNbBytes, const unsigned int timeOut_ms)
+{
+    const unsigned char *data;
+    unsigned int nbRead=0;
+    // Copy up to two contiguous parts (end and beginning of the ring)
+    while (nbRead<maxNbBytes)
+    {
+        int Ret=peek(&data, (nbRead==0) ? timeOut_ms : 1);
+        if (Ret<0) return Ret;
+        if (Ret==0) break;
+        unsigned int nbBytes=maxNbBytes-nbRead;
+        if (nbBytes>(unsigned int)Ret) nbBytes=Ret;
+        memcpy((unsigned char*)buffer+nbRead, data, nbBytes);
+        // Check the bytes were not overwritten during the copy
+        Ret=consume(nbBytes);
+        if (Ret<0) return Ret;
+        nbRead+=nbBytes;
+        if (available()==0) break;
+    }
+    return nbRead;
+}
+
+
+/*!
+    \brief      Access the next received bytes directly in the shared ring (no copy).
+                The bytes may be overwritten by the broker if the client is late: consume
+                reports it, the data must be discarded when consume returns -3.
+    \param      data : pointer to the first byte available
+    \param      timeOut_ms : maximum waiting time for the first byte (0 = no timeout)
+    \return     >0 number of contiguous bytes available at data
+    \return     0 timeout reached
+    \return     -1 the client is not attached
+    \return     -2 the broker is closed
+    \return     -3 the client is overrun: bytes were lost, the next call starts with the oldest bytes available
+*/
+int serialBrokerClient::peek(const unsigned char **data, const unsigned int timeOut_ms)
+{
+    int Ret=waitData(timeOut_ms);
+    if (Ret<=0) return Ret;
+
+    // Check the client is not late by more than the ring
+    uint64_t written=loadPosition(&shared->rxWritten);
+    uint64_t reserved=loadPosition(&shared->rxReserved);
+    if (reserved-cursor>shared->rxSize)
+    {
+        cursor=reserved-shared->rxSize;
+        return -3;
+    }
+
+    // Contiguous bytes until the end of the ring
+    unsigned int offset=(unsigned int)(cursor & (shared->rxSize-1));
+    unsigned int nbBytes=shared->rxSize-offset;
+    if (nbBytes>written-cursor) nbBytes=(unsigned int)(written-cursor);
+    *data=rxRing(shared)+offset;
+    return nbBytes;
+}
+
+
+/*!
+    \brief      Release the bytes accessed with peek, and check they were not overwritten
+    \param      nbBytes : number of bytes released
+    \return     nbBytes success
+    \return     -1 the client is not attached
+    \return     -3 the bytes were overwritten by the broker while they were used, the next
+                call starts with the oldest bytes available
+*/
+int serialBrokerClient::consume(unsigned int nbBytes)
+{
+    if (shared==NULL) return -1;
+    // The bytes must be read before the reservation is checked
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uint64_t reserved=loadPosition(&shared->rxReserved);
+    if (reserved-cursor>shared->rxSize)
+    {
+        cursor=reserved-shared->rxSize;
+        return -3;
+    }
+    cursor+=nbBytes;
+    return nbBytes;
+}
+
+
+/*!
+    \brief      Queue bytes to be written on the port by the broker. The bytes of one call
+                are never interleaved with the bytes of another client.
+    \param      buffer : array of bytes to write
+    \param      nbBytes : number of bytes to write
+    \return     nbBytes success
+    \return     0 not enough room in the transmit ring, retry later
+    \return     -1 the client is not attached
+    \return     -2 the broker is closed
+    \return     -3 nbBytes is larger than the transmit ring
+*/
+int serialBrokerClient::write(const void *buffer, unsigned int nbBytes)
+{
+    if (shared==NULL) return -1;
+    if (__atomic_load_n(&shared->alive, __ATOMIC_ACQUIRE)==0) return -2;
+    if (nbBytes>shared->txSize) return -3;
+
+    // One client at a time
+    int Ret=pthread_mutex_lock(&shared->txLock);
+#if defined (__linux__)
+    // A client died while holding the lock, the positions are consistent (published last)
+    if (Ret==EOWNERDEAD) pthread_mutex_consistent(&shared->txLock);
+    else
+#endif
+    if (Ret!=0) return -1;
+
+    // Check the room left
+    uint64_t txWritten=shared->txWritten;
+    uint64_t txRead=loadPosition(&shared->txRead);
+    if (shared->txSize-(txWritten-txRead)<nbBytes)
+    {
+        pthread_mutex_unlock(&shared->txLock);
+        return 0;
+    }
+
+    // Copy up to two contiguous parts, then publish
+    unsigned int offset=(unsigned int)(txWritten & (shared->txSize-1));
+    unsigned int first=shared->txSize-offset;
+    if (first>nbBytes) first=nbBytes;
+    memcpy(txRing(shared)+offset, buffer, first);
+    memcpy(txRing(shared), (const unsigned char*)buffer+first, nbBytes-first);
+    storePosition(&shared->txWritten, txWritten+nbBytes);
+
+    pthread_mutex_unlock(&shared->txLock);
+
+    // Wake the broker up (a full FIFO means a wake-up is already pending)
+    char wake=0;
+    if (::write(wakeFd, &wake, 1)<0) {}
+    return nbBytes;
+}
+
+#endif
@@ -0,0 +1,167 @@
+/*!
+\file    serialib_broker.h
+\brief   Share one serial port between several processes through System V shared memory (Unix only).
+
+The process that owns the port runs a serialBroker: received bytes are published in a
+shared ring buffer, and bytes queued by the other processes are written on the port.
+The other processes attach a serialBrokerClient with the same key: each client has its
+own read cursor and can read the stream in place (peek/consume) without copy.
+
+    // Owner process
+    serialib serial;
+    serial.openDevice("/dev/ttyUSB0", 115200);
+    serialBroker broker;
+    broker.create(&serial, serialBroker::keyFromDevice("/dev/ttyUSB0"));
+    while (running) broker.pump(10);
+
+    // Any other process
+    serialBrokerClient client;
+    client.attach(serialBroker::keyFromDevice("/dev/ttyUSB0"));
+    int n = client.read(buffer, sizeof(buffer), 100);
+    client.write("AT\r", 3);
+
+A client that queues bytes wakes the broker up through a FIFO (created by the broker in a
+private directory made with mkdtemp, its path is published in the segment), so pump sends
+them at once even while it waits for received bytes.
+
+The broker never waits for the clients: a client that reads too slowly is overrun and
+notified (-3), it resumes with the oldest bytes still available.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY CLAIM,
+DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+This is a licence-free software, it can be used by anyone who try to build a better world.
+*/
+
+
+#ifndef SERIALIB_BROKER_H
+#define SERIALIB_BROKER_H
+
+#include "serialib.h"
+
+#if defined (__linux__) || defined(__APPLE__)
+
+#include <stdint.h>
+#include <sys/ipc.h>
+#include <sys/types.h>
+
+/*! Default size of the shared receive ring (bytes) */
+#define SERIAL_BROKER_RX_SIZE   65536
+
+/*! Default size of the shared transmit ring (bytes) */
+#define SERIAL_BROKER_TX_SIZE   4096
+
+/*! Default permissions of the shared memory segment (owner only) */
+#define SERIAL_BROKER_MODE      0600
+
+/*! Header of the shared memory segment (followed by the receive and the transmit rings) */
+struct serialBrokerShared;
+
+
+
+/*!  \class     serialBroker
+     \brief     Publishes the bytes received on a serial port in shared memory,
+                and writes on the port the bytes queued by the clients.
+   */
+class serialBroker
+{
+public:
+
+    // Constructor of the class
+    serialBroker();
+
+    // Destructor, remove the shared memory segment
+    ~serialBroker();
+
+    // Create the shared memory segment for an open port
+    int                 create(serialib *port, key_t key,
+                               unsigned int rxSize=SERIAL_BROKER_RX_SIZE,
+                               unsigned int txSize=SERIAL_BROKER_TX_SIZE,
+                               mode_t mode=SERIAL_BROKER_MODE);
+
+    // Move data between the port and the shared memory (with timeout)
+    int                 pump(const unsigned int timeOut_ms=0);
+
+    // Remove the shared memory segment (the clients are notified)
+    void                close();
+
+    // Build a key from the path of the device
+    static key_t        keyFromDevice(const char *device);
+
+private:
+    // Not copyable
+    serialBroker(const serialBroker&);
+    serialBroker& operator=(const serialBroker&);
+
+    // Write on the port the bytes queued by the clients
+    int                 transmit();
+
+    // Port and shared memory segment
+    serialib*           port;
+    int                 shmId;
+    serialBrokerShared* shared;
+
+    // FIFO written by the clients when they queue bytes
+    int                 wakeFd;
+};
+
+
+
+/*!  \class     serialBrokerClient
+     \brief     Reads the bytes published by a serialBroker and queues bytes to write on its port.
+   */
+class serialBrokerClient
+{
+public:
+
+    // Constructor of the class
+    serialBrokerClient();
+
+    // Destructor, detach from the shared memory
+    ~serialBrokerClient();
+
+    // Attach to the shared memory segment of a broker
+    int                 attach(key_t key);
+
+    // Detach from the shared memory segment
+    void                detach();
+
+    // Copy the next received bytes (with timeout)
+    int                 read(void *buffer, unsigned int maxNbBytes, const unsigned int timeOut_ms=0);
+
+    // Access the next received bytes in the shared ring, without copy (with timeout)
+    int                 peek(const unsigned char **data, const unsigned int timeOut_ms=0);
+
+    // Release the bytes accessed with peek
+    int                 consume(unsigned int nbBytes);
+
+    // Queue bytes to be written on the port by the broker
+    int                 write(const void *buffer, unsigned int nbBytes);
+
+    // Number of bytes received and not read yet by this client
+    unsigned int        available();
+
+private:
+    // Not copyable
+    serialBrokerClient(const serialBrokerClient&);
+    serialBrokerClient& operator=(const serialBrokerClient&);
+
+    // Wait until bytes are available after the cursor
+    int                 waitData(const unsigned int timeOut_ms);
+
+    // Shared memory segment
+    serialBrokerShared* shared;
+
+    // FIFO that wakes the broker up
+    int                 wakeFd;
+
+    // Position of this client in the received stream
+    uint64_t            cursor;
+};
+
+#endif
+
+#endif // SERIALIB_BROKER_H
@@ -0,0 +1,516 @@
+/*!
+ \file    serialib_decoder.cpp
+ \brief   Source file of the class serialDecoder.
+          Bulk decoder of fixed-size binary records into one array per channel.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY CLAIM,
+DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+
+This is a licence-free software, it can be used by anyone who try to build a better world.
+ */
+
+#include "serialib_decoder.h"
+#include <string.h>
+
+#if defined (__SSE2__) || defined (_M_X64) || (defined (_M_IX86_FP) && _M_IX86_FP>=2)
+    // Conversion of 8 channels values at once
+    #include <emmintrin.h>
+    #define SERIAL_DECODER_SSE2
+#endif
+
+
+// Read a 16-bit value in the native byte order (unaligned)
+static inline uint16_t load16(const unsigned char *data)
+{
+    uint16_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+
+// Read a 16-bit value in the byte order of the records
+static inline uint16_t read16(const unsigned char *data, bool bigEndian)
+{
+    return bigEndian ? (uint16_t)((data[0]<<8) | data[1]) : (uint16_t)(data[0] | (data[1]<<8));
+}
+
+
+// The records are in the native byte order
+static inline bool nativeOrder(bool bigEndian)
+{
+    const uint16_t one=1;
+    return (*(const unsigned char*)&one==1) ? !bigEndian : bigEndian;
+}
+
+
+#if defined (SERIAL_DECODER_SSE2)
+// Load 8 consecutive channels of 8 records (one load per record) and transpose them:
+// values[k] receives the channel k of the 8 records
+static inline void loadBlock(const unsigned char *const *records, unsigned int position, bool swap, __m128i *values)
+{
+    __m128i r0=_mm_loadu_si128((const __m128i*)(records[0]+position));
+    __m128i r1=_mm_loadu_si128((const __m128i*)(records[1]+position));
+    __m128i r2=_mm_loadu_si128((const __m128i*)(records[2]+position));
+    __m128i r3=_mm_loadu_si128((const __m128i*)(records[3]+position));
+    __m128i r4=_mm_loadu_si128((const __m128i*)(records[4]+position));
+    __m128i r5=_mm_loadu_si128((const __m128i*)(records[5]+position));
+    __m128i r6=_mm_loadu_si128((const __m128i*)(records[6]+position));
+    __m128i r7=_mm_loadu_si128((const __m128i*)(records[7]+position));
+
+    // Pairs of records, then groups of 4, then 8 (8x8 transpose of 16-bit values)
+    __m128i a0=_mm_unpacklo_epi16(r0, r1), a1=_mm_unpackhi_epi16(r0, r1);
+    __m128i a2=_mm_unpacklo_epi16(r2, r3), a3=_mm_unpackhi_epi16(r2, r3);
+    __m128i a4=_mm_unpacklo_epi16(r4, r5), a5=_mm_unpackhi_epi16(r4, r5);
+    __m128i a6=_mm_unpacklo_epi16(r6, r7), a7=_mm_unpackhi_epi16(r6, r7);
+    __m128i b0=_mm_unpacklo_epi32(a0, a2), b1=_mm_unpackhi_epi32(a0, a2);
+    __m128i b2=_mm_unpacklo_epi32(a1, a3), b3=_mm_unpackhi_epi32(a1, a3);
+    __m128i b4=_mm_unpacklo_epi32(a4, a6), b5=_mm_unpackhi_epi32(a4, a6);
+    __m128i b6=_mm_unpacklo_epi32(a5, a7), b7=_mm_unpackhi_epi32(a5, a7);
+    values[0]=_mm_unpacklo_epi64(b0, b4);
+    values[1]=_mm_unpackhi_epi64(b0, b4);
+    values[2]=_mm_unpacklo_epi64(b1, b5);
+    values[3]=_mm_unpackhi_epi64(b1, b5);
+    values[4]=_mm_unpacklo_epi64(b2, b6);
+    values[5]=_mm_unpackhi_epi64(b2, b6);
+    values[6]=_mm_unpacklo_epi64(b3, b7);
+    values[7]=_mm_unpackhi_epi64(b3, b7);
+
+    if (swap)
+        for (int k=0;k<8;k++) values[k]=_mm_or_si128(_mm_slli_epi16(values[k], 8), _mm_srli_epi16(values[k], 8));
+}
+
+
+// Sign-extend 8 values, convert them to float, scale them and store them
+static inline void storeScaled(float *column, __m128i values, __m128 factor, __m128 shift)
+{
+    __m128i low=_mm_srai_epi32(_mm_unpacklo_epi16(values, values), 16);
+    __m128i high=_mm_srai_epi32(_mm_unpackhi_epi16(values, values), 16);
+    _mm_storeu_ps(column, _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(low), factor), shift));
+    _mm_storeu_ps(column+4, _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(high), factor), shift));
+}
+#endif
+
+
+
+// ******************************************
+//  Class serialDecoder
+// ******************************************
+
+
+/*!
+    \brief      Constructor of the class serialDecoder
+    \param      format : layout of the records
+    \param      maxRecords : maximum number of records decoded per call
+*/
+serialDecoder::serialDecoder(const SerialRecordFormat &format, unsigned int maxRecords)
+{
+    this->format=format;
+    // Size of a record, 0 if the format is invalid
+    size=0;
+    if (format.syncSize>=1 && format.syncSize<=4 && format.nbChannels<=SERIAL_DECODER_MAX_CHANNELS)
+    {
+        size=format.syncSize+2*format.nbChannels;
+        if (format.checksum==SERIAL_RECORD_SUM8 || format.checksum==SERIAL_RECORD_XOR8) size+=1;
+        if (format.checksum==SERIAL_RECORD_SUM16 || format.checksum==SERIAL_RECORD_CRC16) size+=2;
+    }
+    // Raw values until setScale is called
+    for (unsigned int i=0;i<SERIAL_DECODER_MAX_CHANNELS;i++)
+    {
+        scale[i]=1;
+        offset[i]=0;
+    }
+    capacity=maxRecords;
+    records=new const unsigned char*[maxRecords];
+    synchronized=false;
+    stats=SerialDecoderStats();
+}
+
+
+/*!
+    \brief      Destructor of the class serialDecoder
+*/
+serialDecoder::~serialDecoder()
+{
+    delete[] records;
+}
+
+
+/*!
+    \brief      Size of a record: sync word, channels and checksum
+    \return     The size of a record in bytes, 0 if the format is invalid
+*/
+unsigned int serialDecoder::recordSize()
+{
+    return size;
+}
+
+
+/*!
+    \brief      Set the conversion of a channel to float: value*scale+offset (default 1 and 0)
+    \param      channel : index of the channel
+    \param      scale : factor applied to the raw value
+    \param      offset : added after the scaling
+*/
+void serialDecoder::setScale(unsigned int channel, float scale, float offset)
+{
+    if (channel>=SERIAL_DECODER_MAX_CHANNELS) return;
+    this->scale[channel]=scale;
+    this->offset[channel]=offset;
+}
+
+
+/*!
+    \brief      Get the statistics of the decoder
+    \param      stats : records decoded, checksum errors, losses of synchronization and bytes skipped
+    \param      reset : restart the statistics after reading them
+*/
+void serialDecoder::getStats(SerialDecoderStats *stats, bool reset)
+{
+    *stats=this->stats;
+    if (reset) this->stats=SerialDecoderStats();
+}
+
+
+/*!
+    \brief      Check the sync word and the checksum of a record
+    \param      record : first byte of the record (size bytes available)
+    \return     true if the record is valid
+*/
+bool serialDecoder::checkRecord(const unsigned char *record)
+{
+    if (memcmp(record, format.sync, format.syncSize)!=0) return false;
+
+    // Bytes covered by the checksum, and checksum
+    const unsigned char *data=format.checksumSync ? record : record+format.syncSize;
+    const unsigned char *end=record+format.syncSize+2*format.nbChannels;
+    unsigned int sum=0;
+    switch (format.checksum)
+    {
+    case SERIAL_RECORD_SUM8:
+        while (data<end) sum+=*data++;
+        return (unsigned char)sum==end[0];
+    case SERIAL_RECORD_XOR8:
+        while (data<end) sum^=*data++;
+        return (unsigned char)sum==end[0];
+    case SERIAL_RECORD_SUM16:
+        while (data<end) sum+=*data++;
+        return (uint16_t)sum==read16(end, format.bigEndian);
+    case SERIAL_RECORD_CRC16:
+        sum=0xFFFF;
+        while (data<end)
+        {
+            sum^=(*data++)<<8;
+            for (int bit=0;bit<8;bit++) sum=(sum & 0x8000) ? (sum<<1)^0x1021 : sum<<1;
+        }
+        return (uint16_t)sum==read16(end, format.bigEndian);
+    default:
+        return true;
+    }
+}
+
+
+/*!
+    \brief      Find the valid records at the beginning of a buffer. After a corrupted record,
+                the bytes are skipped up to the next occurrence of the first sync byte (found
+                with memchr) and the search goes on from there.
+    \param      data : received bytes
+    \param      size : number of bytes
+    \param      maxRecords : maximum number of records to find
+    \param      consumed : number of bytes used (valid records and skipped bytes), an
+                incomplete record at the end is not consumed
+    \return     The number of valid records, their addresses are in records
+*/
+unsigned int serialDecoder::scan(const unsigned char *data, unsigned int size, unsigned int maxRecords, unsigned int *consumed)
+{
+    unsigned int nbRecords=0;
+    unsigned int position=0;
+    while (nbRecords<maxRecords && size-position>=this->size)
+    {
+        const unsigned char *record=data+position;
+        if (checkRecord(record))
+        {
+            records[nbRecords++]=record;
+            position+=this->size;
+            synchronized=true;
+            continue;
+        }
+
+        // Corrupted record: look for the next sync word
+        if (memcmp(record, format.sync, format.syncSize)==0) stats.checksumErrors++;
+        if (synchronized) stats.resyncs++;
+        synchronized=false;
+        const unsigned char *next=(const unsigned char*)memchr(record+1, format.sync[0], size-position-1);
+        unsigned int skip=(next==NULL) ? size-position : (unsigned int)(next-record);
+        position+=skip;
+        stats.skippedBytes+=skip;
+    }
+    stats.records+=nbRecords;
+    *consumed=position;
+    return nbRecords;
+}
+
+
+/*!
+    \brief      Write the channels of the records found by scan to the int16 columns, by blocks
+                of 8 channels and 8 records (one 16-byte load per record, transposed in registers),
+                then the remaining channels one after the other
+    \param      nbRecords : number of records
+    \param      columns : one array per channel (NULL to skip a channel)
+*/
+void serialDecoder::extract(unsigned int nbRecords, int16_t *const *columns)
+{
+    bool swap=!nativeOrder(format.bigEndian);
+    unsigned int first=0;
+#if defined (SERIAL_DECODER_SSE2)
+    // The 16-byte loads stay inside the channels of the records
+    unsigned int blocks=nbRecords & ~7U;
+    for (;first+8<=format.nbChannels;first+=8)
+    {
+        unsigned int position=format.syncSize+2*first;
+        __m128i values[8];
+        for (unsigned int i=0;i<blocks;i+=8)
+        {
+            loadBlock(records+i, position, swap, values);
+            for (unsigned int k=0;k<8;k++)
+                if (columns[first+k]!=NULL) _mm_storeu_si128((__m128i*)(columns[first+k]+i), values[k]);
+        }
+        // Last records
+        for (unsigned int k=0;k<8;k++)
+        {
+            if (columns[first+k]==NULL) continue;
+            for (unsigned int i=blocks;i<nbRecords;i++)
+                columns[first+k][i]=(int16_t)read16(records[i]+position+2*k, format.bigEndian);
+        }
+    }
+#endif
+    for (unsigned int channel=first;channel<format.nbChannels;channel++)
+    {
+        int16_t *column=columns[channel];
+        if (column==NULL) continue;
+        unsigned int position=format.syncSize+2*channel;
+        unsigned int i=0;
+#if defined (SERIAL_DECODER_SSE2)
+        // Remaining channels: gather 8 values, swap their bytes in one instruction
+        for (;i+8<=nbRecords;i+=8)
+        {
+            __m128i values=_mm_set_epi16(load16(records[i+7]+position), load16(records[i+6]+position),
+                                         load16(records[i+5]+position), load16(records[i+4]+position),
+                                         load16(records[i+3]+position), load16(records[i+2]+position),
+                                         load16(records[i+1]+position), load16(records[i]+position));
+            if (swap) values=_mm_or_si128(_mm_slli_epi16(values, 8), _mm_srli_epi16(values, 8));
+            _mm_storeu_si128((__m128i*)(column+i), values);
+        }
+#endif
+        for (;i<nbRecords;i++)
+            column[i]=(int16_t)read16(records[i]+position, format.bigEndian);
+    }
+}
+
+
+/*!
+    \brief      Write the channels of the records found by scan to the float columns
+                (value*scale+offset), by blocks of 8 channels and 8 records, then the remaining
+                channels one after the other (see the int16 version)
+    \param      nbRecords : number of records
+    \param      columns : one array per channel (NULL to skip a channel)
+*/
+void serialDecoder::extract(unsigned int nbRecords, float *const *columns)
+{
+    bool swap=!nativeOrder(format.bigEndian);
+    unsigned int first=0;
+#if defined (SERIAL_DECODER_SSE2)
+    // The 16-byte loads stay inside the channels of the records
+    unsigned int blocks=nbRecords & ~7U;
+    for (;first+8<=format.nbChannels;first+=8)
+    {
+        unsigned int position=format.syncSize+2*first;
+        __m128 factor[8], shift[8];
+        for (unsigned int k=0;k<8;k++)
+        {
+            factor[k]=_mm_set1_ps(scale[first+k]);
+            shift[k]=_mm_set1_ps(offset[first+k]);
+        }
+        __m128i values[8];
+        for (unsigned int i=0;i<blocks;i+=8)
+        {
+            loadBlock(records+i, position, swap, values);
+            for (unsigned int k=0;k<8;k++)
+                if (columns[first+k]!=NULL) storeScaled(columns[first+k]+i, values[k], factor[k], shift[k]);
+        }
+        // Last records
+        for (unsigned int k=0;k<8;k++)
+        {
+            if (columns[first+k]==NULL) continue;
+            for (unsigned int i=blocks;i<nbRecords;i++)
+                columns[first+k][i]=(int16_t)read16(records[i]+position+2*k, format.bigEndian)*scale[first+k]+offset[first+k];
+        }
+    }
+#endif
+    for (unsigned int channel=first;channel<format.nbChannels;channel++)
+    {
+        float *column=columns[channel];
+        if (column==NULL) continue;
+        unsigned int position=format.syncSize+2*channel;
+        unsigned int i=0;
+#if defined (SERIAL_DECODER_SSE2)
+        // Remaining channels: gather 8 values, then swap and convert them
+        __m128 factor=_mm_set1_ps(scale[channel]);
+        __m128 shift=_mm_set1_ps(offset[channel]);
+        for (;i+8<=nbRecords;i+=8)
+        {
+            __m128i values=_mm_set_epi16(load16(records[i+7]+position), load16(records[i+6]+position),
+                                         load16(records[i+5]+position), load16(records[i+4]+position),
+                                         load16(records[i+3]+position), load16(records[i+2]+position),
+                                         load16(records[i+1]+position), load16(records[i]+position));
+            if (swap) values=_mm_or_si128(_mm_slli_epi16(values, 8), _mm_srli_epi16(values, 8));
+            storeScaled(column+i, values, factor, shift);
+        }
+#endif
+        for (;i<nbRecords;i++)
+            column[i]=(int16_t)read16(records[i]+position, format.bigEndian)*scale[channel]+offset[channel];
+    }
+}
+
+
+/*!
+    \brief      Decode the valid records at the beginning of a buffer into int16 columns.
+                Corrupted bytes are skipped; an incomplete record at the end is left for the
+                next call (with more data).
+    \param      data : received bytes
+    \param      size : number of bytes
+    \param      consumed : number of bytes used, to remove from the buffer
+    \param      columns : one array of maxRecords values per channel (NULL to skip a channel)
+    \param      maxRecords : maximum number of records to decode (capped to the maxRecords of the constructor)
+    \return     >=0 the number of records decoded
+    \return     -1 invalid format
+*/
+int serialDecoder::decode(const void *data, unsigned int size, unsigned int *consumed,
+                          int16_t *const *columns, unsigned int maxRecords)
+{
+    *consumed=0;
+    if (this->size==0) return -1;
+    if (maxRecords>capacity) maxRecords=capacity;
+    unsigned int nbRecords=scan((const unsigned char*)data, size, maxRecords, consumed);
+    extract(nbRecords, columns);
+    return nbRecords;
+}
+
+
+/*!
+    \brief      Decode the valid records at the beginning of a buffer into float columns
+                (see setScale). See decode above for the details.
+    \param      data : received bytes
+    \param      size : number of bytes
+    \param      consumed : number of bytes used, to remove from the buffer
+    \param      columns : one array of maxRecords values per channel (NULL to skip a channel)
+    \param      maxRecords : maximum number of records to decode (capped to the maxRecords of the constructor)
+    \return     >=0 the number of records decoded
+    \return     -1 invalid format
+*/
+int serialDecoder::decode(const void *data, unsigned int size, unsigned int *consumed,
+                          float *const *columns, unsigned int maxRecords)
+{
+    *consumed=0;
+    if (this->size==0) return -1;
+    if (maxRecords>capacity) maxRecords=capacity;
+    unsigned int nbRecords=scan((const unsigned char*)data, size, maxRecords, consumed);
+    extract(nbRecords, columns);
+    return nbRecords;
+}
+
+
+/*!
+    \brief      Wait for records on a port and decode them as int16 (see readRecords)
+    \param      port : open serial port
+    \param      columns : one array of maxRecords values per channel (NULL to skip a channel)
+    \param      maxRecords : maximum number of records to decode
+    \param      timeOut_ms : delay of timeout before giving up (0 = no timeout)
+    \return     see readRecords
+*/
+int serialDecoder::read(serialib *port, int16_t *const *columns, unsigned int maxRecords, unsigned int timeOut_ms)
+{
+    return readRecords(port, (void *const *)columns, false, maxRecords, timeOut_ms);
+}
+
+
+/*!
+    \brief      Wait for records on a port and decode them as floats (see readRecords)
+    \param      port : open serial port
+    \param      columns : one array of maxRecords values per channel (NULL to skip a channel)
+    \param      maxRecords : maximum number of records to decode
+    \param      timeOut_ms : delay of timeout before giving up (0 = no timeout)
+    \return     see readRecords
+*/
+int serialDecoder::read(serialib *port, float *const *columns, unsigned int maxRecords, unsigned int timeOut_ms)
+{
+    return readRecords(port, (void *const *)columns, true, maxRecords, timeOut_ms);
+}
+
+
+/*!
+    \brief      Wait until at least one record is received, then decode all the records already
+                in the receive buffer of the port, without copying them (peekBytes). The bytes
+                of the valid records and the corrupted bytes are removed from the receive
+                buffer, an incomplete record is kept. The batch is limited by the size of the
+                receive buffer (SERIAL_RX_BUFFER_SIZE).
+                Unix only
+    \param      port : open serial port
+    \param      columns : one array of maxRecords values per channel
+    \param      floats : the columns are float arrays (otherwise int16 arrays)
+    \param      maxRecords : maximum number of records to decode
+    \param      timeOut_ms : delay of timeout before giving up (0 = no timeout)
+    \return     >0 the number of records decoded
+    \return     0 timeout reached (or error while reading)
+    \return     -1 invalid format
+*/
+int serialDecoder::readRecords(serialib *port, void *const *columns, bool floats,
+                               unsigned int maxRecords, unsigned int timeOut_ms)
+{
+    if (size==0 || size>SERIAL_RX_BUFFER_SIZE) return -1;
+    if (maxRecords>capacity) maxRecords=capacity;
+    unsigned long long deadline=timeOut::monotonicTime_ns()+timeOut_ms*1000000ULL;
+    while (true)
+    {
+        // Wait for one record
+        unsigned int wait_ms=0;
+        if (timeOut_ms>0)
+        {
+            unsigned long long now=timeOut::monotonicTime_ns();
+            if (now>=deadline) return 0;
+            wait_ms=(unsigned int)((deadline-now+999999)/1000000);
+        }
+        const unsigned char *data=port->peekBytes(size, wait_ms);
+        if (data==NULL) return 0;
+
+        // Then take everything already received (up to the batch size)
+        unsigned int nbBytes=size;
+        int pending=port->available();
+        if (pending>(int)size)
+        {
+            nbBytes=(unsigned int)pending;
+            if (nbBytes>maxRecords*size) nbBytes=maxRecords*size;
+            if (nbBytes>SERIAL_RX_BUFFER_SIZE) nbBytes=SERIAL_RX_BUFFER_SIZE;
+            const unsigned char *more=port->peekBytes(nbBytes, 1);
+            // Fewer bytes than announced (XON/XOFF removed): decode the first record only
+            if (more!=NULL) data=more;
+            else
+            {
+                nbBytes=size;
+                data=port->peekBytes(size, 1);
+                if (data==NULL) return 0;
+            }
+        }
+
+        // Decode in place, then remove the bytes used from the receive buffer
+        unsigned int consumed;
+        unsigned int nbRecords=scan(data, nbBytes, maxRecords, &consumed);
+        if (floats) extract(nbRecords, (float *const *)columns);
+        else extract(nbRecords, (int16_t *const *)columns);
+        port->consumeBytes(consumed);
+        if (nbRecords>0) return nbRecords;
+    }
+}
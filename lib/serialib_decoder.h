@@ -0,0 +1,146 @@
+/*!
+\file    serialib_decoder.h
+\brief   Bulk decoder of fixed-size binary records (sync word, 16-bit channels, checksum) into
+         one array per channel (structure of arrays).
+
+Sensors such as IMUs stream records like:
+
+    | sync (1 to 4 bytes) | channel 0 (int16) | ... | channel N-1 (int16) | checksum (0 to 2 bytes) |
+
+The decoder checks the sync word and the checksum of the records directly in the receive buffer
+of the port (peekBytes), skips corrupted bytes until the next valid record, and writes each
+channel of a batch of records to its own array, as int16 or as scaled floats:
+
+    SerialRecordFormat format = { {0xAA, 0x55}, 2, 9, false, SERIAL_RECORD_SUM8, false };
+    serialDecoder decoder(format);
+    decoder.setScale(0, 1.0f/16384);                // accelerometer in g
+    float ax[256], ay[256], az[256], ... ;
+    float *columns[9] = { ax, ay, az, ... };        // NULL to skip a channel
+    int nbRecords = decoder.read(&serial, columns, 256, 100);
+
+The records are validated in a first pass, then the channels are extracted in blocks of 8 records
+and 8 channels: with SSE2, each record of a block is read with one 16-byte load and the block is
+transposed in registers (byte swapping, conversion to float and scaling are vectorized as well).
+The channels left when nbChannels is not a multiple of 8 are read one value at a time.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY CLAIM,
+DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+This is a licence-free software, it can be used by anyone who try to build a better world.
+*/
+
+
+#ifndef SERIALIB_DECODER_H
+#define SERIALIB_DECODER_H
+
+#include "serialib.h"
+#include <stdint.h>
+
+/*! Maximum number of channels of a record */
+#define SERIAL_DECODER_MAX_CHANNELS 32
+
+/**
+ * checksum at the end of a record
+ */
+enum SerialRecordChecksum {
+    SERIAL_RECORD_NO_CHECKSUM, /**< no checksum */
+    SERIAL_RECORD_SUM8, /**< 1 byte, sum of the bytes modulo 256 */
+    SERIAL_RECORD_XOR8, /**< 1 byte, exclusive or of the bytes */
+    SERIAL_RECORD_SUM16, /**< 2 bytes, sum of the bytes modulo 65536 */
+    SERIAL_RECORD_CRC16 /**< 2 bytes, CRC-16/CCITT (polynomial 0x1021, initial value 0xFFFF) */
+};
+
+/**
+ * layout of the records
+ */
+struct SerialRecordFormat {
+    unsigned char       sync[4];        /**< bytes that start each record */
+    unsigned int        syncSize;       /**< number of sync bytes: 1 to 4 */
+    unsigned int        nbChannels;     /**< number of 16-bit signed channels (up to SERIAL_DECODER_MAX_CHANNELS) */
+    bool                bigEndian;      /**< byte order of the channels and of the 16-bit checksums */
+    SerialRecordChecksum checksum;      /**< checksum after the channels */
+    bool                checksumSync;   /**< the checksum covers the sync bytes (otherwise the channels only) */
+};
+
+/**
+ * statistics of a decoder
+ */
+struct SerialDecoderStats {
+    unsigned long long  records;        /**< valid records decoded */
+    unsigned long       checksumErrors; /**< records with a valid sync word and a wrong checksum */
+    unsigned long       resyncs;        /**< number of times the synchronization was lost */
+    unsigned long long  skippedBytes;   /**< bytes dropped while looking for the next valid record */
+};
+
+
+
+/*!  \class     serialDecoder
+     \brief     Validates and deinterleaves fixed-size binary records into channel arrays.
+   */
+class serialDecoder
+{
+public:
+
+    // Constructor of the class
+    serialDecoder(const SerialRecordFormat &format, unsigned int maxRecords=256);
+
+    // Destructor
+    ~serialDecoder();
+
+    // Size of a record in bytes (0 if the format is invalid)
+    unsigned int        recordSize();
+
+    // Conversion of a channel to float: value*scale+offset
+    void                setScale(unsigned int channel, float scale, float offset=0);
+
+    // Decode the records of a buffer
+    int                 decode(const void *data, unsigned int size, unsigned int *consumed,
+                               int16_t *const *columns, unsigned int maxRecords);
+    int                 decode(const void *data, unsigned int size, unsigned int *consumed,
+                               float *const *columns, unsigned int maxRecords);
+
+    // Decode the records received on a port (with timeout, Unix only)
+    int                 read(serialib *port, int16_t *const *columns, unsigned int maxRecords, unsigned int timeOut_ms=0);
+    int                 read(serialib *port, float *const *columns, unsigned int maxRecords, unsigned int timeOut_ms=0);
+
+    // Statistics since the creation (or the last reset)
+    void                getStats(SerialDecoderStats *stats, bool reset=false);
+
+private:
+    // Not copyable
+    serialDecoder(const serialDecoder&);
+    serialDecoder& operator=(const serialDecoder&);
+
+    // Find the valid records of a buffer, keep their addresses
+    unsigned int        scan(const unsigned char *data, unsigned int size, unsigned int maxRecords, unsigned int *consumed);
+
+    // Check the sync word and the checksum of a record
+    bool                checkRecord(const unsigned char *record);
+
+    // Write the channels of the records found by scan to the columns
+    void                extract(unsigned int nbRecords, int16_t *const *columns);
+    void                extract(unsigned int nbRecords, float *const *columns);
+
+    // Wait for records on a port, decode them as int16 or float
+    int                 readRecords(serialib *port, void *const *columns, bool floats,
+                                    unsigned int maxRecords, unsigned int timeOut_ms);
+
+    // Layout, size of a record and conversion of each channel
+    SerialRecordFormat  format;
+    unsigned int        size;
+    float               scale[SERIAL_DECODER_MAX_CHANNELS];
+    float               offset[SERIAL_DECODER_MAX_CHANNELS];
+
+    // Addresses of the valid records of the current batch
+    const unsigned char** records;
+    unsigned int        capacity;
+
+    // A valid record was found last (a corrupted byte then counts as a loss of synchronization)
+    bool                synchronized;
+    SerialDecoderStats  stats;
+};
+
+#endif // SERIALIB_DECODER_H
@@ -0,0 +1,226 @@
+/*!
+\file    serialib_layout.h
+\brief   Compile-time message layouts for serialib. Typed, zero-copy access to the fields
+         of binary messages received (serialib::peekBytes) or sent (serialib::writeBytes).
+
+A layout is a structure that declares its fields and its size:
+
+    struct ImuMessage {
+        typedef serialField<0, uint16_t, SERIAL_BIG_ENDIAN>    Sync;
+        typedef serialField<2, int16_t>                        AccX;
+        typedef serialField<4, int32_t, SERIAL_LITTLE_ENDIAN, 3> Pressure;  // 24 bits, sign extended
+        typedef serialField<7, float>                          Temperature;
+        static const unsigned int size = 11;
+    };
+
+    const unsigned char *bytes = serial.peekBytes(ImuMessage::size, 10);
+    serialView<ImuMessage> message(bytes);
+    int16_t accX = message.get<ImuMessage::AccX>();
+    serial.consumeBytes(ImuMessage::size);
+
+Offsets, widths and byte orders are template parameters: each access compiles to a load
+(and a byte swap when needed), without copy of the message and without runtime dispatch.
+Fields that don't fit in the message are rejected at compile time.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY CLAIM,
+DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+This is a licence-free software, it can be used by anyone who try to build a better world.
+*/
+
+
+#ifndef SERIALIB_LAYOUT_H
+#define SERIALIB_LAYOUT_H
+
+#include <stdint.h>
+#include <string.h>
+#include <limits>
+
+/**
+ * byte order of a message field
+ */
+enum SerialEndianness {
+    SERIAL_LITTLE_ENDIAN, /**< least significant byte first */
+    SERIAL_BIG_ENDIAN /**< most significant byte first (network order) */
+};
+
+
+
+//_______________________________
+// ::: Implementation details :::
+
+namespace serialLayoutDetail {
+
+    // Unsigned integer able to hold Width bytes
+    template <unsigned int Width> struct storage        { typedef uint64_t type; };
+    template <> struct storage<1>                       { typedef uint8_t  type; };
+    template <> struct storage<2>                       { typedef uint16_t type; };
+    template <> struct storage<3>                       { typedef uint32_t type; };
+    template <> struct storage<4>                       { typedef uint32_t type; };
+
+    // Assemble Width bytes into an unsigned integer (the compiler turns the loop into a load and a byte swap)
+    template <unsigned int Width, SerialEndianness Endian>
+    inline typename storage<Width>::type load(const unsigned char *data)
+    {
+        typedef typename storage<Width>::type U;
+        U value=0;
+        for (unsigned int i=0;i<Width;i++)
+        {
+            if (Endian==SERIAL_LITTLE_ENDIAN)   value|=(U)data[i]<<(8*i);
+            else                                value|=(U)data[i]<<(8*(Width-1-i));
+        }
+        return value;
+    }
+
+    // Split an unsigned integer into Width bytes
+    template <unsigned int Width, SerialEndianness Endian>
+    inline void store(unsigned char *data, typename storage<Width>::type value)
+    {
+        for (unsigned int i=0;i<Width;i++)
+        {
+            if (Endian==SERIAL_LITTLE_ENDIAN)   data[i]=(unsigned char)(value>>(8*i));
+            else                                data[i]=(unsigned char)(value>>(8*(Width-1-i)));
+        }
+    }
+
+    // Conversion between the raw bits and the field type (integers)
+    template <typename T, unsigned int Width, bool IsInteger = std::numeric_limits<T>::is_integer>
+    struct convert
+    {
+        typedef typename storage<Width>::type U;
+        static T fromBits(U bits)
+        {
+            // Sign extension of the fields narrower than their type
+            if (std::numeric_limits<T>::is_signed && Width<sizeof(T))
+            {
+                const U signBit=(U)1<<(8*Width-1);
+                if (bits & signBit) return (T)((int64_t)bits-((int64_t)signBit<<1));
+            }
+            return (T)bits;
+        }
+        static U toBits(T value) { return (U)value; }
+    };
+
+    // Conversion between the raw bits and the field type (floating point, same size)
+    template <typename T, unsigned int Width>
+    struct convert<T, Width, false>
+    {
+        typedef typename storage<Width>::type U;
+        static T fromBits(U bits) { T value; memcpy(&value,&bits,sizeof(T)); return value; }
+        static U toBits(T value) { U bits; memcpy(&bits,&value,sizeof(T)); return bits; }
+    };
+}
+
+
+
+//_______________
+// ::: Fields :::
+
+
+/*!  \class     serialField
+     \brief     Declares a field of a binary message: position, type, byte order and width.
+     \tparam    Offset : position of the first byte of the field in the message
+     \tparam    T : type of the field (integer, float or double)
+     \tparam    Endian : byte order of the field
+     \tparam    Width : number of bytes of the field (default: sizeof(T)). Integers may be
+                narrower than their type (ex: 24 bits in an int32_t, sign extended).
+*/
+template <unsigned int Offset, typename T, SerialEndianness Endian = SERIAL_LITTLE_ENDIAN, unsigned int Width = sizeof(T)>
+struct serialField
+{
+    static_assert(Width>=1 && Width<=8, "a field is 1 to 8 bytes wide");
+    static_assert(Width<=sizeof(T), "the type of the field is too small for its width");
+    static_assert(std::numeric_limits<T>::is_integer || Width==sizeof(T), "floating point fields can't be narrowed");
+
+    typedef T type;
+    static const unsigned int offset = Offset;
+    static const unsigned int width = Width;
+    static const unsigned int end = Offset+Width;
+
+    // Read the field from the first byte of a message
+    static T read(const unsigned char *message)
+    {
+        return serialLayoutDetail::convert<T,Width>::fromBits(
+               serialLayoutDetail::load<Width,Endian>(message+Offset));
+    }
+
+    // Write the field in a message
+    static void write(unsigned char *message, T value)
+    {
+        serialLayoutDetail::store<Width,Endian>(message+Offset,
+               serialLayoutDetail::convert<T,Width>::toBits(value));
+    }
+};
+
+
+
+//_________________________________
+// ::: Views over message bytes :::
+
+
+/*!  \class     serialView
+     \brief     Read-only typed view over the bytes of a received message (no copy).
+                The bytes must stay valid while the view is used (for serialib::peekBytes:
+                until the next read or consumeBytes).
+     \tparam    Layout : structure that declares the fields (serialField typedefs) and the size of the message
+*/
+template <typename Layout>
+class serialView
+{
+public:
+    // Constructor, data points to the first byte of the message
+    explicit serialView(const void *data) : message((const unsigned char*)data) {}
+
+    // Get the value of a field
+    template <typename Field>
+    typename Field::type get() const
+    {
+        static_assert(Field::end<=Layout::size, "field outside of the message");
+        return Field::read(message);
+    }
+
+    // First byte of the message
+    const unsigned char* bytes() const { return message; }
+
+    // Size of the message
+    static unsigned int size() { return Layout::size; }
+
+private:
+    const unsigned char *message;
+};
+
+
+/*!  \class     serialBuilder
+     \brief     Typed writer that fills a transmit buffer in place (no copy).
+     \tparam    Layout : structure that declares the fields (serialField typedefs) and the size of the message
+*/
+template <typename Layout>
+class serialBuilder
+{
+public:
+    // Constructor, data points to a buffer of at least Layout::size bytes
+    explicit serialBuilder(void *data) : message((unsigned char*)data) {}
+
+    // Set the value of a field, returns the builder to chain the calls
+    template <typename Field>
+    serialBuilder& set(typename Field::type value)
+    {
+        static_assert(Field::end<=Layout::size, "field outside of the message");
+        Field::write(message,value);
+        return *this;
+    }
+
+    // First byte of the message (ready for serialib::writeBytes)
+    unsigned char* bytes() const { return message; }
+
+    // Size of the message
+    static unsigned int size() { return Layout::size; }
+
+private:
+    unsigned char *message;
+};
+
+#endif // SERIALIB_LAYOUT_H
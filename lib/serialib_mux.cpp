@@ -0,0 +1,1143 @@
+/*!
+ \file    serialib_mux.cpp
+ \brief   Source file of the class serialMux.
+          Logical channels over one serial link: GSM 07.10 basic option frames, priorities
+          and credit-based flow control (Unix only).
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY CLAIM,
+DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+
+This is a licence-free software, it can be used by anyone who try to build a better world.
+ */
+
+#include "serialib_mux.h"
+
+#if defined (__linux__) || defined(__APPLE__)
+
+/*! Flag that starts and ends each frame */
+#define SERIAL_MUX_FLAG             0xF9
+
+/*! Frame types (control field without the P/F bit) */
+#define SERIAL_MUX_SABM             0x2F
+#define SERIAL_MUX_UA               0x63
+#define SERIAL_MUX_DM               0x0F
+#define SERIAL_MUX_DISC             0x43
+#define SERIAL_MUX_UIH              0xEF
+#define SERIAL_MUX_UI               0x03
+#define SERIAL_MUX_PF               0x10
+
+/*! Close down command of the control channel (with the C/R and EA bits) */
+#define SERIAL_MUX_CLD              0xC3
+
+/*! States of a channel */
+#define SERIAL_MUX_CLOSED           0
+#define SERIAL_MUX_OPENING          1
+#define SERIAL_MUX_OPEN             2
+
+/*! States of the receiver */
+#define SERIAL_MUX_RX_HUNT          0
+#define SERIAL_MUX_RX_ADDRESS       1
+#define SERIAL_MUX_RX_CONTROL       2
+#define SERIAL_MUX_RX_LENGTH1       3
+#define SERIAL_MUX_RX_LENGTH2       4
+#define SERIAL_MUX_RX_INFO          5
+#define SERIAL_MUX_RX_FCS           6
+#define SERIAL_MUX_RX_CLOSE         7
+
+/*! Size of the control queue */
+#define SERIAL_MUX_CONTROL_SIZE     2048
+
+/*! Interval between two SABM while the peer does not answer */
+#define SERIAL_MUX_RETRY_MS         300
+
+/*! Frame overhead: 2 flags, address, control, 2 length bytes and FCS */
+#define SERIAL_MUX_OVERHEAD         7
+
+
+
+/*!
+    \brief      Bytes waiting to be sent on a channel, or received and not read yet
+*/
+struct serialMuxRing
+{
+    unsigned char*      data;
+    unsigned int        size;
+    unsigned int        head;
+    unsigned int        count;
+};
+
+
+/*!
+    \brief      A channel: its buffers, its credits and its optional pseudo-terminal
+*/
+struct serialMuxChannel
+{
+    int                 state;
+    int                 priority;
+    serialMuxRing       tx;
+    serialMuxRing       rx;
+    // Frames we can send, and frames the peer can send, before new credits are granted
+    unsigned int        txCredits;
+    unsigned int        rxCredits;
+    // Pseudo-terminal (-1 if none), the slave is kept open so the master never hangs up
+    int                 ptyMaster;
+    int                 ptySlave;
+    SerialMuxStats      stats;
+};
+
+
+// CRC-8 of GSM 07.10 (reversed polynomial 0xE0, initial value 0xFF)
+static const unsigned char crcTable[256] = {
+    0x00, 0x91, 0xE3, 0x72, 0x07, 0x96, 0xE4, 0x75, 0x0E, 0x9F, 0xED, 0x7C, 0x09, 0x98, 0xEA, 0x7B,
+    0x1C, 0x8D, 0xFF, 0x6E, 0x1B, 0x8A, 0xF8, 0x69, 0x12, 0x83, 0xF1, 0x60, 0x15, 0x84, 0xF6, 0x67,
+    0x38, 0xA9, 0xDB, 0x4A, 0x3F, 0xAE, 0xDC, 0x4D, 0x36, 0xA7, 0xD5, 0x44, 0x31, 0xA0, 0xD2, 0x43,
+    0x24, 0xB5, 0xC7, 0x56, 0x23, 0xB2, 0xC0, 0x51, 0x2A, 0xBB, 0xC9, 0x58, 0x2D, 0xBC, 0xCE, 0x5F,
+    0x70, 0xE1, 0x93, 0x02, 0x77, 0xE6, 0x94, 0x05, 0x7E, 0xEF, 0x9D, 0x0C, 0x79, 0xE8, 0x9A, 0x0B,
+    0x6C, 0xFD, 0x8F, 0x1E, 0x6B, 0xFA, 0x88, 0x19, 0x62, 0xF3, 0x81, 0x10, 0x65, 0xF4, 0x86, 0x17,
+    0x48, 0xD9, 0xAB, 0x3A, 0x4F, 0xDE, 0xAC, 0x3D, 0x46, 0xD7, 0xA5, 0x34, 0x41, 0xD0, 0xA2, 0x33,
+    0x54, 0xC5, 0xB7, 0x26, 0x53, 0xC2, 0xB0, 0x21, 0x5A, 0xCB, 0xB9, 0x28, 0x5D, 0xCC, 0xBE, 0x2F,
+    0xE0, 0x71, 0x03, 0x92, 0xE7, 0x76, 0x04, 0x95, 0xEE, 0x7F, 0x0D, 0x9C, 0xE9, 0x78, 0x0A, 0x9B,
+    0xFC, 0x6D, 0x1F, 0x8E, 0xFB, 0x6A, 0x18, 0x89, 0xF2, 0x63, 0x11, 0x80, 0xF5, 0x64, 0x16, 0x87,
+    0xD8, 0x49, 0x3B, 0xAA, 0xDF, 0x4E, 0x3C, 0xAD, 0xD6, 0x47, 0x35, 0xA4, 0xD1, 0x40, 0x32, 0xA3,
+    0xC4, 0x55, 0x27, 0xB6, 0xC3, 0x52, 0x20, 0xB1, 0xCA, 0x5B, 0x29, 0xB8, 0xCD, 0x5C, 0x2E, 0xBF,
+    0x90, 0x01, 0x73, 0xE2, 0x97, 0x06, 0x74, 0xE5, 0x9E, 0x0F, 0x7D, 0xEC, 0x99, 0x08, 0x7A, 0xEB,
+    0x8C, 0x1D, 0x6F, 0xFE, 0x8B, 0x1A, 0x68, 0xF9, 0x82, 0x13, 0x61, 0xF0, 0x85, 0x14, 0x66, 0xF7,
+    0xA8, 0x39, 0x4B, 0xDA, 0xAF, 0x3E, 0x4C, 0xDD, 0xA6, 0x37, 0x45, 0xD4, 0xA1, 0x30, 0x42, 0xD3,
+    0xB4, 0x25, 0x57, 0xC6, 0xB3, 0x22, 0x50, 0xC1, 0xBA, 0x2B, 0x59, 0xC8, 0xBD, 0x2C, 0x5E, 0xCF,
+};
+
+
+// Copy bytes at the end of a ring, return the number of bytes copied
+static unsigned int ringPut(serialMuxRing *ring, const unsigned char *data, unsigned int size)
+{
+    if (size>ring->size-ring->count) size=ring->size-ring->count;
+    unsigned int tail=(ring->head+ring->count)%ring->size;
+    unsigned int first=(size<ring->size-tail) ? size : ring->size-tail;
+    memcpy(ring->data+tail, data, first);
+    memcpy(ring->data, data+first, size-first);
+    ring->count+=size;
+    return size;
+}
+
+
+// Move bytes from the start of a ring, return the number of bytes moved
+static unsigned int ringGet(serialMuxRing *ring, unsigned char *data, unsigned int size)
+{
+    if (size>ring->count) size=ring->count;
+    unsigned int first=(size<ring->size-ring->head) ? size : ring->size-ring->head;
+    memcpy(data, ring->data+ring->head, first);
+    memcpy(data+first, ring->data, size-first);
+    ring->head=(ring->head+size)%ring->size;
+    ring->count-=size;
+    return size;
+}
+
+
+// Wait for a condition until a deadline of the monotonic clock
+static void waitCondition(pthread_cond_t *cond, pthread_mutex_t *mutex, unsigned long long deadline_ns, bool noTimeOut)
+{
+    if (noTimeOut)
+    {
+        pthread_cond_wait(cond, mutex);
+        return;
+    }
+#if defined (__linux__)
+    // The condition uses the monotonic clock
+    unsigned long long time_ns=deadline_ns;
+#else
+    // The condition uses the real-time clock
+    unsigned long long now_ns=timeOut::monotonicTime_ns();
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    unsigned long long time_ns=now.tv_sec*1000000000ULL+now.tv_usec*1000ULL+(deadline_ns>now_ns ? deadline_ns-now_ns : 0);
+#endif
+    struct timespec deadline;
+    deadline.tv_sec=time_ns/1000000000ULL;
+    deadline.tv_nsec=time_ns%1000000000ULL;
+    pthread_cond_timedwait(cond, mutex, &deadline);
+}
+
+
+
+// Next time a waiting loop must wake up: the deadline, or the next retransmission if sooner
+static unsigned long long nextWakeUp(unsigned long long deadline_ns, bool hasDeadline, unsigned long long retry_ns)
+{
+    if (retry_ns>0 && (!hasDeadline || retry_ns<deadline_ns)) return retry_ns;
+    return deadline_ns;
+}
+
+
+
+// ******************************************
+//  Class serialMux
+// ******************************************
+
+
+/*!
+    \brief      Constructor of the class serialMux. The multiplexer takes over the port: the
+                application must not read from it or write to it while the multiplexer is used
+    \param      port : open serial port
+    \param      frameSize : maximum payload of a frame (N1, 127 by default, up to 32767),
+                both sides must use the same value
+    \param      bufferSize : size of the transmit and receive buffers of each channel
+*/
+serialMux::serialMux(serialib *port, unsigned int frameSize, unsigned int bufferSize)
+{
+    if (frameSize<2) frameSize=2;
+    if (frameSize>32767) frameSize=32767;
+    if (bufferSize<frameSize) bufferSize=frameSize;
+    this->port=port;
+    this->frameSize=frameSize;
+    this->bufferSize=bufferSize;
+    // No flow control by default, as in standard GSM 07.10 (see setCredits)
+    credits=0;
+    initiator=false;
+    muxOpen=false;
+
+    for (int i=0;i<SERIAL_MUX_CHANNELS;i++) channels[i]=NULL;
+    lastServed=0;
+
+    controlQueue=new unsigned char[SERIAL_MUX_CONTROL_SIZE];
+    controlSending=new unsigned char[SERIAL_MUX_CONTROL_SIZE];
+    controlSize=SERIAL_MUX_CONTROL_SIZE;
+    controlUsed=0;
+
+    rxState=SERIAL_MUX_RX_HUNT;
+    rxAddress=rxControl=rxFcs=0;
+    rxLength=rxReceived=0;
+    rxInfo=new unsigned char[frameSize];
+    txFrame=new unsigned char[frameSize+SERIAL_MUX_OVERHEAD];
+    txPayload=new unsigned char[frameSize];
+    sending=false;
+    frameErrors=0;
+
+    pthread_mutex_init(&lock, NULL);
+    pthread_condattr_t attributes;
+    pthread_condattr_init(&attributes);
+#if defined (__linux__)
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+#endif
+    pthread_cond_init(&changed, &attributes);
+    pthread_condattr_destroy(&attributes);
+    if (pipe(wakePipe)==0)
+    {
+        fcntl(wakePipe[0], F_SETFL, O_NONBLOCK);
+        fcntl(wakePipe[1], F_SETFL, O_NONBLOCK);
+    }
+    else wakePipe[0]=wakePipe[1]=-1;
+    threadRunning=false;
+    threadStop=false;
+}
+
+
+/*!
+    \brief      Destructor of the class serialMux. It stops the thread, closes the channels
+                and the pseudo-terminals (the port stays open)
+*/
+serialMux::~serialMux()
+{
+    close();
+    stopThread();
+    for (int i=0;i<SERIAL_MUX_CHANNELS;i++)
+        if (channels[i])
+        {
+            delete[] channels[i]->tx.data;
+            delete[] channels[i]->rx.data;
+            delete channels[i];
+        }
+    delete[] controlQueue;
+    delete[] controlSending;
+    delete[] rxInfo;
+    delete[] txFrame;
+    delete[] txPayload;
+    if (wakePipe[0]!=-1) ::close(wakePipe[0]);
+    if (wakePipe[1]!=-1) ::close(wakePipe[1]);
+    pthread_cond_destroy(&changed);
+    pthread_mutex_destroy(&lock);
+}
+
+
+/*!
+    \brief      Set the number of frames each side can send on a channel when it opens. The
+                receiver grants new credits as the application reads the data. Call before
+                opening the channels, with the same value on both sides. The flow control is
+                an extension of GSM 07.10: leave it disabled to talk to a standard peer
+    \param      credits : initial credits, limited to bufferSize/frameSize so the frames always
+                fit in the receive buffer (and to 255), 0 disables the flow control (default)
+*/
+void serialMux::setCredits(unsigned int credits)
+{
+    // One credit per frame the receive buffer can hold at most
+    if (credits>bufferSize/frameSize) credits=bufferSize/frameSize;
+    if (credits>255) credits=255;
+    pthread_mutex_lock(&lock);
+    this->credits=credits;
+    pthread_mutex_unlock(&lock);
+}
+
+
+/*!
+    \brief      Start the multiplexer. The initiator sends SABM on the control channel (DLCI 0)
+                until the peer answers, the responder waits for it.
+                run must be called meanwhile by a thread (startThread), otherwise open calls it
+    \param      initiator : true on the side that opens the channels
+    \param      timeOut_ms : maximum waiting time (0 = no timeout)
+    \return     1 the multiplexer is open
+    \return     0 timeout
+*/
+int serialMux::open(bool initiator, unsigned int timeOut_ms)
+{
+    unsigned long long deadline=timeOut::monotonicTime_ns()+timeOut_ms*1000000ULL;
+    pthread_mutex_lock(&lock);
+    this->initiator=initiator;
+    unsigned long long retry=0;
+    while (!muxOpen)
+    {
+        // Send SABM again while the peer does not answer
+        unsigned long long now=timeOut::monotonicTime_ns();
+        if (initiator && now>=retry)
+        {
+            queueFrame(0, SERIAL_MUX_SABM|SERIAL_MUX_PF, true);
+            retry=now+SERIAL_MUX_RETRY_MS*1000000ULL;
+        }
+        if (timeOut_ms>0 && now>=deadline) break;
+        waitChange(nextWakeUp(deadline, timeOut_ms>0, retry), timeOut_ms==0 && !initiator);
+    }
+    int Ret=muxOpen ? 1 : 0;
+    pthread_mutex_unlock(&lock);
+    return Ret;
+}
+
+
+/*!
+    \brief      Open a channel. The initiator sends SABM and waits for the answer of the peer,
+                the responder waits for the peer to open the channel (a channel opened by the
+                peer is also accepted without calling openChannel, with priority 0)
+    \param      dlci : channel, 1 to 63
+    \param      priority : frames of the channels with a higher priority are sent first
+    \param      timeOut_ms : maximum waiting time (0 = no timeout)
+    \return     1 the channel is open
+    \return     0 timeout
+    \return     -1 invalid channel
+    \return     -2 the multiplexer is not open
+    \return     -3 the peer refused the channel
+*/
+int serialMux::openChannel(unsigned int dlci, int priority, unsigned int timeOut_ms)
+{
+    if (dlci<1 || dlci>=SERIAL_MUX_CHANNELS) return -1;
+    unsigned long long deadline=timeOut::monotonicTime_ns()+timeOut_ms*1000000ULL;
+    pthread_mutex_lock(&lock);
+    serialMuxChannel *ch=channel(dlci);
+    ch->priority=priority;
+    int Ret=0;
+    if (ch->state==SERIAL_MUX_OPEN) Ret=1;
+    else if (initiator && !muxOpen) Ret=-2;
+    else
+    {
+        unsigned long long retry=0;
+        if (initiator) ch->state=SERIAL_MUX_OPENING;
+        while (true)
+        {
+            if (ch->state==SERIAL_MUX_OPEN) { Ret=1; break; }
+            // DM received
+            if (initiator && ch->state==SERIAL_MUX_CLOSED) { Ret=-3; break; }
+            unsigned long long now=timeOut::monotonicTime_ns();
+            if (initiator && now>=retry)
+            {
+                queueFrame(dlci, SERIAL_MUX_SABM|SERIAL_MUX_PF, true);
+                retry=now+SERIAL_MUX_RETRY_MS*1000000ULL;
+            }
+            if (timeOut_ms>0 && now>=deadline)
+            {
+                if (ch->state==SERIAL_MUX_OPENING) ch->state=SERIAL_MUX_CLOSED;
+                break;
+            }
+            waitChange(nextWakeUp(deadline, timeOut_ms>0, retry), timeOut_ms==0 && !initiator);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return Ret;
+}
+
+
+/*!
+    \brief      Expose a channel as a pseudo-terminal: the bytes received on the channel are
+                written to it, the bytes written to it are sent on the channel. The received
+                bytes are then no longer returned by read
+    \param      dlci : channel, 1 to 63
+    \param      name : receives the path of the pseudo-terminal (/dev/pts/N)
+    \param      nameSize : size of name
+    \return     1 success
+    \return     -1 invalid channel
+    \return     -2 the pseudo-terminal can't be created
+    \return     -3 name is too small
+*/
+int serialMux::createPty(unsigned int dlci, char *name, unsigned int nameSize)
+{
+    if (dlci<1 || dlci>=SERIAL_MUX_CHANNELS) return -1;
+    pthread_mutex_lock(&lock);
+    serialMuxChannel *ch=channel(dlci);
+    int Ret=1;
+    if (ch->ptyMaster==-1)
+    {
+        int master=posix_openpt(O_RDWR | O_NOCTTY);
+        int slave=-1;
+        if (master!=-1 && grantpt(master)==0 && unlockpt(master)==0)
+            slave=::open(ptsname(master), O_RDWR | O_NOCTTY);
+        if (slave==-1)
+        {
+            if (master!=-1) ::close(master);
+            Ret=-2;
+        }
+        else
+        {
+            // Raw until the application configures its side
+            struct termios options;
+            tcgetattr(slave, &options);
+            cfmakeraw(&options);
+            tcsetattr(slave, TCSANOW, &options);
+            fcntl(master, F_SETFL, O_NONBLOCK);
+            ch->ptyMaster=master;
+            ch->ptySlave=slave;
+        }
+    }
+    if (Ret==1)
+    {
+        const char *path=ptsname(ch->ptyMaster);
+        if (strlen(path)>=nameSize) Ret=-3;
+        else strcpy(name, path);
+    }
+    pthread_mutex_unlock(&lock);
+    // The pseudo-terminal must be polled
+    if (Ret==1 && wakePipe[1]!=-1 && ::write(wakePipe[1], "", 1)) {}
+    return Ret;
+}
+
+
+/*!
+    \brief      Queue bytes on a channel. They are sent by run, after the frames of the channels
+                with a higher priority, and when the peer has granted credits
+    \param      dlci : channel, 1 to 63
+    \param      data : bytes to send
+    \param      size : number of bytes
+    \param      timeOut_ms : maximum time waiting for room in the transmit buffer (0 = no timeout)
+    \return     >=0 number of bytes queued (less than size on timeout)
+    \return     -1 invalid channel
+    \return     -2 the channel is not open
+*/
+int serialMux::write(unsigned int dlci, const void *data, unsigned int size, unsigned int timeOut_ms)
+{
+    if (dlci<1 || dlci>=SERIAL_MUX_CHANNELS) return -1;
+    unsigned long long deadline=timeOut::monotonicTime_ns()+timeOut_ms*1000000ULL;
+    const unsigned char *bytes=(const unsigned char*)data;
+    unsigned int written=0;
+    pthread_mutex_lock(&lock);
+    serialMuxChannel *ch=channels[dlci];
+    int Ret;
+    if (!ch || ch->state!=SERIAL_MUX_OPEN) Ret=-2;
+    else
+    {
+        while (true)
+        {
+            written+=ringPut(&ch->tx, bytes+written, size-written);
+            if (written>0 && wakePipe[1]!=-1 && ::write(wakePipe[1], "", 1)) {}
+            if (written==size || ch->state!=SERIAL_MUX_OPEN) break;
+            if (!waitChange(deadline, timeOut_ms==0)) break;
+        }
+        Ret=written;
+    }
+    pthread_mutex_unlock(&lock);
+    return Ret;
+}
+
+
+/*!
+    \brief      Read the bytes received on a channel. Returns as soon as bytes are available
+    \param      dlci : channel, 1 to 63
+    \param      buffer : array where the bytes are stored
+    \param      maxNbBytes : maximum number of bytes read
+    \param      timeOut_ms : maximum waiting time for the first byte (0 = no timeout)
+    \return     >0 number of bytes read
+    \return     0 timeout
+    \return     -1 invalid channel
+    \return     -2 the channel is not open and all its bytes were read
+*/
+int serialMux::read(unsigned int dlci, void *buffer, unsigned int maxNbBytes, unsigned int timeOut_ms)
+{
+    if (dlci<1 || dlci>=SERIAL_MUX_CHANNELS) return -1;
+    unsigned long long deadline=timeOut::monotonicTime_ns()+timeOut_ms*1000000ULL;
+    pthread_mutex_lock(&lock);
+    serialMuxChannel *ch=channel(dlci);
+    int Ret=0;
+    while (true)
+    {
+        if (ch->rx.count>0)
+        {
+            Ret=ringGet(&ch->rx, (unsigned char*)buffer, maxNbBytes);
+            // The room freed may be given back to the peer
+            grantCredits(ch, dlci);
+            break;
+        }
+        if (ch->state!=SERIAL_MUX_OPEN) { Ret=-2; break; }
+        if (!waitChange(deadline, timeOut_ms==0)) break;
+    }
+    pthread_mutex_unlock(&lock);
+    return Ret;
+}
+
+
+/*!
+    \brief      Number of bytes received on a channel and not read yet
+    \param      dlci : channel, 1 to 63
+    \return     >=0 number of bytes
+    \return     -1 invalid channel
+*/
+int serialMux::available(unsigned int dlci)
+{
+    if (dlci<1 || dlci>=SERIAL_MUX_CHANNELS) return -1;
+    pthread_mutex_lock(&lock);
+    int Ret=channels[dlci] ? channels[dlci]->rx.count : 0;
+    pthread_mutex_unlock(&lock);
+    return Ret;
+}
+
+
+/*!
+    \brief      Traffic of a channel since the creation of the multiplexer
+    \param      dlci : channel, 1 to 63
+    \param      stats : receives the counters
+    \return     1 success
+    \return     -1 invalid channel
+*/
+int serialMux::getStats(unsigned int dlci, SerialMuxStats *stats)
+{
+    if (dlci<1 || dlci>=SERIAL_MUX_CHANNELS) return -1;
+    pthread_mutex_lock(&lock);
+    serialMuxChannel *ch=channel(dlci);
+    *stats=ch->stats;
+    stats->txCredits=ch->txCredits;
+    stats->open=(ch->state==SERIAL_MUX_OPEN);
+    pthread_mutex_unlock(&lock);
+    return 1;
+}
+
+
+/*!
+    \brief      Number of frames dropped since the creation of the multiplexer
+    \return     frames with a wrong FCS, a wrong address or a payload longer than frameSize
+*/
+unsigned long serialMux::getFrameErrors()
+{
+    pthread_mutex_lock(&lock);
+    unsigned long Ret=frameErrors;
+    pthread_mutex_unlock(&lock);
+    return Ret;
+}
+
+
+/*!
+    \brief      Send the queued frames, wait for data (on the port or on the pseudo-terminals),
+                dispatch the received frames and send again. Must be called by one thread only,
+                in a loop, or by the thread of startThread
+    \param      timeOut_ms : maximum waiting time (0 = until something happens)
+    \return     >=0 number of bytes received on the port
+    \return     -1 error while writing to the port
+    \return     -2 error while reading from the port
+*/
+int serialMux::run(unsigned int timeOut_ms)
+{
+    struct pollfd fds[SERIAL_MUX_CHANNELS+1];
+    unsigned int fdChannel[SERIAL_MUX_CHANNELS+1];
+    unsigned char buffer[4096];
+
+    pthread_mutex_lock(&lock);
+    int Ret=sendFrames();
+
+    // The port, the wake-up pipe and the pseudo-terminals
+    unsigned int nbFds=0;
+    fds[nbFds].fd=port->fileDescriptor();
+    fds[nbFds].events=POLLIN;
+    fds[nbFds].revents=0;
+    nbFds++;
+    fds[nbFds].fd=wakePipe[0];
+    fds[nbFds].events=POLLIN;
+    fds[nbFds].revents=0;
+    nbFds++;
+    bool backlog=false;
+    for (unsigned int i=1;i<SERIAL_MUX_CHANNELS;i++)
+    {
+        serialMuxChannel *ch=channels[i];
+        if (!ch) continue;
+        // Bytes left because the driver is full: check again soon
+        if (ch->tx.count>0 && ch->state==SERIAL_MUX_OPEN && (credits==0 || ch->txCredits>0)) backlog=true;
+        if (ch->ptyMaster==-1 || nbFds>SERIAL_MUX_CHANNELS) continue;
+        fds[nbFds].fd=ch->ptyMaster;
+        fds[nbFds].events=(ch->tx.count<ch->tx.size ? POLLIN : 0) | (ch->rx.count>0 ? POLLOUT : 0);
+        fds[nbFds].revents=0;
+        fdChannel[nbFds]=i;
+        nbFds++;
+    }
+    pthread_mutex_unlock(&lock);
+
+    // Wait, unless bytes are already in the receive buffer of the port
+    int wait=(timeOut_ms==0) ? -1 : (int)timeOut_ms;
+    if (backlog && (wait==-1 || wait>1)) wait=1;
+    if (Ret>=0 && port->available()>0) wait=0;
+    if (Ret>=0) poll(fds, nbFds, wait);
+
+    pthread_mutex_lock(&lock);
+    int received=0;
+    while (Ret>=0)
+    {
+        int n=port->available();
+        if (n<=0) break;
+        if (n>(int)sizeof(buffer)) n=sizeof(buffer);
+        n=port->readAvailable(buffer, n, 1);
+        if (n<0) { Ret=-2; break; }
+        receive(buffer, n);
+        received+=n;
+    }
+    if (fds[1].revents & POLLIN)
+        while (::read(wakePipe[0], buffer, sizeof(buffer))>0);
+    for (unsigned int i=2;i<nbFds;i++)
+        servePty(channels[fdChannel[i]], fdChannel[i], fds[i].revents & POLLIN, fds[i].revents & POLLOUT);
+    if (Ret>=0 && sendFrames()<0) Ret=-1;
+    pthread_cond_broadcast(&changed);
+    pthread_mutex_unlock(&lock);
+    return (Ret<0) ? Ret : received;
+}
+
+
+/*!
+    \brief      Start a thread that calls run in a loop. read, write, open and openChannel then
+                wait for this thread instead of calling run themselves
+    \return     1 success, the thread is running
+    \return     -2 error while creating the thread
+    \return     -3 the thread is already running
+*/
+int serialMux::startThread()
+{
+    if (threadRunning) return -3;
+    threadStop=false;
+    if (pthread_create(&thread, NULL, muxThread, this)!=0) return -2;
+    pthread_mutex_lock(&lock);
+    threadRunning=true;
+    pthread_mutex_unlock(&lock);
+    return 1;
+}
+
+
+/*!
+    \brief      Stop the thread started by startThread and wait for its termination.
+                Does nothing if the thread is not running
+*/
+void serialMux::stopThread()
+{
+    if (!threadRunning) return;
+    threadStop=true;
+    if (wakePipe[1]!=-1 && ::write(wakePipe[1], "", 1)) {}
+    pthread_join(thread, NULL);
+    pthread_mutex_lock(&lock);
+    threadRunning=false;
+    pthread_mutex_unlock(&lock);
+}
+
+
+/*!
+    \brief      Close the open channels (DISC), close the multiplexer (CLD) and the
+                pseudo-terminals. The queued bytes that were not sent are dropped
+*/
+void serialMux::close()
+{
+    pthread_mutex_lock(&lock);
+    for (unsigned int i=1;i<SERIAL_MUX_CHANNELS;i++)
+    {
+        serialMuxChannel *ch=channels[i];
+        if (!ch) continue;
+        if (ch->state!=SERIAL_MUX_CLOSED) queueFrame(i, SERIAL_MUX_DISC|SERIAL_MUX_PF, true);
+        ch->state=SERIAL_MUX_CLOSED;
+        ch->tx.count=0;
+        if (ch->ptyMaster!=-1)
+        {
+            ::close(ch->ptyMaster);
+            ::close(ch->ptySlave);
+            ch->ptyMaster=ch->ptySlave=-1;
+        }
+    }
+    if (muxOpen)
+    {
+        const unsigned char closeDown[2]={ SERIAL_MUX_CLD, 0x01 };
+        queueFrame(0, SERIAL_MUX_UIH, true, closeDown, sizeof(closeDown));
+        muxOpen=false;
+    }
+    sendFrames();
+    pthread_cond_broadcast(&changed);
+    pthread_mutex_unlock(&lock);
+}
+
+
+/*!
+    \brief      Get a channel, allocate it on first use (called with the lock held)
+    \param      dlci : channel, 1 to 63
+    \return     the channel
+*/
+serialMuxChannel* serialMux::channel(unsigned int dlci)
+{
+    if (!channels[dlci])
+    {
+        serialMuxChannel *ch=new serialMuxChannel;
+        memset(ch, 0, sizeof(*ch));
+        ch->state=SERIAL_MUX_CLOSED;
+        ch->tx.data=new unsigned char[bufferSize];
+        ch->tx.size=bufferSize;
+        ch->rx.data=new unsigned char[bufferSize];
+        ch->rx.size=bufferSize;
+        ch->ptyMaster=ch->ptySlave=-1;
+        channels[dlci]=ch;
+    }
+    return channels[dlci];
+}
+
+
+/*!
+    \brief      Build a frame. The payload is made of two parts (credits and data)
+    \param      frame : receives the frame, frameSize+7 bytes
+    \param      dlci : channel
+    \param      control : frame type with the P/F bit
+    \param      command : the frame is a command (otherwise a response)
+    \param      info1, length1 : first part of the payload
+    \param      info2, length2 : second part of the payload
+    \return     size of the frame
+*/
+unsigned int serialMux::buildFrame(unsigned char *frame, unsigned int dlci, unsigned char control, bool command,
+                                   const unsigned char *info1, unsigned int length1,
+                                   const unsigned char *info2, unsigned int length2)
+{
+    unsigned int length=length1+length2;
+    unsigned int size=0;
+    frame[size++]=SERIAL_MUX_FLAG;
+    // The C/R bit is set on the commands of the initiator and on the responses of the responder
+    frame[size++]=(unsigned char)((dlci<<2) | ((command==initiator) ? 0x02 : 0) | 0x01);
+    frame[size++]=control;
+    if (length<128) frame[size++]=(unsigned char)((length<<1) | 0x01);
+    else
+    {
+        frame[size++]=(unsigned char)((length & 0x7F)<<1);
+        frame[size++]=(unsigned char)(length>>7);
+    }
+    if (length1>0) memcpy(frame+size, info1, length1);
+    if (length2>0) memcpy(frame+size+length1, info2, length2);
+    // The FCS covers the address, control and length fields, and the payload of UI frames
+    unsigned int covered=((control & ~SERIAL_MUX_PF)==SERIAL_MUX_UI) ? size+length : size;
+    unsigned char crc=0xFF;
+    for (unsigned int i=1;i<covered;i++) crc=crcTable[crc ^ frame[i]];
+    size+=length;
+    frame[size++]=0xFF-crc;
+    frame[size++]=SERIAL_MUX_FLAG;
+    return size;
+}
+
+
+/*!
+    \brief      Queue a frame in the control queue, sent before the data frames
+    \param      dlci : channel
+    \param      control : frame type with the P/F bit
+    \param      command : the frame is a command (otherwise a response)
+    \param      info : payload
+    \param      length : size of the payload
+*/
+void serialMux::queueFrame(unsigned int dlci, unsigned char control, bool command,
+                           const unsigned char *info, unsigned int length)
+{
+    // Control frames are short, the queue is only full if the port is stuck
+    if (controlUsed+length+SERIAL_MUX_OVERHEAD>controlSize) return;
+    controlUsed+=buildFrame(controlQueue+controlUsed, dlci, control, command, info, length, NULL, 0);
+    if (wakePipe[1]!=-1 && ::write(wakePipe[1], "", 1)) {}
+}
+
+
+/*!
+    \brief      Send the control frames, then the data frames of the channels by priority while
+                the driver holds less than two frames (called with the lock held).
+                The lock is released during each write, which may block (flow control), so the
+                application can still queue and read data. Only one thread sends at a time: a call
+                made while another thread is sending returns at once, the frames it queued are
+                sent by the other thread.
+    \return     1 success
+    \return     -1 error while writing
+*/
+int serialMux::sendFrames()
+{
+    if (sending) return 1;
+    sending=true;
+
+    int limit=2*(frameSize+SERIAL_MUX_OVERHEAD);
+    int Ret=1;
+    bool sent=false;
+    while (true)
+    {
+        // Control frames first, moved out of the queue so new ones can be queued during the write
+        if (controlUsed>0)
+        {
+            unsigned int size=controlUsed;
+            memcpy(controlSending, controlQueue, size);
+            controlUsed=0;
+            pthread_mutex_unlock(&lock);
+            int written=port->writeBytes(controlSending, size);
+            pthread_mutex_lock(&lock);
+            if (written!=1) { Ret=-1; break; }
+            continue;
+        }
+
+        // Keep the driver queue short, so a high priority frame does not wait behind the others
+        int queued=port->pendingOutput();
+        if (queued>=limit) break;
+
+        // Highest priority first, in turn for the same priority
+        unsigned int best=0;
+        for (unsigned int n=1;n<SERIAL_MUX_CHANNELS;n++)
+        {
+            unsigned int i=(lastServed+n-1)%(SERIAL_MUX_CHANNELS-1)+1;
+            serialMuxChannel *ch=channels[i];
+            if (!ch || ch->state!=SERIAL_MUX_OPEN || ch->tx.count==0) continue;
+            if (credits>0 && ch->txCredits==0) continue;
+            if (best==0 || ch->priority>channels[best]->priority) best=i;
+        }
+        if (best==0) break;
+        serialMuxChannel *ch=channels[best];
+        lastServed=best;
+
+        // Credits for the peer travel with the data
+        unsigned char grant=0;
+        if (credits>0) grant=(unsigned char)creditsToGrant(ch);
+        unsigned int length=ringGet(&ch->tx, txPayload, grant>0 ? frameSize-1 : frameSize);
+        unsigned int size=buildFrame(txFrame, best, SERIAL_MUX_UIH | (grant>0 ? SERIAL_MUX_PF : 0), true,
+                                     &grant, grant>0 ? 1 : 0, txPayload, length);
+        ch->rxCredits+=grant;
+        if (credits>0) ch->txCredits--;
+        ch->stats.txBytes+=length;
+        ch->stats.txFrames++;
+        // The frame (taken from the ring) is only used by this thread
+        pthread_mutex_unlock(&lock);
+        int written=port->writeBytes(txFrame, size);
+        pthread_mutex_lock(&lock);
+        if (written!=1) { Ret=-1; break; }
+        sent=true;
+    }
+    if (sent)
+    {
+        pthread_mutex_unlock(&lock);
+        if (port->flushWriteBuffer()<0) Ret=-1;
+        pthread_mutex_lock(&lock);
+    }
+    sending=false;
+    return Ret;
+}
+
+
+/*!
+    \brief      Credits that can be granted to the peer: frames that fit in the free part of
+                the receive buffer, minus the credits it already has
+    \param      ch : channel
+    \return     number of credits, at most 255
+*/
+unsigned int serialMux::creditsToGrant(serialMuxChannel *ch)
+{
+    unsigned int room=(ch->rx.size-ch->rx.count)/frameSize;
+    if (room<=ch->rxCredits) return 0;
+    return (room-ch->rxCredits>255) ? 255 : room-ch->rxCredits;
+}
+
+
+/*!
+    \brief      Send a credit frame when the peer is running out of credits (called with the
+                lock held, after the application consumed received bytes)
+    \param      ch : channel
+    \param      dlci : number of the channel
+*/
+void serialMux::grantCredits(serialMuxChannel *ch, unsigned int dlci)
+{
+    if (credits==0 || ch->state!=SERIAL_MUX_OPEN) return;
+    unsigned int grant=creditsToGrant(ch);
+    // Wait until half of the initial credits can be granted, to save frames
+    if (grant==0 || grant<(credits+1)/2) return;
+    unsigned char value=(unsigned char)grant;
+    queueFrame(dlci, SERIAL_MUX_UIH | SERIAL_MUX_PF, true, &value, 1);
+    ch->rxCredits+=grant;
+}
+
+
+/*!
+    \brief      Parse the received bytes, handle each complete frame (called with the lock held)
+    \param      data : received bytes
+    \param      size : number of bytes
+*/
+void serialMux::receive(const unsigned char *data, unsigned int size)
+{
+    unsigned int i=0;
+    while (i<size)
+    {
+        unsigned char byte=data[i];
+        switch (rxState)
+        {
+        case SERIAL_MUX_RX_HUNT:
+        {
+            // Skip to the next flag
+            const unsigned char *flag=(const unsigned char*)memchr(data+i, SERIAL_MUX_FLAG, size-i);
+            if (!flag) return;
+            i=flag-data+1;
+            rxState=SERIAL_MUX_RX_ADDRESS;
+            continue;
+        }
+        case SERIAL_MUX_RX_ADDRESS:
+            // Flags between frames
+            if (byte==SERIAL_MUX_FLAG) break;
+            // The address field has only one byte (EA set)
+            if (!(byte & 0x01))
+            {
+                frameErrors++;
+                rxState=SERIAL_MUX_RX_HUNT;
+                break;
+            }
+            rxAddress=byte;
+            rxFcs=crcTable[0xFF ^ byte];
+            rxState=SERIAL_MUX_RX_CONTROL;
+            break;
+        case SERIAL_MUX_RX_CONTROL:
+            rxControl=byte;
+            rxFcs=crcTable[rxFcs ^ byte];
+            rxState=SERIAL_MUX_RX_LENGTH1;
+            break;
+        case SERIAL_MUX_RX_LENGTH1:
+        case SERIAL_MUX_RX_LENGTH2:
+            rxFcs=crcTable[rxFcs ^ byte];
+            if (rxState==SERIAL_MUX_RX_LENGTH1) rxLength=byte>>1;
+            else rxLength|=(unsigned int)byte<<7;
+            if (rxState==SERIAL_MUX_RX_LENGTH1 && !(byte & 0x01))
+            {
+                rxState=SERIAL_MUX_RX_LENGTH2;
+                break;
+            }
+            if (rxLength>frameSize)
+            {
+                frameErrors++;
+                rxState=SERIAL_MUX_RX_HUNT;
+                break;
+            }
+            rxReceived=0;
+            rxState=(rxLength>0) ? SERIAL_MUX_RX_INFO : SERIAL_MUX_RX_FCS;
+            break;
+        case SERIAL_MUX_RX_INFO:
+        {
+            // Copy the payload at once
+            unsigned int n=rxLength-rxReceived;
+            if (n>size-i) n=size-i;
+            memcpy(rxInfo+rxReceived, data+i, n);
+            // The FCS of UI frames also covers the payload
+            if ((rxControl & ~SERIAL_MUX_PF)==SERIAL_MUX_UI)
+                for (unsigned int k=0;k<n;k++) rxFcs=crcTable[rxFcs ^ data[i+k]];
+            rxReceived+=n;
+            i+=n;
+            if (rxReceived==rxLength) rxState=SERIAL_MUX_RX_FCS;
+            continue;
+        }
+        case SERIAL_MUX_RX_FCS:
+            if ((unsigned char)(0xFF-rxFcs)!=byte)
+            {
+                frameErrors++;
+                rxState=SERIAL_MUX_RX_HUNT;
+                break;
+            }
+            rxState=SERIAL_MUX_RX_CLOSE;
+            break;
+        case SERIAL_MUX_RX_CLOSE:
+            if (byte!=SERIAL_MUX_FLAG)
+            {
+                frameErrors++;
+                rxState=SERIAL_MUX_RX_HUNT;
+                break;
+            }
+            // The closing flag may also open the next frame
+            rxState=SERIAL_MUX_RX_ADDRESS;
+            handleFrame();
+            break;
+        }
+        i++;
+    }
+}
+
+
+/*!
+    \brief      Handle a valid frame (called with the lock held)
+*/
+void serialMux::handleFrame()
+{
+    unsigned int dlci=rxAddress>>2;
+    unsigned char type=rxControl & ~SERIAL_MUX_PF;
+    serialMuxChannel *ch=(dlci>0) ? channel(dlci) : NULL;
+
+    if (type==SERIAL_MUX_SABM)
+    {
+        // Accept the multiplexer and any channel
+        queueFrame(dlci, SERIAL_MUX_UA|SERIAL_MUX_PF, false);
+        if (!ch) muxOpen=true;
+        else if (ch->state!=SERIAL_MUX_OPEN)
+        {
+            ch->state=SERIAL_MUX_OPEN;
+            ch->txCredits=ch->rxCredits=credits;
+        }
+    }
+    else if (type==SERIAL_MUX_UA)
+    {
+        // Answer to the SABM of open
+        if (!ch) muxOpen=muxOpen || initiator;
+        else if (ch->state==SERIAL_MUX_OPENING)
+        {
+            ch->state=SERIAL_MUX_OPEN;
+            ch->txCredits=ch->rxCredits=credits;
+        }
+    }
+    else if (type==SERIAL_MUX_DM)
+    {
+        if (ch) ch->state=SERIAL_MUX_CLOSED;
+    }
+    else if (type==SERIAL_MUX_DISC)
+    {
+        queueFrame(dlci, SERIAL_MUX_UA|SERIAL_MUX_PF, false);
+        if (ch) ch->state=SERIAL_MUX_CLOSED;
+        else
+        {
+            muxOpen=false;
+            for (unsigned int i=1;i<SERIAL_MUX_CHANNELS;i++)
+                if (channels[i]) channels[i]->state=SERIAL_MUX_CLOSED;
+        }
+    }
+    else if (type==SERIAL_MUX_UIH || type==SERIAL_MUX_UI)
+    {
+        if (!ch)
+        {
+            handleControl(rxInfo, rxLength);
+            return;
+        }
+        const unsigned char *info=rxInfo;
+        unsigned int length=rxLength;
+        // Credits granted by the peer
+        if (credits>0 && (rxControl & SERIAL_MUX_PF) && length>0)
+        {
+            ch->txCredits+=info[0];
+            info++;
+            length--;
+        }
+        if (length==0) return;
+        if (credits>0 && ch->rxCredits>0) ch->rxCredits--;
+        unsigned int stored=ringPut(&ch->rx, info, length);
+        ch->stats.rxBytes+=stored;
+        ch->stats.rxFrames++;
+        ch->stats.dropped+=length-stored;
+    }
+}
+
+
+/*!
+    \brief      Handle a message of the control channel: the commands are acknowledged, the
+                close down command (CLD) closes the multiplexer
+    \param      info : payload of the frame
+    \param      length : size of the payload
+*/
+void serialMux::handleControl(const unsigned char *info, unsigned int length)
+{
+    // Responses of the peer need no action
+    if (length==0 || !(info[0] & 0x02)) return;
+    // The response is the command with the C/R bit cleared
+    memcpy(txPayload, info, length);
+    txPayload[0]&=~0x02;
+    queueFrame(0, SERIAL_MUX_UIH, false, txPayload, length);
+    if (info[0]==SERIAL_MUX_CLD)
+    {
+        muxOpen=false;
+        for (unsigned int i=1;i<SERIAL_MUX_CHANNELS;i++)
+            if (channels[i]) channels[i]->state=SERIAL_MUX_CLOSED;
+    }
+}
+
+
+/*!
+    \brief      Move the received bytes of a channel to its pseudo-terminal, and the bytes
+                written to the pseudo-terminal to the channel (called with the lock held)
+    \param      ch : channel
+    \param      dlci : number of the channel
+    \param      readable : the pseudo-terminal has bytes to read
+    \param      writable : the pseudo-terminal has room
+*/
+void serialMux::servePty(serialMuxChannel *ch, unsigned int dlci, bool readable, bool writable)
+{
+    if (ch->ptyMaster==-1) return;
+    if (writable && ch->rx.count>0)
+    {
+        // Contiguous part of the ring
+        unsigned int n=ch->rx.size-ch->rx.head;
+        if (n>ch->rx.count) n=ch->rx.count;
+        ssize_t written=::write(ch->ptyMaster, ch->rx.data+ch->rx.head, n);
+        if (written>0)
+        {
+            ch->rx.head=(ch->rx.head+written)%ch->rx.size;
+            ch->rx.count-=written;
+            grantCredits(ch, dlci);
+        }
+    }
+    if (readable && ch->state==SERIAL_MUX_OPEN && ch->tx.count<ch->tx.size)
+    {
+        unsigned int tail=(ch->tx.head+ch->tx.count)%ch->tx.size;
+        unsigned int n=ch->tx.size-ch->tx.count;
+        if (n>ch->tx.size-tail) n=ch->tx.size-tail;
+        ssize_t nbRead=::read(ch->ptyMaster, ch->tx.data+tail, n);
+        if (nbRead>0) ch->tx.count+=nbRead;
+    }
+}
+
+
+/*!
+    \brief      Wait for a change of the state until a deadline (called with the lock held).
+                Waits for the thread of startThread, or calls run if the thread is not running
+    \param      deadline_ns : deadline of the monotonic clock
+    \param      noTimeOut : ignore the deadline
+    \return     false if the deadline has passed
+*/
+bool serialMux::waitChange(unsigned long long deadline_ns, bool noTimeOut)
+{
+    if (threadRunning) waitCondition(&changed, &lock, deadline_ns, noTimeOut);
+    else
+    {
+        unsigned long long now=timeOut::monotonicTime_ns();
+        unsigned int timeOut_ms=0;
+        if (!noTimeOut)
+        {
+            if (now>=deadline_ns) return false;
+            timeOut_ms=(unsigned int)((deadline_ns-now+999999)/1000000);
+        }
+        pthread_mutex_unlock(&lock);
+        run(timeOut_ms);
+        pthread_mutex_lock(&lock);
+    }
+    return noTimeOut || timeOut::monotonicTime_ns()<deadline_ns;
+}
+
+
+/*!
+    \brief      Body of the thread of startThread
+    \param      arg : the multiplexer
+    \return     NULL
+*/
+void* serialMux::muxThread(void *arg)
+{
+    serialMux *mux=(serialMux*)arg;
+    while (!mux->threadStop)
+        if (mux->run(100)<0) timeOut::sleepUntil_ns(timeOut::monotonicTime_ns()+10000000ULL);
+    return NULL;
+}
+
+#endif
@@ -0,0 +1,215 @@
+/*!
+\file    serialib_mux.h
+\brief   Multiplexer of logical channels over one serial link, with the framing of GSM 07.10
+         (3GPP 27.010, CMUX basic option), priorities and optional credit-based flow control
+         (Unix only).
+
+Each channel (DLCI 1 to 63) is a separate byte stream, read and written with read and write, or
+exposed as a local pseudo-terminal that another program (or another serialib) can open:
+
+    serialMux mux(&serial);
+    mux.startThread();                          // or call mux.run() in a loop
+    mux.setCredits(8);                          // optional, same value on both sides
+    mux.open(true);                             // the other side calls open(false)
+    mux.openChannel(1, 10);                     // control, highest priority
+    mux.openChannel(2, 5);                      // telemetry
+    mux.openChannel(3, 0);                      // logs
+    mux.write(1, "STOP\n", 5);
+    char name[64];
+    mux.createPty(3, name, sizeof(name));       // logs readable on /dev/pts/N
+
+Frames are sent one at a time, and only when the driver holds less than two frames, so a frame
+of a high priority channel waits at most for two frames of lower priority. Channels with the
+same priority share the link in turn.
+
+Flow control (optional, off by default as in standard 07.10): after setCredits(n) on both sides,
+each side grants credits to the other, one credit per frame it can store (as in RFCOMM: a UIH
+frame with the P/F bit set carries the number of credits in its first byte). A sender without
+credits stops sending on that channel only, so a slow log reader never blocks the other
+channels. Leave it off to talk to a standard 07.10 peer such as a cellular modem.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY CLAIM,
+DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+This is a licence-free software, it can be used by anyone who try to build a better world.
+*/
+
+
+#ifndef SERIALIB_MUX_H
+#define SERIALIB_MUX_H
+
+#include "serialib.h"
+
+#if defined (__linux__) || defined(__APPLE__)
+
+/*! Number of DLCI, channel 0 is the control channel */
+#define SERIAL_MUX_CHANNELS         64
+
+/*! Default maximum payload of a frame (N1) */
+#define SERIAL_MUX_FRAME_SIZE       127
+
+/*! Default size of the transmit and receive buffers of each channel */
+#define SERIAL_MUX_BUFFER_SIZE      4096
+
+/**
+ * traffic of a channel
+ */
+struct SerialMuxStats {
+    unsigned long long  txBytes;        /**< payload bytes sent */
+    unsigned long long  rxBytes;        /**< payload bytes received */
+    unsigned long       txFrames;       /**< frames sent */
+    unsigned long       rxFrames;       /**< frames received */
+    unsigned long       dropped;        /**< bytes received without room to store them (no flow control) */
+    unsigned int        txCredits;      /**< frames that can be sent before the peer grants more credits */
+    bool                open;           /**< the channel is open */
+};
+
+/*! Ring buffer of a channel */
+struct serialMuxRing;
+
+/*! A channel */
+struct serialMuxChannel;
+
+
+
+/*!  \class     serialMux
+     \brief     Multiplexes logical channels over an open serialib port (GSM 07.10 framing).
+   */
+class serialMux
+{
+public:
+
+    // Constructor of the class
+    serialMux(serialib *port, unsigned int frameSize=SERIAL_MUX_FRAME_SIZE,
+              unsigned int bufferSize=SERIAL_MUX_BUFFER_SIZE);
+
+    // Destructor, close the multiplexer
+    ~serialMux();
+
+    // Credits granted to the peer when a channel opens (0 = no flow control, standard 07.10)
+    void                setCredits(unsigned int credits);
+
+    // Start the multiplexer (the initiator sends SABM on DLCI 0, the responder waits for it)
+    int                 open(bool initiator, unsigned int timeOut_ms=1000);
+
+    // Open a channel (with timeout)
+    int                 openChannel(unsigned int dlci, int priority=0, unsigned int timeOut_ms=1000);
+
+    // Expose a channel as a pseudo-terminal, name receives the path to open
+    int                 createPty(unsigned int dlci, char *name, unsigned int nameSize);
+
+    // Queue bytes on a channel (with timeout)
+    int                 write(unsigned int dlci, const void *data, unsigned int size, unsigned int timeOut_ms=0);
+
+    // Read the bytes received on a channel, or wait for the first one (with timeout)
+    int                 read(unsigned int dlci, void *buffer, unsigned int maxNbBytes, unsigned int timeOut_ms=0);
+
+    // Number of bytes received on a channel and not read yet
+    int                 available(unsigned int dlci);
+
+    // Traffic of a channel
+    int                 getStats(unsigned int dlci, SerialMuxStats *stats);
+
+    // Number of frames dropped because of a wrong FCS or length
+    unsigned long       getFrameErrors();
+
+    // Exchange frames: send the queued data, receive and dispatch the frames (with timeout)
+    int                 run(unsigned int timeOut_ms=0);
+
+    // Call run from a background thread
+    int                 startThread();
+    void                stopThread();
+
+    // Close the channels and the multiplexer
+    void                close();
+
+private:
+    // Not copyable
+    serialMux(const serialMux&);
+    serialMux& operator=(const serialMux&);
+
+    // Allocate the buffers of a channel
+    serialMuxChannel*   channel(unsigned int dlci);
+
+    // Queue a frame in the control queue (sent before the data)
+    void                queueFrame(unsigned int dlci, unsigned char control, bool command,
+                                   const unsigned char *info=NULL, unsigned int length=0);
+
+    // Build a frame: flag, address, control, length, payload, FCS, flag
+    unsigned int        buildFrame(unsigned char *frame, unsigned int dlci, unsigned char control, bool command,
+                                   const unsigned char *info1, unsigned int length1,
+                                   const unsigned char *info2, unsigned int length2);
+
+    // Send the control frames, then the data frames by priority (releases the lock while writing)
+    int                 sendFrames();
+
+    // Parse the received bytes, handle the complete frames
+    void                receive(const unsigned char *data, unsigned int size);
+    void                handleFrame();
+    void                handleControl(const unsigned char *info, unsigned int length);
+
+    // Credits the peer can be given for a channel
+    unsigned int        creditsToGrant(serialMuxChannel *ch);
+
+    // Grant credits after the application consumed received bytes
+    void                grantCredits(serialMuxChannel *ch, unsigned int dlci);
+
+    // Move data between the channels and their pseudo-terminals
+    void                servePty(serialMuxChannel *ch, unsigned int dlci, bool readable, bool writable);
+
+    // Wait for a change (frame received, data sent...) until the deadline, driving run if no thread does
+    bool                waitChange(unsigned long long deadline_ns, bool noTimeOut);
+
+    // Body of the background thread
+    static void*        muxThread(void *arg);
+
+    // Port and settings
+    serialib*           port;
+    unsigned int        frameSize;
+    unsigned int        bufferSize;
+    unsigned int        credits;
+    bool                initiator;
+    volatile bool       muxOpen;
+
+    // Channels (allocated when used) and channel served last for each priority
+    serialMuxChannel*   channels[SERIAL_MUX_CHANNELS];
+    unsigned int        lastServed;
+
+    // Control frames waiting to be sent, and control frames being written
+    unsigned char*      controlQueue;
+    unsigned int        controlSize;
+    unsigned int        controlUsed;
+    unsigned char*      controlSending;
+
+    // Frame being received
+    int                 rxState;
+    unsigned char       rxAddress;
+    unsigned char       rxControl;
+    unsigned char       rxFcs;
+    unsigned int        rxLength;
+    unsigned int        rxReceived;
+    unsigned char*      rxInfo;
+    unsigned long       frameErrors;
+
+    // Frame being sent, and its payload
+    unsigned char*      txFrame;
+    unsigned char*      txPayload;
+    // A thread is in sendFrames (it writes without the lock)
+    bool                sending;
+
+    // State shared with the background thread, and signal of the changes
+    pthread_mutex_t     lock;
+    pthread_cond_t      changed;
+    // Pipe that wakes run up when data or control frames are queued
+    int                 wakePipe[2];
+    pthread_t           thread;
+    bool                threadRunning;
+    volatile bool       threadStop;
+};
+
+#endif
+
+#endif // SERIALIB_MUX_H
@@ -0,0 +1,1261 @@
+/*!
+ \file    serialib_transfer.cpp
+ \brief   Source file of the class serialTransfer.
+          File transfer over a serial port: YMODEM, YMODEM-g and a windowed streaming protocol (Unix only).
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY CLAIM,
+DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+
+This is a licence-free software, it can be used by anyone who try to build a better world.
+ */
+
+#include "serialib_transfer.h"
+
+#if defined (__linux__) || defined(__APPLE__)
+
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Frames of the streaming protocol:
+//   'S' 'T' type flags offset(4, LE) length(2, LE) payload(length) CRC-32(4, LE)
+// The CRC covers the header and the payload.
+#define STREAM_HEADER           10
+#define STREAM_OVERHEAD         14
+#define STREAM_FILE             1   // sender: offset is the size of the file, payload is its name
+#define STREAM_START            2   // receiver: offset is where the transfer starts (resume),
+                                    // payload is the CRC-32 of the bytes before offset (if not 0)
+#define STREAM_DATA             3   // sender: payload is the data at offset
+#define STREAM_ACK              4   // receiver: all the bytes before offset are received
+#define STREAM_NAK              5   // receiver: bytes from offset are missing or corrupted
+#define STREAM_FIN              6   // both: end of the transfer
+#define STREAM_CANCEL           7   // both: transfer aborted
+
+// Flags: compression proposed (FILE) or accepted (START), payload compressed (DATA)
+#define STREAM_FLAG_LZ4         0x01
+// Flag of FILE: the receiver's partial file differs from the file sent, it must start from 0
+#define STREAM_FLAG_RESTART     0x02
+
+// Attempts to exchange FIN once all the data is acknowledged (the transfer is complete anyway)
+#define STREAM_FIN_ATTEMPTS     2
+
+// YMODEM control characters
+#define YMODEM_SOH              0x01
+#define YMODEM_STX              0x02
+#define YMODEM_EOT              0x04
+#define YMODEM_ACK              0x06
+#define YMODEM_NAK              0x15
+#define YMODEM_CAN              0x18
+#define YMODEM_PAD              0x1A
+
+
+
+//_____________________
+// ::: Little endian :::
+
+
+static inline void storeLE32(unsigned char *data, uint32_t value)
+{
+    data[0]=(unsigned char)value;
+    data[1]=(unsigned char)(value>>8);
+    data[2]=(unsigned char)(value>>16);
+    data[3]=(unsigned char)(value>>24);
+}
+
+static inline uint32_t loadLE32(const unsigned char *data)
+{
+    return (uint32_t)data[0] | ((uint32_t)data[1]<<8) | ((uint32_t)data[2]<<16) | ((uint32_t)data[3]<<24);
+}
+
+
+
+// ******************************************
+//  Class serialTransfer
+// ******************************************
+
+
+/*!
+    \brief      Constructor of the class serialTransfer.
+    \param      port : open serial port
+*/
+serialTransfer::serialTransfer(serialib *port)
+{
+    this->port=port;
+    window=SERIAL_TRANSFER_WINDOW;
+    frameSize=SERIAL_TRANSFER_FRAME_SIZE;
+    timeOut_ms=3000;
+    retries=10;
+    resume=false;
+    compression=false;
+    progress=NULL;
+    progressData=NULL;
+    frameType=0;
+    frameFlags=0;
+    frameOffset=0;
+    framePayload=NULL;
+    frameLength=0;
+    stats=SerialTransferStats();
+    startTime_ns=0;
+}
+
+
+/*!
+    \brief      Set the number of bytes sent without acknowledgement and the payload of the frames
+                (streaming protocol). The window should cover the round trip of an acknowledgement
+                (latency of the receiver and of the adapters, plus one frame at the line rate).
+    \param      windowBytes : maximum number of bytes in flight
+    \param      frameSize : payload of a frame (at most SERIAL_RX_BUFFER_SIZE-14 bytes, the
+                frames must fit in the receive buffer of the receiver)
+*/
+void serialTransfer::setWindow(unsigned int windowBytes, unsigned int frameSize)
+{
+    if (frameSize==0) frameSize=SERIAL_TRANSFER_FRAME_SIZE;
+    if (frameSize>SERIAL_RX_BUFFER_SIZE-STREAM_OVERHEAD) frameSize=SERIAL_RX_BUFFER_SIZE-STREAM_OVERHEAD;
+    if (windowBytes<frameSize) windowBytes=frameSize;
+    this->window=windowBytes;
+    this->frameSize=frameSize;
+}
+
+
+/*!
+    \brief      Set the delay without progress before retransmitting, and the number of
+                consecutive retries before giving up
+    \param      timeOut_ms : delay without progress
+    \param      retries : number of retries
+*/
+void serialTransfer::setTimeout(unsigned int timeOut_ms, unsigned int retries)
+{
+    this->timeOut_ms=(timeOut_ms==0) ? 1 : timeOut_ms;
+    this->retries=retries;
+}
+
+
+/*!
+    \brief      When receiving with the streaming protocol, continue the existing file from its end
+                instead of overwriting it (after an interrupted transfer)
+    \param      resume : true to continue the existing file
+*/
+void serialTransfer::setResume(bool resume)
+{
+    this->resume=resume;
+}
+
+
+/*!
+    \brief      Compress the data of the streaming protocol. The sender proposes the compression
+                at the start of each transfer, it is used if the receiver enabled it too.
+                Useful on slow links (radio modems...) with compressible files (logs, configuration)
+    \param      enable : true to propose (sender) or accept (receiver) the compression
+*/
+void serialTransfer::setCompression(bool enable)
+{
+    compression=enable;
+}
+
+
+/*!
+    \brief      Report the progress of the transfers to a callback
+    \param      callback : function called after each frame or block (NULL to disable)
+    \param      userData : parameter of the callback
+*/
+void serialTransfer::setProgress(SerialTransferCallback callback, void *userData)
+{
+    progress=callback;
+    progressData=userData;
+}
+
+
+/*!
+    \brief      Get the statistics of the last transfer
+    \param      stats : statistics
+*/
+void serialTransfer::getStats(SerialTransferStats *stats)
+{
+    *stats=this->stats;
+}
+
+
+/*!
+    \brief      Update the duration of the transfer and call the progress callback
+*/
+void serialTransfer::report()
+{
+    stats.duration_ns=timeOut::monotonicTime_ns()-startTime_ns;
+    if (progress!=NULL) progress(&stats, progressData);
+}
+
+
+
+//______________
+// ::: Files :::
+
+
+/*!
+    \brief      Send a file. The file is memory-mapped and sent without copy.
+                With YMODEM, the receiver selects YMODEM or YMODEM-g (it starts with 'C' or 'G').
+    \param      path : file to send, the receiver gets its name without the directories
+    \param      protocol : SERIAL_TRANSFER_STREAM or YMODEM (SERIAL_TRANSFER_YMODEM or SERIAL_TRANSFER_YMODEM_G)
+    \return     1 success
+    \return     -1 the file can't be read
+    \return     -2 error on the serial port
+    \return     -3 no answer from the receiver
+    \return     -4 transfer cancelled by the receiver
+    \return     -5 protocol error (or file larger than 4 GB with the streaming protocol)
+*/
+int serialTransfer::sendFile(const char *path, SerialTransferProtocol protocol)
+{
+    stats=SerialTransferStats();
+    startTime_ns=timeOut::monotonicTime_ns();
+
+    // Map the file
+    int file=open(path, O_RDONLY);
+    if (file==-1) return -1;
+    struct stat status;
+    if (fstat(file, &status)==-1)
+    {
+        close(file);
+        return -1;
+    }
+    unsigned long long size=status.st_size;
+    const unsigned char *data=NULL;
+    if (size>0)
+    {
+        void *mapping=mmap(NULL, size, PROT_READ, MAP_SHARED, file, 0);
+        if (mapping==MAP_FAILED)
+        {
+            close(file);
+            return -1;
+        }
+        // The file is read once, from the beginning to the end
+        madvise(mapping, size, MADV_SEQUENTIAL);
+        data=(const unsigned char*)mapping;
+    }
+    stats.size=size;
+
+    // Name of the file, without the directories
+    const char *name=strrchr(path, '/');
+    name=(name==NULL) ? path : name+1;
+
+    int Ret;
+    if (protocol==SERIAL_TRANSFER_STREAM)
+        Ret=(size>0xFFFFFFFFULL) ? -5 : sendStream(data, size, name);
+    else
+        Ret=sendYmodem(data, size, name);
+
+    if (data!=NULL) munmap((void*)data, size);
+    close(file);
+    report();
+    return Ret;
+}
+
+
+/*!
+    \brief      Receive a file. The received data is written to the file from the receive
+                buffer of the port, without intermediate copy.
+    \param      path : file to write
+    \param      protocol : protocol used by the sender (with YMODEM, SERIAL_TRANSFER_YMODEM_G
+                asks the sender to stream the blocks)
+    \param      remoteName : if not NULL, receives the name of the file sent
+    \param      remoteNameSize : size of remoteName
+    \return     1 success
+    \return     -1 the file can't be written
+    \return     -2 error on the serial port
+    \return     -3 no data from the sender
+    \return     -4 transfer cancelled by the sender
+    \return     -5 protocol error
+*/
+int serialTransfer::receiveFile(const char *path, SerialTransferProtocol protocol, char *remoteName, unsigned int remoteNameSize)
+{
+    stats=SerialTransferStats();
+    startTime_ns=timeOut::monotonicTime_ns();
+    if (remoteName!=NULL && remoteNameSize>0) remoteName[0]=0;
+
+    // Readable too: a resumed prefix is checked with its CRC
+    int file=open(path, O_RDWR | O_CREAT, 0644);
+    if (file==-1) return -1;
+
+    int Ret;
+    if (protocol==SERIAL_TRANSFER_STREAM)
+        Ret=receiveStream(file, remoteName, remoteNameSize);
+    else
+        Ret=receiveYmodem(file, remoteName, remoteNameSize, protocol==SERIAL_TRANSFER_YMODEM_G);
+
+    close(file);
+    report();
+    return Ret;
+}
+
+
+
+//___________________________
+// ::: Streaming protocol :::
+
+
+/*!
+    \brief      Send a frame of the streaming protocol. The payload is written from its location
+                (the mapping of the file), without copy.
+    \param      type : type of the frame
+    \param      offset : offset field
+    \param      payload : bytes of the payload
+    \param      length : size of the payload
+    \param      flags : flags of the frame (STREAM_FLAG_LZ4)
+    \return     1 success
+    \return     -2 error while writing
+*/
+int serialTransfer::sendFrame(unsigned char type, uint32_t offset, const void *payload, unsigned int length, unsigned char flags)
+{
+    unsigned char header[STREAM_HEADER];
+    header[0]='S';
+    header[1]='T';
+    header[2]=type;
+    header[3]=flags;
+    storeLE32(header+4, offset);
+    header[8]=(unsigned char)length;
+    header[9]=(unsigned char)(length>>8);
+
+    unsigned char trailer[4];
+    storeLE32(trailer, crc32(payload, length, crc32(header, STREAM_HEADER)));
+
+    if (port->writeBytes(header, STREAM_HEADER)!=1) return -2;
+    if (length>0 && port->writeBytes(payload, length)!=1) return -2;
+    if (port->writeBytes(trailer, 4)!=1) return -2;
+    return 1;
+}
+
+
+/*!
+    \brief      Wait for the next valid frame of the streaming protocol. Bytes that are not the
+                beginning of a frame are skipped. The frame stays in the receive buffer of the port
+                (framePayload points to it) until releaseFrame is called.
+    \param      deadline_ns : time limit (monotonic clock)
+    \return     >0 type of the frame received
+    \return     0 timeout reached
+    \return     -1 corrupted frame (skipped)
+*/
+int serialTransfer::receiveFrame(unsigned long long deadline_ns)
+{
+    while (true)
+    {
+        unsigned long long now=timeOut::monotonicTime_ns();
+        if (now>=deadline_ns) return 0;
+        unsigned int wait_ms=(unsigned int)((deadline_ns-now+999999)/1000000);
+
+        // Look for the start of a frame
+        const unsigned char *frame=port->peekBytes(2, wait_ms);
+        if (frame==NULL) return 0;
+        if (frame[0]!='S' || frame[1]!='T')
+        {
+            port->consumeBytes(1);
+            continue;
+        }
+
+        // Header
+        frame=port->peekBytes(STREAM_HEADER, wait_ms);
+        if (frame==NULL) return 0;
+        unsigned int length=frame[8] | (frame[9]<<8);
+        if (frame[2]<STREAM_FILE || frame[2]>STREAM_CANCEL || length>SERIAL_RX_BUFFER_SIZE-STREAM_OVERHEAD)
+        {
+            port->consumeBytes(1);
+            continue;
+        }
+
+        // Whole frame
+        frame=port->peekBytes(length+STREAM_OVERHEAD, wait_ms);
+        if (frame==NULL) return 0;
+        if (crc32(frame, STREAM_HEADER+length)!=loadLE32(frame+STREAM_HEADER+length))
+        {
+            // Resynchronize on the next byte
+            port->consumeBytes(1);
+            stats.errors++;
+            return -1;
+        }
+        frameType=frame[2];
+        frameFlags=frame[3];
+        frameOffset=loadLE32(frame+4);
+        framePayload=frame+STREAM_HEADER;
+        frameLength=length;
+        return frameType;
+    }
+}
+
+
+/*!
+    \brief      Remove the last frame received from the receive buffer of the port
+*/
+void serialTransfer::releaseFrame()
+{
+    port->consumeBytes(frameLength+STREAM_OVERHEAD);
+    framePayload=NULL;
+}
+
+
+/*!
+    \brief      Send a file with the streaming protocol: the data frames are sent as long as
+                the unacknowledged bytes fit in the window. On a NAK, or when the acknowledgements
+                stop, the transmission restarts from the first byte not acknowledged.
+    \param      data : content of the file
+    \param      size : size of the file
+    \param      name : name of the file
+    \return     see sendFile
+*/
+int serialTransfer::sendStream(const unsigned char *data, unsigned long long size, const char *name)
+{
+    unsigned long long timeOut_ns=timeOut_ms*1000000ULL;
+    unsigned int attempt=0;
+    int type;
+
+    // Announce the file until the receiver tells where to start (and accepts the compression)
+    uint32_t start=0;
+    bool restart=false;
+    while (true)
+    {
+        unsigned char flags=(compression ? STREAM_FLAG_LZ4 : 0) | (restart ? STREAM_FLAG_RESTART : 0);
+        if (sendFrame(STREAM_FILE, (uint32_t)size, name, strlen(name), flags)<0) return -2;
+        type=receiveFrame(timeOut::monotonicTime_ns()+timeOut_ns);
+        if (type>0)
+        {
+            start=frameOffset;
+            stats.compressed=compression && (frameFlags & STREAM_FLAG_LZ4);
+            // A partial file is continued only if it holds the beginning of this file
+            bool prefixValid=(start==0) ||
+                             (start<=size && frameLength>=4 && crc32(data, start)==loadLE32(framePayload));
+            releaseFrame();
+            if (type==STREAM_CANCEL) return -4;
+            if (type==STREAM_START && prefixValid) break;
+            if (type==STREAM_START) restart=true;
+        }
+        else if (++attempt>retries) return -3;
+    }
+    stats.resumedFrom=stats.transferred=start;
+    report();
+
+    // Compressed frames carry up to 4 frames of data, if the result fits in one frame
+    unsigned char packed[SERIAL_RX_BUFFER_SIZE];
+    unsigned int blockSize=4*frameSize;
+    if (blockSize>SERIAL_TRANSFER_BLOCK_SIZE) blockSize=SERIAL_TRANSFER_BLOCK_SIZE;
+
+    // Bytes acknowledged, next byte to send
+    unsigned long long acked=start;
+    unsigned long long next=start;
+    unsigned long long progressTime=timeOut::monotonicTime_ns();
+    attempt=0;
+    while (acked<size)
+    {
+        // Fill the window, stop as soon as an answer arrives
+        while (next<size && next-acked<window)
+        {
+            unsigned int length=(size-next>frameSize) ? frameSize : (unsigned int)(size-next);
+            const unsigned char *payload=data+next;
+            unsigned int payloadLength=length;
+            unsigned char flags=0;
+            if (stats.compressed)
+            {
+                // The largest block that fits in a frame once compressed, down to one frame of data
+                unsigned int block=(size-next>blockSize) ? blockSize : (unsigned int)(size-next);
+                int packedLength=compress(data+next, block, packed, frameSize);
+                while (packedLength<0 && block>length)
+                {
+                    block=(block/2>length) ? block/2 : length;
+                    packedLength=compress(data+next, block, packed, frameSize);
+                }
+                // Sent as is if it doesn't shrink
+                if (packedLength>0 && (unsigned int)packedLength<block)
+                {
+                    length=block;
+                    payload=packed;
+                    payloadLength=packedLength;
+                    flags=STREAM_FLAG_LZ4;
+                }
+            }
+            if (sendFrame(STREAM_DATA, (uint32_t)next, payload, payloadLength, flags)<0) return -2;
+            stats.lineBytes+=payloadLength+STREAM_OVERHEAD;
+            next+=length;
+            if (port->available()>0) break;
+        }
+
+        // Wait for an answer only when nothing more can be sent
+        bool windowFull=(next>=size || next-acked>=window);
+        if (!windowFull && port->available()<=0) continue;
+        unsigned long long now=timeOut::monotonicTime_ns();
+        type=receiveFrame(windowFull ? progressTime+timeOut_ns : now+1000000ULL);
+        if (type>0)
+        {
+            uint32_t offset=frameOffset;
+            releaseFrame();
+            if (type==STREAM_CANCEL) return -4;
+            if (type==STREAM_ACK && offset>acked && offset<=next)
+            {
+                // Progress
+                acked=offset;
+                progressTime=timeOut::monotonicTime_ns();
+                attempt=0;
+                stats.transferred=acked;
+                report();
+            }
+            else if (type==STREAM_NAK && offset>=acked && offset<next)
+            {
+                // Go back to the first missing byte
+                acked=offset;
+                progressTime=timeOut::monotonicTime_ns();
+                stats.transferred=acked;
+                stats.retransmitted+=next-offset;
+                stats.errors++;
+                next=offset;
+            }
+        }
+        else if (windowFull && timeOut::monotonicTime_ns()>=progressTime+timeOut_ns)
+        {
+            // No acknowledgement: send again from the first byte not acknowledged
+            if (++attempt>retries) return -3;
+            stats.retransmitted+=next-acked;
+            next=acked;
+            progressTime=timeOut::monotonicTime_ns();
+        }
+    }
+
+    // End of the transfer, all the data is acknowledged
+    for (attempt=0;attempt<STREAM_FIN_ATTEMPTS;attempt++)
+    {
+        if (sendFrame(STREAM_FIN, (uint32_t)size)<0) return -2;
+        type=receiveFrame(timeOut::monotonicTime_ns()+timeOut_ns);
+        if (type>0) releaseFrame();
+        if (type==STREAM_FIN) break;
+    }
+    return 1;
+}
+
+
+/*!
+    \brief      Receive a file with the streaming protocol. The receiver acknowledges every quarter
+                of window, sends a NAK once per missing byte position, and acknowledges again when
+                the sender goes silent or repeats data already received.
+    \param      file : file to write
+    \param      remoteName : if not NULL, receives the name of the file
+    \param      remoteNameSize : size of remoteName
+    \return     see receiveFile
+*/
+int serialTransfer::receiveStream(int file, char *remoteName, unsigned int remoteNameSize)
+{
+    unsigned long long timeOut_ns=timeOut_ms*1000000ULL;
+    int type;
+
+    // Wait for the announcement of the file
+    unsigned long long deadline=timeOut::monotonicTime_ns()+timeOut_ns*(retries+1);
+    while ((type=receiveFrame(deadline))!=STREAM_FILE)
+    {
+        if (type==0) return -3;
+        if (type>0) releaseFrame();
+        if (type==STREAM_CANCEL) return -4;
+    }
+    unsigned long long size=frameOffset;
+    stats.compressed=compression && (frameFlags & STREAM_FLAG_LZ4);
+    unsigned char flags=stats.compressed ? STREAM_FLAG_LZ4 : 0;
+    if (remoteName!=NULL && remoteNameSize>0)
+    {
+        unsigned int length=(frameLength<remoteNameSize-1) ? frameLength : remoteNameSize-1;
+        memcpy(remoteName, framePayload, length);
+        remoteName[length]=0;
+    }
+    releaseFrame();
+
+    // Continue a partial file, or start from scratch. The CRC of the partial file lets the sender
+    // check that it is the beginning of the same file
+    struct stat status;
+    unsigned long long start=0;
+    if (resume && fstat(file, &status)==0 && (unsigned long long)status.st_size<=size)
+        start=status.st_size;
+    uint32_t prefixCrc=0;
+    if (start>0 && fileCrc32(file, start, &prefixCrc)<0) start=0;
+    if (ftruncate(file, start)==-1) return -1;
+    unsigned char crcPayload[4];
+    storeLE32(crcPayload, prefixCrc);
+    if (sendFrame(STREAM_START, (uint32_t)start, crcPayload, start>0 ? 4 : 0, flags)<0) return -2;
+    stats.size=size;
+    stats.resumedFrom=stats.transferred=start;
+    report();
+
+    // Data of the compressed frames
+    unsigned char unpacked[SERIAL_TRANSFER_BLOCK_SIZE];
+
+    unsigned long long expected=start;
+    unsigned int unacked=0;
+    unsigned int attempt=0;
+    bool nakSent=false;
+    bool duplicateAcked=false;
+    while (expected<size)
+    {
+        type=receiveFrame(timeOut::monotonicTime_ns()+timeOut_ns);
+        if (type==STREAM_DATA)
+        {
+            stats.lineBytes+=frameLength+STREAM_OVERHEAD;
+            // Compressed data is expanded first
+            const unsigned char *data=framePayload;
+            int dataLength=frameLength;
+            if (frameFlags & STREAM_FLAG_LZ4)
+            {
+                dataLength=stats.compressed ? decompress(framePayload, frameLength, unpacked, sizeof(unpacked)) : -1;
+                data=unpacked;
+            }
+            if (dataLength<0)
+            {
+                // Valid CRC but invalid content: handled as a corrupted frame
+                releaseFrame();
+                stats.errors++;
+                if (!nakSent && sendFrame(STREAM_NAK, (uint32_t)expected)<0) return -2;
+                nakSent=true;
+            }
+            else if (frameOffset==expected)
+            {
+                // Next data: written from the receive buffer (or from the expanded data)
+                unsigned int length=((unsigned int)dataLength>size-expected) ? (unsigned int)(size-expected) : dataLength;
+                if (pwrite(file, data, length, expected)!=(ssize_t)length)
+                {
+                    releaseFrame();
+                    sendFrame(STREAM_CANCEL, (uint32_t)expected);
+                    return -1;
+                }
+                prefixCrc=crc32(data, length, prefixCrc);
+                expected+=length;
+                unacked+=length;
+                releaseFrame();
+                nakSent=duplicateAcked=false;
+                attempt=0;
+                stats.transferred=expected;
+                report();
+                if (unacked>=window/4 || expected>=size)
+                {
+                    if (sendFrame(STREAM_ACK, (uint32_t)expected)<0) return -2;
+                    unacked=0;
+                }
+            }
+            else if (frameOffset>expected)
+            {
+                // Data is missing: ask for it once, the following frames are dropped
+                releaseFrame();
+                stats.errors++;
+                if (!nakSent && sendFrame(STREAM_NAK, (uint32_t)expected)<0) return -2;
+                nakSent=true;
+            }
+            else
+            {
+                // Data already received: the sender missed an acknowledgement
+                releaseFrame();
+                if (!duplicateAcked && sendFrame(STREAM_ACK, (uint32_t)expected)<0) return -2;
+                duplicateAcked=true;
+            }
+        }
+        else if (type==STREAM_FILE)
+        {
+            // The sender didn't get the start position, or the partial file is not the beginning
+            // of its file: everything is received again
+            bool restart=(frameFlags & STREAM_FLAG_RESTART)!=0;
+            releaseFrame();
+            if (restart && expected>0)
+            {
+                if (ftruncate(file, 0)==-1)
+                {
+                    sendFrame(STREAM_CANCEL, (uint32_t)expected);
+                    return -1;
+                }
+                expected=0;
+                prefixCrc=0;
+                unacked=0;
+                nakSent=duplicateAcked=false;
+                stats.resumedFrom=stats.transferred=0;
+                report();
+            }
+            storeLE32(crcPayload, prefixCrc);
+            if (sendFrame(STREAM_START, (uint32_t)expected, crcPayload, expected>0 ? 4 : 0, flags)<0) return -2;
+        }
+        else if (type==STREAM_CANCEL)
+        {
+            releaseFrame();
+            return -4;
+        }
+        else if (type>0) releaseFrame();
+        else if (type==-1)
+        {
+            // Corrupted frame
+            if (!nakSent && sendFrame(STREAM_NAK, (uint32_t)expected)<0) return -2;
+            nakSent=true;
+        }
+        else
+        {
+            // Silence: acknowledge again, the sender will resend what is missing
+            if (++attempt>retries) return -3;
+            if (sendFrame(STREAM_ACK, (uint32_t)expected)<0) return -2;
+            nakSent=false;
+        }
+    }
+
+    // End of the transfer, the file is complete
+    for (attempt=0;attempt<STREAM_FIN_ATTEMPTS;)
+    {
+        type=receiveFrame(timeOut::monotonicTime_ns()+timeOut_ns);
+        if (type>0) releaseFrame();
+        if (type==STREAM_FIN)
+        {
+            sendFrame(STREAM_FIN, (uint32_t)size);
+            break;
+        }
+        // The last acknowledgement was lost
+        if (type==0) attempt++;
+        if (type==0 || type==STREAM_DATA) sendFrame(STREAM_ACK, (uint32_t)size);
+    }
+    return 1;
+}
+
+
+
+//_______________
+// ::: YMODEM :::
+
+
+/*!
+    \brief      Send a YMODEM block (header, data, padding and CRC-16). The data is written
+                from its location, without copy.
+    \param      number : block number
+    \param      data : bytes of the block
+    \param      length : number of bytes (the rest of the block is padded)
+    \param      blockSize : 128 or 1024
+    \return     1 success
+    \return     -2 error while writing
+*/
+int serialTransfer::sendBlock(unsigned char number, const unsigned char *data, unsigned int length, unsigned int blockSize)
+{
+    unsigned char header[3]={ (unsigned char)(blockSize==1024 ? YMODEM_STX : YMODEM_SOH), number, (unsigned char)~number };
+    unsigned char padding[1024];
+    memset(padding, YMODEM_PAD, blockSize-length);
+
+    uint16_t crc=crc16(padding, blockSize-length, crc16(data, length));
+    unsigned char trailer[2]={ (unsigned char)(crc>>8), (unsigned char)crc };
+
+    if (port->writeBytes(header, 3)!=1) return -2;
+    if (length>0 && port->writeBytes(data, length)!=1) return -2;
+    if (length<blockSize && port->writeBytes(padding, blockSize-length)!=1) return -2;
+    if (port->writeBytes(trailer, 2)!=1) return -2;
+    return 1;
+}
+
+
+/*!
+    \brief      Receive a YMODEM block
+    \param      block : receives the block number (block[0]) and the data (1024 bytes max)
+    \param      timeOut_ms : delay before the first byte of the block
+    \return     >0 size of the block (128 or 1024)
+    \return     0 timeout reached
+    \return     -1 EOT received
+    \return     -2 error while reading
+    \return     -3 corrupted block
+    \return     -4 transfer cancelled (two CAN received)
+*/
+int serialTransfer::receiveBlock(unsigned char *block, unsigned int timeOut_ms)
+{
+    char c;
+    unsigned int blockSize;
+
+    // Wait for the start of the block, skip the noise
+    while (true)
+    {
+        int Ret=port->readChar(&c, timeOut_ms);
+        if (Ret==0) return 0;
+        if (Ret<0) return -2;
+        if (c==YMODEM_SOH) { blockSize=128; break; }
+        if (c==YMODEM_STX) { blockSize=1024; break; }
+        if (c==YMODEM_EOT) return -1;
+        if (c==YMODEM_CAN && port->readChar(&c, timeOut_ms)==1 && c==YMODEM_CAN) return -4;
+    }
+
+    // Number, complement, data and CRC
+    unsigned char body[1028];
+    int Ret=port->readExact(body, blockSize+4, timeOut_ms);
+    if (Ret<0) return -2;
+    if (Ret==0 ||
+        body[0]!=(unsigned char)~body[1] ||
+        crc16(body+2, blockSize)!=(uint16_t)((body[blockSize+2]<<8) | body[blockSize+3]))
+    {
+        // Let the rest of the block go by
+        stats.errors++;
+        char discard[64];
+        while (port->readFrame(discard, sizeof(discard), 1)!=0) {}
+        return -3;
+    }
+    block[0]=body[0];
+    memcpy(block+1, body+2, blockSize);
+    return blockSize;
+}
+
+
+/*!
+    \brief      Abort a YMODEM transfer (CAN sequence)
+*/
+void serialTransfer::cancel()
+{
+    const unsigned char sequence[5]={ YMODEM_CAN, YMODEM_CAN, YMODEM_CAN, YMODEM_CAN, YMODEM_CAN };
+    port->writeBytes(sequence, sizeof(sequence));
+}
+
+
+/*!
+    \brief      Send a file with YMODEM, or YMODEM-g if the receiver starts with 'G'.
+    \param      data : content of the file
+    \param      size : size of the file
+    \param      name : name of the file
+    \return     see sendFile
+*/
+int serialTransfer::sendYmodem(const unsigned char *data, unsigned long long size, const char *name)
+{
+    unsigned int attempt=0;
+    char c=0;
+
+    // The receiver selects the variant
+    while (true)
+    {
+        int Ret=port->readChar(&c, timeOut_ms);
+        if (Ret<0) return -2;
+        if (Ret==0 && ++attempt>retries) return -3;
+        if (Ret==1 && c==YMODEM_CAN) return -4;
+        if (Ret==1 && (c=='C' || c=='G')) break;
+    }
+    bool streamed=(c=='G');
+
+    // Block 0: name and size
+    unsigned char header[1024];
+    memset(header, 0, sizeof(header));
+    unsigned int length=snprintf((char*)header, sizeof(header)-1, "%s", name)+1;
+    length+=snprintf((char*)header+length, sizeof(header)-length, "%llu", size);
+    unsigned int headerSize=(length<128) ? 128 : 1024;
+    for (attempt=0;;)
+    {
+        if (sendBlock(0, header, headerSize, headerSize)<0) return -2;
+        int Ret=port->readChar(&c, timeOut_ms);
+        if (Ret<0) return -2;
+        if (Ret==1 && c==YMODEM_CAN) return -4;
+        // YMODEM-g: the receiver asks for the data with 'G', YMODEM: ACK then 'C'
+        if (Ret==1 && (c==YMODEM_ACK || (streamed && c=='G'))) break;
+        if (++attempt>retries) return -3;
+    }
+    while (!streamed)
+    {
+        int Ret=port->readChar(&c, timeOut_ms);
+        if (Ret<0) return -2;
+        if (Ret==0) return -3;
+        if (c=='C') break;
+        if (c==YMODEM_CAN) return -4;
+    }
+
+    // Data blocks
+    unsigned long long sent=0;
+    unsigned char number=1;
+    while (sent<size)
+    {
+        unsigned int blockLength=(size-sent>1024) ? 1024 : (unsigned int)(size-sent);
+        unsigned int blockSize=(blockLength>128) ? 1024 : 128;
+        for (attempt=0;;)
+        {
+            if (sendBlock(number, data+sent, blockLength, blockSize)<0) return -2;
+            if (streamed) break;
+            int Ret=port->readChar(&c, timeOut_ms);
+            if (Ret<0) return -2;
+            if (Ret==1 && c==YMODEM_ACK) break;
+            if (Ret==1 && c==YMODEM_CAN) return -4;
+            // NAK or no answer: send the block again
+            stats.errors++;
+            stats.retransmitted+=blockLength;
+            if (++attempt>retries)
+            {
+                cancel();
+                return -3;
+            }
+        }
+        sent+=blockLength;
+        number++;
+        stats.transferred=sent;
+        report();
+    }
+
+    // End of file: EOT until acknowledged (the first one is usually NAKed)
+    for (attempt=0;;)
+    {
+        if (port->writeChar(YMODEM_EOT)!=1) return -2;
+        int Ret=port->readChar(&c, timeOut_ms);
+        if (Ret<0) return -2;
+        if (Ret==1 && c==YMODEM_ACK) break;
+        if (Ret==1 && c==YMODEM_CAN) return -4;
+        if (++attempt>retries) return -3;
+    }
+
+    // End of the batch: empty block 0
+    memset(header, 0, 128);
+    for (attempt=0;attempt<=retries;attempt++)
+    {
+        int Ret=port->readChar(&c, timeOut_ms);
+        if (Ret<0) return -2;
+        if (Ret==1 && (c=='C' || c=='G'))
+        {
+            if (sendBlock(0, header, 128, 128)<0) return -2;
+            if (streamed) break;
+        }
+        if (Ret==1 && c==YMODEM_ACK) break;
+    }
+    return 1;
+}
+
+
+/*!
+    \brief      Receive a file with YMODEM or YMODEM-g. Only the first file of a batch is received.
+    \param      file : file to write
+    \param      remoteName : if not NULL, receives the name of the file
+    \param      remoteNameSize : size of remoteName
+    \param      streaming : ask for YMODEM-g (no acknowledgement, any error aborts the transfer)
+    \return     see receiveFile
+*/
+int serialTransfer::receiveYmodem(int file, char *remoteName, unsigned int remoteNameSize, bool streaming)
+{
+    const char request=streaming ? 'G' : 'C';
+    unsigned char block[1025];
+    unsigned int attempt=0;
+    int Ret;
+
+    if (ftruncate(file, 0)==-1) return -1;
+
+    // Block 0: name and size
+    while (true)
+    {
+        if (port->writeChar(request)!=1) return -2;
+        Ret=receiveBlock(block, timeOut_ms);
+        if (Ret==-2 || Ret==-4) return Ret;
+        if (Ret>0 && block[0]==0) break;
+        if (++attempt>retries) return -3;
+    }
+    // The header is padded with zeros, make sure the fields are terminated
+    block[Ret]=0;
+    const char *name=(const char*)block+1;
+    if (name[0]==0)
+    {
+        // Empty batch
+        if (!streaming) port->writeChar(YMODEM_ACK);
+        return -5;
+    }
+    if (remoteName!=NULL && remoteNameSize>0)
+    {
+        strncpy(remoteName, name, remoteNameSize-1);
+        remoteName[remoteNameSize-1]=0;
+    }
+    const char *sizeField=name+strlen(name)+1;
+    bool sizeKnown=(*sizeField>='0' && *sizeField<='9');
+    unsigned long long size=sizeKnown ? strtoull(sizeField, NULL, 10) : 0;
+    stats.size=size;
+    if (!streaming && port->writeChar(YMODEM_ACK)!=1) return -2;
+    if (port->writeChar(request)!=1) return -2;
+
+    // Data blocks until EOT
+    unsigned long long received=0;
+    unsigned char expected=1;
+    unsigned int nbEot=0;
+    attempt=0;
+    while (true)
+    {
+        Ret=receiveBlock(block, timeOut_ms);
+        if (Ret==-2 || Ret==-4) return Ret;
+        if (Ret>0 && block[0]==expected)
+        {
+            // Don't write the padding of the last block
+            unsigned int length=Ret;
+            if (sizeKnown && size-received<length) length=(unsigned int)(size-received);
+            if (pwrite(file, block+1, length, received)!=(ssize_t)length)
+            {
+                cancel();
+                return -1;
+            }
+            received+=length;
+            expected++;
+            attempt=0;
+            stats.transferred=received;
+            report();
+            if (!streaming && port->writeChar(YMODEM_ACK)!=1) return -2;
+        }
+        else if (Ret>0 && block[0]==(unsigned char)(expected-1))
+        {
+            // The sender missed the acknowledgement
+            if (!streaming && port->writeChar(YMODEM_ACK)!=1) return -2;
+        }
+        else if (Ret==-1)
+        {
+            // Confirm the end of file with a second EOT
+            if (++nbEot==1 && !streaming)
+            {
+                if (port->writeChar(YMODEM_NAK)!=1) return -2;
+                continue;
+            }
+            if (port->writeChar(YMODEM_ACK)!=1) return -2;
+            break;
+        }
+        else
+        {
+            // YMODEM-g can't recover from an error
+            if (streaming || Ret>0 || ++attempt>retries)
+            {
+                cancel();
+                return (Ret==0) ? -3 : -5;
+            }
+            if (port->writeChar(YMODEM_NAK)!=1) return -2;
+        }
+    }
+
+    // End of the batch: the sender answers with an empty block 0
+    if (port->writeChar(request)==1 && receiveBlock(block, timeOut_ms)>0 && !streaming)
+        port->writeChar(YMODEM_ACK);
+    return 1;
+}
+
+
+
+//_____________
+// ::: CRCs :::
+
+
+/*!
+    \brief      Compress a block in the LZ4 block format (greedy matching with a 4096-entry hash
+                table on the stack), readable by any LZ4 block decoder
+    \param      data : bytes to compress
+    \param      size : number of bytes, at most 65535
+    \param      output : receives the compressed block
+    \param      capacity : size of output
+    \return     >=0 size of the compressed block
+    \return     -1 the compressed block doesn't fit in output (or size is too large)
+*/
+int serialTransfer::compress(const void *data, unsigned int size, void *output, unsigned int capacity)
+{
+    // Matches are at least 4 bytes long, the last 5 bytes are literals and the last match
+    // starts at least 12 bytes before the end (rules of the format)
+    const unsigned int minMatch=4, lastLiterals=5, matchLimit=12;
+    const unsigned char *in=(const unsigned char*)data;
+    unsigned char *out=(unsigned char*)output;
+    if (size>65535) return -1;
+
+    // Last position of each hashed sequence of 4 bytes
+    uint16_t table[4096];
+    memset(table, 0, sizeof(table));
+
+    unsigned int ip=0, anchor=0, op=0;
+    while (size>matchLimit && ip<size-matchLimit)
+    {
+        uint32_t sequence;
+        memcpy(&sequence, in+ip, 4);
+        unsigned int hash=(sequence*2654435761U)>>20;
+        unsigned int ref=table[hash];
+        table[hash]=(uint16_t)ip;
+        if (ref>=ip || memcmp(in+ref, in+ip, minMatch)!=0)
+        {
+            ip++;
+            continue;
+        }
+
+        // Extend the match
+        unsigned int end=ip+minMatch;
+        while (end<size-lastLiterals && in[end]==in[ref+end-ip]) end++;
+        unsigned int literals=ip-anchor;
+        unsigned int matchLength=end-ip-minMatch;
+        if (op+1+literals/255+1+literals+2+matchLength/255+1>capacity) return -1;
+
+        // Token, literals, offset and length of the match
+        unsigned char *token=out+op++;
+        *token=(unsigned char)((literals>=15 ? 15 : literals)<<4);
+        if (literals>=15)
+        {
+            unsigned int n=literals-15;
+            for (;n>=255;n-=255) out[op++]=255;
+            out[op++]=(unsigned char)n;
+        }
+        memcpy(out+op, in+anchor, literals);
+        op+=literals;
+        out[op++]=(unsigned char)(ip-ref);
+        out[op++]=(unsigned char)((ip-ref)>>8);
+        *token|=(unsigned char)(matchLength>=15 ? 15 : matchLength);
+        if (matchLength>=15)
+        {
+            unsigned int n=matchLength-15;
+            for (;n>=255;n-=255) out[op++]=255;
+            out[op++]=(unsigned char)n;
+        }
+        ip=anchor=end;
+    }
+
+    // Last literals
+    unsigned int literals=size-anchor;
+    if (op+1+literals/255+1+literals>capacity) return -1;
+    out[op++]=(unsigned char)((literals>=15 ? 15 : literals)<<4);
+    if (literals>=15)
+    {
+        unsigned int n=literals-15;
+        for (;n>=255;n-=255) out[op++]=255;
+        out[op++]=(unsigned char)n;
+    }
+    memcpy(out+op, in+anchor, literals);
+    return op+literals;
+}
+
+
+/*!
+    \brief      Decompress a block in the LZ4 block format. The block is checked: a corrupted
+                block can't write outside output
+    \param      data : compressed block
+    \param      size : size of the compressed block
+    \param      output : receives the data
+    \param      capacity : size of output
+    \return     >=0 size of the data
+    \return     -1 invalid block, or the data doesn't fit in output
+*/
+int serialTransfer::decompress(const void *data, unsigned int size, void *output, unsigned int capacity)
+{
+    const unsigned char *in=(const unsigned char*)data;
+    unsigned char *out=(unsigned char*)output;
+    unsigned int ip=0, op=0;
+    while (ip<size)
+    {
+        // Literals
+        unsigned char token=in[ip++];
+        unsigned int length=token>>4;
+        if (length==15)
+        {
+            unsigned char byte;
+            do
+            {
+                if (ip>=size) return -1;
+                byte=in[ip++];
+                length+=byte;
+            } while (byte==255);
+        }
+        if (length>size-ip || length>capacity-op) return -1;
+        memcpy(out+op, in+ip, length);
+        ip+=length;
+        op+=length;
+
+        // The last sequence has no match
+        if (ip==size) break;
+        if (size-ip<2) return -1;
+        unsigned int offset=in[ip] | (in[ip+1]<<8);
+        ip+=2;
+        if (offset==0 || offset>op) return -1;
+        length=token & 0x0F;
+        if (length==15)
+        {
+            unsigned char byte;
+            do
+            {
+                if (ip>=size) return -1;
+                byte=in[ip++];
+                length+=byte;
+            } while (byte==255);
+        }
+        length+=4;
+        if (length>capacity-op) return -1;
+        // The match may overlap the bytes it produces
+        for (unsigned int i=0;i<length;i++,op++) out[op]=out[op-offset];
+    }
+    return op;
+}
+
+
+// CRC-32 of IEEE 802.3 (reversed polynomial 0xEDB88320)
+static const uint32_t crc32Table[256] = {
+    0x00000000U, 0x77073096U, 0xEE0E612CU, 0x990951BAU, 0x076DC419U, 0x706AF48FU, 0xE963A535U, 0x9E6495A3U,
+    0x0EDB8832U, 0x79DCB8A4U, 0xE0D5E91EU, 0x97D2D988U, 0x09B64C2BU, 0x7EB17CBDU, 0xE7B82D07U, 0x90BF1D91U,
+    0x1DB71064U, 0x6AB020F2U, 0xF3B97148U, 0x84BE41DEU, 0x1ADAD47DU, 0x6DDDE4EBU, 0xF4D4B551U, 0x83D385C7U,
+    0x136C9856U, 0x646BA8C0U, 0xFD62F97AU, 0x8A65C9ECU, 0x14015C4FU, 0x63066CD9U, 0xFA0F3D63U, 0x8D080DF5U,
+    0x3B6E20C8U, 0x4C69105EU, 0xD56041E4U, 0xA2677172U, 0x3C03E4D1U, 0x4B04D447U, 0xD20D85FDU, 0xA50AB56BU,
+    0x35B5A8FAU, 0x42B2986CU, 0xDBBBC9D6U, 0xACBCF940U, 0x32D86CE3U, 0x45DF5C75U, 0xDCD60DCFU, 0xABD13D59U,
+    0x26D930ACU, 0x51DE003AU, 0xC8D75180U, 0xBFD06116U, 0x21B4F4B5U, 0x56B3C423U, 0xCFBA9599U, 0xB8BDA50FU,
+    0x2802B89EU, 0x5F058808U, 0xC60CD9B2U, 0xB10BE924U, 0x2F6F7C87U, 0x58684C11U, 0xC1611DABU, 0xB6662D3DU,
+    0x76DC4190U, 0x01DB7106U, 0x98D220BCU, 0xEFD5102AU, 0x71B18589U, 0x06B6B51FU, 0x9FBFE4A5U, 0xE8B8D433U,
+    0x7807C9A2U, 0x0F00F934U, 0x9609A88EU, 0xE10E9818U, 0x7F6A0DBBU, 0x086D3D2DU, 0x91646C97U, 0xE6635C01U,
+    0x6B6B51F4U, 0x1C6C6162U, 0x856530D8U, 0xF262004EU, 0x6C0695EDU, 0x1B01A57BU, 0x8208F4C1U, 0xF50FC457U,
+    0x65B0D9C6U, 0x12B7E950U, 0x8BBEB8EAU, 0xFCB9887CU, 0x62DD1DDFU, 0x15DA2D49U, 0x8CD37CF3U, 0xFBD44C65U,
+    0x4DB26158U, 0x3AB551CEU, 0xA3BC0074U, 0xD4BB30E2U, 0x4ADFA541U, 0x3DD895D7U, 0xA4D1C46DU, 0xD3D6F4FBU,
+    0x4369E96AU, 0x346ED9FCU, 0xAD678846U, 0xDA60B8D0U, 0x44042D73U, 0x33031DE5U, 0xAA0A4C5FU, 0xDD0D7CC9U,
+    0x5005713CU, 0x270241AAU, 0xBE0B1010U, 0xC90C2086U, 0x5768B525U, 0x206F85B3U, 0xB966D409U, 0xCE61E49FU,
+    0x5EDEF90EU, 0x29D9C998U, 0xB0D09822U, 0xC7D7A8B4U, 0x59B33D17U, 0x2EB40D81U, 0xB7BD5C3BU, 0xC0BA6CADU,
+    0xEDB88320U, 0x9ABFB3B6U, 0x03B6E20CU, 0x74B1D29AU, 0xEAD54739U, 0x9DD277AFU, 0x04DB2615U, 0x73DC1683U,
+    0xE3630B12U, 0x94643B84U, 0x0D6D6A3EU, 0x7A6A5AA8U, 0xE40ECF0BU, 0x9309FF9DU, 0x0A00AE27U, 0x7D079EB1U,
+    0xF00F9344U, 0x8708A3D2U, 0x1E01F268U, 0x6906C2FEU, 0xF762575DU, 0x806567CBU, 0x196C3671U, 0x6E6B06E7U,
+    0xFED41B76U, 0x89D32BE0U, 0x10DA7A5AU, 0x67DD4ACCU, 0xF9B9DF6FU, 0x8EBEEFF9U, 0x17B7BE43U, 0x60B08ED5U,
+    0xD6D6A3E8U, 0xA1D1937EU, 0x38D8C2C4U, 0x4FDFF252U, 0xD1BB67F1U, 0xA6BC5767U, 0x3FB506DDU, 0x48B2364BU,
+    0xD80D2BDAU, 0xAF0A1B4CU, 0x36034AF6U, 0x41047A60U, 0xDF60EFC3U, 0xA867DF55U, 0x316E8EEFU, 0x4669BE79U,
+    0xCB61B38CU, 0xBC66831AU, 0x256FD2A0U, 0x5268E236U, 0xCC0C7795U, 0xBB0B4703U, 0x220216B9U, 0x5505262FU,
+    0xC5BA3BBEU, 0xB2BD0B28U, 0x2BB45A92U, 0x5CB36A04U, 0xC2D7FFA7U, 0xB5D0CF31U, 0x2CD99E8BU, 0x5BDEAE1DU,
+    0x9B64C2B0U, 0xEC63F226U, 0x756AA39CU, 0x026D930AU, 0x9C0906A9U, 0xEB0E363FU, 0x72076785U, 0x05005713U,
+    0x95BF4A82U, 0xE2B87A14U, 0x7BB12BAEU, 0x0CB61B38U, 0x92D28E9BU, 0xE5D5BE0DU, 0x7CDCEFB7U, 0x0BDBDF21U,
+    0x86D3D2D4U, 0xF1D4E242U, 0x68DDB3F8U, 0x1FDA836EU, 0x81BE16CDU, 0xF6B9265BU, 0x6FB077E1U, 0x18B74777U,
+    0x88085AE6U, 0xFF0F6A70U, 0x66063BCAU, 0x11010B5CU, 0x8F659EFFU, 0xF862AE69U, 0x616BFFD3U, 0x166CCF45U,
+    0xA00AE278U, 0xD70DD2EEU, 0x4E048354U, 0x3903B3C2U, 0xA7672661U, 0xD06016F7U, 0x4969474DU, 0x3E6E77DBU,
+    0xAED16A4AU, 0xD9D65ADCU, 0x40DF0B66U, 0x37D83BF0U, 0xA9BCAE53U, 0xDEBB9EC5U, 0x47B2CF7FU, 0x30B5FFE9U,
+    0xBDBDF21CU, 0xCABAC28AU, 0x53B39330U, 0x24B4A3A6U, 0xBAD03605U, 0xCDD70693U, 0x54DE5729U, 0x23D967BFU,
+    0xB3667A2EU, 0xC4614AB8U, 0x5D681B02U, 0x2A6F2B94U, 0xB40BBE37U, 0xC30C8EA1U, 0x5A05DF1BU, 0x2D02EF8DU,
+};
+
+
+/*!
+    \brief      Compute the CRC-32 of a buffer (IEEE 802.3, as zlib)
+    \param      data : bytes
+    \param      size : number of bytes
+    \param      crc : CRC of the previous bytes, to compute the CRC of several buffers
+    \return     The CRC-32
+*/
+uint32_t serialTransfer::crc32(const void *data, unsigned int size, uint32_t crc)
+{
+    const unsigned char *bytes=(const unsigned char*)data;
+    crc=~crc;
+    for (unsigned int i=0;i<size;i++) crc=crc32Table[(crc^bytes[i]) & 0xFF]^(crc>>8);
+    return ~crc;
+}
+
+
+/*!
+    \brief      Compute the CRC-32 of the beginning of a file
+    \param      file : file to read
+    \param      size : number of bytes from the beginning
+    \param      crc : receives the CRC-32
+    \return     1 success
+    \return     -1 error while reading (or the file is shorter)
+*/
+int serialTransfer::fileCrc32(int file, unsigned long long size, uint32_t *crc)
+{
+    unsigned char buffer[SERIAL_TRANSFER_BLOCK_SIZE];
+    uint32_t value=0;
+    for (unsigned long long offset=0;offset<size;)
+    {
+        size_t length=(size-offset>sizeof(buffer)) ? sizeof(buffer) : (size_t)(size-offset);
+        ssize_t count=pread(file, buffer, length, offset);
+        if (count<=0) return -1;
+        value=crc32(buffer, count, value);
+        offset+=count;
+    }
+    *crc=value;
+    return 1;
+}
+
+
+/*!
+    \brief      Compute the CRC-16 of XMODEM/YMODEM (polynomial 0x1021, initial value 0)
+    \param      data : bytes
+    \param      size : number of bytes
+    \param      crc : CRC of the previous bytes, to compute the CRC of several buffers
+    \return     The CRC-16
+*/
+uint16_t serialTransfer::crc16(const void *data, unsigned int size, uint16_t crc)
+{
+    const unsigned char *bytes=(const unsigned char*)data;
+    for (unsigned int i=0;i<size;i++)
+    {
+        crc^=(uint16_t)bytes[i]<<8;
+        for (int bit=0;bit<8;bit++) crc=(crc & 0x8000) ? (uint16_t)((crc<<1)^0x1021) : (uint16_t)(crc<<1);
+    }
+    return crc;
+}
+
+#endif
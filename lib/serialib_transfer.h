@@ -0,0 +1,182 @@
+/*!
+\file    serialib_transfer.h
+\brief   File transfer over a serial port: YMODEM, YMODEM-g and a windowed streaming protocol (Unix only).
+
+YMODEM (1K blocks, CRC-16) is stop-and-wait: the line is idle while each block is acknowledged.
+YMODEM-g streams the blocks without acknowledgement, but any error aborts the transfer.
+The streaming protocol (SERIAL_TRANSFER_STREAM, both sides must use serialTransfer) keeps a
+window of frames in flight like ZMODEM: the receiver acknowledges periodically, a corrupted or
+missing frame is retransmitted from the first missing byte (go-back-N), every frame is protected
+by a CRC-32, and an interrupted transfer resumes where the receiver's file ends (the receiver
+sends the CRC-32 of its partial file, the transfer restarts from the beginning if it doesn't
+match the file sent).
+
+    // Sender
+    serialTransfer transfer(&serial);
+    transfer.sendFile("firmware.bin");
+
+    // Receiver
+    serialTransfer transfer(&serial);
+    transfer.setResume(true);
+    transfer.receiveFile("firmware.bin");
+
+The file to send is memory-mapped: the frames are written on the port directly from the
+mapping, and the received frames are written to the file directly from the receive buffer.
+
+On slow links, the streaming protocol can compress the data (LZ4 block format, no dependency):
+the sender proposes it when setCompression(true) was called, and the receiver accepts it if it
+called setCompression(true) too. Each frame is compressed on its own, up to
+SERIAL_TRANSFER_BLOCK_SIZE bytes of the file, so retransmission and resume work unchanged; a
+frame that doesn't shrink is sent as is. The effective rate is (transferred-resumedFrom)/duration,
+the rate on the line is lineBytes/duration.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY CLAIM,
+DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+This is a licence-free software, it can be used by anyone who try to build a better world.
+*/
+
+
+#ifndef SERIALIB_TRANSFER_H
+#define SERIALIB_TRANSFER_H
+
+#include "serialib.h"
+
+#if defined (__linux__) || defined(__APPLE__)
+
+#include <stdint.h>
+
+/*! Default number of bytes in flight (streaming protocol) */
+#define SERIAL_TRANSFER_WINDOW      16384
+
+/*! Default payload of a frame (streaming protocol) */
+#define SERIAL_TRANSFER_FRAME_SIZE  1024
+
+/*! Maximum number of bytes of the file carried by a compressed frame (streaming protocol) */
+#define SERIAL_TRANSFER_BLOCK_SIZE  16384
+
+/**
+ * file transfer protocol
+ */
+enum SerialTransferProtocol {
+    SERIAL_TRANSFER_YMODEM, /**< YMODEM, 1K blocks with CRC-16, each block acknowledged */
+    SERIAL_TRANSFER_YMODEM_G, /**< YMODEM-g, 1K blocks streamed without acknowledgement, no error recovery */
+    SERIAL_TRANSFER_STREAM /**< windowed streaming with CRC-32, retransmission and resume */
+};
+
+/**
+ * progress and statistics of a transfer
+ */
+struct SerialTransferStats {
+    unsigned long long  size;           /**< size of the file */
+    unsigned long long  transferred;    /**< bytes acknowledged by the receiver (or written to the file) */
+    unsigned long long  resumedFrom;    /**< offset where the transfer started (resume) */
+    unsigned long long  retransmitted;  /**< bytes sent again after an error */
+    unsigned long       errors;         /**< corrupted or missing frames and blocks */
+    unsigned long long  duration_ns;    /**< duration of the transfer */
+    unsigned long long  lineBytes;      /**< bytes of the data frames sent or received on the line (headers included, after compression) */
+    bool                compressed;     /**< the data is compressed (negotiated at the start of the transfer) */
+};
+
+/*! Function called after each frame or block to report the progress */
+typedef void (*SerialTransferCallback)(const SerialTransferStats *stats, void *userData);
+
+
+
+/*!  \class     serialTransfer
+     \brief     Sends and receives files on an open serialib port.
+   */
+class serialTransfer
+{
+public:
+
+    // Constructor of the class
+    serialTransfer(serialib *port);
+
+    // Number of bytes in flight and payload of the frames (streaming protocol)
+    void                setWindow(unsigned int windowBytes=SERIAL_TRANSFER_WINDOW,
+                                  unsigned int frameSize=SERIAL_TRANSFER_FRAME_SIZE);
+
+    // Delay without progress before a retransmission, and number of retries
+    void                setTimeout(unsigned int timeOut_ms=3000, unsigned int retries=10);
+
+    // Continue a partial file instead of overwriting it (streaming protocol, receiver)
+    void                setResume(bool resume);
+
+    // Propose (sender) or accept (receiver) the compression of the data (streaming protocol)
+    void                setCompression(bool enable);
+
+    // Report the progress to a callback
+    void                setProgress(SerialTransferCallback callback, void *userData=NULL);
+
+    // Send a file
+    int                 sendFile(const char *path, SerialTransferProtocol protocol=SERIAL_TRANSFER_STREAM);
+
+    // Receive a file
+    int                 receiveFile(const char *path, SerialTransferProtocol protocol=SERIAL_TRANSFER_STREAM,
+                                    char *remoteName=NULL, unsigned int remoteNameSize=0);
+
+    // Statistics of the last transfer
+    void                getStats(SerialTransferStats *stats);
+
+    // CRC-32 (IEEE 802.3), can be chained
+    static uint32_t     crc32(const void *data, unsigned int size, uint32_t crc=0);
+
+    // CRC-16 of XMODEM (CCITT, initial value 0)
+    static uint16_t     crc16(const void *data, unsigned int size, uint16_t crc=0);
+
+    // Compress a block in the LZ4 block format (at most 65535 bytes)
+    static int          compress(const void *data, unsigned int size, void *output, unsigned int capacity);
+
+    // Decompress a block in the LZ4 block format
+    static int          decompress(const void *data, unsigned int size, void *output, unsigned int capacity);
+
+private:
+    // Streaming protocol
+    int                 sendStream(const unsigned char *data, unsigned long long size, const char *name);
+    int                 receiveStream(int file, char *remoteName, unsigned int remoteNameSize);
+    int                 sendFrame(unsigned char type, uint32_t offset, const void *payload=NULL, unsigned int length=0,
+                                  unsigned char flags=0);
+    int                 receiveFrame(unsigned long long deadline_ns);
+    void                releaseFrame();
+    static int          fileCrc32(int file, unsigned long long size, uint32_t *crc);
+
+    // YMODEM
+    int                 sendYmodem(const unsigned char *data, unsigned long long size, const char *name);
+    int                 receiveYmodem(int file, char *remoteName, unsigned int remoteNameSize, bool streaming);
+    int                 sendBlock(unsigned char number, const unsigned char *data, unsigned int length, unsigned int blockSize);
+    int                 receiveBlock(unsigned char *block, unsigned int timeOut_ms);
+    void                cancel();
+
+    // Report the progress
+    void                report();
+
+    // Port and settings
+    serialib*           port;
+    unsigned int        window;
+    unsigned int        frameSize;
+    unsigned int        timeOut_ms;
+    unsigned int        retries;
+    bool                resume;
+    bool                compression;
+    SerialTransferCallback progress;
+    void*               progressData;
+
+    // Last frame received: type, flags, offset, payload (in the receive buffer of the port) and total size
+    unsigned char       frameType;
+    unsigned char       frameFlags;
+    uint32_t            frameOffset;
+    const unsigned char* framePayload;
+    unsigned int        frameLength;
+
+    // Statistics of the current transfer
+    SerialTransferStats stats;
+    unsigned long long  startTime_ns;
+};
+
+#endif
+
+#endif // SERIALIB_TRANSFER_H